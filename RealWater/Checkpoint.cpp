@@ -0,0 +1,121 @@
+#include "Checkpoint.hpp"
+#include <sstream>
+#include <cstring>
+#include <stdexcept>
+
+static const char CHECKPOINT_MAGIC[8] = "RWCHKPT";
+
+static uint64_t alignSection(uint64_t offset)
+{
+	return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+Checkpoint::Checkpoint()
+{
+	memset(&header, 0, sizeof(header));
+}
+
+void Checkpoint::open(const string& path)
+{
+	file.open(path);
+	if (file.size() < sizeof(CheckpointHeader))
+	{
+		file.close();
+		throw runtime_error(path + " is not a checkpoint!");
+	}
+	memcpy(&header, file.data(), sizeof(header));
+
+	// Everything the sections are read through must fit in the file
+	stringstream ss;
+	if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+		ss << path << " is not a checkpoint!";
+	else if (header.version != CHECKPOINT_VERSION)
+		ss << path << " is checkpoint version " << header.version << ", expected " << CHECKPOINT_VERSION << "!";
+	else if (header.headerSize != sizeof(CheckpointHeader) || header.particleSize != sizeof(Particle) || header.emitterSize != sizeof(Emitter)
+		|| header.obstacleSize != sizeof(ColliderObstacle))
+		ss << path << " was written by a build with other particle, emitter or obstacle layouts!";
+	else if (header.fileSize != file.size() || header.liveCount > header.capacity
+		|| header.particleOffset + (uint64_t)header.liveCount * sizeof(Particle) > file.size()
+		|| header.activityOffset + (uint64_t)header.liveCount * sizeof(GLuint) > file.size()
+		|| header.ringOffset + (uint64_t)header.liveCount * sizeof(GLuint) > file.size()
+		|| header.emitterOffset + (uint64_t)header.emitterCount * sizeof(Emitter) > file.size()
+		|| header.killPlaneOffset + (uint64_t)header.killPlaneCount * sizeof(vec4) > file.size()
+		|| header.sinkOffset + (uint64_t)header.sinkCount * sizeof(Sink) > file.size()
+		|| header.obstacleOffset + (uint64_t)header.obstacleCount * sizeof(ColliderObstacle) > file.size()
+		|| header.cornerOffset + (uint64_t)header.cornerCount * sizeof(vec3) > file.size())
+		ss << path << " is truncated or damaged!";
+	if (!ss.str().empty())
+	{
+		file.close();
+		throw runtime_error(ss.str());
+	}
+}
+
+void Checkpoint::create(const string& path)
+{
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.headerSize = sizeof(CheckpointHeader);
+	header.particleSize = sizeof(Particle);
+	header.emitterSize = sizeof(Emitter);
+	header.obstacleSize = sizeof(ColliderObstacle);
+
+	// The particles first and page aligned, the small sections behind them
+	header.particleOffset = alignSection(sizeof(CheckpointHeader));
+	header.activityOffset = alignSection(header.particleOffset + (uint64_t)header.liveCount * sizeof(Particle));
+	header.ringOffset = alignSection(header.activityOffset + (uint64_t)header.liveCount * sizeof(GLuint));
+	header.emitterOffset = alignSection(header.ringOffset + (uint64_t)header.liveCount * sizeof(GLuint));
+	header.killPlaneOffset = header.emitterOffset + (uint64_t)header.emitterCount * sizeof(Emitter);
+	header.sinkOffset = header.killPlaneOffset + (uint64_t)header.killPlaneCount * sizeof(vec4);
+	header.obstacleOffset = header.sinkOffset + (uint64_t)header.sinkCount * sizeof(Sink);
+	header.cornerOffset = header.obstacleOffset + (uint64_t)header.obstacleCount * sizeof(ColliderObstacle);
+	header.fileSize = header.cornerOffset + (uint64_t)header.cornerCount * sizeof(vec3);
+
+	file.create(path, (size_t)header.fileSize);
+	memcpy(file.data(), &header, sizeof(header));
+}
+
+void Checkpoint::close()
+{
+	file.close();
+}
+
+Particle* Checkpoint::particles()
+{
+	return (Particle*)(file.data() + header.particleOffset);
+}
+
+GLuint* Checkpoint::activity()
+{
+	return (GLuint*)(file.data() + header.activityOffset);
+}
+
+GLuint* Checkpoint::ring()
+{
+	return (GLuint*)(file.data() + header.ringOffset);
+}
+
+Emitter* Checkpoint::emitters()
+{
+	return (Emitter*)(file.data() + header.emitterOffset);
+}
+
+vec4* Checkpoint::killPlanes()
+{
+	return (vec4*)(file.data() + header.killPlaneOffset);
+}
+
+Sink* Checkpoint::sinks()
+{
+	return (Sink*)(file.data() + header.sinkOffset);
+}
+
+ColliderObstacle* Checkpoint::obstacles()
+{
+	return (ColliderObstacle*)(file.data() + header.obstacleOffset);
+}
+
+vec3* Checkpoint::corners()
+{
+	return (vec3*)(file.data() + header.cornerOffset);
+}
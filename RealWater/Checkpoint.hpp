@@ -0,0 +1,70 @@
+#ifndef _CHECKPOINT_HPP
+#define _CHECKPOINT_HPP
+
+#include <string>
+#include <cstdint>
+#include "ParticleManager.hpp"
+#include "MappedFile.hpp"
+
+using namespace glm;
+using namespace std;
+
+const uint32_t CHECKPOINT_VERSION = 3;		// bump with any change of the layout or of a saved struct
+const uint64_t CHECKPOINT_ALIGN = 4096;	// sections start on page boundaries
+
+// Front of the file, the sections follow at the recorded offsets
+struct CheckpointHeader
+{
+	char magic[8];				// "RWCHKPT"
+	uint32_t version;
+	uint32_t headerSize;		// sizes of the saved structs, a build with other layouts refuses the file
+	uint32_t particleSize;
+	uint32_t emitterSize;
+	uint32_t obstacleSize;
+	uint32_t capacity;			// particle buffer of the run
+	uint32_t liveCount;
+	uint32_t emitHead;
+	uint32_t emitterCount;
+	uint32_t killPlaneCount;
+	uint32_t sinkCount;
+	uint32_t obstacleCount;		// collider obstacles behind the container
+	uint32_t cornerCount;		// mesh triangle corners of the obstacles
+	uint32_t pad;
+	uint64_t stepCounter;		// the GPU emitters seed their random numbers with it
+	SimulationParameters parameters;
+	uint64_t particleOffset;	// liveCount Particle
+	uint64_t activityOffset;	// liveCount sleep counters
+	uint64_t ringOffset;		// liveCount emitter ring positions, the age order of the particles
+	uint64_t emitterOffset;
+	uint64_t killPlaneOffset;	// vec4 each
+	uint64_t sinkOffset;
+	uint64_t obstacleOffset;	// ColliderObstacle each
+	uint64_t cornerOffset;		// vec3 each, transformed, the mesh file is not needed
+	uint64_t fileSize;
+};
+
+// Versioned binary checkpoint of a run, mapped instead of read. The particles of an open
+// checkpoint go to glBufferSubData or the CPU solver as they lie in the file, restarting
+// takes as long as the pages take to come in.
+class Checkpoint {
+public:
+	CheckpointHeader header;
+
+	Checkpoint();
+	void open(const string& path);		// map and validate, throws runtime_error
+	void create(const string& path);	// lay out the counts of the header and map for writing
+	void close();
+	Particle* particles();
+	GLuint* activity();
+	GLuint* ring();
+	Emitter* emitters();
+	vec4* killPlanes();
+	Sink* sinks();
+	ColliderObstacle* obstacles();
+	vec3* corners();
+
+private:
+	MappedFile file;
+};
+
+#endif // !_CHECKPOINT_HPP
@@ -0,0 +1,203 @@
+#include "CpuKernels.hpp"
+#include "constants.hpp"
+#include <cmath>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// Scalar fallback and reference for the SIMD kernels, the sums of the shader passes
+static float densityScalar(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, int& neighbors)
+{
+	const float h2 = CORE_RADIUS * CORE_RADIUS;
+	float sum = 0.f;
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = ranges[r].begin; j < ranges[r].end; j++)
+		{
+			float dx = p.x[i] - p.x[j], dy = p.y[i] - p.y[j], dz = p.z[i] - p.z[j];
+			float r2 = dx * dx + dy * dy + dz * dz;
+			if (r2 < h2)
+			{
+				float w = h2 - r2;
+				sum += w * w * w;
+				count++;
+			}
+		}
+	}
+	neighbors = count;
+	return sum;
+}
+
+static void forcesScalar(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, ForceSums& sums)
+{
+	const float h2 = CORE_RADIUS * CORE_RADIUS;
+	sums = ForceSums();
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = ranges[r].begin; j < ranges[r].end; j++)
+		{
+			float dx = p.x[i] - p.x[j], dy = p.y[i] - p.y[j], dz = p.z[i] - p.z[j];
+			float r2 = dx * dx + dy * dy + dz * dz;
+			if (r2 >= h2 || j == i)
+				continue;
+
+			float dist = sqrtf(r2);
+			float q = CORE_RADIUS - dist;
+			float w = h2 - r2;
+			float densityIJ = p.density[i] * p.density[j];
+			float pressure = (p.pressure[i] + p.pressure[j]) / (2.f * densityIJ) * q * q / dist;
+			sums.pressure[0] += dx * pressure;
+			sums.pressure[1] += dy * pressure;
+			sums.pressure[2] += dz * pressure;
+
+			float viscosity = q / densityIJ;
+			sums.viscosity[0] += (p.vx[j] - p.vx[i]) * viscosity;
+			sums.viscosity[1] += (p.vy[j] - p.vy[i]) * viscosity;
+			sums.viscosity[2] += (p.vz[j] - p.vz[i]) * viscosity;
+			sums.viscosityWeight += viscosity;
+
+			float invDensity = 1.f / p.density[j];
+			sums.color += invDensity * w * w * w;
+			float normal = invDensity * w * w;
+			sums.normal[0] += dx * normal;
+			sums.normal[1] += dy * normal;
+			sums.normal[2] += dz * normal;
+		}
+	}
+}
+
+static int densitySymmetricScalar(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc)
+{
+	const float h2 = CORE_RADIUS * CORE_RADIUS;
+	float sum = 0.f;
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = r == 0 ? i + 1 : ranges[r].begin; j < ranges[r].end; j++)
+		{
+			float dx = p.x[i] - p.x[j], dy = p.y[i] - p.y[j], dz = p.z[i] - p.z[j];
+			float r2 = dx * dx + dy * dy + dz * dz;
+			if (r2 < h2)
+			{
+				float w = h2 - r2;
+				float w3 = w * w * w;
+				sum += w3;
+				acc.density[j] += w3;
+				count++;
+			}
+		}
+	}
+	acc.density[i] += sum;
+	return count;
+}
+
+static void forcesSymmetricScalar(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc)
+{
+	const float h2 = CORE_RADIUS * CORE_RADIUS;
+	float invDensityI = 1.f / p.density[i];
+	ForceSums sums = ForceSums();
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = r == 0 ? i + 1 : ranges[r].begin; j < ranges[r].end; j++)
+		{
+			float dx = p.x[i] - p.x[j], dy = p.y[i] - p.y[j], dz = p.z[i] - p.z[j];
+			float r2 = dx * dx + dy * dy + dz * dz;
+			if (r2 >= h2)
+				continue;
+
+			float dist = sqrtf(r2);
+			float q = CORE_RADIUS - dist;
+			float w = h2 - r2;
+			float densityIJ = p.density[i] * p.density[j];
+			float d[3] = { dx, dy, dz };
+			float dv[3] = { p.vx[j] - p.vx[i], p.vy[j] - p.vy[i], p.vz[j] - p.vz[i] };
+
+			// pressure and viscosity are antisymmetric, the weights symmetric
+			float pressure = (p.pressure[i] + p.pressure[j]) / (2.f * densityIJ) * q * q / dist;
+			float viscosity = q / densityIJ;
+			float invDensityJ = 1.f / p.density[j];
+			for (int k = 0; k < 3; k++)
+			{
+				sums.pressure[k] += d[k] * pressure;
+				acc.pressure[k][j] -= d[k] * pressure;
+				sums.viscosity[k] += dv[k] * viscosity;
+				acc.viscosity[k][j] -= dv[k] * viscosity;
+				sums.normal[k] += d[k] * invDensityJ * w * w;
+				acc.normal[k][j] -= d[k] * invDensityI * w * w;
+			}
+			sums.viscosityWeight += viscosity;
+			acc.viscosityWeight[j] += viscosity;
+			sums.color += invDensityJ * w * w * w;
+			acc.color[j] += invDensityI * w * w * w;
+		}
+	}
+
+	for (int k = 0; k < 3; k++)
+	{
+		acc.pressure[k][i] += sums.pressure[k];
+		acc.viscosity[k][i] += sums.viscosity[k];
+		acc.normal[k][i] += sums.normal[k];
+	}
+	acc.viscosityWeight[i] += sums.viscosityWeight;
+	acc.color[i] += sums.color;
+}
+
+const CpuKernels CPU_KERNELS_SCALAR = { "Scalar", 1, densityScalar, forcesScalar, densitySymmetricScalar, forcesSymmetricScalar };
+
+
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int*)regs, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+int detectCpuKernelLevel()
+{
+	unsigned int regs[4];
+	cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return CPU_KERNEL_SCALAR;
+
+	// The OS must save the wide registers (OSXSAVE, then the XCR0 state bits)
+	cpuid(1, 0, regs);
+	bool osxsave = (regs[2] >> 27) & 1;
+	bool fma = (regs[2] >> 12) & 1;
+	if (!osxsave)
+		return CPU_KERNEL_SCALAR;
+	unsigned long long xcr0 = xgetbv0();
+
+	cpuid(7, 0, regs);
+	bool avx2 = (regs[1] >> 5) & 1;
+	bool avx512f = (regs[1] >> 16) & 1;
+	if (avx512f && (xcr0 & 0xe6) == 0xe6)
+		return CPU_KERNEL_AVX512;
+	if (avx2 && fma && (xcr0 & 0x6) == 0x6)
+		return CPU_KERNEL_AVX2;
+	return CPU_KERNEL_SCALAR;
+}
+
+const CpuKernels& cpuKernels(int level)
+{
+	if (level >= CPU_KERNEL_AVX512)
+		return CPU_KERNELS_AVX512;
+	if (level == CPU_KERNEL_AVX2)
+		return CPU_KERNELS_AVX2;
+	return CPU_KERNELS_SCALAR;
+}
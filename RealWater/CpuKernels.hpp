@@ -0,0 +1,80 @@
+#ifndef _CPU_KERNELS_HPP
+#define _CPU_KERNELS_HPP
+
+// Every cell's range of the sorted arrays starts at a multiple of CPU_KERNEL_PAD and is
+// filled up with far away dummies, so kernels of any width run whole vectors
+#define CPU_KERNEL_PAD 16
+#define CPU_KERNEL_FAR 1e30f
+
+// Kernel instruction sets, in order of preference
+const int CPU_KERNEL_SCALAR = 0;
+const int CPU_KERNEL_AVX2 = 1;
+const int CPU_KERNEL_AVX512 = 2;
+
+// Cell-sorted SoA view of the particles (with the dummies)
+struct KernelParticles
+{
+	const float* x;
+	const float* y;
+	const float* z;
+	const float* vx;
+	const float* vy;
+	const float* vz;
+	const float* density;
+	const float* pressure;
+};
+
+// Padded slot range of one neighbor cell
+struct CellRange
+{
+	int begin;
+	int end;
+};
+
+// Neighbor sums of pass 2 for one particle, scaled by the caller
+struct ForceSums
+{
+	float pressure[3];
+	float viscosity[3];
+	float normal[3];
+	float color;
+	float viscosityWeight;
+};
+
+// Per slot sums of the symmetric traversal, one set per worker so that the updates of j
+// need no atomics; the sets are added up after the pass
+struct PairAccumulators
+{
+	float* density;
+	float* pressure[3];
+	float* viscosity[3];
+	float* normal[3];
+	float* color;
+	float* viscosityWeight;
+};
+
+// Density and force loops of sh_compute.glsl pass 1 and 2 over the candidates of the
+// neighbor cells of slot i, evaluating width candidates at once
+struct CpuKernels
+{
+	const char* name;
+	int width;
+	// sum_j (h^2 - r^2)^3, neighbors gets the number of j within h (i included)
+	float (*density)(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, int& neighbors);
+	void (*forces)(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, ForceSums& sums);
+
+	// Half shell versions: ranges[0] is the own cell where only j > i is visited, the rest
+	// are the neighbor cells stored after it. Each pair adds to the sums of i and j (Newton's third law),
+	// density returns the pairs found, the self term of i is left to the caller.
+	int (*densitySymmetric)(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc);
+	void (*forcesSymmetric)(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc);
+};
+
+extern const CpuKernels CPU_KERNELS_SCALAR;
+extern const CpuKernels CPU_KERNELS_AVX2;		// CpuKernelsAVX2.cpp, built with /arch:AVX2
+extern const CpuKernels CPU_KERNELS_AVX512;	// CpuKernelsAVX512.cpp, built with /arch:AVX512
+
+int detectCpuKernelLevel();		// best instruction set of this CPU and OS (cpuid / xgetbv)
+const CpuKernels& cpuKernels(int level);
+
+#endif // !_CPU_KERNELS_HPP
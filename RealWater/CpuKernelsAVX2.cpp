@@ -0,0 +1,258 @@
+// 8 candidates per iteration, compiled with /arch:AVX2 and only called after
+// detectCpuKernelLevel() found AVX2 and FMA
+#ifndef _MSC_VER
+#pragma GCC target("avx2,fma,popcnt")
+#endif
+#include "CpuKernels.hpp"
+#include "constants.hpp"
+#include <immintrin.h>
+
+static inline float horizontalSum(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+static float densityAVX2(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, int& neighbors)
+{
+	const __m256 h2 = _mm256_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	__m256 xi = _mm256_set1_ps(p.x[i]), yi = _mm256_set1_ps(p.y[i]), zi = _mm256_set1_ps(p.z[i]);
+	__m256 sum = _mm256_setzero_ps();
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = ranges[r].begin; j < ranges[r].end; j += 8)
+		{
+			__m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(p.x + j));
+			__m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(p.y + j));
+			__m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(p.z + j));
+			__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+			__m256 inside = _mm256_cmp_ps(r2, h2, _CMP_LT_OQ);
+			__m256 w = _mm256_sub_ps(h2, r2);
+			__m256 w3 = _mm256_mul_ps(_mm256_mul_ps(w, w), w);
+			sum = _mm256_add_ps(sum, _mm256_and_ps(inside, w3));
+			count += _mm_popcnt_u32(_mm256_movemask_ps(inside));
+		}
+	}
+	neighbors = count;
+	return horizontalSum(sum);
+}
+
+static void forcesAVX2(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, ForceSums& sums)
+{
+	const __m256 h = _mm256_set1_ps(CORE_RADIUS);
+	const __m256 h2 = _mm256_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i self = _mm256_set1_epi32(i);
+	__m256 xi = _mm256_set1_ps(p.x[i]), yi = _mm256_set1_ps(p.y[i]), zi = _mm256_set1_ps(p.z[i]);
+	__m256 vxi = _mm256_set1_ps(p.vx[i]), vyi = _mm256_set1_ps(p.vy[i]), vzi = _mm256_set1_ps(p.vz[i]);
+	__m256 densityI = _mm256_set1_ps(p.density[i]);
+	__m256 pressureI = _mm256_set1_ps(p.pressure[i]);
+
+	__m256 px = _mm256_setzero_ps(), py = _mm256_setzero_ps(), pz = _mm256_setzero_ps();
+	__m256 vx = _mm256_setzero_ps(), vy = _mm256_setzero_ps(), vz = _mm256_setzero_ps();
+	__m256 nx = _mm256_setzero_ps(), ny = _mm256_setzero_ps(), nz = _mm256_setzero_ps();
+	__m256 color = _mm256_setzero_ps(), weight = _mm256_setzero_ps();
+
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = ranges[r].begin; j < ranges[r].end; j += 8)
+		{
+			__m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(p.x + j));
+			__m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(p.y + j));
+			__m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(p.z + j));
+			__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+			__m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), lanes);
+			__m256 notSelf = _mm256_castsi256_ps(_mm256_cmpeq_epi32(index, self));
+			__m256 mask = _mm256_andnot_ps(notSelf, _mm256_cmp_ps(r2, h2, _CMP_LT_OQ));
+			if (_mm256_movemask_ps(mask) == 0)
+				continue;
+
+			__m256 dist = _mm256_sqrt_ps(r2);
+			__m256 q = _mm256_sub_ps(h, dist);
+			__m256 w = _mm256_sub_ps(h2, r2);
+			__m256 densityJ = _mm256_loadu_ps(p.density + j);
+			__m256 densityIJ = _mm256_mul_ps(densityI, densityJ);
+
+			// pressure, (p_i + p_j) / (2 rho_i rho_j) (h - r)^2 along dir / r
+			__m256 pressure = _mm256_div_ps(_mm256_add_ps(pressureI, _mm256_loadu_ps(p.pressure + j)),
+				_mm256_mul_ps(_mm256_add_ps(densityIJ, densityIJ), dist));
+			pressure = _mm256_and_ps(mask, _mm256_mul_ps(pressure, _mm256_mul_ps(q, q)));
+			px = _mm256_fmadd_ps(dx, pressure, px);
+			py = _mm256_fmadd_ps(dy, pressure, py);
+			pz = _mm256_fmadd_ps(dz, pressure, pz);
+
+			// viscosity, (v_j - v_i) (h - r) / (rho_i rho_j)
+			__m256 viscosity = _mm256_and_ps(mask, _mm256_div_ps(q, densityIJ));
+			vx = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_loadu_ps(p.vx + j), vxi), viscosity, vx);
+			vy = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_loadu_ps(p.vy + j), vyi), viscosity, vy);
+			vz = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_loadu_ps(p.vz + j), vzi), viscosity, vz);
+			weight = _mm256_add_ps(weight, viscosity);
+
+			// color field and surface normal
+			// (dummies give inf * 0 before the mask, so mask the products)
+			__m256 invDensity = _mm256_div_ps(one, densityJ);
+			__m256 normal = _mm256_and_ps(mask, _mm256_mul_ps(invDensity, _mm256_mul_ps(w, w)));
+			color = _mm256_add_ps(color, _mm256_and_ps(mask, _mm256_mul_ps(normal, w)));
+			nx = _mm256_fmadd_ps(dx, normal, nx);
+			ny = _mm256_fmadd_ps(dy, normal, ny);
+			nz = _mm256_fmadd_ps(dz, normal, nz);
+		}
+	}
+
+	sums.pressure[0] = horizontalSum(px);
+	sums.pressure[1] = horizontalSum(py);
+	sums.pressure[2] = horizontalSum(pz);
+	sums.viscosity[0] = horizontalSum(vx);
+	sums.viscosity[1] = horizontalSum(vy);
+	sums.viscosity[2] = horizontalSum(vz);
+	sums.normal[0] = horizontalSum(nx);
+	sums.normal[1] = horizontalSum(ny);
+	sums.normal[2] = horizontalSum(nz);
+	sums.color = horizontalSum(color);
+	sums.viscosityWeight = horizontalSum(weight);
+}
+
+// Start of the half shell in range r, the own cell starts at the block holding i
+static inline int halfShellBegin(const CellRange* ranges, int r, int i)
+{
+	return r == 0 ? ranges[0].begin + (i - ranges[0].begin) / 8 * 8 : ranges[r].begin;
+}
+
+static inline void addTo(float* acc, __m256 v)
+{
+	_mm256_storeu_ps(acc, _mm256_add_ps(_mm256_loadu_ps(acc), v));
+}
+
+static inline void subtractFrom(float* acc, __m256 a, __m256 b)
+{
+	_mm256_storeu_ps(acc, _mm256_fnmadd_ps(a, b, _mm256_loadu_ps(acc)));
+}
+
+static int densitySymmetricAVX2(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc)
+{
+	const __m256 h2 = _mm256_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 xi = _mm256_set1_ps(p.x[i]), yi = _mm256_set1_ps(p.y[i]), zi = _mm256_set1_ps(p.z[i]);
+	__m256 sum = _mm256_setzero_ps();
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		// j > i in the own cell, everything in the forward cells
+		__m256i first = _mm256_set1_epi32(r == 0 ? i : -1);
+		for (int j = halfShellBegin(ranges, r, i); j < ranges[r].end; j += 8)
+		{
+			__m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(p.x + j));
+			__m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(p.y + j));
+			__m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(p.z + j));
+			__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+			__m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), lanes);
+			__m256 inside = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(index, first)), _mm256_cmp_ps(r2, h2, _CMP_LT_OQ));
+			int bits = _mm256_movemask_ps(inside);
+			if (bits == 0)
+				continue;
+
+			__m256 w = _mm256_sub_ps(h2, r2);
+			__m256 w3 = _mm256_and_ps(inside, _mm256_mul_ps(_mm256_mul_ps(w, w), w));
+			sum = _mm256_add_ps(sum, w3);
+			addTo(acc.density + j, w3);
+			count += _mm_popcnt_u32(bits);
+		}
+	}
+	acc.density[i] += horizontalSum(sum);
+	return count;
+}
+
+static void forcesSymmetricAVX2(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc)
+{
+	const __m256 h = _mm256_set1_ps(CORE_RADIUS);
+	const __m256 h2 = _mm256_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 xi = _mm256_set1_ps(p.x[i]), yi = _mm256_set1_ps(p.y[i]), zi = _mm256_set1_ps(p.z[i]);
+	__m256 vxi = _mm256_set1_ps(p.vx[i]), vyi = _mm256_set1_ps(p.vy[i]), vzi = _mm256_set1_ps(p.vz[i]);
+	__m256 densityI = _mm256_set1_ps(p.density[i]);
+	__m256 invDensityI = _mm256_set1_ps(1.f / p.density[i]);
+	__m256 pressureI = _mm256_set1_ps(p.pressure[i]);
+
+	__m256 px = _mm256_setzero_ps(), py = _mm256_setzero_ps(), pz = _mm256_setzero_ps();
+	__m256 vx = _mm256_setzero_ps(), vy = _mm256_setzero_ps(), vz = _mm256_setzero_ps();
+	__m256 nx = _mm256_setzero_ps(), ny = _mm256_setzero_ps(), nz = _mm256_setzero_ps();
+	__m256 color = _mm256_setzero_ps(), weight = _mm256_setzero_ps();
+
+	for (int r = 0; r < rangeCount; r++)
+	{
+		__m256i first = _mm256_set1_epi32(r == 0 ? i : -1);
+		for (int j = halfShellBegin(ranges, r, i); j < ranges[r].end; j += 8)
+		{
+			__m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(p.x + j));
+			__m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(p.y + j));
+			__m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(p.z + j));
+			__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+			__m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), lanes);
+			__m256 mask = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(index, first)), _mm256_cmp_ps(r2, h2, _CMP_LT_OQ));
+			if (_mm256_movemask_ps(mask) == 0)
+				continue;
+
+			__m256 dist = _mm256_sqrt_ps(r2);
+			__m256 q = _mm256_sub_ps(h, dist);
+			__m256 w = _mm256_sub_ps(h2, r2);
+			__m256 w2 = _mm256_mul_ps(w, w);
+			__m256 densityJ = _mm256_loadu_ps(p.density + j);
+			__m256 densityIJ = _mm256_mul_ps(densityI, densityJ);
+
+			// pressure and viscosity go to j with the opposite sign
+			__m256 pressure = _mm256_div_ps(_mm256_add_ps(pressureI, _mm256_loadu_ps(p.pressure + j)),
+				_mm256_mul_ps(_mm256_add_ps(densityIJ, densityIJ), dist));
+			pressure = _mm256_and_ps(mask, _mm256_mul_ps(pressure, _mm256_mul_ps(q, q)));
+			px = _mm256_fmadd_ps(dx, pressure, px);
+			py = _mm256_fmadd_ps(dy, pressure, py);
+			pz = _mm256_fmadd_ps(dz, pressure, pz);
+			subtractFrom(acc.pressure[0] + j, dx, pressure);
+			subtractFrom(acc.pressure[1] + j, dy, pressure);
+			subtractFrom(acc.pressure[2] + j, dz, pressure);
+
+			__m256 viscosity = _mm256_and_ps(mask, _mm256_div_ps(q, densityIJ));
+			__m256 dvx = _mm256_sub_ps(_mm256_loadu_ps(p.vx + j), vxi);
+			__m256 dvy = _mm256_sub_ps(_mm256_loadu_ps(p.vy + j), vyi);
+			__m256 dvz = _mm256_sub_ps(_mm256_loadu_ps(p.vz + j), vzi);
+			vx = _mm256_fmadd_ps(dvx, viscosity, vx);
+			vy = _mm256_fmadd_ps(dvy, viscosity, vy);
+			vz = _mm256_fmadd_ps(dvz, viscosity, vz);
+			weight = _mm256_add_ps(weight, viscosity);
+			subtractFrom(acc.viscosity[0] + j, dvx, viscosity);
+			subtractFrom(acc.viscosity[1] + j, dvy, viscosity);
+			subtractFrom(acc.viscosity[2] + j, dvz, viscosity);
+			addTo(acc.viscosityWeight + j, viscosity);
+
+			// color field and normal of i weigh by 1 / rho_j, those of j by 1 / rho_i
+			__m256 normal = _mm256_and_ps(mask, _mm256_mul_ps(_mm256_div_ps(one, densityJ), w2));
+			__m256 normalJ = _mm256_and_ps(mask, _mm256_mul_ps(invDensityI, w2));
+			color = _mm256_add_ps(color, _mm256_and_ps(mask, _mm256_mul_ps(normal, w)));
+			addTo(acc.color + j, _mm256_and_ps(mask, _mm256_mul_ps(normalJ, w)));
+			nx = _mm256_fmadd_ps(dx, normal, nx);
+			ny = _mm256_fmadd_ps(dy, normal, ny);
+			nz = _mm256_fmadd_ps(dz, normal, nz);
+			subtractFrom(acc.normal[0] + j, dx, normalJ);
+			subtractFrom(acc.normal[1] + j, dy, normalJ);
+			subtractFrom(acc.normal[2] + j, dz, normalJ);
+		}
+	}
+
+	acc.pressure[0][i] += horizontalSum(px);
+	acc.pressure[1][i] += horizontalSum(py);
+	acc.pressure[2][i] += horizontalSum(pz);
+	acc.viscosity[0][i] += horizontalSum(vx);
+	acc.viscosity[1][i] += horizontalSum(vy);
+	acc.viscosity[2][i] += horizontalSum(vz);
+	acc.normal[0][i] += horizontalSum(nx);
+	acc.normal[1][i] += horizontalSum(ny);
+	acc.normal[2][i] += horizontalSum(nz);
+	acc.color[i] += horizontalSum(color);
+	acc.viscosityWeight[i] += horizontalSum(weight);
+}
+
+const CpuKernels CPU_KERNELS_AVX2 = { "AVX2", 8, densityAVX2, forcesAVX2, densitySymmetricAVX2, forcesSymmetricAVX2 };
@@ -0,0 +1,239 @@
+// 16 candidates per iteration, compiled with /arch:AVX512 and only called after
+// detectCpuKernelLevel() found AVX-512F
+#ifndef _MSC_VER
+#pragma GCC target("avx512f,popcnt")
+#endif
+#include "CpuKernels.hpp"
+#include "constants.hpp"
+#include <immintrin.h>
+
+static float densityAVX512(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, int& neighbors)
+{
+	const __m512 h2 = _mm512_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	__m512 xi = _mm512_set1_ps(p.x[i]), yi = _mm512_set1_ps(p.y[i]), zi = _mm512_set1_ps(p.z[i]);
+	__m512 sum = _mm512_setzero_ps();
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = ranges[r].begin; j < ranges[r].end; j += 16)
+		{
+			__m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(p.x + j));
+			__m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(p.y + j));
+			__m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(p.z + j));
+			__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+			__mmask16 inside = _mm512_cmp_ps_mask(r2, h2, _CMP_LT_OQ);
+			__m512 w = _mm512_sub_ps(h2, r2);
+			sum = _mm512_mask_add_ps(sum, inside, sum, _mm512_mul_ps(_mm512_mul_ps(w, w), w));
+			count += _mm_popcnt_u32(inside);
+		}
+	}
+	neighbors = count;
+	return _mm512_reduce_add_ps(sum);
+}
+
+static void forcesAVX512(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, ForceSums& sums)
+{
+	const __m512 h = _mm512_set1_ps(CORE_RADIUS);
+	const __m512 h2 = _mm512_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	const __m512 one = _mm512_set1_ps(1.f);
+	__m512 xi = _mm512_set1_ps(p.x[i]), yi = _mm512_set1_ps(p.y[i]), zi = _mm512_set1_ps(p.z[i]);
+	__m512 vxi = _mm512_set1_ps(p.vx[i]), vyi = _mm512_set1_ps(p.vy[i]), vzi = _mm512_set1_ps(p.vz[i]);
+	__m512 densityI = _mm512_set1_ps(p.density[i]);
+	__m512 pressureI = _mm512_set1_ps(p.pressure[i]);
+
+	__m512 px = _mm512_setzero_ps(), py = _mm512_setzero_ps(), pz = _mm512_setzero_ps();
+	__m512 vx = _mm512_setzero_ps(), vy = _mm512_setzero_ps(), vz = _mm512_setzero_ps();
+	__m512 nx = _mm512_setzero_ps(), ny = _mm512_setzero_ps(), nz = _mm512_setzero_ps();
+	__m512 color = _mm512_setzero_ps(), weight = _mm512_setzero_ps();
+
+	for (int r = 0; r < rangeCount; r++)
+	{
+		for (int j = ranges[r].begin; j < ranges[r].end; j += 16)
+		{
+			__m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(p.x + j));
+			__m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(p.y + j));
+			__m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(p.z + j));
+			__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+			__mmask16 mask = _mm512_cmp_ps_mask(r2, h2, _CMP_LT_OQ);
+			if (i >= j && i < j + 16)
+				mask &= (__mmask16)~(1u << (i - j));
+			if (mask == 0)
+				continue;
+
+			__m512 dist = _mm512_sqrt_ps(r2);
+			__m512 q = _mm512_sub_ps(h, dist);
+			__m512 w = _mm512_sub_ps(h2, r2);
+			__m512 densityJ = _mm512_loadu_ps(p.density + j);
+			__m512 densityIJ = _mm512_mul_ps(densityI, densityJ);
+
+			// masked products, the dummies would give inf * 0
+			__m512 pressure = _mm512_div_ps(_mm512_add_ps(pressureI, _mm512_loadu_ps(p.pressure + j)),
+				_mm512_mul_ps(_mm512_add_ps(densityIJ, densityIJ), dist));
+			pressure = _mm512_maskz_mul_ps(mask, pressure, _mm512_mul_ps(q, q));
+			px = _mm512_fmadd_ps(dx, pressure, px);
+			py = _mm512_fmadd_ps(dy, pressure, py);
+			pz = _mm512_fmadd_ps(dz, pressure, pz);
+
+			__m512 viscosity = _mm512_maskz_div_ps(mask, q, densityIJ);
+			vx = _mm512_fmadd_ps(_mm512_sub_ps(_mm512_loadu_ps(p.vx + j), vxi), viscosity, vx);
+			vy = _mm512_fmadd_ps(_mm512_sub_ps(_mm512_loadu_ps(p.vy + j), vyi), viscosity, vy);
+			vz = _mm512_fmadd_ps(_mm512_sub_ps(_mm512_loadu_ps(p.vz + j), vzi), viscosity, vz);
+			weight = _mm512_add_ps(weight, viscosity);
+
+			__m512 invDensity = _mm512_div_ps(one, densityJ);
+			__m512 normal = _mm512_maskz_mul_ps(mask, invDensity, _mm512_mul_ps(w, w));
+			color = _mm512_mask3_fmadd_ps(normal, w, color, mask);
+			nx = _mm512_fmadd_ps(dx, normal, nx);
+			ny = _mm512_fmadd_ps(dy, normal, ny);
+			nz = _mm512_fmadd_ps(dz, normal, nz);
+		}
+	}
+
+	sums.pressure[0] = _mm512_reduce_add_ps(px);
+	sums.pressure[1] = _mm512_reduce_add_ps(py);
+	sums.pressure[2] = _mm512_reduce_add_ps(pz);
+	sums.viscosity[0] = _mm512_reduce_add_ps(vx);
+	sums.viscosity[1] = _mm512_reduce_add_ps(vy);
+	sums.viscosity[2] = _mm512_reduce_add_ps(vz);
+	sums.normal[0] = _mm512_reduce_add_ps(nx);
+	sums.normal[1] = _mm512_reduce_add_ps(ny);
+	sums.normal[2] = _mm512_reduce_add_ps(nz);
+	sums.color = _mm512_reduce_add_ps(color);
+	sums.viscosityWeight = _mm512_reduce_add_ps(weight);
+}
+
+// Lanes of the block starting at j that belong to the half shell of i, the own cell (r == 0)
+// starts at the block holding i and keeps only j > i
+static inline __mmask16 halfShellLanes(int r, int i, int j)
+{
+	return r == 0 && i >= j ? (__mmask16)~((2u << (i - j)) - 1) : (__mmask16)0xffff;
+}
+
+static inline void addTo(float* acc, __m512 v)
+{
+	_mm512_storeu_ps(acc, _mm512_add_ps(_mm512_loadu_ps(acc), v));
+}
+
+static inline void subtractFrom(float* acc, __m512 a, __m512 b)
+{
+	_mm512_storeu_ps(acc, _mm512_fnmadd_ps(a, b, _mm512_loadu_ps(acc)));
+}
+
+static int densitySymmetricAVX512(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc)
+{
+	const __m512 h2 = _mm512_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	__m512 xi = _mm512_set1_ps(p.x[i]), yi = _mm512_set1_ps(p.y[i]), zi = _mm512_set1_ps(p.z[i]);
+	__m512 sum = _mm512_setzero_ps();
+	int count = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		int begin = r == 0 ? ranges[0].begin + (i - ranges[0].begin) / 16 * 16 : ranges[r].begin;
+		for (int j = begin; j < ranges[r].end; j += 16)
+		{
+			__m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(p.x + j));
+			__m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(p.y + j));
+			__m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(p.z + j));
+			__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+			__mmask16 inside = _mm512_mask_cmp_ps_mask(halfShellLanes(r, i, j), r2, h2, _CMP_LT_OQ);
+			if (inside == 0)
+				continue;
+
+			__m512 w = _mm512_sub_ps(h2, r2);
+			__m512 w3 = _mm512_maskz_mul_ps(inside, _mm512_mul_ps(w, w), w);
+			sum = _mm512_add_ps(sum, w3);
+			addTo(acc.density + j, w3);
+			count += _mm_popcnt_u32(inside);
+		}
+	}
+	acc.density[i] += _mm512_reduce_add_ps(sum);
+	return count;
+}
+
+static void forcesSymmetricAVX512(const KernelParticles& p, int i, const CellRange* ranges, int rangeCount, const PairAccumulators& acc)
+{
+	const __m512 h = _mm512_set1_ps(CORE_RADIUS);
+	const __m512 h2 = _mm512_set1_ps(CORE_RADIUS * CORE_RADIUS);
+	const __m512 one = _mm512_set1_ps(1.f);
+	__m512 xi = _mm512_set1_ps(p.x[i]), yi = _mm512_set1_ps(p.y[i]), zi = _mm512_set1_ps(p.z[i]);
+	__m512 vxi = _mm512_set1_ps(p.vx[i]), vyi = _mm512_set1_ps(p.vy[i]), vzi = _mm512_set1_ps(p.vz[i]);
+	__m512 densityI = _mm512_set1_ps(p.density[i]);
+	__m512 invDensityI = _mm512_set1_ps(1.f / p.density[i]);
+	__m512 pressureI = _mm512_set1_ps(p.pressure[i]);
+
+	__m512 px = _mm512_setzero_ps(), py = _mm512_setzero_ps(), pz = _mm512_setzero_ps();
+	__m512 vx = _mm512_setzero_ps(), vy = _mm512_setzero_ps(), vz = _mm512_setzero_ps();
+	__m512 nx = _mm512_setzero_ps(), ny = _mm512_setzero_ps(), nz = _mm512_setzero_ps();
+	__m512 color = _mm512_setzero_ps(), weight = _mm512_setzero_ps();
+
+	for (int r = 0; r < rangeCount; r++)
+	{
+		int begin = r == 0 ? ranges[0].begin + (i - ranges[0].begin) / 16 * 16 : ranges[r].begin;
+		for (int j = begin; j < ranges[r].end; j += 16)
+		{
+			__m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(p.x + j));
+			__m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(p.y + j));
+			__m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(p.z + j));
+			__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+			__mmask16 mask = _mm512_mask_cmp_ps_mask(halfShellLanes(r, i, j), r2, h2, _CMP_LT_OQ);
+			if (mask == 0)
+				continue;
+
+			__m512 dist = _mm512_sqrt_ps(r2);
+			__m512 q = _mm512_sub_ps(h, dist);
+			__m512 w = _mm512_sub_ps(h2, r2);
+			__m512 w2 = _mm512_mul_ps(w, w);
+			__m512 densityJ = _mm512_loadu_ps(p.density + j);
+			__m512 densityIJ = _mm512_mul_ps(densityI, densityJ);
+
+			// pressure and viscosity go to j with the opposite sign
+			__m512 pressure = _mm512_div_ps(_mm512_add_ps(pressureI, _mm512_loadu_ps(p.pressure + j)),
+				_mm512_mul_ps(_mm512_add_ps(densityIJ, densityIJ), dist));
+			pressure = _mm512_maskz_mul_ps(mask, pressure, _mm512_mul_ps(q, q));
+			px = _mm512_fmadd_ps(dx, pressure, px);
+			py = _mm512_fmadd_ps(dy, pressure, py);
+			pz = _mm512_fmadd_ps(dz, pressure, pz);
+			subtractFrom(acc.pressure[0] + j, dx, pressure);
+			subtractFrom(acc.pressure[1] + j, dy, pressure);
+			subtractFrom(acc.pressure[2] + j, dz, pressure);
+
+			__m512 viscosity = _mm512_maskz_div_ps(mask, q, densityIJ);
+			__m512 dvx = _mm512_sub_ps(_mm512_loadu_ps(p.vx + j), vxi);
+			__m512 dvy = _mm512_sub_ps(_mm512_loadu_ps(p.vy + j), vyi);
+			__m512 dvz = _mm512_sub_ps(_mm512_loadu_ps(p.vz + j), vzi);
+			vx = _mm512_fmadd_ps(dvx, viscosity, vx);
+			vy = _mm512_fmadd_ps(dvy, viscosity, vy);
+			vz = _mm512_fmadd_ps(dvz, viscosity, vz);
+			weight = _mm512_add_ps(weight, viscosity);
+			subtractFrom(acc.viscosity[0] + j, dvx, viscosity);
+			subtractFrom(acc.viscosity[1] + j, dvy, viscosity);
+			subtractFrom(acc.viscosity[2] + j, dvz, viscosity);
+			addTo(acc.viscosityWeight + j, viscosity);
+
+			// color field and normal of i weigh by 1 / rho_j, those of j by 1 / rho_i
+			__m512 normal = _mm512_maskz_mul_ps(mask, _mm512_div_ps(one, densityJ), w2);
+			__m512 normalJ = _mm512_maskz_mul_ps(mask, invDensityI, w2);
+			color = _mm512_mask3_fmadd_ps(normal, w, color, mask);
+			addTo(acc.color + j, _mm512_maskz_mul_ps(mask, normalJ, w));
+			nx = _mm512_fmadd_ps(dx, normal, nx);
+			ny = _mm512_fmadd_ps(dy, normal, ny);
+			nz = _mm512_fmadd_ps(dz, normal, nz);
+			subtractFrom(acc.normal[0] + j, dx, normalJ);
+			subtractFrom(acc.normal[1] + j, dy, normalJ);
+			subtractFrom(acc.normal[2] + j, dz, normalJ);
+		}
+	}
+
+	acc.pressure[0][i] += _mm512_reduce_add_ps(px);
+	acc.pressure[1][i] += _mm512_reduce_add_ps(py);
+	acc.pressure[2][i] += _mm512_reduce_add_ps(pz);
+	acc.viscosity[0][i] += _mm512_reduce_add_ps(vx);
+	acc.viscosity[1][i] += _mm512_reduce_add_ps(vy);
+	acc.viscosity[2][i] += _mm512_reduce_add_ps(vz);
+	acc.normal[0][i] += _mm512_reduce_add_ps(nx);
+	acc.normal[1][i] += _mm512_reduce_add_ps(ny);
+	acc.normal[2][i] += _mm512_reduce_add_ps(nz);
+	acc.color[i] += _mm512_reduce_add_ps(color);
+	acc.viscosityWeight[i] += _mm512_reduce_add_ps(weight);
+}
+
+const CpuKernels CPU_KERNELS_AVX512 = { "AVX-512", 16, densityAVX512, forcesAVX512, densitySymmetricAVX512, forcesSymmetricAVX512 };
@@ -0,0 +1,1087 @@
+#include "CpuSolver.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <climits>
+
+CpuSolver::CpuSolver(int threadCount) :
+	pairCount(0),
+	rebuildCount(0),
+	kernelTime(0.f),
+	blockSize(CPU_CELLS_PER_TASK),
+	symmetric(false),
+	incrementalGrid(false),
+	tombstones(0),
+	gridStats(),
+	brickCursorSize(0),
+	pool(threadCount)
+{
+	maxKernelLevel = detectCpuKernelLevel();
+	kernelLevel = maxKernelLevel;
+	workerPairs.resize(pool.size());
+	workerSums.resize(pool.size());
+	workerBricks.resize(pool.size());
+	workerScratch.resize(pool.size());
+}
+
+void CpuSolver::load(const Particle* particles, int count)
+{
+	positions.resize(count);
+	prevPositions.resize(count);
+	velocities.resize(count);
+	accelerations.resize(count);
+	normals.resize(count);
+	factors.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		positions[i] = particles[i].currPos;
+		prevPositions[i] = particles[i].prevPos;
+		velocities[i] = particles[i].vel;
+		accelerations[i] = particles[i].acc;
+		normals[i] = particles[i].surfaceNorm;
+		factors[i] = particles[i].factor;
+	}
+}
+
+void CpuSolver::store(Particle* particles)
+{
+	for (int i = 0; i < count(); i++)
+	{
+		particles[i].currPos = positions[i];
+		particles[i].prevPos = prevPositions[i];
+		particles[i].vel = velocities[i];
+		particles[i].acc = accelerations[i];
+		particles[i].surfaceNorm = normals[i];
+		particles[i].factor = factors[i];
+	}
+}
+
+void CpuSolver::step(float deltaTime, SDFCollider& collider)
+{
+	sort();
+	auto start = chrono::high_resolution_clock::now();
+	computeDensity();
+	computeForces(deltaTime);
+	chrono::duration<float, milli> elapsed = chrono::high_resolution_clock::now() - start;
+	kernelTime = elapsed.count();
+	integrate(deltaTime, collider);
+}
+
+// 21 bits of v to every third bit, the z-order interleave
+static inline uint64_t spreadBits(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+	return v;
+}
+
+static inline uint64_t mortonKey(ivec3 cell)
+{
+	// Biased so that the cells below the origin keep their order
+	const int bias = 1 << 20;
+	return spreadBits(cell.x + bias) | spreadBits(cell.y + bias) << 1 | spreadBits(cell.z + bias) << 2;
+}
+
+ivec3 CpuSolver::cellOf(vec3 p)
+{
+	// No domain, only the brick keys of the sparse grid bound the cells
+	return SparseBlockGrid::clampCell(ivec3(floor(p / CORE_RADIUS)));
+}
+
+// Z-order of a cell inside its brick of 4^3 cells, the bins of the pass per brick
+static inline int brickLocalKey(ivec3 cell)
+{
+	ivec3 local = cell & (GRID_BRICK - 1);
+	ivec3 spread = (local & 1) | (local & 2) << 2;
+	return spread.x | spread.y << 1 | spread.z << 2;
+}
+
+int CpuSolver::scanExclusive(vector<int>& values)
+{
+	// Sums of the blocks on the pool, their offsets in order, then every block adds its own
+	int count = (int)values.size();
+	int block = glm::max(CPU_PARTICLES_PER_TASK, count / pool.size() + 1);
+	blockSums.assign((count + block - 1) / block, 0);
+	pool.parallelFor(count, block, [&](int begin, int end, int) {
+		int sum = 0;
+		for (int k = begin; k < end; k++)
+			sum += values[k];
+		blockSums[begin / block] = sum;
+	});
+	int total = 0;
+	for (int& sum : blockSums)
+	{
+		int blockTotal = sum;
+		sum = total;
+		total += blockTotal;
+	}
+	pool.parallelFor(count, block, [&](int begin, int end, int) {
+		int sum = blockSums[begin / block];
+		for (int k = begin; k < end; k++)
+		{
+			int value = values[k];
+			values[k] = sum;
+			sum += value;
+		}
+	});
+	return total;
+}
+
+void CpuSolver::rebuildNeighbors()
+{
+	// Occupied neighbors of every cell, the 27 lookups are only paid when the cells change.
+	// Counted first, then written at the scanned offsets.
+	int cellTotal = (int)cellKeys.size();
+	neighborStart.resize(cellTotal + 1);
+	auto visit = [&](int cell, int* out) {
+		int found = 0;
+		for (int dz = -1; dz <= 1; dz++)
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					int* neighbor = grid.find(cellCoords[cell] + ivec3(dx, dy, dz));
+					if (neighbor && *neighbor >= 0)
+					{
+						if (out)
+							out[found] = *neighbor;
+						found++;
+					}
+				}
+		return found;
+	};
+	pool.parallelFor(cellTotal, 64 * blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+			neighborStart[cell] = visit(cell, NULL);
+	});
+	neighborStart[cellTotal] = 0;
+	neighborCells.resize(scanExclusive(neighborStart));
+	pool.parallelFor(cellTotal, 64 * blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+			visit(cell, neighborCells.data() + neighborStart[cell]);
+	});
+	rebuildCount++;
+}
+
+void CpuSolver::sort()
+{
+	auto start = chrono::high_resolution_clock::now();
+	int n = count();
+	int moved = -1;
+	bool patched = incrementalGrid && updateSlots(moved);
+	if (!patched)
+	{
+		int changed = rebuildSlots();
+		if (moved < 0)
+			moved = changed;
+	}
+
+	chrono::duration<float, milli> elapsed = chrono::high_resolution_clock::now() - start;
+	gridStats.movedFraction = n > 0 ? (float)moved / n : 0.f;
+	gridStats.updateTime = elapsed.count();
+	gridStats.rebuilt = !patched;
+	gridStats.tombstones = tombstones;
+	gridStats.rebuilds += patched ? 0 : 1;
+}
+
+void CpuSolver::writeSlot(int slot, int i)
+{
+	sortedX[slot] = positions[i].x;
+	sortedY[slot] = positions[i].y;
+	sortedZ[slot] = positions[i].z;
+	sortedVX[slot] = velocities[i].x;
+	sortedVY[slot] = velocities[i].y;
+	sortedVZ[slot] = velocities[i].z;
+	slotParticle[slot] = i;
+	particleSlot[i] = slot;
+}
+
+void CpuSolver::clearSlot(int slot)
+{
+	// Dummies are out of reach of everything and have a harmless density
+	sortedX[slot] = CPU_KERNEL_FAR;
+	sortedY[slot] = CPU_KERNEL_FAR;
+	sortedZ[slot] = CPU_KERNEL_FAR;
+	sortedVX[slot] = 0.f;
+	sortedVY[slot] = 0.f;
+	sortedVZ[slot] = 0.f;
+	sortedDensity[slot] = 1.f;
+	sortedPressure[slot] = 0.f;
+	slotParticle[slot] = -1;
+}
+
+bool CpuSolver::updateSlots(int& moved)
+{
+	int n = count();
+	if ((int)particleSlot.size() != n || slotParticle.empty())
+		return false;
+
+	// Particles that changed cell, too many of them and a full rebuild is cheaper
+	movedParticles.clear();
+	for (int i = 0; i < n; i++)
+	{
+		uint64_t key = mortonKey(cellOf(vec3(positions[i])));
+		if (key != particleKeys[i])
+		{
+			movedParticles.push_back(i);
+			particleKeys[i] = key;
+		}
+	}
+	moved = (int)movedParticles.size();
+	if (moved > CPU_GRID_MOVED_FRACTION * n)
+		return false;
+
+	// Old slot becomes a tombstone, the new cell takes a tombstone or a slack slot. A new
+	// cell or a full one needs a rebuild, which also repairs whatever was patched so far.
+	for (int i : movedParticles)
+	{
+		int* entry = grid.find(cellOf(vec3(positions[i])));
+		if (!entry || *entry < 0)
+			return false;
+		int cell = *entry;
+		int slot = cellStart[cell];
+		while (slot < cellStart[cell] + cellUsed[cell] && slotParticle[slot] >= 0)
+			slot++;
+		if (slot == cellEnd[cell])
+			return false;
+
+		if (slot == cellStart[cell] + cellUsed[cell])
+			cellUsed[cell]++;
+		else
+			tombstones--;
+		clearSlot(particleSlot[i]);
+		tombstones++;
+		writeSlot(slot, i);
+	}
+	if (tombstones > CPU_GRID_TOMBSTONE_FRACTION * n)
+		return false;
+
+	// Everyone else stays in place, only the copies are refreshed
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+				if (slotParticle[slot] >= 0)
+					writeSlot(slot, slotParticle[slot]);
+	});
+	return true;
+}
+
+int CpuSolver::rebuildSlots()
+{
+	// Lock free counting sort into z-order. The bricks of the sparse grid are the bins of
+	// the particles, the cells of a brick the bins of a second pass inside each brick.
+	int n = count();
+	int workers = pool.size();
+	bool resized = (int)particleKeys.size() != n;
+	particleKeys.resize(n);
+	particleSlot.resize(n);
+	particleCells.resize(n);
+	particleBrick.resize(n);
+	order.resize(n);
+
+	// Keys and bricks of the particles. Particles in a row mostly share the brick, only
+	// the first of a run probes the table. A table sized after the last bricks can run
+	// full, then it is redone at the particle count, which bounds the bricks.
+	atomic<int> changed(0);
+	bool fits = false;
+	for (int maxBricks = resized ? n : glm::max(2 * grid.brickCount(), 1024); !fits; maxBricks = n)
+	{
+		grid.reset(maxBricks);
+		atomic<bool> full(false);
+		pool.parallelFor(n, CPU_PARTICLES_PER_TASK, [&](int begin, int end, int) {
+			int moved = 0;
+			bool inserted = true;
+			ivec3 lastBrick = ivec3(INT_MAX);
+			for (int i = begin; i < end; i++)
+			{
+				ivec3 cell = cellOf(vec3(positions[i]));
+				uint64_t key = mortonKey(cell);
+				moved += key != particleKeys[i];
+				particleKeys[i] = key;
+				particleCells[i] = cell;
+				if ((cell >> GRID_BRICK_SHIFT) != lastBrick)
+				{
+					inserted = grid.insert(cell) && inserted;
+					lastBrick = cell >> GRID_BRICK_SHIFT;
+				}
+			}
+			changed.fetch_add(moved, memory_order_relaxed);
+			if (!inserted)
+				full.store(true, memory_order_relaxed);
+		});
+		fits = !full.load();
+	}
+	grid.allocate();
+
+	// Brick histograms, every worker counts into its own
+	int bricks = grid.brickCount();
+	for (vector<int>& histogram : workerBricks)
+		histogram.assign(bricks, 0);
+	pool.parallelFor(n, CPU_PARTICLES_PER_TASK, [&](int begin, int end, int worker) {
+		vector<int>& histogram = workerBricks[worker];
+		ivec3 lastBrick = ivec3(INT_MAX);
+		int brick = -1;
+		for (int i = begin; i < end; i++)
+		{
+			if ((particleCells[i] >> GRID_BRICK_SHIFT) != lastBrick)
+			{
+				brick = grid.brickOf(particleCells[i]);
+				lastBrick = particleCells[i] >> GRID_BRICK_SHIFT;
+			}
+			particleBrick[i] = brick;
+			histogram[brick]++;
+		}
+	});
+
+	// Offsets of the bricks, then the scatter hands out the slots of a brick by fetch-add
+	brickStart.resize(bricks + 1);
+	pool.parallelFor(bricks, CPU_PARTICLES_PER_TASK, [&](int begin, int end, int) {
+		for (int brick = begin; brick < end; brick++)
+		{
+			int sum = 0;
+			for (int w = 0; w < workers; w++)
+				sum += workerBricks[w][brick];
+			brickStart[brick] = sum;
+		}
+	});
+	brickStart[bricks] = 0;
+	scanExclusive(brickStart);
+	if (brickCursorSize < (size_t)bricks)
+	{
+		brickCursor.reset(new atomic<int>[bricks]);
+		brickCursorSize = bricks;
+	}
+	for (int brick = 0; brick < bricks; brick++)
+		brickCursor[brick].store(brickStart[brick], memory_order_relaxed);
+	pool.parallelFor(n, CPU_PARTICLES_PER_TASK, [&](int begin, int end, int) {
+		for (int i = begin; i < end; i++)
+			order[brickCursor[particleBrick[i]].fetch_add(1, memory_order_relaxed)] = i;
+	});
+
+	// Inside every brick the cells in z-order, the particles of a cell by index so that
+	// the slots do not depend on the threads, then the occupied cells are counted
+	const int brickCells = GRID_BRICK * GRID_BRICK * GRID_BRICK;
+	brickCellCount.resize(bricks);
+	pool.parallelFor(bricks, 1, [&](int begin, int end, int worker) {
+		vector<int>& scratch = workerScratch[worker];
+		for (int brick = begin; brick < end; brick++)
+		{
+			int first = brickStart[brick], last = brickStart[brick + 1];
+			int start[brickCells + 1] = {}, cursor[brickCells];
+			for (int s = first; s < last; s++)
+				start[brickLocalKey(particleCells[order[s]]) + 1]++;
+			for (int c = 0; c < brickCells; c++)
+				start[c + 1] += start[c];
+			copy(start, start + brickCells, cursor);
+			scratch.resize(last - first);
+			for (int s = first; s < last; s++)
+				scratch[cursor[brickLocalKey(particleCells[order[s]])]++] = order[s];
+
+			int occupied = 0;
+			for (int c = 0; c < brickCells; c++)
+			{
+				for (int s = start[c] + 1; s < start[c + 1]; s++)
+				{
+					int i = scratch[s], t = s;
+					for (; t > start[c] && scratch[t - 1] > i; t--)
+						scratch[t] = scratch[t - 1];
+					scratch[t] = i;
+				}
+				occupied += start[c + 1] > start[c];
+			}
+			copy(scratch.begin(), scratch.end(), order.begin() + first);
+			brickCellCount[brick] = occupied;
+		}
+	});
+
+	// Cell ranges from the runs of equal keys, numbered brick after brick
+	int cellTotal = scanExclusive(brickCellCount);
+	vector<uint64_t> keys(cellTotal);
+	cellCoords.resize(cellTotal);
+	cellUsed.resize(cellTotal);
+	cellFirst.resize(cellTotal);
+	pool.parallelFor(bricks, 1, [&](int begin, int end, int) {
+		for (int brick = begin; brick < end; brick++)
+			for (int s = brickStart[brick], cell = brickCellCount[brick] - 1; s < brickStart[brick + 1]; s++)
+			{
+				uint64_t key = particleKeys[order[s]];
+				if (s == brickStart[brick] || key != particleKeys[order[s - 1]])
+				{
+					cell++;
+					keys[cell] = key;
+					cellCoords[cell] = particleCells[order[s]];
+					cellFirst[cell] = s;
+					cellUsed[cell] = 0;
+					*grid.find(cellCoords[cell]) = cell;
+				}
+				cellUsed[cell]++;
+			}
+	});
+	if (keys != cellKeys)
+	{
+		cellKeys.swap(keys);
+		rebuildNeighbors();
+	}
+
+	// Every range rounded up to CPU_KERNEL_PAD, in incremental mode after a CPU_GRID_SLACK
+	// share of free slots for particles moving in
+	cellStart.resize(cellTotal);
+	cellEnd.resize(cellTotal);
+	pool.parallelFor(cellTotal, 64 * blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+		{
+			int slack = incrementalGrid ? (int)ceil(CPU_GRID_SLACK * cellUsed[cell]) : 0;
+			cellStart[cell] = (cellUsed[cell] + slack + CPU_KERNEL_PAD - 1) / CPU_KERNEL_PAD * CPU_KERNEL_PAD;
+		}
+	});
+	int slots = scanExclusive(cellStart);
+	tombstones = 0;
+
+	// Particles into the SoA copies, dummies after them
+	sortedX.resize(slots);
+	sortedY.resize(slots);
+	sortedZ.resize(slots);
+	sortedVX.resize(slots);
+	sortedVY.resize(slots);
+	sortedVZ.resize(slots);
+	sortedDensity.resize(slots);
+	sortedPressure.resize(slots);
+	slotParticle.resize(slots);
+	pool.parallelFor(cellTotal, blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+		{
+			cellEnd[cell] = cell + 1 < cellTotal ? cellStart[cell + 1] : slots;
+			for (int k = 0; k < cellUsed[cell]; k++)
+				writeSlot(cellStart[cell] + k, order[cellFirst[cell] + k]);
+			for (int slot = cellStart[cell] + cellUsed[cell]; slot < cellEnd[cell]; slot++)
+				clearSlot(slot);
+		}
+	});
+	return resized ? n : changed.load();
+}
+
+int CpuSolver::gatherRanges(int cell, CellRange* ranges)
+{
+	int rangeCount = 0;
+	for (int k = neighborStart[cell]; k < neighborStart[cell + 1]; k++)
+	{
+		int neighbor = neighborCells[k];
+		ranges[rangeCount].begin = cellStart[neighbor];
+		ranges[rangeCount].end = cellEnd[neighbor];
+		rangeCount++;
+	}
+	return rangeCount;
+}
+
+int CpuSolver::gatherHalfShell(int cell, CellRange* ranges)
+{
+	// Neighbors stored after the cell, every pair of cells is visited once
+	CellRange all[27];
+	int count = gatherRanges(cell, all);
+	int rangeCount = 1;
+	for (int r = 0; r < count; r++)
+	{
+		if (all[r].begin == cellStart[cell])
+			ranges[0] = all[r];
+		else if (all[r].begin > cellStart[cell])
+			ranges[rangeCount++] = all[r];
+	}
+	return rangeCount;
+}
+
+KernelParticles CpuSolver::sortedView()
+{
+	KernelParticles p = { sortedX.data(), sortedY.data(), sortedZ.data(), sortedVX.data(), sortedVY.data(), sortedVZ.data(),
+		sortedDensity.data(), sortedPressure.data() };
+	return p;
+}
+
+PairAccumulators CpuSolver::accumulators(int worker)
+{
+	size_t slots = sortedX.size();
+	float* base = workerSums[worker].data();
+	PairAccumulators acc;
+	acc.density = base;
+	for (int k = 0; k < 3; k++)
+	{
+		acc.pressure[k] = base + (1 + k) * slots;
+		acc.viscosity[k] = base + (4 + k) * slots;
+		acc.normal[k] = base + (7 + k) * slots;
+	}
+	acc.color = base + 10 * slots;
+	acc.viscosityWeight = base + 11 * slots;
+	return acc;
+}
+
+void CpuSolver::clearAccumulators(int firstArray, int arrayCount)
+{
+	size_t slots = sortedX.size();
+	for (vector<float>& sums : workerSums)
+		sums.resize(12 * slots);
+
+	// Zeroed by cell blocks so the pages are first touched by the pool
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int) {
+		int from = cellStart[begin];
+		int to = end < (int)cellKeys.size() ? cellStart[end] : (int)slots;
+		for (vector<float>& sums : workerSums)
+			for (int a = firstArray; a < firstArray + arrayCount; a++)
+				fill(sums.begin() + a * slots + from, sums.begin() + a * slots + to, 0.f);
+	});
+}
+
+void CpuSolver::applyDensity(int slot, float sum)
+{
+	const float poly6 = 315.f / (64.f * SPH_PI * pow(CORE_RADIUS, 9.f));
+	float density = poly6 * MASS * sum;
+	float pressure = glm::max(STIFFNESS * (density - REST_DENSITY), 0.f);
+	sortedDensity[slot] = density;
+	sortedPressure[slot] = pressure;
+	int i = slotParticle[slot];
+	factors[i].x = density;
+	factors[i].y = pressure;
+}
+
+void CpuSolver::applyForces(int slot, const ForceSums& sums, float deltaTime)
+{
+	const float spiky = 45.f / (SPH_PI * pow(CORE_RADIUS, 6.f));
+	const float viscosityCoefficient = MASS * VISCOSITY * spiky;
+	const float color = MASS * 315.f / (64.f * SPH_PI * pow(CORE_RADIUS, 9.f));
+	const float normal = -MASS * 945.f / (32.f * SPH_PI * pow(CORE_RADIUS, 9.f));
+	int i = slotParticle[slot];
+
+	vec3 acc = spiky * MASS * vec3(sums.pressure[0], sums.pressure[1], sums.pressure[2])
+		+ viscosityCoefficient * vec3(sums.viscosity[0], sums.viscosity[1], sums.viscosity[2])
+		+ vec3(0.f, GRAVITY_Y, 0.f);
+	accelerations[i] = vec4(acc, 1.f);
+	velocities[i] = vec4(vec3(velocities[i]) + acc * deltaTime, 1.f);
+
+	factors[i].z = color * sums.color;
+	vec3 surfaceNormal = normal * vec3(sums.normal[0], sums.normal[1], sums.normal[2]);
+	float len = length(surfaceNormal);
+	normals[i] = vec4(len > 0.f ? surfaceNormal / len : vec3(0.f), 0.f);
+}
+
+void CpuSolver::computeDensity()
+{
+	if (symmetric)
+	{
+		computeDensitySymmetric();
+		return;
+	}
+
+	const CpuKernels& kernels = cpuKernels(kernelLevel);
+	KernelParticles p = sortedView();
+	fill(workerPairs.begin(), workerPairs.end(), 0);
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int worker) {
+		CellRange ranges[27];
+		size_t pairs = 0;
+		for (int cell = begin; cell < end; cell++)
+		{
+			int rangeCount = gatherRanges(cell, ranges);
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] < 0)
+					continue;
+				int neighbors;
+				applyDensity(slot, kernels.density(p, slot, ranges, rangeCount, neighbors));
+				pairs += neighbors;
+			}
+		}
+		workerPairs[worker] += pairs;
+	});
+
+	pairCount = 0;
+	for (size_t pairs : workerPairs)
+		pairCount += pairs;
+}
+
+void CpuSolver::computeForces(float deltaTime)
+{
+	if (symmetric)
+	{
+		computeForcesSymmetric(deltaTime);
+		return;
+	}
+
+	const CpuKernels& kernels = cpuKernels(kernelLevel);
+	KernelParticles p = sortedView();
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int) {
+		CellRange ranges[27];
+		for (int cell = begin; cell < end; cell++)
+		{
+			int rangeCount = gatherRanges(cell, ranges);
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] < 0)
+					continue;
+				ForceSums sums;
+				kernels.forces(p, slot, ranges, rangeCount, sums);
+				applyForces(slot, sums, deltaTime);
+			}
+		}
+	});
+}
+
+void CpuSolver::computeDensitySymmetric()
+{
+	const CpuKernels& kernels = cpuKernels(kernelLevel);
+	const float h2 = CORE_RADIUS * CORE_RADIUS;
+	KernelParticles p = sortedView();
+	clearAccumulators(0, 1);
+	fill(workerPairs.begin(), workerPairs.end(), 0);
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int worker) {
+		CellRange ranges[27];
+		PairAccumulators acc = accumulators(worker);
+		size_t pairs = 0;
+		for (int cell = begin; cell < end; cell++)
+		{
+			int rangeCount = gatherHalfShell(cell, ranges);
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] >= 0)
+					pairs += kernels.densitySymmetric(p, slot, ranges, rangeCount, acc);
+			}
+		}
+		workerPairs[worker] += pairs;
+	});
+
+	// Sum of the workers plus the self term, the gather pass counts i as its own neighbor
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+		{
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] < 0)
+					continue;
+				float sum = h2 * h2 * h2;
+				for (vector<float>& sums : workerSums)
+					sum += sums[slot];
+				applyDensity(slot, sum);
+			}
+		}
+	});
+
+	pairCount = count();
+	for (size_t pairs : workerPairs)
+		pairCount += 2 * pairs;
+}
+
+void CpuSolver::computeForcesSymmetric(float deltaTime)
+{
+	const CpuKernels& kernels = cpuKernels(kernelLevel);
+	KernelParticles p = sortedView();
+	clearAccumulators(1, 11);
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int worker) {
+		CellRange ranges[27];
+		PairAccumulators acc = accumulators(worker);
+		for (int cell = begin; cell < end; cell++)
+		{
+			int rangeCount = gatherHalfShell(cell, ranges);
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] >= 0)
+					kernels.forcesSymmetric(p, slot, ranges, rangeCount, acc);
+			}
+		}
+	});
+
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int) {
+		vector<PairAccumulators> all;
+		for (int w = 0; w < (int)workerSums.size(); w++)
+			all.push_back(accumulators(w));
+		for (int cell = begin; cell < end; cell++)
+		{
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] < 0)
+					continue;
+				ForceSums sums = ForceSums();
+				for (const PairAccumulators& acc : all)
+				{
+					for (int k = 0; k < 3; k++)
+					{
+						sums.pressure[k] += acc.pressure[k][slot];
+						sums.viscosity[k] += acc.viscosity[k][slot];
+						sums.normal[k] += acc.normal[k][slot];
+					}
+					sums.color += acc.color[slot];
+					sums.viscosityWeight += acc.viscosityWeight[slot];
+				}
+				applyForces(slot, sums, deltaTime);
+			}
+		}
+	});
+}
+
+// Distance to the nearest container wall and its inward normal, as containerDistance of
+// sh_compute.glsl
+static float containerDistance(vec3 pos, vec3 containerMin, vec3 containerMax, vec3& n)
+{
+	vec3 toMin = pos - containerMin;
+	vec3 toMax = containerMax - pos;
+	float phi = toMin.y;
+	n = vec3(0.f, 1.f, 0.f);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (toMin[axis] < phi)
+		{
+			phi = toMin[axis];
+			n = vec3(0.f);
+			n[axis] = 1.f;
+		}
+		if (toMax[axis] < phi)
+		{
+			phi = toMax[axis];
+			n = vec3(0.f);
+			n[axis] = -1.f;
+		}
+	}
+	return phi;
+}
+
+void CpuSolver::integrate(float deltaTime, SDFCollider& collider)
+{
+	// Same collision response as pass 3, on the container walls and the baked field, by the
+	// cells of the last sort
+	vec3 containerMin, containerMax;
+	collider.getContainer(containerMin, containerMax);
+	pool.parallelFor((int)cellKeys.size(), blockSize, [&](int begin, int end, int) {
+		for (int cell = begin; cell < end; cell++)
+		{
+			for (int slot = cellStart[cell]; slot < cellStart[cell] + cellUsed[cell]; slot++)
+			{
+				if (slotParticle[slot] < 0)
+					continue;
+				int i = slotParticle[slot];
+				vec3 pos = vec3(positions[i]) + vec3(velocities[i]) * deltaTime;
+				vec3 vel = vec3(velocities[i]);
+				vec3 n;
+				float phi = containerDistance(pos, containerMin, containerMax, n);
+				if (phi < 0.f)
+				{
+					pos -= phi * n;
+					float velN = dot(vel, n);
+					if (velN < 0.f)
+						vel -= (1.f + SPEED_DECAY) * velN * n;
+				}
+				phi = collider.sample(pos);
+				if (phi < 0.f)
+				{
+					n = collider.sampleNormal(pos);
+					pos -= phi * n;
+					float velN = dot(vel, n);
+					if (velN < 0.f)
+						vel -= (1.f + SPEED_DECAY) * velN * n;
+				}
+				prevPositions[i] = positions[i];
+				positions[i] = vec4(pos, positions[i].w);
+				velocities[i] = vec4(vel, velocities[i].w);
+			}
+		}
+	});
+}
+
+void CpuSolver::setKernelLevel(int level)
+{
+	kernelLevel = glm::clamp(level, (int)CPU_KERNEL_SCALAR, maxKernelLevel);
+}
+
+void CpuSolver::setBlockSize(int cellsPerTask)
+{
+	blockSize = glm::max(cellsPerTask, 1);
+}
+
+void CpuSolver::setPinThreads(bool pinned)
+{
+	pool.setAffinity(pinned);
+}
+
+ThreadPoolStats CpuSolver::getSchedulerStats()
+{
+	ThreadPoolStats stats = pool.getStats();
+	pool.resetStats();
+	return stats;
+}
+
+void CpuSolver::setSymmetric(bool enabled)
+{
+	symmetric = enabled;
+}
+
+void CpuSolver::setIncrementalGrid(bool enabled)
+{
+	// The slack of the cells only comes with the next rebuild
+	if (enabled && !incrementalGrid)
+		particleSlot.clear();
+	incrementalGrid = enabled;
+}
+
+GridStats CpuSolver::getGridStats()
+{
+	return gridStats;
+}
+
+int CpuSolver::getKernelLevel()
+{
+	return kernelLevel;
+}
+
+bool CpuSolver::isSymmetric()
+{
+	return symmetric;
+}
+
+int CpuSolver::count()
+{
+	return (int)positions.size();
+}
+
+size_t CpuSolver::getPairCount()
+{
+	return pairCount;
+}
+
+float CpuSolver::getKernelTime()
+{
+	return kernelTime;
+}
+
+int CpuSolver::getCellCount()
+{
+	return (int)cellKeys.size();
+}
+
+int CpuSolver::getBrickCount()
+{
+	return grid.brickCount();
+}
+
+int CpuSolver::getRebuildCount()
+{
+	return rebuildCount;
+}
+
+size_t CpuSolver::getGridBytes()
+{
+	return particleKeys.capacity() * sizeof(uint64_t) + (order.capacity() + particleBrick.capacity() + cellFirst.capacity()) * sizeof(int)
+		+ particleCells.capacity() * sizeof(ivec3)
+		+ cellKeys.capacity() * sizeof(uint64_t) + cellCoords.capacity() * sizeof(ivec3)
+		+ (cellStart.capacity() + cellUsed.capacity() + cellEnd.capacity() + particleSlot.capacity() + neighborStart.capacity() + neighborCells.capacity()) * sizeof(int)
+		+ grid.bytes();
+}
+
+
+// Sorted cube at the spawn spacing above the floor, about 350 neighbors per particle
+static vector<Particle> benchmarkCube(int base)
+{
+	vector<Particle> particles;
+	float d = 2 * RADIUS;
+	for (int i = 0; i < base; i++)
+		for (int j = 0; j < base; j++)
+			for (int k = 0; k < base; k++)
+			{
+				Particle particle = {};
+				particle.currPos = vec4(d * (i - base / 2), d * j + FLOOR_Y + RADIUS, d * (k - base / 2), 1.f);
+				particle.prevPos = particle.currPos;
+				particle.vel = vec4(0.01f * (i % 3), 0.f, -0.01f * (k % 2), 1.f);
+				particles.push_back(particle);
+			}
+	return particles;
+}
+
+// Average ms of the density and force passes, they only read the sorted copies so
+// repeating them measures the same work
+static float timeKernels(CpuSolver& solver, int repeats)
+{
+	solver.sort();
+	float ms = 0.f;
+	for (int r = 0; r <= repeats; r++)
+	{
+		auto start = chrono::high_resolution_clock::now();
+		solver.computeDensity();
+		solver.computeForces(0.001f);
+		chrono::duration<float, milli> elapsed = chrono::high_resolution_clock::now() - start;
+		if (r > 0)
+			ms += elapsed.count() / repeats;
+	}
+	return ms;
+}
+
+void benchmarkCpuKernels()
+{
+	const int bases[] = { 16, 24, 32 };
+	const int repeats = 5;
+	int best = detectCpuKernelLevel();
+	cout << "best kernel: " << cpuKernels(best).name << endl;
+	cout << left << setw(10) << "kernel" << setw(10) << "pairs" << right << setw(10) << "particles" << setw(14) << "pairs/step"
+		<< setw(14) << "ms/step" << setw(18) << "Mpairs/s/core" << setw(10) << "speedup" << setw(14) << "max rel err" << endl;
+
+	// One thread, every kernel gathered and symmetric
+	for (int base : bases)
+	{
+		vector<Particle> particles = benchmarkCube(base);
+		CpuSolver solver(1);
+		vector<Particle> reference(particles.size()), result(particles.size());
+		float scalarMs = 0.f;
+		for (int level = CPU_KERNEL_SCALAR; level <= best; level++)
+		{
+			for (int symmetric = 0; symmetric < 2; symmetric++)
+			{
+				bool isReference = level == CPU_KERNEL_SCALAR && !symmetric;
+				solver.load(particles.data(), (int)particles.size());
+				solver.setKernelLevel(level);
+				solver.setSymmetric(symmetric != 0);
+				float ms = timeKernels(solver, repeats);
+				solver.store(isReference ? reference.data() : result.data());
+				if (isReference)
+					scalarMs = ms;
+
+				// Density, color field and acceleration against the gathered scalar kernels
+				float maxError = 0.f;
+				if (!isReference)
+					for (size_t i = 0; i < particles.size(); i++)
+					{
+						maxError = glm::max(maxError, glm::abs(result[i].factor.x - reference[i].factor.x) / reference[i].factor.x);
+						maxError = glm::max(maxError, glm::abs(result[i].factor.z - reference[i].factor.z) / reference[i].factor.z);
+						maxError = glm::max(maxError, length(vec3(result[i].acc - reference[i].acc)) / length(vec3(reference[i].acc)));
+					}
+
+				// Each neighbor pair is evaluated by the density and by the force pass, the
+				// symmetric rate counts both directions of a pair visited once
+				double pairs = 2.0 * solver.getPairCount();
+				cout << left << setw(10) << cpuKernels(level).name << setw(10) << (symmetric ? "half" : "gather")
+					<< right << setw(10) << particles.size()
+					<< setw(14) << solver.getPairCount() << fixed << setprecision(3) << setw(14) << ms
+					<< setw(18) << pairs / (ms * 1e3) << setw(10) << scalarMs / ms
+					<< scientific << setprecision(2) << setw(14) << maxError << defaultfloat << endl;
+			}
+		}
+	}
+
+	// Best kernel on the largest cube, 1 to all hardware threads
+	int hardwareThreads = glm::max(1, (int)thread::hardware_concurrency());
+	vector<Particle> particles = benchmarkCube(bases[2]);
+	cout << endl << left << setw(10) << "threads" << setw(10) << "pairs" << right << setw(14) << "ms/step" << setw(14) << "Mpairs/s"
+		<< setw(18) << "Mpairs/s/core" << setw(10) << "tasks" << setw(10) << "steals" << endl;
+	for (int threads = 1; ; threads = glm::min(threads * 2, hardwareThreads))
+	{
+		for (int symmetric = 0; symmetric < 2; symmetric++)
+		{
+			CpuSolver solver(threads);
+			solver.load(particles.data(), (int)particles.size());
+			solver.setKernelLevel(best);
+			solver.setSymmetric(symmetric != 0);
+			float ms = timeKernels(solver, repeats);
+			ThreadPoolStats stats = solver.getSchedulerStats();
+			double pairs = 2.0 * solver.getPairCount();
+			cout << left << setw(10) << threads << setw(10) << (symmetric ? "half" : "gather")
+				<< right << fixed << setprecision(3) << setw(14) << ms
+				<< setw(14) << pairs / (ms * 1e3) << setw(18) << pairs / (ms * 1e3) / threads
+				<< setw(10) << stats.tasks << setw(10) << stats.steals << defaultfloat << endl;
+		}
+		if (threads == hardwareThreads)
+			break;
+	}
+
+	// Occupied cells of the largest cube, then of the same cube with drops thrown far up.
+	// A dense grid over the bounding box would grow with the height, the compact one not.
+	cout << endl << left << setw(10) << "layout" << right << setw(10) << "cells" << setw(10) << "bricks" << setw(14) << "grid KB"
+		<< setw(14) << "dense KB" << setw(14) << "full ms" << setw(14) << "resort ms" << endl;
+	for (int drops = 0; drops < 2; drops++)
+	{
+		vector<Particle> particles = benchmarkCube(bases[2]);
+		if (drops)
+			for (size_t i = 0; i < particles.size(); i += 16)
+				particles[i].currPos.y += 0.05f * i;
+		CpuSolver solver(1);
+		solver.load(particles.data(), (int)particles.size());
+		auto start = chrono::high_resolution_clock::now();
+		solver.sort();
+		chrono::duration<float, milli> fullMs = chrono::high_resolution_clock::now() - start;
+
+		// A tenth of the radius of motion, most particles keep their cell and their order
+		vec3 lower = vec3(particles[0].currPos), upper = lower;
+		for (size_t i = 0; i < particles.size(); i++)
+		{
+			particles[i].currPos += vec4(0.1f * CORE_RADIUS * vec3(sinf(i * 0.7f), cosf(i * 1.3f), sinf(i * 2.9f)), 0.f);
+			lower = min(lower, vec3(particles[i].currPos));
+			upper = max(upper, vec3(particles[i].currPos));
+		}
+		solver.load(particles.data(), (int)particles.size());
+		start = chrono::high_resolution_clock::now();
+		solver.sort();
+		chrono::duration<float, milli> resortMs = chrono::high_resolution_clock::now() - start;
+
+		// Start and count of every cell of the box and the cell of every particle
+		ivec3 dims = ivec3(ceil((upper - lower) / CORE_RADIUS)) + 1;
+		double denseBytes = 2.0 * sizeof(int) * dims.x * dims.y * dims.z + sizeof(int) * particles.size();
+		cout << left << setw(10) << (drops ? "drops" : "cube") << right << setw(10) << solver.getCellCount() << setw(10) << solver.getBrickCount()
+			<< fixed << setprecision(1) << setw(14) << solver.getGridBytes() / 1024.0 << setw(14) << denseBytes / 1024.0
+			<< setprecision(3) << setw(14) << fullMs.count() << setw(14) << resortMs.count() << defaultfloat << endl;
+	}
+
+	// Grid updates over a few steps of small motions, full rebuilds against patching the
+	// slots of the particles that changed cell. The cube is shifted off the cell borders,
+	// its layers would otherwise sit right on them.
+	cout << endl << left << setw(10) << "grid" << right << setw(10) << "motion" << setw(10) << "moved %" << setw(14) << "ms/step"
+		<< setw(10) << "rebuilds" << setw(14) << "tombstones" << endl;
+	const int steps = 10;
+	for (float motion : { 0.002f, 0.005f, 0.02f })
+	{
+		for (int incremental = 0; incremental < 2; incremental++)
+		{
+			vector<Particle> particles = benchmarkCube(bases[2]);
+			for (Particle& particle : particles)
+				particle.currPos += vec4(vec3(0.5f * RADIUS), 0.f);
+			CpuSolver solver(hardwareThreads);
+			solver.setIncrementalGrid(incremental != 0);
+			solver.load(particles.data(), (int)particles.size());
+			solver.sort();
+			int rebuilds = solver.getGridStats().rebuilds;
+			float moved = 0.f, ms = 0.f;
+			for (int step = 0; step < steps; step++)
+			{
+				for (size_t i = 0; i < particles.size(); i++)
+					particles[i].currPos += vec4(motion * CORE_RADIUS * vec3(sinf(i * 0.7f), cosf(i * 1.3f), sinf(i * 2.9f)), 0.f);
+				solver.load(particles.data(), (int)particles.size());
+				solver.sort();
+				GridStats stats = solver.getGridStats();
+				moved += stats.movedFraction / steps;
+				ms += stats.updateTime / steps;
+			}
+			GridStats stats = solver.getGridStats();
+			cout << left << setw(10) << (incremental ? "patch" : "full") << right << setw(10) << motion
+				<< fixed << setprecision(2) << setw(10) << 100.f * moved << setprecision(3) << setw(14) << ms
+				<< setw(10) << stats.rebuilds - rebuilds << setw(14) << stats.tombstones << defaultfloat << endl;
+		}
+	}
+
+	// Counting sort of a large scattered cube, 1 to all hardware threads
+	particles = benchmarkCube(2 * bases[2]);
+	for (size_t i = 0; i < particles.size(); i++)
+		particles[i].currPos += vec4(0.5f * CORE_RADIUS * vec3(sinf(i * 0.7f), cosf(i * 1.3f), sinf(i * 2.9f)), 0.f);
+	cout << endl << left << setw(10) << "threads" << right << setw(10) << "particles" << setw(14) << "ms/sort"
+		<< setw(14) << "Mparticles/s" << setw(10) << "speedup" << endl;
+	float oneThreadMs = 0.f;
+	for (int threads = 1; ; threads = glm::min(threads * 2, hardwareThreads))
+	{
+		CpuSolver solver(threads);
+		solver.load(particles.data(), (int)particles.size());
+		solver.sort();
+		float ms = 0.f;
+		for (int r = 0; r < repeats; r++)
+		{
+			solver.sort();
+			ms += solver.getGridStats().updateTime / repeats;
+		}
+		if (threads == 1)
+			oneThreadMs = ms;
+		cout << left << setw(10) << threads << right << setw(10) << particles.size() << fixed << setprecision(3) << setw(14) << ms
+			<< setw(14) << particles.size() / (ms * 1e3) << setprecision(2) << setw(10) << oneThreadMs / ms << defaultfloat << endl;
+		if (threads == hardwareThreads)
+			break;
+	}
+}
@@ -0,0 +1,141 @@
+#ifndef _CPU_SOLVER_HPP
+#define _CPU_SOLVER_HPP
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "ParticleManager.hpp"
+#include "CpuKernels.hpp"
+#include "ThreadPool.hpp"
+#include "SparseGrid.hpp"
+
+using namespace glm;
+using namespace std;
+
+// Grid update of the last sort, or of a recent GPU step where the particles that left the
+// cell of the last reorder count as moved and a reorder as a rebuild
+struct GridStats
+{
+	float movedFraction;	// particles that changed cell
+	float updateTime;		// ms of the sort
+	bool rebuilt;			// full rebuild instead of a patch
+	int tombstones;			// slots freed by patches since the last rebuild, none on the GPU
+	int rebuilds;			// full rebuilds so far
+};
+
+// Pass 1 to 3 of sh_compute.glsl on the CPU. Each step sorts the particles by the z-order
+// of their cells of the support radius, with a lock free parallel counting sort over the
+// bricks and then the cells, and copies them into padded SoA arrays, the density
+// and force loops run through the kernel table of the best instruction set of the CPU.
+// Only occupied cells exist, found through the bricks of a sparse block grid, so memory
+// follows the particle count and the domain is unbounded. The incremental grid only moves
+// the particles that changed cell, into free slots of their new cell, and falls back to a
+// full rebuild when too many moved.
+// The phases run as blocks of occupied cells on a work stealing pool. In symmetric mode
+// each pair is visited once through a half shell of cells and its terms are added to
+// both particles in per worker accumulators, summed after the pass.
+class CpuSolver {
+public:
+	CpuSolver(int threadCount = 0);			// 0 = all hardware threads
+	void load(const Particle* particles, int count);
+	void store(Particle* particles);		// count() particles, in load order
+	void step(float deltaTime, SDFCollider& collider);
+	void sort();							// z-order the particles and build the padded arrays
+	void computeDensity();
+	void computeForces(float deltaTime);
+	void integrate(float deltaTime, SDFCollider& collider);
+	void setKernelLevel(int level);			// clamped to what the CPU supports
+	void setBlockSize(int cellsPerTask);
+	void setPinThreads(bool pinned);
+	void setSymmetric(bool enabled);		// half shell pairs instead of the 27 cell gather
+	void setIncrementalGrid(bool enabled);	// patch the slots of moved particles
+	GridStats getGridStats();
+	ThreadPoolStats getSchedulerStats();	// since the last call
+	int getKernelLevel();
+	bool isSymmetric();
+	int count();
+	size_t getPairCount();					// pairs within the radius in the last density pass
+	float getKernelTime();					// ms of the last density and force passes
+	int getCellCount();						// occupied cells
+	int getBrickCount();					// allocated bricks of the sparse grid
+	int getRebuildCount();					// sorts that changed the occupied cells
+	size_t getGridBytes();					// keys, order, cells, bricks and neighbor lists
+
+private:
+	int kernelLevel;
+	int maxKernelLevel;
+	size_t pairCount;
+	int rebuildCount;
+	float kernelTime;
+	int blockSize;
+	bool symmetric;
+	bool incrementalGrid;
+	int tombstones;
+	GridStats gridStats;
+	size_t brickCursorSize;
+	ThreadPool pool;
+	vector<size_t> workerPairs;		// per worker, summed after the density pass
+	vector<vector<float>> workerSums;	// per worker PairAccumulators, 12 arrays of the slot count
+
+	// Particles in load order
+	vector<vec4> positions;
+	vector<vec4> prevPositions;
+	vector<vec4> velocities;
+	vector<vec4> accelerations;
+	vector<vec4> normals;
+	vector<vec4> factors;
+
+	// Cell sorted and padded copies
+	vector<float> sortedX, sortedY, sortedZ;
+	vector<float> sortedVX, sortedVY, sortedVZ;
+	vector<float> sortedDensity, sortedPressure;
+	vector<int> slotParticle;		// particle of each slot, -1 for the dummies
+
+	// Occupied cells in z-order, the grid and neighbor lists only change with the cell set
+	vector<uint64_t> particleKeys;
+	vector<int> order;				// particles in slot order
+	vector<ivec3> particleCells;
+	vector<int> particleBrick;
+	vector<vector<int>> workerBricks;	// per worker brick histograms of the counting sort
+	vector<vector<int>> workerScratch;
+	vector<int> brickStart;			// first particle of every brick in order, then the count
+	vector<int> brickCellCount;		// occupied cells, then the first cell of every brick
+	unique_ptr<atomic<int>[]> brickCursor;
+	vector<int> blockSums;
+	vector<uint64_t> cellKeys;
+	vector<ivec3> cellCoords;
+	vector<int> cellFirst;			// first particle of the cell in order
+	vector<int> cellStart;
+	vector<int> cellUsed;			// slots up to the last particle, tombstones included
+	vector<int> cellEnd;			// padded end of the cell's slots
+	vector<int> particleSlot;
+	vector<int> movedParticles;
+	SparseBlockGrid grid;			// cell entries of the occupied bricks
+	vector<int> neighborStart;		// cell's occupied neighbors in neighborCells, own cell included
+	vector<int> neighborCells;
+
+	ivec3 cellOf(vec3 p);
+	void rebuildNeighbors();
+	int scanExclusive(vector<int>& values);	// in place on the pool, returns the total
+	int rebuildSlots();				// counting sort into new slots, particles that changed cell
+	bool updateSlots(int& moved);	// false if a rebuild is needed
+	void writeSlot(int slot, int i);
+	void clearSlot(int slot);
+	int gatherRanges(int cell, CellRange* ranges);	// padded ranges of the 27 neighbor cells
+	int gatherHalfShell(int cell, CellRange* ranges);	// own cell first, then the neighbors stored after it
+	KernelParticles sortedView();
+	PairAccumulators accumulators(int worker);
+	void clearAccumulators(int firstArray, int arrayCount);
+	void applyDensity(int slot, float sum);
+	void applyForces(int slot, const ForceSums& sums, float deltaTime);
+	void computeDensitySymmetric();
+	void computeForcesSymmetric(float deltaTime);
+};
+
+// Density and force passes of every supported kernel on cubes of increasing size, gathered
+// and symmetric, then the best kernel and the grid build on 1 to all hardware threads
+void benchmarkCpuKernels();
+
+#endif // !_CPU_SOLVER_HPP
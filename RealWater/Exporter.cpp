@@ -0,0 +1,176 @@
+#include "Exporter.hpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+static bool hostIsBigEndian()
+{
+	const uint32_t one = 1;
+	return *(const char*)&one == 0;
+}
+
+static inline uint32_t swapBytes(uint32_t v)
+{
+	return v >> 24 | (v >> 8 & 0xff00) | (v << 8 & 0xff0000) | v << 24;
+}
+
+// Streams fixed size chunks of converted values to the file, byte swapped if the format's
+// byte order is not the host's
+class ChunkWriter {
+public:
+	ChunkWriter(const string& path, bool bigEndian) :
+		path(path),
+		swap(bigEndian != hostIsBigEndian()),
+		file(fopen(path.c_str(), "wb"))
+	{
+		if (!file)
+			throw runtime_error("Could not open " + path + "!");
+	}
+
+	~ChunkWriter()
+	{
+		if (file)
+			fclose(file);
+	}
+
+	void text(const string& s)
+	{
+		write(s.data(), s.size());
+	}
+
+	void write(const void* data, size_t bytes)
+	{
+		if (fwrite(data, 1, bytes, file) != bytes)
+			throw runtime_error("Could not write " + path + "!");
+	}
+
+	// components values per particle from get(index, particle, out), all particles in order
+	template <typename T, typename Get>
+	void values(const Particle* particles, size_t count, int components, Get get)
+	{
+		chunk.resize(EXPORT_CHUNK * components * sizeof(T));
+		T* out = (T*)chunk.data();
+		for (size_t first = 0; first < count; first += EXPORT_CHUNK)
+		{
+			size_t n = std::min(EXPORT_CHUNK, count - first);
+			for (size_t i = 0; i < n; i++)
+				get(first + i, particles[first + i], out + i * components);
+			if (swap)
+			{
+				uint32_t* words = (uint32_t*)out;
+				for (size_t w = 0; w < n * components; w++)
+					words[w] = swapBytes(words[w]);
+			}
+			write(out, n * components * sizeof(T));
+		}
+	}
+
+	void close()
+	{
+		if (fclose(file) != 0)
+		{
+			file = NULL;
+			throw runtime_error("Could not write " + path + "!");
+		}
+		file = NULL;
+	}
+
+private:
+	string path;
+	bool swap;
+	FILE* file;
+	vector<char> chunk;
+};
+
+static void exportVtk(const string& path, const Particle* particles, size_t count)
+{
+	ChunkWriter writer(path, true);
+	string n = to_string(count);
+	writer.text("# vtk DataFile Version 3.0\nRealWater particles\nBINARY\nDATASET POLYDATA\nPOINTS " + n + " float\n");
+	writer.values<float>(particles, count, 3, [](size_t, const Particle& p, float* out)
+		{ out[0] = p.currPos.x; out[1] = p.currPos.y; out[2] = p.currPos.z; });
+
+	// One vertex cell per point, without cells ParaView shows no points
+	writer.text("\nVERTICES " + n + " " + to_string(2 * count) + "\n");
+	writer.values<int32_t>(particles, count, 2, [](size_t i, const Particle&, int32_t* out)
+		{ out[0] = 1; out[1] = (int32_t)i; });
+
+	writer.text("\nPOINT_DATA " + n + "\nVECTORS velocity float\n");
+	writer.values<float>(particles, count, 3, [](size_t, const Particle& p, float* out)
+		{ out[0] = p.vel.x; out[1] = p.vel.y; out[2] = p.vel.z; });
+	writer.text("\nSCALARS density float 1\nLOOKUP_TABLE default\n");
+	writer.values<float>(particles, count, 1, [](size_t, const Particle& p, float* out) { out[0] = p.factor.x; });
+	writer.text("\nSCALARS pressure float 1\nLOOKUP_TABLE default\n");
+	writer.values<float>(particles, count, 1, [](size_t, const Particle& p, float* out) { out[0] = p.factor.y; });
+	writer.text("\nNORMALS surface_normal float\n");
+	writer.values<float>(particles, count, 3, [](size_t, const Particle& p, float* out)
+		{ out[0] = p.surfaceNorm.x; out[1] = p.surfaceNorm.y; out[2] = p.surfaceNorm.z; });
+	writer.text("\n");
+	writer.close();
+}
+
+// The interleaved floats of the PLY vertices and of the point cache
+static void pointFloats(size_t, const Particle& p, float* out)
+{
+	out[0] = p.currPos.x; out[1] = p.currPos.y; out[2] = p.currPos.z;
+	out[3] = p.vel.x; out[4] = p.vel.y; out[5] = p.vel.z;
+	out[6] = p.factor.x; out[7] = p.factor.y;
+	out[8] = p.surfaceNorm.x; out[9] = p.surfaceNorm.y; out[10] = p.surfaceNorm.z;
+}
+
+static void exportPly(const string& path, const Particle* particles, size_t count)
+{
+	ChunkWriter writer(path, false);
+	writer.text("ply\nformat binary_little_endian 1.0\ncomment RealWater particles\nelement vertex " + to_string(count) + "\n"
+		"property float x\nproperty float y\nproperty float z\n"
+		"property float vx\nproperty float vy\nproperty float vz\n"
+		"property float density\nproperty float pressure\n"
+		"property float nx\nproperty float ny\nproperty float nz\nend_header\n");
+	writer.values<float>(particles, count, POINT_CACHE_FLOATS, pointFloats);
+	writer.close();
+}
+
+static void exportRaw(const string& path, const Particle* particles, size_t count)
+{
+	ChunkWriter writer(path, hostIsBigEndian());
+	PointCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, POINT_CACHE_MAGIC, sizeof(header.magic));
+	header.version = POINT_CACHE_VERSION;
+	header.count = (uint32_t)count;
+	header.floatsPerPoint = POINT_CACHE_FLOATS;
+	writer.write(&header, sizeof(header));
+	writer.values<float>(particles, count, POINT_CACHE_FLOATS, pointFloats);
+	writer.close();
+}
+
+const char* exportExtension(int format)
+{
+	switch (format)
+	{
+	case EXPORT_VTK:
+		return ".vtk";
+	case EXPORT_PLY:
+		return ".ply";
+	default:
+		return ".rwp";
+	}
+}
+
+void exportParticles(const string& path, int format, const Particle* particles, size_t count)
+{
+	switch (format)
+	{
+	case EXPORT_VTK:
+		exportVtk(path, particles, count);
+		break;
+	case EXPORT_PLY:
+		exportPly(path, particles, count);
+		break;
+	default:
+		exportRaw(path, particles, count);
+		break;
+	}
+}
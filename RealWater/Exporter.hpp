@@ -0,0 +1,36 @@
+#ifndef _EXPORTER_HPP
+#define _EXPORTER_HPP
+
+#include <string>
+#include <cstdint>
+#include "ParticleManager.hpp"
+
+using namespace std;
+
+// Export formats
+const int EXPORT_VTK = 0;			// legacy binary VTK polydata, big endian
+const int EXPORT_PLY = 1;			// binary little endian PLY
+const int EXPORT_RAW = 2;			// point cache, PointCacheHeader and interleaved floats in host order
+const size_t EXPORT_CHUNK = 16384;	// particles converted per write
+const uint32_t POINT_CACHE_VERSION = 1;
+const char POINT_CACHE_MAGIC[8] = "RWPTS";
+const uint32_t POINT_CACHE_FLOATS = 11;	// position, velocity, density, pressure, surface normal
+
+// Front of a raw point cache
+struct PointCacheHeader
+{
+	char magic[8];			// "RWPTS"
+	uint32_t version;
+	uint32_t count;
+	uint32_t floatsPerPoint;
+	uint32_t pad;
+};
+
+const char* exportExtension(int format);
+
+// Position, velocity, density, pressure and surface normal of the particles. They are read
+// in place and converted a chunk at a time, so the particles can come straight from a
+// mapped GPU buffer and memory use does not grow with their count. Throws runtime_error.
+void exportParticles(const string& path, int format, const Particle* particles, size_t count);
+
+#endif // !_EXPORTER_HPP
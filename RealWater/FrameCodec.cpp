@@ -0,0 +1,853 @@
+#include "FrameCodec.hpp"
+#include "constants.hpp"
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// rANS over the 65 bit lengths of 64 bit residuals, 32 bit state, byte wise renormalization
+const int RANS_SCALE_BITS = 12;
+const uint32_t RANS_SCALE = 1u << RANS_SCALE_BITS;
+const uint32_t RANS_LOW = 1u << 23;
+const int TOKEN_COUNT = 65;
+const int SORT_DIGIT_BITS = 11;
+
+static inline int bitLength(uint64_t v)
+{
+	if (!v)
+		return 0;
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, v);
+	return (int)index + 1;
+#else
+	return 64 - __builtin_clzll(v);
+#endif
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// 21 bits of v to every third bit and back
+static inline uint64_t spreadBits(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+	return v;
+}
+
+static inline uint32_t compactBits(uint64_t v)
+{
+	v &= 0x1249249249249249ULL;
+	v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+	v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+	v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+	v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+	v = (v ^ (v >> 32)) & 0x1fffffULL;
+	return (uint32_t)v;
+}
+
+template <typename T>
+static void append(vector<char>& out, const T& value)
+{
+	const char* bytes = (const char*)&value;
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static void damaged()
+{
+	throw runtime_error("Compressed frame is truncated or damaged!");
+}
+
+template <typename T>
+static T take(const char*& p, const char* end)
+{
+	if ((size_t)(end - p) < sizeof(T))
+		damaged();
+	T value;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return value;
+}
+
+// Little endian bit stream, up to 64 bits per put
+class BitWriter {
+public:
+	BitWriter(vector<char>& out) : out(out), bits(0), used(0) {}
+
+	void put(uint64_t value, int count)
+	{
+		while (count > 0)
+		{
+			int n = std::min(count, 32);
+			bits |= (value & ((1ULL << n) - 1)) << used;
+			used += n;
+			value >>= n;
+			count -= n;
+			if (used >= 32)
+			{
+				append(out, (uint32_t)bits);
+				bits >>= 32;
+				used -= 32;
+			}
+		}
+	}
+
+	void flush()
+	{
+		for (; used > 0; used -= 8, bits >>= 8)
+			out.push_back((char)(bits & 0xff));
+		used = 0;
+	}
+
+private:
+	vector<char>& out;
+	uint64_t bits;
+	int used;
+};
+
+class BitReader {
+public:
+	BitReader(const char* p, const char* end) : p((const uint8_t*)p), end((const uint8_t*)end), bits(0), available(0) {}
+
+	uint64_t get(int count)
+	{
+		uint64_t value = 0;
+		for (int shift = 0; count > 0; )
+		{
+			int n = std::min(count, 32);
+			while (available < n && p < end)
+			{
+				bits |= (uint64_t)*p++ << available;
+				available += 8;
+			}
+			if (available < n)
+				damaged();
+			value |= (bits & ((1ULL << n) - 1)) << shift;
+			bits >>= n;
+			available -= n;
+			shift += n;
+			count -= n;
+		}
+		return value;
+	}
+
+private:
+	const uint8_t* p;
+	const uint8_t* end;
+	uint64_t bits;
+	int available;
+};
+
+// Frequencies of the tokens scaled to RANS_SCALE, every present token keeps at least one
+static void normalizeFrequencies(const uint32_t* counts, size_t total, uint16_t* freq)
+{
+	int sum = 0;
+	for (int s = 0; s < TOKEN_COUNT; s++)
+	{
+		freq[s] = counts[s] ? (uint16_t)std::max<uint64_t>(1, (uint64_t)counts[s] * RANS_SCALE / total) : 0;
+		sum += freq[s];
+	}
+	while (sum != (int)RANS_SCALE)
+	{
+		int largest = (int)(max_element(freq, freq + TOKEN_COUNT) - freq);
+		if (sum < (int)RANS_SCALE)
+		{
+			freq[largest] += (uint16_t)(RANS_SCALE - sum);
+			sum = RANS_SCALE;
+		}
+		else
+		{
+			int cut = std::min(sum - (int)RANS_SCALE, freq[largest] - 1);
+			freq[largest] -= (uint16_t)cut;
+			sum -= cut;
+		}
+	}
+}
+
+// Frequency table, rANS coded bit lengths, then the bits below the leading one
+static void encodeResiduals(const vector<uint64_t>& values, vector<char>& out)
+{
+	vector<uint8_t> tokens(values.size());
+	uint32_t counts[TOKEN_COUNT] = {};
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		tokens[i] = (uint8_t)bitLength(values[i]);
+		counts[tokens[i]]++;
+	}
+	uint16_t freq[TOKEN_COUNT] = {};
+	uint32_t start[TOKEN_COUNT];
+	if (!values.empty())
+		normalizeFrequencies(counts, values.size(), freq);
+	for (int s = 0, cumulative = 0; s < TOKEN_COUNT; s++)
+	{
+		start[s] = cumulative;
+		cumulative += freq[s];
+	}
+	out.insert(out.end(), (const char*)freq, (const char*)(freq + TOKEN_COUNT));
+
+	// Encoded backwards so that the decoder runs forwards, its renormalization bytes come
+	// out in reverse
+	vector<char> renormalized;
+	uint32_t x = RANS_LOW;
+	for (size_t i = values.size(); i-- > 0; )
+	{
+		uint32_t f = freq[tokens[i]];
+		uint32_t limit = ((RANS_LOW >> RANS_SCALE_BITS) << 8) * f;
+		while (x >= limit)
+		{
+			renormalized.push_back((char)(x & 0xff));
+			x >>= 8;
+		}
+		x = ((x / f) << RANS_SCALE_BITS) + x % f + start[tokens[i]];
+	}
+	size_t sizes = out.size();
+	append(out, (uint32_t)(sizeof(uint32_t) + renormalized.size()));
+	append(out, (uint32_t)0);
+	append(out, x);
+	out.insert(out.end(), renormalized.rbegin(), renormalized.rend());
+
+	size_t raw = out.size();
+	BitWriter writer(out);
+	for (size_t i = 0; i < values.size(); i++)
+		if (tokens[i] > 1)
+			writer.put(values[i], tokens[i] - 1);
+	writer.flush();
+	uint32_t rawBytes = (uint32_t)(out.size() - raw);
+	memcpy(&out[sizes + sizeof(uint32_t)], &rawBytes, sizeof(rawBytes));
+}
+
+static void decodeResiduals(const char*& p, const char* end, size_t count, vector<uint64_t>& values)
+{
+	uint16_t freq[TOKEN_COUNT];
+	for (int s = 0; s < TOKEN_COUNT; s++)
+		freq[s] = take<uint16_t>(p, end);
+	uint32_t ransBytes = take<uint32_t>(p, end);
+	uint32_t rawBytes = take<uint32_t>(p, end);
+	if ((uint64_t)ransBytes + rawBytes > (uint64_t)(end - p) || ransBytes < sizeof(uint32_t))
+		damaged();
+	const char* rans = p;
+	const char* ransEnd = p + ransBytes;
+	const char* raw = ransEnd;
+	p = raw + rawBytes;
+
+	values.resize(count);
+	if (count)
+	{
+		// Slot of the scaled cumulative frequency to token
+		uint8_t symbol[RANS_SCALE];
+		uint32_t start[TOKEN_COUNT];
+		uint32_t cumulative = 0;
+		for (int s = 0; s < TOKEN_COUNT; s++)
+		{
+			start[s] = cumulative;
+			if (cumulative + freq[s] > RANS_SCALE)
+				damaged();
+			memset(symbol + cumulative, s, freq[s]);
+			cumulative += freq[s];
+		}
+		if (cumulative != RANS_SCALE)
+			damaged();
+
+		uint32_t x = take<uint32_t>(rans, ransEnd);
+		const uint8_t* in = (const uint8_t*)rans;
+		const uint8_t* inEnd = (const uint8_t*)ransEnd;
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t slot = x & (RANS_SCALE - 1);
+			uint8_t s = symbol[slot];
+			x = freq[s] * (x >> RANS_SCALE_BITS) + slot - start[s];
+			while (x < RANS_LOW)
+			{
+				if (in == inEnd)
+					damaged();
+				x = x << 8 | *in++;
+			}
+			values[i] = s;
+		}
+	}
+
+	BitReader reader(raw, raw + rawBytes);
+	for (size_t i = 0; i < count; i++)
+	{
+		int length = (int)values[i];
+		values[i] = length > 1 ? (1ULL << (length - 1)) | reader.get(length - 1) : length;
+	}
+}
+
+int codecPositionBits(vec3 boundsMin, vec3 boundsMax, float errorBound)
+{
+	for (int bits = 1; bits <= CODEC_MAX_POSITION_BITS; bits++)
+		if (codecMaxError(boundsMin, boundsMax, bits) <= errorBound)
+			return bits;
+	return 0;
+}
+
+float codecMaxError(vec3 boundsMin, vec3 boundsMax, int bits)
+{
+	vec3 extent = boundsMax - boundsMin;
+	return glm::max(extent.x, glm::max(extent.y, extent.z)) / ((1 << bits) - 1) * 0.5f;
+}
+
+// Grid steps per world unit along every axis
+static vec3 positionScale(const RecordingHeader& header)
+{
+	vec3 extent = vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2])
+		- vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+	return float((1 << header.positionBits) - 1) / glm::max(extent, vec3(1e-6f));
+}
+
+// Morton code of p on the grid, false if p lies outside of it
+static inline bool quantizePosition(vec3 p, vec3 boundsMin, vec3 scale, float maxQ, uint64_t& code)
+{
+	vec3 q = glm::floor((p - boundsMin) * scale + 0.5f);
+	if (!(q.x >= 0.f && q.y >= 0.f && q.z >= 0.f && q.x <= maxQ && q.y <= maxQ && q.z <= maxQ))
+		return false;
+	uvec3 u = uvec3(q);
+	code = spreadBits(u.x) | spreadBits(u.y) << 1 | spreadBits(u.z) << 2;
+	return true;
+}
+
+FrameEncoder::FrameEncoder() :
+	frameIndex(0)
+{
+	memset(&settings, 0, sizeof(settings));
+}
+
+void FrameEncoder::reset(const RecordingHeader& header)
+{
+	settings = header;
+	frameIndex = 0;
+	previousCodes.clear();
+}
+
+void FrameEncoder::encode(const RecordFrameHeader& frame, const float* data, vector<char>& out)
+{
+	GLuint n = frame.liveCount;
+	int attributes = settings.attributes;
+	bool keyframe = settings.keyframeInterval == 0 || frameIndex % settings.keyframeInterval == 0;
+	frameIndex++;
+
+	CompressedFrameHeader header;
+	memset(&header, 0, sizeof(header));
+	header.keyframe = keyframe;
+	out.clear();
+	append(out, header);
+
+	// Grid codes of the positions, sorted with the particle order by an LSD radix sort
+	// that skips the digits all particles share. Particles outside the box, splashes over
+	// the open top, are left out of the grid and go behind the sorted ones
+	order.resize(n);
+	for (GLuint i = 0; i < n; i++)
+		order[i] = i;
+	codes.assign(n, 0);
+	if (attributes & RECORD_POSITION)
+	{
+		vec3 boundsMin = vec3(settings.boundsMin[0], settings.boundsMin[1], settings.boundsMin[2]);
+		vec3 scale = positionScale(settings);
+		float maxQ = float((1 << settings.positionBits) - 1);
+		GLuint inside = 0;
+		escaped.clear();
+		for (GLuint i = 0; i < n; i++)
+		{
+			vec3 p = vec3(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+			if (quantizePosition(p, boundsMin, scale, maxQ, codes[inside]))
+				order[inside++] = i;
+			else
+				escaped.push_back(i);
+		}
+		header.escapedCount = (uint32_t)escaped.size();
+		codes.resize(inside);
+		order.resize(inside);
+		n = inside;
+
+		sortScratch.resize(n);
+		orderScratch.resize(n);
+		vector<uint32_t> histogram(1 << SORT_DIGIT_BITS);
+		for (int shift = 0; shift < 3 * (int)settings.positionBits; shift += SORT_DIGIT_BITS)
+		{
+			fill(histogram.begin(), histogram.end(), 0);
+			for (GLuint i = 0; i < n; i++)
+				histogram[(codes[i] >> shift) & ((1 << SORT_DIGIT_BITS) - 1)]++;
+			if (n == 0 || histogram[(codes[0] >> shift) & ((1 << SORT_DIGIT_BITS) - 1)] == n)
+				continue;
+			for (uint32_t d = 0, sum = 0; d < histogram.size(); d++)
+			{
+				uint32_t count = histogram[d];
+				histogram[d] = sum;
+				sum += count;
+			}
+			for (GLuint i = 0; i < n; i++)
+			{
+				uint32_t dst = histogram[(codes[i] >> shift) & ((1 << SORT_DIGIT_BITS) - 1)]++;
+				sortScratch[dst] = codes[i];
+				orderScratch[dst] = order[i];
+			}
+			codes.swap(sortScratch);
+			order.swap(orderScratch);
+		}
+
+		// Per block the gaps along the curve or the changes against the frame before
+		GLuint blocks = (n + CODEC_BLOCK - 1) / CODEC_BLOCK;
+		modes.assign((blocks + 7) / 8, 0);
+		residuals.resize(n);
+		for (GLuint b = 0; b < blocks; b++)
+		{
+			GLuint first = b * CODEC_BLOCK;
+			GLuint last = std::min(n, first + CODEC_BLOCK);
+			int intraBits = 0, interBits = 0;
+			for (GLuint k = first; k < last; k++)
+				intraBits += bitLength(k ? codes[k] - codes[k - 1] : codes[k]);
+			bool inter = !keyframe && last <= previousCodes.size();
+			if (inter)
+			{
+				for (GLuint k = first; k < last; k++)
+					interBits += bitLength(zigzag((int64_t)(codes[k] - previousCodes[k])));
+				inter = interBits < intraBits;
+			}
+			if (inter)
+			{
+				modes[b / 8] |= (uint8_t)(1 << (b % 8));
+				for (GLuint k = first; k < last; k++)
+					residuals[k] = zigzag((int64_t)(codes[k] - previousCodes[k]));
+			}
+			else
+			{
+				for (GLuint k = first; k < last; k++)
+					residuals[k] = k ? codes[k] - codes[k - 1] : codes[k];
+			}
+		}
+		out.insert(out.end(), (const char*)modes.data(), (const char*)(modes.data() + modes.size()));
+		encodeResiduals(residuals, out);
+		previousCodes.swap(codes);
+
+		n = frame.liveCount;
+		order.insert(order.end(), escaped.begin(), escaped.end());
+		for (GLuint k = inside; k < n; k++)
+			for (int c = 0; c < 3; c++)
+				append(out, data[3 * order[k] + c]);
+	}
+
+	// The other attributes on their own 16 bit range, as changes along the curve
+	const float* attribute = data + (attributes & RECORD_POSITION ? 3 * n : 0);
+	const float maxQ = float((1 << CODEC_ATTRIBUTE_BITS) - 1);
+	for (int a = 0; a < 2; a++)
+	{
+		int components = a == 0 ? 3 : 1;
+		if (!(attributes & (a == 0 ? RECORD_VELOCITY : RECORD_COLOR)))
+			continue;
+		float* rangeMin = a == 0 ? header.velocityMin : &header.colorMin;
+		float* rangeMax = a == 0 ? header.velocityMax : &header.colorMax;
+		for (int c = 0; c < components; c++)
+		{
+			rangeMin[c] = n ? attribute[c] : 0.f;
+			rangeMax[c] = rangeMin[c];
+		}
+		for (GLuint i = 0; i < n; i++)
+			for (int c = 0; c < components; c++)
+			{
+				rangeMin[c] = glm::min(rangeMin[c], attribute[components * i + c]);
+				rangeMax[c] = glm::max(rangeMax[c], attribute[components * i + c]);
+			}
+
+		residuals.resize((size_t)components * n);
+		for (int c = 0; c < components; c++)
+		{
+			float scale = maxQ / glm::max(rangeMax[c] - rangeMin[c], 1e-12f);
+			int64_t previous = 0;
+			for (GLuint k = 0; k < n; k++)
+			{
+				float v = attribute[components * order[k] + c];
+				int64_t q = (int64_t)glm::clamp(glm::floor((v - rangeMin[c]) * scale + 0.5f), 0.f, maxQ);
+				residuals[(size_t)components * k + c] = zigzag(q - previous);
+				previous = q;
+			}
+		}
+		encodeResiduals(residuals, out);
+		attribute += (size_t)components * n;
+	}
+
+	// Ids exactly, as changes along the curve
+	if (attributes & RECORD_ID)
+	{
+		residuals.resize(n);
+		int64_t previous = 0;
+		for (GLuint k = 0; k < n; k++)
+		{
+			uint32_t id;
+			memcpy(&id, attribute + order[k], sizeof(id));
+			residuals[k] = zigzag((int64_t)id - previous);
+			previous = id;
+		}
+		encodeResiduals(residuals, out);
+	}
+
+	header.payloadBytes = (uint32_t)(out.size() - sizeof(header));
+	memcpy(out.data(), &header, sizeof(header));
+}
+
+FrameDecoder::FrameDecoder()
+{
+	memset(&settings, 0, sizeof(settings));
+}
+
+void FrameDecoder::reset(const RecordingHeader& header)
+{
+	settings = header;
+	previousCodes.clear();
+}
+
+void FrameDecoder::decode(const RecordFrameHeader& frame, const char* payload, size_t size, vector<float>& data)
+{
+	const char* p = payload;
+	const char* end = payload + size;
+	CompressedFrameHeader header = take<CompressedFrameHeader>(p, end);
+	if (header.payloadBytes > (size_t)(end - p) || frame.liveCount > settings.capacity)
+		damaged();
+	end = p + header.payloadBytes;
+
+	GLuint n = frame.liveCount;
+	int attributes = settings.attributes;
+	data.resize(Recorder::frameBytes(n, attributes) / sizeof(float));
+	float* out = data.data();
+	if (attributes & RECORD_POSITION)
+	{
+		if (header.escapedCount > n)
+			damaged();
+		n -= header.escapedCount;
+		if (!header.keyframe && previousCodes.empty() && n > 0)
+			throw runtime_error("Compressed frame decoded without the frames before it!");
+		GLuint blocks = (n + CODEC_BLOCK - 1) / CODEC_BLOCK;
+		if ((size_t)(end - p) < (blocks + 7) / 8)
+			damaged();
+		const uint8_t* modes = (const uint8_t*)p;
+		p += (blocks + 7) / 8;
+		decodeResiduals(p, end, n, residuals);
+
+		codes.resize(n);
+		for (GLuint b = 0; b < blocks; b++)
+		{
+			GLuint first = b * CODEC_BLOCK;
+			GLuint last = std::min(n, first + CODEC_BLOCK);
+			if (modes[b / 8] & (1 << (b % 8)))
+			{
+				if (last > previousCodes.size())
+					damaged();
+				for (GLuint k = first; k < last; k++)
+					codes[k] = previousCodes[k] + (uint64_t)unzigzag(residuals[k]);
+			}
+			else
+			{
+				for (GLuint k = first; k < last; k++)
+					codes[k] = k ? codes[k - 1] + residuals[k] : residuals[k];
+			}
+		}
+
+		vec3 boundsMin = vec3(settings.boundsMin[0], settings.boundsMin[1], settings.boundsMin[2]);
+		vec3 step = 1.f / positionScale(settings);
+		for (GLuint k = 0; k < n; k++)
+		{
+			vec3 q = vec3(compactBits(codes[k]), compactBits(codes[k] >> 1), compactBits(codes[k] >> 2));
+			vec3 position = boundsMin + q * step;
+			out[3 * k] = position.x;
+			out[3 * k + 1] = position.y;
+			out[3 * k + 2] = position.z;
+		}
+		previousCodes.swap(codes);
+
+		n = frame.liveCount;
+		if ((size_t)(end - p) < (size_t)header.escapedCount * 3 * sizeof(float))
+			damaged();
+		memcpy(out + 3 * (n - header.escapedCount), p, (size_t)header.escapedCount * 3 * sizeof(float));
+		p += (size_t)header.escapedCount * 3 * sizeof(float);
+		out += 3 * n;
+	}
+
+	const float maxQ = float((1 << CODEC_ATTRIBUTE_BITS) - 1);
+	for (int a = 0; a < 2; a++)
+	{
+		int components = a == 0 ? 3 : 1;
+		if (!(attributes & (a == 0 ? RECORD_VELOCITY : RECORD_COLOR)))
+			continue;
+		const float* rangeMin = a == 0 ? header.velocityMin : &header.colorMin;
+		const float* rangeMax = a == 0 ? header.velocityMax : &header.colorMax;
+		decodeResiduals(p, end, (size_t)components * n, residuals);
+		for (int c = 0; c < components; c++)
+		{
+			float step = glm::max(rangeMax[c] - rangeMin[c], 1e-12f) / maxQ;
+			int64_t q = 0;
+			for (GLuint k = 0; k < n; k++)
+			{
+				q += unzigzag(residuals[(size_t)components * k + c]);
+				out[components * k + c] = rangeMin[c] + q * step;
+			}
+		}
+		out += (size_t)components * n;
+	}
+
+	if (attributes & RECORD_ID)
+	{
+		decodeResiduals(p, end, n, residuals);
+		int64_t id = 0;
+		for (GLuint k = 0; k < n; k++)
+		{
+			id += unzigzag(residuals[k]);
+			uint32_t bits = (uint32_t)id;
+			memcpy(out + k, &bits, sizeof(bits));
+		}
+	}
+}
+
+RecordingReader::RecordingReader() :
+	offsets(NULL),
+	count(0),
+	indexOffset(0),
+	lastDecoded(0)
+{
+	memset(&header, 0, sizeof(header));
+}
+
+void RecordingReader::open(const string& path)
+{
+	file.open(path);
+	size_t size = file.size();
+	RecordingFooter footer;
+	memset(&footer, 0, sizeof(footer));
+	if (size >= sizeof(RecordingHeader) + sizeof(RecordingFooter))
+	{
+		memcpy(&header, file.data(), sizeof(header));
+		memcpy(&footer, file.data() + size - sizeof(footer), sizeof(footer));
+	}
+
+	stringstream ss;
+	if (size < sizeof(RecordingHeader) + sizeof(RecordingFooter) || memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0)
+		ss << path << " is not a recording!";
+	else if (header.version != RECORDING_VERSION)
+		ss << path << " is recording version " << header.version << ", expected " << RECORDING_VERSION << "!";
+	else if (memcmp(footer.magic, RECORDING_INDEX_MAGIC, sizeof(footer.magic)) != 0)
+		ss << path << " was not finished, its index is missing!";
+	else if (footer.indexOffset < sizeof(RecordingHeader) || footer.frameCount > (size - footer.indexOffset) / sizeof(uint64_t)
+		|| footer.indexOffset + footer.frameCount * sizeof(uint64_t) + sizeof(footer) != size
+		|| header.positionBits > CODEC_MAX_POSITION_BITS)
+		ss << path << " is truncated or damaged!";
+	else
+	{
+		offsets = (const uint64_t*)(file.data() + footer.indexOffset);
+		for (size_t k = 0; k < footer.frameCount; k++)
+			if (offsets[k] < sizeof(RecordingHeader) || (k > 0 && offsets[k] < offsets[k - 1] + sizeof(RecordFrameHeader))
+				|| offsets[k] + sizeof(RecordFrameHeader) > footer.indexOffset)
+			{
+				ss << path << " is truncated or damaged!";
+				break;
+			}
+	}
+	if (!ss.str().empty())
+	{
+		close();
+		throw runtime_error(ss.str());
+	}
+
+	count = (size_t)footer.frameCount;
+	indexOffset = footer.indexOffset;
+	lastDecoded = count;
+	decoder.reset(header);
+}
+
+void RecordingReader::close()
+{
+	file.close();
+	offsets = NULL;
+	count = 0;
+	lastDecoded = 0;
+}
+
+size_t RecordingReader::frameCount()
+{
+	return count;
+}
+
+size_t RecordingReader::frameSize(size_t frame)
+{
+	return (size_t)((frame + 1 < count ? offsets[frame + 1] : indexOffset) - offsets[frame]);
+}
+
+void RecordingReader::read(size_t frame, RecordFrameHeader& frameHeader, vector<float>& data)
+{
+	if (frame >= count)
+		throw runtime_error("Recording has no frame " + to_string(frame) + "!");
+
+	// A compressed frame needs the codes of the one before, decoding starts behind the
+	// last decoded frame or at the keyframe before, whichever comes first
+	size_t first = frame;
+	if (header.positionBits)
+		for (; first > 0; first--)
+		{
+			if (lastDecoded != count && lastDecoded + 1 == first)
+				break;
+			CompressedFrameHeader compressed;
+			if (frameSize(first) < sizeof(RecordFrameHeader) + sizeof(compressed))
+				damaged();
+			memcpy(&compressed, file.data() + offsets[first] + sizeof(RecordFrameHeader), sizeof(compressed));
+			if (compressed.keyframe)
+				break;
+		}
+	for (size_t k = first; k <= frame; k++)
+		decodeFrame(k, frameHeader, data);
+}
+
+void RecordingReader::decodeFrame(size_t frame, RecordFrameHeader& frameHeader, vector<float>& data)
+{
+	const char* p = file.data() + offsets[frame];
+	size_t size = frameSize(frame);
+	memcpy(&frameHeader, p, sizeof(frameHeader));
+	p += sizeof(frameHeader);
+	size -= sizeof(frameHeader);
+	lastDecoded = count;
+	if (header.positionBits)
+	{
+		decoder.decode(frameHeader, p, size, data);
+		lastDecoded = frame;
+		return;
+	}
+
+	size_t bytes = Recorder::frameBytes(frameHeader.liveCount, header.attributes);
+	if (frameHeader.liveCount > header.capacity || bytes > size)
+		throw runtime_error("Recorded frame is truncated or damaged!");
+	data.resize(bytes / sizeof(float));
+	memcpy(data.data(), p, bytes);
+}
+
+
+// Cube of the spawn spacing, swaying as a whole or resting apart from its top layers
+static void benchmarkFrame(int base, int frame, bool resting, vector<float>& data)
+{
+	size_t n = (size_t)base * base * base;
+	data.resize(7 * n);
+	float d = 2 * RADIUS;
+	float t = frame / 60.f;
+	size_t i = 0;
+	for (int x = 0; x < base; x++)
+		for (int y = 0; y < base; y++)
+			for (int z = 0; z < base; z++, i++)
+			{
+				vec3 p = vec3(d * (x - base / 2), d * y + FLOOR_Y + RADIUS, d * (z - base / 2));
+				float amplitude = resting ? glm::max(0.f, (y - 0.9f * base) / base) : 0.25f;
+				float phase = 2.f * t + 0.7f * p.x + 0.3f * p.z;
+				vec3 offset = amplitude * vec3(sinf(phase), 0.3f * cosf(phase + 0.5f * p.y), 0.5f * sinf(1.3f * phase));
+				vec3 velocity = amplitude * 2.f * vec3(cosf(phase), -0.3f * sinf(phase + 0.5f * p.y), 0.65f * cosf(1.3f * phase));
+				p += offset;
+				for (int c = 0; c < 3; c++)
+				{
+					data[3 * i + c] = p[c];
+					data[3 * n + 3 * i + c] = velocity[c];
+				}
+				data[6 * n + i] = 1.f - (float)y / base;
+			}
+}
+
+void benchmarkFrameCodec()
+{
+	const int base = 48;
+	const int frames = 60;
+	const int attributes = RECORD_POSITION | RECORD_VELOCITY | RECORD_COLOR;
+	vec3 boundsMin = vec3(-BOUNDING_MAX_X, FLOOR_Y, -BOUNDING_MAX_Z) - COLLIDER_MARGIN;
+	vec3 boundsMax = vec3(BOUNDING_MAX_X, COLLIDER_TOP_Y, BOUNDING_MAX_Z) + COLLIDER_MARGIN;
+	const float bounds[] = { CODEC_DEFAULT_ERROR_BOUND, 1e-5f };
+
+	cout << left << setw(10) << "scene" << right << setw(12) << "bound" << setw(6) << "bits" << setw(10) << "particles"
+		<< setw(12) << "pos bits" << setw(12) << "all bits" << setw(10) << "ratio" << setw(14) << "max err"
+		<< setw(18) << "encode MB/s/core" << setw(18) << "decode MB/s/core" << endl;
+	for (int resting = 0; resting < 2; resting++)
+	{
+		for (float bound : bounds)
+		{
+			RecordingHeader header;
+			memset(&header, 0, sizeof(header));
+			header.attributes = attributes;
+			header.capacity = base * base * base;
+			header.positionBits = codecPositionBits(boundsMin, boundsMax, bound);
+			header.errorBound = bound;
+			header.keyframeInterval = CODEC_KEYFRAME_INTERVAL;
+			for (int c = 0; c < 3; c++)
+			{
+				header.boundsMin[c] = boundsMin[c];
+				header.boundsMax[c] = boundsMax[c];
+			}
+
+			// Every frame through the encoder, the positions alone and all attributes
+			double rawBytes = 0.0, encodedBytes = 0.0, positionBytes = 0.0, encodeMs = 0.0, decodeMs = 0.0;
+			float maxError = 0.f;
+			FrameEncoder encoder, positionEncoder;
+			FrameDecoder decoder;
+			encoder.reset(header);
+			decoder.reset(header);
+			RecordingHeader positionHeader = header;
+			positionHeader.attributes = RECORD_POSITION;
+			positionEncoder.reset(positionHeader);
+			vector<float> data, decoded;
+			vector<char> out;
+			vector<pair<uint64_t, GLuint>> ranked(header.capacity);
+			vec3 scale = positionScale(header);
+			float maxQ = float((1 << header.positionBits) - 1);
+			auto mortonOf = [&](vec3 p)
+			{
+				uint64_t code;
+				return quantizePosition(p, boundsMin, scale, maxQ, code) ? code : UINT64_MAX;
+			};
+			for (int f = 0; f < frames; f++)
+			{
+				benchmarkFrame(base, f, resting != 0, data);
+				RecordFrameHeader frame = { (GLuint)f, header.capacity, (GLuint)attributes, 0 };
+				auto start = chrono::high_resolution_clock::now();
+				encoder.encode(frame, data.data(), out);
+				chrono::duration<double, milli> elapsed = chrono::high_resolution_clock::now() - start;
+				encodeMs += elapsed.count();
+				rawBytes += sizeof(frame) + data.size() * sizeof(float);
+				encodedBytes += sizeof(frame) + out.size();
+
+				start = chrono::high_resolution_clock::now();
+				decoder.decode(frame, out.data(), out.size(), decoded);
+				elapsed = chrono::high_resolution_clock::now() - start;
+				decodeMs += elapsed.count();
+
+				// Decoded particles come in Morton order, ties and those outside the box in the order
+				// they were packed
+				for (GLuint i = 0; i < frame.liveCount; i++)
+					ranked[i] = make_pair(mortonOf(vec3(data[3 * i], data[3 * i + 1], data[3 * i + 2])), i);
+				stable_sort(ranked.begin(), ranked.end(),
+					[](const pair<uint64_t, GLuint>& a, const pair<uint64_t, GLuint>& b) { return a.first < b.first; });
+				for (GLuint k = 0; k < frame.liveCount; k++)
+					for (int c = 0; c < 3; c++)
+						maxError = glm::max(maxError, glm::abs(decoded[3 * k + c] - data[3 * ranked[k].second + c]));
+
+				positionEncoder.encode(frame, data.data(), out);
+				positionBytes += out.size();
+			}
+
+			double particles = (double)header.capacity * frames;
+			cout << left << setw(10) << (resting ? "resting" : "swaying") << right << scientific << setprecision(1) << setw(12) << bound
+				<< defaultfloat << setw(6) << header.positionBits << setw(10) << header.capacity
+				<< fixed << setprecision(2) << setw(12) << positionBytes * 8 / particles << setw(12) << encodedBytes * 8 / particles
+				<< setw(10) << rawBytes / encodedBytes << scientific << setprecision(2) << setw(14) << maxError << fixed
+				<< setprecision(1) << setw(18) << rawBytes / (encodeMs * 1e3) << setw(18) << rawBytes / (decodeMs * 1e3)
+				<< defaultfloat << endl;
+		}
+	}
+}
@@ -0,0 +1,113 @@
+#ifndef _FRAME_CODEC_HPP
+#define _FRAME_CODEC_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "Recorder.hpp"
+#include "MappedFile.hpp"
+
+using namespace glm;
+using namespace std;
+
+const int CODEC_BLOCK = 256;				// particles sharing the choice of intra or inter residuals
+const int CODEC_ATTRIBUTE_BITS = 16;		// velocity and color field, over the range of the frame
+const uint32_t CODEC_KEYFRAME_INTERVAL = 30;	// every so many frames stands alone, for seeking
+const float CODEC_DEFAULT_ERROR_BOUND = 5e-4f;	// world units per axis
+const int CODEC_MAX_POSITION_BITS = 21;		// per axis, three fit a 64 bit Morton code
+
+// Behind the RecordFrameHeader of a compressed frame
+struct CompressedFrameHeader
+{
+	uint32_t payloadBytes;		// behind this header
+	uint32_t keyframe;			// no residuals against the frame before
+	uint32_t escapedCount;		// positions outside the box, as floats behind the codes
+	float velocityMin[3];
+	float velocityMax[3];
+	float colorMin;
+	float colorMax;
+};
+
+// Fewest bits per axis that hold the error bound over the box, 0 if even
+// CODEC_MAX_POSITION_BITS do not
+int codecPositionBits(vec3 boundsMin, vec3 boundsMax, float errorBound);
+// Largest error of a quantized position inside the box, per axis
+float codecMaxError(vec3 boundsMin, vec3 boundsMax, int bits);
+
+// Compresses frames of a recording. Positions are quantized on the fixed grid of the
+// recording's box and sorted by their Morton code, the few outside the box follow at full
+// precision. Blocks of the sorted codes keep either
+// the gaps to the code before or the differences to the code of the same rank in the frame
+// before, whichever is smaller. Velocity and color field are quantized over their range in
+// the frame and kept as differences along the same order, ids exactly so. All residuals go
+// out as bit lengths, rANS coded with a table of the frame, followed by their raw low bits.
+class FrameEncoder {
+public:
+	FrameEncoder();
+	void reset(const RecordingHeader& header);	// next frame is a keyframe
+	// CompressedFrameHeader and payload of the SoA data of a frame, replaces out
+	void encode(const RecordFrameHeader& frame, const float* data, vector<char>& out);
+
+private:
+	RecordingHeader settings;
+	uint32_t frameIndex;
+	vector<uint64_t> codes;
+	vector<uint64_t> previousCodes;		// sorted codes of the frame before
+	vector<uint64_t> sortScratch;
+	vector<uint32_t> order;
+	vector<uint32_t> orderScratch;
+	vector<uint32_t> escaped;			// particles outside the box, in packed order
+	vector<uint64_t> residuals;
+	vector<uint8_t> modes;
+};
+
+// Inverse of FrameEncoder, frames have to come in recording order from a keyframe on.
+// Decoded frames have the SoA layout of uncompressed ones, the particles in Morton order and
+// those outside the box behind them in the order they were packed. Recorded with RECORD_ID,
+// the ids tell the particles apart from frame to frame.
+class FrameDecoder {
+public:
+	FrameDecoder();
+	void reset(const RecordingHeader& header);
+	// Decodes the bytes behind the frame header, throws runtime_error if they are damaged
+	void decode(const RecordFrameHeader& frame, const char* payload, size_t size, vector<float>& data);
+
+private:
+	RecordingHeader settings;
+	vector<uint64_t> codes;
+	vector<uint64_t> previousCodes;
+	vector<uint64_t> residuals;
+};
+
+// Finished recording mapped for reading, compressed or not. Frames are read in any order,
+// a compressed frame is decoded from the keyframe before it or from the last frame read,
+// if that comes later.
+class RecordingReader {
+public:
+	RecordingHeader header;
+
+	RecordingReader();
+	void open(const string& path);		// map and validate, throws runtime_error
+	void close();
+	size_t frameCount();
+	size_t frameSize(size_t frame);		// bytes in the file, header included
+	// SoA data of the frame into data, throws runtime_error
+	void read(size_t frame, RecordFrameHeader& frameHeader, vector<float>& data);
+
+private:
+	MappedFile file;
+	const uint64_t* offsets;
+	size_t count;
+	uint64_t indexOffset;
+	FrameDecoder decoder;
+	size_t lastDecoded;			// frame the decoder holds the codes of, count if none
+
+	void decodeFrame(size_t frame, RecordFrameHeader& frameHeader, vector<float>& data);
+};
+
+// Ratio, bits per particle, error and encode / decode throughput on a single core for
+// recordings of a moving and of a resting cube, at the default error bound and a tight one
+void benchmarkFrameCodec();
+
+#endif // !_FRAME_CODEC_HPP
@@ -0,0 +1,439 @@
+#include "Importer.hpp"
+#include "Exporter.hpp"
+#include "utils.hpp"
+#include <sstream>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+static bool hostIsBigEndian()
+{
+	const uint32_t one = 1;
+	return *(const char*)&one == 0;
+}
+
+static string lowerExtension(const string& path)
+{
+	size_t dot = path.find_last_of('.');
+	string extension = dot == string::npos ? "" : path.substr(dot);
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension;
+}
+
+int importFormat(const string& path)
+{
+	string extension = lowerExtension(path);
+	if (extension == ".ply")
+		return IMPORT_PLY;
+	if (extension == ".rwp")
+		return IMPORT_RAW;
+	if (extension == ".obj")
+		return IMPORT_OBJ;
+	return -1;
+}
+
+SceneImport::SceneImport() :
+	points(NULL),
+	pointCount(0),
+	stride(0),
+	swap(false)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		fields[i].type = FIELD_NONE;
+		fields[i].offset = 0;
+	}
+}
+
+void SceneImport::open(const string& path)
+{
+	close();
+	switch (importFormat(path))
+	{
+	case IMPORT_PLY:
+		openPly(path);
+		break;
+	case IMPORT_RAW:
+		openPointCache(path);
+		break;
+	case IMPORT_OBJ:
+		voxelize(path);
+		break;
+	default:
+		throw runtime_error("Could not import " + path + ", expected a .ply, .rwp or .obj file!");
+	}
+	if (pointCount == 0)
+	{
+		close();
+		throw runtime_error("No particles in " + path + "!");
+	}
+}
+
+void SceneImport::close()
+{
+	file.close();
+	points = NULL;
+	pointCount = 0;
+	stride = 0;
+	swap = false;
+	for (int i = 0; i < 6; i++)
+		fields[i].type = FIELD_NONE;
+	lattice.clear();
+	lattice.shrink_to_fit();
+}
+
+size_t SceneImport::count()
+{
+	return pointCount;
+}
+
+void SceneImport::read(Particle* out)
+{
+	// Chunks of the mapped file are converted on every core, the page faults of a cold
+	// file overlap instead of coming in one at a time
+	ThreadPool pool;
+	int chunks = (int)((pointCount + IMPORT_CHUNK - 1) / IMPORT_CHUNK);
+	pool.parallelFor(chunks, 1, [&](int begin, int end, int)
+	{
+		for (int chunk = begin; chunk < end; chunk++)
+		{
+			size_t first = (size_t)chunk * IMPORT_CHUNK;
+			convert(first, std::min((size_t)IMPORT_CHUNK, pointCount - first), out);
+		}
+	});
+}
+
+void SceneImport::convert(size_t first, size_t n, Particle* out)
+{
+	for (size_t i = first; i < first + n; i++)
+	{
+		vec3 position, velocity(0.f);
+		if (points)
+		{
+			const char* point = points + i * stride;
+			position = vec3(field(point, fields[0]), field(point, fields[1]), field(point, fields[2]));
+			if (fields[3].type != FIELD_NONE)
+				velocity = vec3(field(point, fields[3]), field(point, fields[4]), field(point, fields[5]));
+		}
+		else
+			position = lattice[i];
+
+		Particle particle;
+		particle.currPos = vec4(position, 1.f);
+		particle.prevPos = particle.currPos;
+		particle.vel = vec4(velocity, 0.f);
+		particle.acc = vec4(0.f);
+		particle.surfaceNorm = vec4(0.f);
+		particle.factor = vec4(vec3(0.f), 1.f);
+		out[i] = particle;
+	}
+}
+
+template <typename T>
+static T loadField(const char* p, bool swap)
+{
+	char bytes[sizeof(T)];
+	memcpy(bytes, p, sizeof(T));
+	if (swap)
+		reverse(bytes, bytes + sizeof(T));
+	T value;
+	memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+float SceneImport::field(const char* point, const Field& f)
+{
+	const char* p = point + f.offset;
+	switch (f.type)
+	{
+	case FIELD_INT8:
+		return (float)loadField<int8_t>(p, false);
+	case FIELD_UINT8:
+		return (float)loadField<uint8_t>(p, false);
+	case FIELD_INT16:
+		return (float)loadField<int16_t>(p, swap);
+	case FIELD_UINT16:
+		return (float)loadField<uint16_t>(p, swap);
+	case FIELD_INT32:
+		return (float)loadField<int32_t>(p, swap);
+	case FIELD_UINT32:
+		return (float)loadField<uint32_t>(p, swap);
+	case FIELD_FLOAT32:
+		return loadField<float>(p, swap);
+	case FIELD_FLOAT64:
+		return (float)loadField<double>(p, swap);
+	default:
+		return 0.f;
+	}
+}
+
+// Type and size of a PLY scalar type name, both spellings of the specification
+static int plyType(const string& name, size_t& size)
+{
+	static const char* names[][2] = { { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+	static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	for (int i = 0; i < 8; i++)
+	{
+		if (name == names[i][0] || name == names[i][1])
+		{
+			size = sizes[i];
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+void SceneImport::openPly(const string& path)
+{
+	file.open(path);
+
+	// The header is text up to end_header, the binary points follow
+	const char* data = file.data();
+	size_t size = file.size();
+	const char* marker = "end_header\n";
+	const char* end = search(data, data + std::min(size, (size_t)65536), marker, marker + strlen(marker));
+	if (size < 4 || memcmp(data, "ply", 3) != 0 || end == data + std::min(size, (size_t)65536))
+	{
+		close();
+		throw runtime_error(path + " is not a PLY file!");
+	}
+	size_t dataStart = end - data + strlen(marker);
+
+	// Elements before the vertices are skipped by their size, the ones after are ignored
+	static const char* names[6] = { "x", "y", "z", "vx", "vy", "vz" };
+	stringstream header(string(data, dataStart));
+	stringstream error;
+	string line;
+	bool inVertex = false, vertexFound = false;
+	size_t skipped = 0, elementSize = 0, elementCount = 0;
+	while (getline(header, line) && error.str().empty())
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		stringstream ls(line);
+		string keyword;
+		ls >> keyword;
+		if (keyword == "format")
+		{
+			string format;
+			ls >> format;
+			if (format == "binary_little_endian" || format == "binary_big_endian")
+				swap = (format == "binary_big_endian") != hostIsBigEndian();
+			else
+				error << path << " is a " << format << " PLY file, only binary ones are imported!";
+		}
+		else if (keyword == "element")
+		{
+			if (!inVertex && !vertexFound)
+				skipped += elementSize * elementCount;
+			string name;
+			ls >> name >> elementCount;
+			inVertex = name == "vertex";
+			vertexFound = vertexFound || inVertex;
+			if (inVertex)
+				pointCount = elementCount;
+			elementSize = 0;
+		}
+		else if (keyword == "property")
+		{
+			string type, name;
+			ls >> type;
+			size_t typeSize = 0;
+			int fieldType = plyType(type, typeSize);
+			if (type == "list")
+			{
+				// Faces behind the vertices are fine, a list before or in them has no fixed size
+				if (!vertexFound || inVertex)
+					error << path << " has list properties in or before its vertices!";
+				continue;
+			}
+			if (!fieldType)
+			{
+				error << path << " has a property of unknown type " << type << "!";
+				continue;
+			}
+			ls >> name;
+			if (inVertex)
+				for (int i = 0; i < 6; i++)
+					if (name == names[i])
+					{
+						fields[i].type = fieldType;
+						fields[i].offset = elementSize;
+					}
+			elementSize += typeSize;
+			if (inVertex)
+				stride = elementSize;
+		}
+	}
+
+	// Velocity only if all three components are there
+	if (fields[3].type == FIELD_NONE || fields[4].type == FIELD_NONE || fields[5].type == FIELD_NONE)
+		fields[3].type = fields[4].type = fields[5].type = FIELD_NONE;
+	if (error.str().empty())
+	{
+		if (!vertexFound || fields[0].type == FIELD_NONE || fields[1].type == FIELD_NONE || fields[2].type == FIELD_NONE)
+			error << path << " has no vertex positions!";
+		else if (dataStart + skipped + (uint64_t)pointCount * stride > size)
+			error << path << " is truncated or damaged!";
+	}
+	if (!error.str().empty())
+	{
+		close();
+		throw runtime_error(error.str());
+	}
+	points = data + dataStart + skipped;
+}
+
+void SceneImport::openPointCache(const string& path)
+{
+	file.open(path);
+	PointCacheHeader header;
+	stringstream error;
+	if (file.size() < sizeof(PointCacheHeader))
+		error << path << " is not a point cache!";
+	else
+	{
+		memcpy(&header, file.data(), sizeof(header));
+		if (memcmp(header.magic, POINT_CACHE_MAGIC, sizeof(header.magic)) != 0)
+			error << path << " is not a point cache!";
+		else if (header.version != POINT_CACHE_VERSION)
+			error << path << " is point cache version " << header.version << ", expected " << POINT_CACHE_VERSION << "!";
+		else if (header.floatsPerPoint < 6)
+			error << path << " has no velocities!";
+		else if (sizeof(PointCacheHeader) + (uint64_t)header.count * header.floatsPerPoint * sizeof(float) > file.size())
+			error << path << " is truncated or damaged!";
+	}
+	if (!error.str().empty())
+	{
+		close();
+		throw runtime_error(error.str());
+	}
+
+	// Position and velocity lead the floats of a point, in host order
+	points = file.data() + sizeof(PointCacheHeader);
+	pointCount = header.count;
+	stride = header.floatsPerPoint * sizeof(float);
+	for (int i = 0; i < 6; i++)
+	{
+		fields[i].type = FIELD_FLOAT32;
+		fields[i].offset = i * sizeof(float);
+	}
+}
+
+// Twice the signed area of a, b and p in the xz plane. The end points are taken in a fixed
+// order, so a triangle on the other side of a shared edge gets the exact negative.
+static double edgeFunction(dvec2 a, dvec2 b, dvec2 p)
+{
+	bool flipped = b.x < a.x || (b.x == a.x && b.y < a.y);
+	if (flipped)
+		std::swap(a, b);
+	double e = (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+	return flipped ? -e : e;
+}
+
+// A column exactly on an edge belongs to one of the two triangles sharing it, the one the
+// edge runs in a fixed half plane of directions for
+static bool ownsEdge(dvec2 direction)
+{
+	return direction.y > 0.0 || (direction.y == 0.0 && direction.x < 0.0);
+}
+
+void SceneImport::voxelize(const string& path)
+{
+	vector<vec3> vertices;
+	vector<uvec3> triangles;
+	loadOBJ(path, vertices, triangles);
+	if (triangles.empty())
+		throw runtime_error("No triangles in " + path + "!");
+
+	// Lattice aligned to the spacing, columns along y through the cell centers in xz
+	vec3 lo(FLT_MAX), hi(-FLT_MAX);
+	for (auto it = vertices.begin(); it != vertices.end(); ++it)
+	{
+		lo = glm::min(lo, *it);
+		hi = glm::max(hi, *it);
+	}
+	const float d = IMPORT_SPACING;
+	vec3 base = glm::floor(lo / d) * d;
+	ivec3 cells = ivec3(glm::ceil((hi - base) / d)) + 1;
+	auto center = [&](int axis, int index) { return base[axis] + (index + 0.5f) * d; };
+
+	// Triangles binned to the columns their xz bounds cover, as offsets into one array
+	auto forColumns = [&](size_t t, const function<void(size_t)>& body)
+	{
+		vec3 a = vertices[triangles[t].x], b = vertices[triangles[t].y], c = vertices[triangles[t].z];
+		vec3 tlo = glm::min(a, glm::min(b, c)), thi = glm::max(a, glm::max(b, c));
+		int i0 = glm::max((int)std::ceil((tlo.x - base.x) / d - 0.5f), 0);
+		int i1 = glm::min((int)std::floor((thi.x - base.x) / d - 0.5f), cells.x - 1);
+		int k0 = glm::max((int)std::ceil((tlo.z - base.z) / d - 0.5f), 0);
+		int k1 = glm::min((int)std::floor((thi.z - base.z) / d - 0.5f), cells.z - 1);
+		for (int i = i0; i <= i1; i++)
+			for (int k = k0; k <= k1; k++)
+				body((size_t)i * cells.z + k);
+	};
+	vector<uint32_t> binStart((size_t)cells.x * cells.z + 1, 0);
+	for (size_t t = 0; t < triangles.size(); t++)
+		forColumns(t, [&](size_t column) { binStart[column + 1]++; });
+	for (size_t column = 0; column + 1 < binStart.size(); column++)
+		binStart[column + 1] += binStart[column];
+	vector<uint32_t> binFill(binStart.begin(), binStart.end() - 1);
+	vector<uint32_t> binTriangles(binStart.back());
+	for (size_t t = 0; t < triangles.size(); t++)
+		forColumns(t, [&](size_t column) { binTriangles[binFill[column]++] = (uint32_t)t; });
+
+	// Every row of columns on its own: the crossings of a column in y order pair up into
+	// inside intervals, lattice points in them are kept
+	vector<vector<vec3>> rows(cells.x);
+	ThreadPool pool;
+	pool.parallelFor(cells.x, 1, [&](int begin, int end, int)
+	{
+		vector<float> crossings;
+		for (int i = begin; i < end; i++)
+		{
+			for (int k = 0; k < cells.z; k++)
+			{
+				dvec2 p(center(0, i), center(2, k));
+				size_t column = (size_t)i * cells.z + k;
+				crossings.clear();
+				for (uint32_t b = binStart[column]; b < binStart[column + 1]; b++)
+				{
+					const uvec3& triangle = triangles[binTriangles[b]];
+					vec3 v[3] = { vertices[triangle.x], vertices[triangle.y], vertices[triangle.z] };
+					dvec2 q[3] = { dvec2(v[0].x, v[0].z), dvec2(v[1].x, v[1].z), dvec2(v[2].x, v[2].z) };
+					double area = edgeFunction(q[0], q[1], q[2]);
+					if (area == 0.0)
+						continue;
+					double sign = area > 0.0 ? 1.0 : -1.0;
+					double w[3];
+					bool covered = true;
+					for (int e = 0; e < 3 && covered; e++)
+					{
+						dvec2 from = q[(e + 1) % 3], to = q[(e + 2) % 3];
+						w[e] = sign * edgeFunction(from, to, p);
+						covered = w[e] > 0.0 || (w[e] == 0.0 && ownsEdge(sign * (to - from)));
+					}
+					if (covered)
+						crossings.push_back((float)((w[0] * v[0].y + w[1] * v[1].y + w[2] * v[2].y) / (w[0] + w[1] + w[2])));
+				}
+				sort(crossings.begin(), crossings.end());
+
+				// An odd count only comes from a mesh that is not closed, its last crossing is dropped
+				for (size_t c = 0; c + 1 < crossings.size(); c += 2)
+				{
+					int j0 = glm::max((int)std::ceil((crossings[c] - base.y) / d - 0.5f), 0);
+					int j1 = glm::min((int)std::ceil((crossings[c + 1] - base.y) / d - 0.5f), cells.y);
+					for (int j = j0; j < j1; j++)
+						rows[i].push_back(vec3(p.x, center(1, j), p.y));
+				}
+			}
+		}
+	});
+
+	for (auto it = rows.begin(); it != rows.end(); ++it)
+		lattice.insert(lattice.end(), it->begin(), it->end());
+	pointCount = lattice.size();
+}
@@ -0,0 +1,61 @@
+#ifndef _IMPORTER_HPP
+#define _IMPORTER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "ParticleManager.hpp"
+#include "MappedFile.hpp"
+
+using namespace glm;
+using namespace std;
+
+// Import formats, told apart by the file extension
+const int IMPORT_PLY = 0;			// binary PLY, vertex element with x y z and optional vx vy vz
+const int IMPORT_RAW = 1;			// point cache of the exporter
+const int IMPORT_OBJ = 2;			// closed triangle mesh, filled with particles
+const int IMPORT_CHUNK = 16384;		// particles converted per task
+const float IMPORT_SPACING = 2 * RADIUS;	// lattice of the generated cubes
+
+int importFormat(const string& path);	// IMPORT_*, -1 for an unknown extension
+
+// Initial particles of a scene from outside. Point files are mapped and their points are
+// converted only when read, so they can go from the page cache straight into a mapped GPU
+// buffer. A mesh is voxelized when opened: every lattice point at IMPORT_SPACING inside it
+// becomes a particle at rest, found by the crossings of the mesh along lattice columns.
+class SceneImport {
+public:
+	SceneImport();
+	void open(const string& path);		// map or voxelize, throws runtime_error
+	void close();
+	size_t count();
+	// Every particle into out, in parallel chunks. Particles without a velocity in the
+	// file start at rest.
+	void read(Particle* out);
+
+private:
+	// Scalar types of PLY properties
+	enum { FIELD_NONE, FIELD_INT8, FIELD_UINT8, FIELD_INT16, FIELD_UINT16, FIELD_INT32, FIELD_UINT32, FIELD_FLOAT32, FIELD_FLOAT64 };
+
+	struct Field
+	{
+		int type;
+		size_t offset;		// in the point
+	};
+
+	MappedFile file;
+	const char* points;		// first point in the mapping
+	size_t pointCount;
+	size_t stride;			// bytes per point
+	bool swap;				// byte order of the file is not the host's
+	Field fields[6];		// x y z vx vy vz
+	vector<vec3> lattice;	// points of a voxelized mesh
+
+	void openPly(const string& path);
+	void openPointCache(const string& path);
+	void voxelize(const string& path);
+	float field(const char* point, const Field& f);
+	void convert(size_t first, size_t n, Particle* out);
+};
+
+#endif // !_IMPORTER_HPP
@@ -0,0 +1,554 @@
+#include "JobServer.hpp"
+#include "Exporter.hpp"
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+typedef SOCKET JobSocket;
+#define pollSockets WSAPoll
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+typedef int JobSocket;
+#define INVALID_SOCKET (-1)
+#define pollSockets poll
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static void closeSocket(JobSocket socket)
+{
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+// Winsock once per process, a client that went away must not kill the server with SIGPIPE
+static void startSockets()
+{
+#ifdef _WIN32
+	static bool started = false;
+	if (!started)
+	{
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			throw runtime_error("Could not start winsock!");
+		started = true;
+	}
+#else
+	signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+static sockaddr_un socketAddress(const string& path)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path))
+		throw runtime_error("Socket path " + path + " is too long!");
+	memcpy(address.sun_path, path.c_str(), path.size());
+	return address;
+}
+
+static JobSocket connectSocket(const string& path)
+{
+	sockaddr_un address = socketAddress(path);
+	JobSocket socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	if (connect(socket, (sockaddr*)&address, sizeof(address)) != 0)
+	{
+		closeSocket(socket);
+		return INVALID_SOCKET;
+	}
+	return socket;
+}
+
+// Sends on the socket fail instead of waiting for a client that stopped reading
+static void setNonBlocking(JobSocket socket)
+{
+#ifdef _WIN32
+	u_long enabled = 1;
+	ioctlsocket(socket, FIONBIO, &enabled);
+#else
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+static bool wouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static bool sendAll(JobSocket socket, const string& data)
+{
+	size_t sent = 0;
+	while (sent < data.size())
+	{
+		int n = (int)send(socket, data.data() + sent, (int)(data.size() - sent), SEND_FLAGS);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+// Connection of a client, closed once neither the connection thread nor a job holds it.
+// The socket never blocks, what it does not take waits in output for the connection thread
+struct JobClient
+{
+	JobSocket socket;
+	string input;			// received, not yet a whole line
+	string output;			// replies not sent yet
+	mutex lock;				// both threads reply
+
+	JobClient(JobSocket socket) : socket(socket) { setNonBlocking(socket); }
+	~JobClient() { closeSocket(socket); }
+
+	// A client that hung up misses the line, its jobs still run. A droppable line (progress)
+	// is left out while earlier replies still wait, a slow client never stalls the jobs
+	void reply(const string& line, bool droppable = false)
+	{
+		lock_guard<mutex> guard(lock);
+		if (droppable && !output.empty())
+			return;
+		output += line + "\n";
+		send();
+	}
+
+	// Waiting replies out as far as the socket takes them
+	void flush()
+	{
+		lock_guard<mutex> guard(lock);
+		send();
+	}
+
+	bool pending()
+	{
+		lock_guard<mutex> guard(lock);
+		return !output.empty();
+	}
+
+private:
+	void send()
+	{
+		while (!output.empty())
+		{
+			int n = (int)::send(socket, output.data(), (int)output.size(), SEND_FLAGS);
+			if (n <= 0)
+			{
+				if (n < 0 && wouldBlock())
+					return;
+				output.clear();
+				return;
+			}
+			output.erase(0, n);
+		}
+	}
+};
+
+// Heap order, true if a runs after b
+static bool runsAfter(const SimulationJob& a, const SimulationJob& b)
+{
+	return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+}
+
+JobServer::JobServer() :
+	listener((intptr_t)INVALID_SOCKET),
+	nextId(0),
+	running(0),
+	stopping(false)
+{
+}
+
+JobServer::~JobServer()
+{
+	stop();
+	if (connections.joinable())
+		connections.join();
+}
+
+bool JobServer::parseJob(const string& line, SimulationJob& job, string& error)
+{
+	job.id = 0;
+	job.priority = 0;
+	rwDefaultSceneDesc(&job.desc);
+	job.restore.clear();
+	job.scene.clear();
+	job.steps = 240;
+	job.deltaTime = 1.f / 60.f;
+	job.output.clear();
+	job.format = EXPORT_VTK;
+	job.every = 0;
+	job.checkpoint.clear();
+
+	istringstream words(line);
+	string word;
+	while (words >> word)
+	{
+		size_t equals = word.find('=');
+		if (equals == string::npos || equals == 0 || equals + 1 == word.size())
+		{
+			error = "expected key=value, got " + word;
+			return false;
+		}
+		string key = word.substr(0, equals), value = word.substr(equals + 1);
+		if (key == "mode")
+			job.desc.mode = atoi(value.c_str());
+		else if (key == "n")
+			job.desc.capacity = atoi(value.c_str());
+		else if (key == "steps")
+			job.steps = atoi(value.c_str());
+		else if (key == "dt")
+			job.deltaTime = (float)atof(value.c_str());
+		else if (key == "priority")
+			job.priority = atoi(value.c_str());
+		else if (key == "backend" && (value == "gpu" || value == "cpu"))
+			job.desc.backend = value == "cpu" ? RW_BACKEND_CPU : RW_BACKEND_GPU;
+		else if (key == "boundx")
+			job.desc.boundingX = (float)atof(value.c_str());
+		else if (key == "boundz")
+			job.desc.boundingZ = (float)atof(value.c_str());
+		else if (key == "viscosity")
+		{
+			job.desc.viscosityIterations = atoi(value.c_str());
+			job.desc.implicitViscosity = job.desc.viscosityIterations > 0;
+			if (!job.desc.implicitViscosity)
+				job.desc.viscosityIterations = VISCOSITY_CG_ITERATIONS;
+		}
+		else if (key == "boundary")
+			job.desc.useBoundary = atoi(value.c_str()) != 0;
+		else if (key == "sleeping")
+			job.desc.useSleeping = atoi(value.c_str()) != 0;
+		else if (key == "scene")
+			job.scene = value;
+		else if (key == "restore")
+			job.restore = value;
+		else if (key == "output")
+			job.output = value;
+		else if (key == "format" && (value == "vtk" || value == "ply" || value == "cache"))
+			job.format = value == "vtk" ? EXPORT_VTK : value == "ply" ? EXPORT_PLY : EXPORT_RAW;
+		else if (key == "every")
+			job.every = atoi(value.c_str());
+		else if (key == "checkpoint")
+			job.checkpoint = value;
+		else
+		{
+			error = "unknown " + word;
+			return false;
+		}
+	}
+	if (job.desc.mode < 0 || job.desc.mode > 5 || job.desc.capacity < 0 || job.steps <= 0 || !(job.deltaTime > 0.f) || job.every < 0)
+	{
+		error = "mode must be 0 to 5, steps and dt positive, n and every not negative";
+		return false;
+	}
+	return true;
+}
+
+void JobServer::run(const string& socketPath)
+{
+	stopping = false;
+	simulation.create(true);
+	cout << "Serving on " << socketPath << ": " << simulation.describe() << endl;
+	try {
+		listen(socketPath);
+	}
+	catch (...) {
+		simulation.destroy();
+		throw;
+	}
+	connections = thread(&JobServer::serveClients, this);
+
+	// GL calls only on this thread, the context is current here
+	while (true)
+	{
+		SimulationJob job;
+		{
+			unique_lock<mutex> guard(lock);
+			jobReady.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (stopping)
+				break;
+			pop_heap(queue.begin(), queue.end(), runsAfter);
+			job = queue.back();
+			queue.pop_back();
+			running = job.id;
+		}
+		runJob(job);
+		lock_guard<mutex> guard(lock);
+		running = 0;
+	}
+
+	connections.join();
+	for (auto it = queue.begin(); it != queue.end(); ++it)
+		it->client->reply("failed " + to_string(it->id) + " The server is shutting down!");
+	queue.clear();
+	closeSocket((JobSocket)listener);
+	listener = (intptr_t)INVALID_SOCKET;
+#ifndef _WIN32
+	unlink(socketPath.c_str());
+#endif
+	simulation.destroy();
+}
+
+void JobServer::stop()
+{
+	lock_guard<mutex> guard(lock);
+	stopping = true;
+	jobReady.notify_all();
+}
+
+void JobServer::listen(const string& path)
+{
+	startSockets();
+	socketPath = path;
+
+	// A socket file nobody answers on is left over from a server that died
+	JobSocket live = connectSocket(path);
+	if (live != INVALID_SOCKET)
+	{
+		closeSocket(live);
+		throw runtime_error("A server is already listening on " + path + "!");
+	}
+#ifdef _WIN32
+	DeleteFileA(path.c_str());
+#else
+	unlink(path.c_str());
+#endif
+
+	// Jobs write files as the server's user, the socket is created for that user alone
+	sockaddr_un address = socketAddress(path);
+	JobSocket socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket == INVALID_SOCKET)
+		throw runtime_error("Could not create a socket for " + path + "!");
+#ifdef _WIN32
+	bool bound = ::bind(socket, (sockaddr*)&address, sizeof(address)) == 0;
+#else
+	mode_t mask = umask(0177);
+	bool bound = ::bind(socket, (sockaddr*)&address, sizeof(address)) == 0;
+	umask(mask);
+	bound = bound && chmod(path.c_str(), 0600) == 0;
+#endif
+	if (!bound || ::listen(socket, 16) != 0)
+	{
+		closeSocket(socket);
+		throw runtime_error("Could not listen on " + path + "!");
+	}
+	listener = (intptr_t)socket;
+}
+
+void JobServer::serveClients()
+{
+	vector<shared_ptr<JobClient>> clients;
+	vector<pollfd> fds;
+	char buffer[4096];
+	while (!stopping)
+	{
+		fds.assign(clients.size() + 1, pollfd());
+		fds[0].fd = (JobSocket)listener;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			fds[i + 1].fd = clients[i]->socket;
+			fds[i + 1].events = POLLIN | (clients[i]->pending() ? POLLOUT : 0);
+		}
+		if (pollSockets(fds.data(), (unsigned long)fds.size(), JOB_POLL_MS) <= 0)
+			continue;
+
+		// Requests a line at a time, a client that hung up leaves the list
+		for (size_t i = clients.size(); i-- > 0;)
+		{
+			if (!fds[i + 1].revents)
+				continue;
+			shared_ptr<JobClient> client = clients[i];
+			if (fds[i + 1].revents & POLLOUT)
+				client->flush();
+			if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			int n = (int)recv(client->socket, buffer, sizeof(buffer), 0);
+			if (n < 0 && wouldBlock())
+				continue;
+			if (n <= 0)
+			{
+				clients.erase(clients.begin() + i);
+				continue;
+			}
+			client->input.append(buffer, n);
+			size_t end;
+			while ((end = client->input.find('\n')) != string::npos)
+			{
+				string line = client->input.substr(0, end);
+				client->input.erase(0, end + 1);
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+				if (!line.empty())
+					handleLine(client, line);
+			}
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			JobSocket socket = accept((JobSocket)listener, NULL, NULL);
+			if (socket != INVALID_SOCKET)
+				clients.push_back(make_shared<JobClient>(socket));
+		}
+	}
+}
+
+void JobServer::handleLine(const shared_ptr<JobClient>& client, const string& line)
+{
+	if (line == "shutdown")
+	{
+		client->reply("bye");
+		stop();
+		return;
+	}
+	if (line == "status")
+	{
+		lock_guard<mutex> guard(lock);
+		client->reply("status " + to_string(queue.size()) + " " + to_string(running));
+		return;
+	}
+
+	SimulationJob job;
+	string error;
+	if (!parseJob(line, job, error))
+	{
+		client->reply("error " + error);
+		return;
+	}
+	job.client = client;
+	size_t ahead = 0;
+	{
+		lock_guard<mutex> guard(lock);
+		job.id = ++nextId;
+		for (auto it = queue.begin(); it != queue.end(); ++it)
+			ahead += runsAfter(job, *it);
+		queue.push_back(job);
+		push_heap(queue.begin(), queue.end(), runsAfter);
+		jobReady.notify_one();
+	}
+	client->reply("queued " + to_string(job.id) + " " + to_string(ahead));
+}
+
+void JobServer::runJob(SimulationJob& job)
+{
+	string id = to_string(job.id);
+	job.desc.checkpoint = job.restore.empty() ? NULL : job.restore.c_str();
+	job.desc.scene = job.scene.empty() ? NULL : job.scene.c_str();
+	job.client->reply("started " + id);
+	auto start = chrono::steady_clock::now();
+
+	ParticleManager* scene = NULL;
+	int frames = 0;
+	try {
+		scene = simulation.createScene(job.desc);
+		int report = std::max(1, job.steps / JOB_PROGRESS_REPORTS);
+		for (int step = 1; step <= job.steps; step++)
+		{
+			if (stopping)
+				throw runtime_error("The server is shutting down!");
+			scene->step(job.deltaTime);
+			if (!job.output.empty() && job.every > 0 && step % job.every == 0)
+			{
+				char number[16];
+				snprintf(number, sizeof(number), "_%05d", frames);
+				scene->exportFrame(job.output + number + exportExtension(job.format), job.format);
+				frames++;
+			}
+			if (step % report == 0 || step == job.steps)
+			{
+				// A step counts once the GPU ran it
+				glFinish();
+				job.client->reply("progress " + id + " " + to_string(step) + " " + to_string(job.steps) + " " + to_string(frames), true);
+			}
+		}
+		if (!job.output.empty() && job.every == 0)
+		{
+			scene->exportFrame(job.output + exportExtension(job.format), job.format);
+			frames++;
+		}
+		if (!job.checkpoint.empty())
+			scene->saveCheckpoint(job.checkpoint);
+	}
+	catch (const exception& e) {
+		cerr << "Job " << id << " failed: " << e.what() << endl;
+		job.client->reply("failed " + id + " " + e.what());
+		simulation.releaseScene(scene);
+		return;
+	}
+	simulation.releaseScene(scene);
+
+	long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+	cout << "Job " << id << " done, " << job.steps << " steps in " << ms << " ms" << endl;
+	job.client->reply("done " + id + " " + to_string(job.steps) + " " + to_string(frames) + " " + to_string(ms));
+}
+
+bool submitJob(const string& socketPath, const string& request, ostream& out)
+{
+	startSockets();
+	JobSocket socket = connectSocket(socketPath);
+	if (socket == INVALID_SOCKET)
+		throw runtime_error("Could not connect to " + socketPath + "!");
+	if (!sendAll(socket, request + "\n"))
+	{
+		closeSocket(socket);
+		throw runtime_error("Could not send to " + socketPath + "!");
+	}
+
+	// The reply ends with the first line that answers the request completely
+	string input;
+	char buffer[4096];
+	while (true)
+	{
+		size_t end;
+		while ((end = input.find('\n')) != string::npos)
+		{
+			string line = input.substr(0, end);
+			input.erase(0, end + 1);
+			out << line << endl;
+			string word = line.substr(0, line.find(' '));
+			if (word == "done" || word == "status" || word == "bye")
+			{
+				closeSocket(socket);
+				return true;
+			}
+			if (word == "failed" || word == "error")
+			{
+				closeSocket(socket);
+				return false;
+			}
+		}
+		int n = (int)recv(socket, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+		{
+			closeSocket(socket);
+			throw runtime_error("The server at " + socketPath + " hung up!");
+		}
+		input.append(buffer, n);
+	}
+}
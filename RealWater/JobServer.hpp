@@ -0,0 +1,90 @@
+#ifndef _JOB_SERVER_HPP
+#define _JOB_SERVER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <condition_variable>
+#include "Simulation.hpp"
+
+using namespace std;
+
+const char* const JOB_SERVER_SOCKET = "realwater.sock";	// default socket, in the working directory
+const int JOB_PROGRESS_REPORTS = 20;	// progress lines of a job, each waits for the GPU
+const int JOB_POLL_MS = 200;			// the connection thread notices a stop this late at most
+
+struct JobClient;
+
+// A scene job, one request line of key=value words:
+//   mode=4 n=0 steps=240 dt=0.0167 priority=0 backend=gpu|cpu boundx=3.2 boundz=3.2
+//   viscosity=0 boundary=0 sleeping=0 scene=file restore=file
+//   output=prefix format=vtk|ply|cache every=0 checkpoint=file
+// viscosity is the iteration count of the implicit solve, 0 leaves it explicit. every > 0
+// exports prefix_00000.ext every that many steps, 0 just the last step to prefix.ext.
+// Paths cannot hold spaces.
+struct SimulationJob
+{
+	uint64_t id;
+	int priority;			// higher first, in the order of submission within a priority
+	RwSceneDesc desc;		// checkpoint and scene point into restore and scene when it runs
+	string restore;
+	string scene;
+	int steps;
+	float deltaTime;
+	string output;
+	int format;				// EXPORT_*
+	int every;
+	string checkpoint;		// saved after the last step, empty for none
+	shared_ptr<JobClient> client;
+};
+
+// Runs scene jobs from local clients on one warm headless context. The solver programs are
+// compiled once and the buffers of finished scenes are reused by the next job of the same
+// capacity. A connection thread accepts clients and queues their jobs by priority, the
+// calling thread runs them one at a time and streams back to the client, one line each:
+//   queued <id> <jobs ahead>      started <id>
+//   progress <id> <step> <steps> <frames>
+//   done <id> <steps> <frames> <ms>      failed <id> <message>      error <message>
+// Besides jobs a client may send status (answered with status <queued> <running id>) and
+// shutdown (answered with bye). Replies never wait for a client, progress lines are left
+// out while it falls behind. The socket is accessible to the server's user alone.
+class JobServer {
+public:
+	JobServer();
+	~JobServer();
+	// Listens on the socket and runs jobs on the calling thread until a client sends
+	// shutdown or stop() is called. Throws runtime_error
+	void run(const string& socketPath);
+	void stop();
+	// false with the reason if the line is no job
+	static bool parseJob(const string& line, SimulationJob& job, string& error);
+
+private:
+	SimulationContext simulation;
+	intptr_t listener;				// socket, a SOCKET on Windows
+	string socketPath;
+	thread connections;
+	mutex lock;
+	condition_variable jobReady;
+	vector<SimulationJob> queue;	// heap, next job in front
+	uint64_t nextId;
+	uint64_t running;				// id of the running job, 0 if none
+	atomic<bool> stopping;
+
+	void listen(const string& path);
+	void serveClients();			// connection thread
+	void handleLine(const shared_ptr<JobClient>& client, const string& line);
+	void runJob(SimulationJob& job);
+};
+
+// Sends a request line and writes the replies to out until the server has answered it
+// completely (done, failed, error, status or bye). Returns false unless it ended with done,
+// status or bye. Throws runtime_error
+bool submitJob(const string& socketPath, const string& request, ostream& out);
+
+#endif // !_JOB_SERVER_HPP
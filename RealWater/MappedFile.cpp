@@ -0,0 +1,190 @@
+#include "MappedFile.hpp"
+#include <stdexcept>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+MappedFile::MappedFile() :
+	base(NULL),
+	length(0),
+#ifdef _WIN32
+	file(INVALID_HANDLE_VALUE),
+	mapping(NULL)
+#else
+	file(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+void MappedFile::open(const string& path)
+{
+	map(path, 0, false, false);
+}
+
+void MappedFile::create(const string& path, size_t size)
+{
+	map(path, size, true, false);
+}
+
+void MappedFile::openShared(const string& name)
+{
+	map(name, 0, false, true);
+}
+
+void MappedFile::createShared(const string& name, size_t size)
+{
+	map(name, size, true, true);
+}
+
+void MappedFile::map(const string& path, size_t size, bool writable, bool shared)
+{
+	close();
+#ifdef _WIN32
+	if (shared)
+	{
+		// Backed by the paging file, the size of an existing mapping is that of its view
+		string mappingName = "Local\\" + path;
+		if (writable)
+		{
+			mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+				(DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xffffffffu), mappingName.c_str());
+			if (mapping && GetLastError() == ERROR_ALREADY_EXISTS)
+			{
+				close();
+				throw runtime_error("Shared memory " + path + " is already in use!");
+			}
+		}
+		else
+			mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, mappingName.c_str());
+		if (!mapping)
+			throw runtime_error("Could not open shared memory " + path + "!");
+		base = (char*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, writable ? size : 0);
+		length = size;
+		if (base && !writable)
+		{
+			MEMORY_BASIC_INFORMATION region;
+			VirtualQuery(base, &region, sizeof(region));
+			length = region.RegionSize;
+		}
+		if (!base)
+		{
+			close();
+			throw runtime_error("Could not map shared memory " + path + "!");
+		}
+		return;
+	}
+	file = CreateFileA(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+		writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		throw runtime_error("Could not open " + path + "!");
+	if (!writable)
+	{
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (size_t)fileSize.QuadPart;
+	}
+	length = size;
+	if (length == 0)
+		return;
+
+	// The mapping of a new file sets its size
+	mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)((unsigned long long)length >> 32), (DWORD)(length & 0xffffffffu), NULL);
+	if (mapping)
+		base = (char*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length);
+#else
+	// Shared memory objects live in their own namespace, their names start with a slash. Like
+	// the Windows mapping a name is created only if it is free, never taken over from a live
+	// ring, so only its creator unlinks it
+	string shmName = path[0] == '/' ? path : "/" + path;
+	if (shared)
+		file = shm_open(shmName.c_str(), writable ? O_RDWR | O_CREAT | O_EXCL : O_RDONLY, 0600);
+	else
+		file = ::open(path.c_str(), writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+	if (file < 0 && shared && writable && errno == EEXIST)
+		throw runtime_error("Shared memory " + path + " is already in use, or left behind by a publisher that did not stop!");
+	if (file < 0)
+		throw runtime_error("Could not open " + path + "!");
+	if (shared && writable)
+		sharedName = shmName;
+	if (writable)
+	{
+		if (ftruncate(file, (off_t)size) != 0)
+		{
+			close();
+			throw runtime_error("Could not resize " + path + "!");
+		}
+	}
+	else
+	{
+		struct stat status;
+		fstat(file, &status);
+		size = (size_t)status.st_size;
+	}
+	length = size;
+	if (length == 0)
+		return;
+
+	void* view = mmap(NULL, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+	base = view == MAP_FAILED ? NULL : (char*)view;
+	if (base && !writable && !shared)
+		madvise(base, length, MADV_SEQUENTIAL);
+#endif
+	if (!base)
+	{
+		close();
+		throw runtime_error("Could not map " + path + "!");
+	}
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (base)
+		munmap(base, length);
+	if (file >= 0)
+		::close(file);
+	if (!sharedName.empty())
+		shm_unlink(sharedName.c_str());
+	file = -1;
+	sharedName.clear();
+#endif
+	base = NULL;
+	length = 0;
+}
+
+char* MappedFile::data()
+{
+	return base;
+}
+
+size_t MappedFile::size()
+{
+	return length;
+}
+
+bool MappedFile::isOpen()
+{
+	return base != NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef _MAPPED_FILE_HPP
+#define _MAPPED_FILE_HPP
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// Whole file mapped into memory, read only or created at a fixed size for writing. The
+// pages are read or written back by the OS on demand, nothing is copied through streams.
+// Named shared memory (POSIX shm or a Windows paging file mapping) is mapped the same way.
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+	void open(const string& path);					// read only, throws runtime_error
+	void create(const string& path, size_t size);	// read write, truncated to size, throws runtime_error
+	void openShared(const string& name);			// named shared memory, read only, throws runtime_error
+	// Named shared memory of size, read write. Throws runtime_error if the name exists. The
+	// name goes away again on close, mappings of other processes stay valid.
+	void createShared(const string& name, size_t size);
+	void close();									// unmaps, written pages go back to the file
+	char* data();
+	size_t size();
+	bool isOpen();
+
+private:
+	char* base;
+	size_t length;
+#ifdef _WIN32
+	void* file;			// HANDLE of the file and of its mapping
+	void* mapping;
+#else
+	int file;
+	string sharedName;	// shm object created here, unlinked on close
+#endif
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+	void map(const string& path, size_t size, bool writable, bool shared);
+};
+
+#endif // !_MAPPED_FILE_HPP
@@ -0,0 +1,398 @@
+#include "Offscreen.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#ifdef _WIN32
+#include <GLFW/glfw3.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+OffscreenContext::OffscreenContext() :
+#ifdef _WIN32
+	window(NULL)
+#else
+	display(EGL_NO_DISPLAY),
+	context(EGL_NO_CONTEXT),
+	surface(EGL_NO_SURFACE)
+#endif
+{
+}
+
+OffscreenContext::~OffscreenContext()
+{
+	destroy();
+}
+
+#ifdef _WIN32
+
+void OffscreenContext::create()
+{
+	destroy();
+	if (!glfwInit())
+		throw runtime_error("failed to init glfw!");
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	window = glfwCreateWindow(16, 16, "Real Water", NULL, NULL);
+	if (!window)
+	{
+		glfwTerminate();
+		throw runtime_error("failed to create window!");
+	}
+	glfwMakeContextCurrent((GLFWwindow*)window);
+}
+
+void OffscreenContext::destroy()
+{
+	if (!window)
+		return;
+	glfwDestroyWindow((GLFWwindow*)window);
+	glfwTerminate();
+	window = NULL;
+}
+
+#else
+
+void OffscreenContext::create()
+{
+	destroy();
+
+	// The surfaceless platform needs neither a GPU nor a display server, the default
+	// display is the fallback of drivers without it
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	EGLDisplay eglDisplay = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : EGL_NO_DISPLAY;
+	EGLint major, minor;
+	if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor))
+	{
+		eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor))
+			throw runtime_error("Could not initialize an EGL display!");
+	}
+	display = eglDisplay;
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		destroy();
+		throw runtime_error("EGL has no desktop OpenGL!");
+	}
+
+	const EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(eglDisplay, configAttributes, &config, 1, &configCount) || configCount == 0)
+	{
+		destroy();
+		throw runtime_error("No EGL config for an OpenGL pbuffer!");
+	}
+
+	// The shaders want 4.6 compatibility, 4.5 is as far as llvmpipe goes and enough for them
+	const EGLint versions[][2] = { { 4, 6 }, { 4, 5 } };
+	for (int v = 0; v < 2 && context == EGL_NO_CONTEXT; v++)
+	{
+		const EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, versions[v][0], EGL_CONTEXT_MINOR_VERSION, versions[v][1],
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, EGL_NONE };
+		context = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+	}
+	if (context == EGL_NO_CONTEXT)
+	{
+		destroy();
+		throw runtime_error("Could not create an OpenGL 4.5 context through EGL!");
+	}
+
+	// Everything is drawn into framebuffer objects, the pbuffer only makes the context current
+	const char* extensions = eglQueryString(eglDisplay, EGL_EXTENSIONS);
+	if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+	{
+		const EGLint pbufferAttributes[] = { EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE };
+		surface = eglCreatePbufferSurface(eglDisplay, config, pbufferAttributes);
+	}
+	if (!eglMakeCurrent(eglDisplay, surface, surface, context))
+	{
+		destroy();
+		throw runtime_error("Could not make the EGL context current!");
+	}
+}
+
+void OffscreenContext::destroy()
+{
+	if (display == EGL_NO_DISPLAY)
+		return;
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (surface != EGL_NO_SURFACE)
+		eglDestroySurface(display, surface);
+	if (context != EGL_NO_CONTEXT)
+		eglDestroyContext(display, context);
+	eglTerminate(display);
+	display = EGL_NO_DISPLAY;
+	context = EGL_NO_CONTEXT;
+	surface = EGL_NO_SURFACE;
+}
+
+#endif
+
+string OffscreenContext::describe()
+{
+	const char* version = (const char*)glGetString(GL_VERSION);
+	const char* renderer = (const char*)glGetString(GL_RENDERER);
+	return string(version ? version : "?") + ", " + (renderer ? renderer : "?");
+}
+
+OffscreenRenderer::OffscreenRenderer() :
+	width(0),
+	height(0),
+	format(OFFSCREEN_PNG),
+	framebuffer(0),
+	color(0),
+	depth(0),
+	next(0),
+	frame(0),
+	created(false),
+	stopping(false),
+	framesWritten(0)
+{
+	for (int i = 0; i < OFFSCREEN_RING; i++)
+	{
+		slots[i].buffer = 0;
+		slots[i].mapped = NULL;
+		slots[i].fence = 0;
+		slots[i].state = SLOT_FREE;
+		slots[i].frame = 0;
+	}
+}
+
+OffscreenRenderer::~OffscreenRenderer()
+{
+	destroy();
+}
+
+void OffscreenRenderer::create(int width, int height, const string& prefix, int format)
+{
+	destroy();
+	this->width = width;
+	this->height = height;
+	this->prefix = prefix;
+	this->format = format;
+
+	glGenRenderbuffers(1, &color);
+	glBindRenderbuffer(GL_RENDERBUFFER, color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glGenRenderbuffers(1, &depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	created = true;
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		destroy();
+		throw runtime_error("The offscreen framebuffer is incomplete!");
+	}
+
+	// RGBA rows as glReadPixels packs them, the writer reads them through the mapping once
+	// the fence behind the readback has passed
+	GLsizeiptr size = (GLsizeiptr)width * height * 4;
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	for (int i = 0; i < OFFSCREEN_RING; i++)
+	{
+		glGenBuffers(1, &slots[i].buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].buffer);
+		glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+		slots[i].mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+		slots[i].fence = 0;
+		slots[i].state = SLOT_FREE;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	next = 0;
+	frame = 0;
+	framesWritten = 0;
+	error.clear();
+	stopping = false;
+	writer = thread(&OffscreenRenderer::writerLoop, this);
+}
+
+void OffscreenRenderer::destroy()
+{
+	if (!created)
+		return;
+	if (writer.joinable())
+	{
+		finish();
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		queueReady.notify_one();
+		writer.join();
+	}
+
+	for (int i = 0; i < OFFSCREEN_RING; i++)
+	{
+		if (!slots[i].buffer)
+			continue;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].buffer);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glDeleteBuffers(1, &slots[i].buffer);
+		slots[i].buffer = 0;
+		slots[i].mapped = NULL;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(1, &color);
+	glDeleteRenderbuffers(1, &depth);
+	framebuffer = color = depth = 0;
+	created = false;
+}
+
+void OffscreenRenderer::begin()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+}
+
+void OffscreenRenderer::end()
+{
+	// The buffer of the frame before last may still be with the writer
+	Slot& slot = slots[next];
+	if (slot.state != SLOT_FREE)
+	{
+		poll(true);
+		unique_lock<mutex> guard(lock);
+		slotFree.wait(guard, [&] { return slot.state == SLOT_FREE; });
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.frame = frame++;
+	slot.state = SLOT_FENCED;
+	next = (next + 1) % OFFSCREEN_RING;
+	poll(false);
+}
+
+void OffscreenRenderer::finish()
+{
+	if (!created)
+		return;
+	poll(true);
+	unique_lock<mutex> guard(lock);
+	slotFree.wait(guard, [&]
+	{
+		for (int i = 0; i < OFFSCREEN_RING; i++)
+			if (slots[i].state != SLOT_FREE)
+				return false;
+		return true;
+	});
+}
+
+size_t OffscreenRenderer::getFramesWritten()
+{
+	return framesWritten;
+}
+
+string OffscreenRenderer::getError()
+{
+	lock_guard<mutex> guard(lock);
+	return error;
+}
+
+void OffscreenRenderer::poll(bool wait)
+{
+	// Oldest first, so the frames reach the writer in order
+	for (int n = 0; n < OFFSCREEN_RING; n++)
+	{
+		Slot& slot = slots[(next + n) % OFFSCREEN_RING];
+		if (slot.state != SLOT_FENCED)
+			continue;
+		if (wait)
+			while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		else
+		{
+			GLenum status = glClientWaitSync(slot.fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				break;
+		}
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		{
+			lock_guard<mutex> guard(lock);
+			slot.state = SLOT_WRITING;
+			queue.push_back((int)(&slot - slots));
+		}
+		queueReady.notify_one();
+	}
+}
+
+void OffscreenRenderer::writerLoop()
+{
+	vector<unsigned char> rgb;
+	while (true)
+	{
+		int index;
+		{
+			unique_lock<mutex> guard(lock);
+			queueReady.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			index = queue.front();
+			queue.pop_front();
+		}
+		writeFrame(slots[index], rgb);
+		{
+			lock_guard<mutex> guard(lock);
+			slots[index].state = SLOT_FREE;
+		}
+		slotFree.notify_all();
+	}
+}
+
+void OffscreenRenderer::writeFrame(Slot& slot, vector<unsigned char>& rgb)
+{
+	// GL rows start at the bottom, the files start at the top
+	rgb.resize((size_t)width * height * 3);
+	for (int y = 0; y < height; y++)
+	{
+		const unsigned char* src = slot.mapped + (size_t)(height - 1 - y) * width * 4;
+		unsigned char* dst = rgb.data() + (size_t)y * width * 3;
+		for (int x = 0; x < width; x++)
+		{
+			dst[3 * x] = src[4 * x];
+			dst[3 * x + 1] = src[4 * x + 1];
+			dst[3 * x + 2] = src[4 * x + 2];
+		}
+	}
+
+	char number[16];
+	snprintf(number, sizeof(number), "_%05d", slot.frame);
+	string path = prefix + number + (format == OFFSCREEN_PNG ? ".png" : ".rgb");
+	// stb encodes into memory, the file is written here so that a full disk is noticed
+	unsigned char* out = rgb.data();
+	int size = (int)rgb.size();
+	if (format == OFFSCREEN_PNG)
+		out = stbi_write_png_to_mem(rgb.data(), width * 3, width, height, 3, &size);
+
+	FILE* file = out ? fopen(path.c_str(), "wb") : NULL;
+	bool written = file && fwrite(out, 1, size, file) == (size_t)size;
+	if (file && fclose(file) != 0)
+		written = false;
+	if (format == OFFSCREEN_PNG)
+		STBIW_FREE(out);
+	if (written)
+	{
+		framesWritten++;
+		return;
+	}
+	lock_guard<mutex> guard(lock);
+	if (error.empty())
+		error = "Could not write " + path + "!";
+}
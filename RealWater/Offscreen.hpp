@@ -0,0 +1,96 @@
+#ifndef _OFFSCREEN_HPP
+#define _OFFSCREEN_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <GL/glew.h>
+
+using namespace std;
+
+// Frame files of the offscreen renderer, rows top down and 8 bit RGB
+const int OFFSCREEN_PNG = 0;		// prefix_00000.png
+const int OFFSCREEN_RAW = 1;		// prefix_00000.rgb, bare pixels for ffmpeg -f rawvideo -pix_fmt rgb24
+const int OFFSCREEN_RING = 3;		// pixel buffers in flight
+
+// GL context without a window. EGL on a surfaceless display, or a pbuffer if the driver has
+// no surfaceless contexts, so it comes up on hosts without a GPU or a display (Mesa
+// llvmpipe). Windows has no EGL, a hidden GLFW window stands in there.
+class OffscreenContext {
+public:
+	OffscreenContext();
+	~OffscreenContext();
+	void create();				// current on the calling thread, throws runtime_error
+	void destroy();
+	string describe();			// version and renderer of the context
+
+private:
+#ifdef _WIN32
+	void* window;				// GLFWwindow
+#else
+	void* display;				// EGLDisplay, EGLContext and EGLSurface
+	void* context;
+	void* surface;
+#endif
+};
+
+// Renders frames into a framebuffer object and reads them back through a ring of
+// persistently mapped pixel buffers. The readback of a frame is only fenced, the next
+// frames render while it completes, and a worker thread writes the files from the mapped
+// buffers. Every frame is written: with all buffers in flight end() waits for the oldest.
+class OffscreenRenderer {
+public:
+	OffscreenRenderer();
+	~OffscreenRenderer();
+	void create(int width, int height, const string& prefix, int format);	// throws runtime_error
+	void destroy();				// waits for the frames in flight
+	void begin();				// the framebuffer object takes the drawing
+	void end();					// readback of the frame, back to the default framebuffer
+	void finish();				// waits until every frame is written
+	size_t getFramesWritten();
+	string getError();			// first write error, empty if none
+
+private:
+	// Free, read back on the GPU, with the writer
+	enum { SLOT_FREE, SLOT_FENCED, SLOT_WRITING };
+
+	struct Slot
+	{
+		GLuint buffer;
+		unsigned char* mapped;
+		GLsync fence;
+		atomic<int> state;
+		int frame;
+	};
+
+	int width;
+	int height;
+	string prefix;
+	int format;
+	GLuint framebuffer;
+	GLuint color;
+	GLuint depth;
+	Slot slots[OFFSCREEN_RING];
+	int next;
+	int frame;
+	bool created;
+
+	thread writer;
+	mutex lock;
+	condition_variable queueReady;
+	condition_variable slotFree;
+	deque<int> queue;
+	bool stopping;
+	atomic<size_t> framesWritten;
+	string error;
+
+	void poll(bool wait);		// readbacks whose fence passed go to the writer, oldest first
+	void writerLoop();
+	void writeFrame(Slot& slot, vector<unsigned char>& rgb);
+};
+
+#endif // !_OFFSCREEN_HPP
@@ -1,7 +1,19 @@
 #include "ParticleManager.hpp"
+#include "CpuSolver.hpp"
+#include "Checkpoint.hpp"
+#include "Recorder.hpp"
+#include "Exporter.hpp"
+#include "Importer.hpp"
 #include "glm/glm.hpp";
 #include <random>
 #include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <map>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+#include <glm/gtc/constants.hpp>
 
 mt19937 rng;
 uniform_real_distribution<float> noise;
@@ -14,13 +26,105 @@ float random(float min, float max)
 	return noise(rng);
 }
 
-ParticleManager::ParticleManager(unsigned int particleNum, int mode, GLuint shader, GLuint computeShader) : 
+ParticleManager::ParticleManager(unsigned int particleNum, int mode, GLuint shader, GLuint computeShader, GPUPrimitives* primitives,
+	Checkpoint* checkpoint, SceneImport* scene) : 
 	particleNum(particleNum), 
+	collider(vec3(-BOUNDING_MAX_X, FLOOR_Y, -BOUNDING_MAX_Z) - COLLIDER_MARGIN,
+		vec3(BOUNDING_MAX_X, COLLIDER_TOP_Y, BOUNDING_MAX_Z) + COLLIDER_MARGIN, COLLIDER_CELL_SIZE),
 	mode(mode),
+	boundingZ(BOUNDING_DEFAULT),
+	boundingX(BOUNDING_DEFAULT),
+	implicitViscosity(false),
+	viscosityIterations(VISCOSITY_CG_ITERATIONS),
+	useBoundary(false),
+	boundaryDirty(true),
+	boundarySettleStep(0),
+	boundaryNum(0),
+	boundaryCellMin(0),
+	boundaryCellDims(0),
+	useSleeping(false),
+	backend(BACKEND_GPU),
+	cpuSolver(NULL),
+	stepCounter(0),
+	recorder(NULL),
+	publisher(NULL),
+	stepCost(0.f),
+	stepQueryPending(false),
+	VAO(0),
 	shader(shader), 
-	computeShader(computeShader)
+	primitives(primitives),
+	computeShader(computeShader),
+	particleSSBO(0),
+	viscositySSBO(0),
+	reductionSSBO(0),
+	boundarySSBO(0),
+	boundaryCellsSSBO(0),
+	ringSSBO(0),
+	activitySSBO(0),
+	activeListSSBO(0),
+	countersSSBO(0),
+	gridCellsSSBO(0),
+	gridSSBO(0),
+	gridParticleSSBO(0),
+	gridBrickCapacity(0),
+	gridOrderSSBO(0),
+	gridReadbackBuffer(0),
+	gridFence(0),
+	incrementalGrid(false),
+	gridHeader(),
+	gridCost(0.f),
+	particleScratchSSBO(0),
+	activityScratchSSBO(0),
+	stepQuery(0),
+	gridQueries(),
+	gridQueryPending(false)
 {
-	init(mode);
+	load(checkpoint, scene);
+}
+
+void ParticleManager::reset(int mode, Checkpoint* checkpoint, SceneImport* scene)
+{
+	// Settings of a new manager, the buffers of the capacity stay
+	if (cpuSolver) { delete cpuSolver; cpuSolver = NULL; }
+	cpuParticles.clear();
+	this->mode = mode;
+	boundingZ = BOUNDING_DEFAULT;
+	boundingX = BOUNDING_DEFAULT;
+	implicitViscosity = false;
+	viscosityIterations = VISCOSITY_CG_ITERATIONS;
+	useBoundary = false;
+	boundaryDirty = true;
+	boundarySettleStep = 0;
+	boundaryNum = 0;
+	boundaryCellMin = ivec3(0);
+	boundaryCellDims = ivec3(0);
+	useSleeping = false;
+	backend = BACKEND_GPU;
+	stepCounter = 0;
+	recorder = NULL;
+	publisher = NULL;
+	stepCost = 0.f;
+	stepQueryPending = false;
+	if (gridFence) { glDeleteSync(gridFence); gridFence = 0; }
+	incrementalGrid = false;
+	gridHeader = GridHeader();
+	gridCost = 0.f;
+	gridQueryPending = false;
+	emitters.clear();
+	killPlanes.clear();
+	sinks.clear();
+	collider.clearObstacles();
+	load(checkpoint, scene);
+}
+
+void ParticleManager::load(Checkpoint* checkpoint, SceneImport* scene)
+{
+	if (checkpoint)
+		restore(*checkpoint);
+	else if (scene)
+		importScene(*scene);
+	else
+		init(mode);
 }
 
 void ParticleManager::init(int particleGenMode)
@@ -158,21 +262,124 @@ void ParticleManager::init(int particleGenMode)
 
 		break;
 	}
+
+	case 5:
+	{
+		// Pour: starts empty, a nozzle above the tank fills the preallocated buffer over time
+		addEmitter(EMITTER_NOZZLE, vec3(-1.f, 2.f, 0.f), vec3(0.3f, -1.f, 0.f), vec3(4 * RADIUS), 2.f, EMITTER_DEFAULT_RATE);
+		break;
+	}
 		
 	default:
 		break;
 	}
 
-	// Generate SSBO
-	glGenBuffers(1, &particleSSBO);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, particleNum * sizeof(Particle), particles.data(), GL_STATIC_DRAW);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
+	initBuffers(particles.data(), (GLuint)particles.size(), NULL, (GLuint)particles.size(), NULL);
 	//delete particles;
 	particles.clear();
+}
+
+// Storage for the capacity on the first call. A reset of the manager keeps it and only
+// uploads the data, leaves the buffer bound for uploads behind the call
+static void reserveBuffer(GLuint& buffer, GLsizeiptr bytes, const void* data, GLenum usage)
+{
+	bool created = buffer == 0;
+	if (created)
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	if (created)
+		glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, data, usage);
+	else if (data)
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, data);
+}
+
+void ParticleManager::initBuffers(const Particle* particles, GLuint liveCount, const GLuint* sleepSteps, GLuint emitHead, const GLuint* ring)
+{
+	// Generate SSBO
+	reserveBuffer(particleSSBO, particleNum * sizeof(Particle), NULL, GL_STATIC_DRAW);
+	if (liveCount && particles)
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, liveCount * sizeof(Particle), particles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
+
+	// Implicit viscosity CG vectors and reduction scratch
+	GLuint groups = (particleNum + WORK_GROUP_SIZE - 1) / WORK_GROUP_SIZE;
+	reserveBuffer(viscositySSBO, particleNum * sizeof(ViscositySolve), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, viscositySSBO);
+
+	vector<char> reduction(sizeof(ReductionHeader) + groups * sizeof(vec4), 0);
+	reserveBuffer(reductionSSBO, reduction.size(), reduction.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, reductionSSBO);
+
+	if (!boundarySSBO)
+		glGenBuffers(1, &boundarySSBO);
+	if (!boundaryCellsSSBO)
+		glGenBuffers(1, &boundaryCellsSSBO);
+
+	// Sleep counters start awake unless restored, the active list is rebuilt each step
+	vector<GLuint> awake(particleNum, 0);
+	reserveBuffer(activitySSBO, particleNum * sizeof(GLuint), awake.data(), GL_DYNAMIC_COPY);
+	if (sleepSteps && liveCount)
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, liveCount * sizeof(GLuint), sleepSteps);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, activitySSBO);
+
+	reserveBuffer(activeListSSBO, sizeof(ActiveListHeader) + particleNum * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, activeListSSBO);
+
+	// Live count, every generated particle starts alive
+	SimulationCounters counters = { (liveCount + WORK_GROUP_SIZE - 1) / WORK_GROUP_SIZE, 1, 1, liveCount, liveCount, 1, 0, 0, emitHead, { 0, 0, 0 } };
+	reserveBuffer(countersSSBO, sizeof(SimulationCounters), &counters, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, countersSSBO);
+
+	// Emitter ring, without saved positions the particles are as old as their slots say and
+	// the last one is the newest
+	vector<GLuint> ringSlots(particleNum, RING_EMPTY);
+	for (GLuint i = 0; i < liveCount; i++)
+		ringSlots[ring ? ring[i] : (emitHead - liveCount + i) % particleNum] = i;
+	reserveBuffer(ringSSBO, particleNum * sizeof(GLuint), ringSlots.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, ringSSBO);
+
+	// Sparse block grid. At worst every particle has a brick of its own, so the table (at
+	// most half full) is sized by the capacity and never by the domain. The cells start with
+	// a brick per 8 particles and follow the bricks the steps allocate
+	resizeGridCells(liveCount / 8);
+	if (!gridReadbackBuffer)
+	{
+		glGenBuffers(1, &gridReadbackBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, gridReadbackBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GridHeader), NULL, GL_STREAM_READ);
+	}
+
+	gridTableSize = WORK_GROUP_SIZE;
+	while (gridTableSize < 2 * (GLuint)particleNum)
+		gridTableSize *= 2;
+	vector<char> grid(sizeof(GridHeader) + 2 * gridTableSize * sizeof(GLuint), 0);
+	reserveBuffer(gridSSBO, grid.size(), grid.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, gridSSBO);
+
+	// No slot has a cell of a last reorder yet, so that the first step reorders
+	vector<uvec4> gridParticles(particleNum, uvec4(RING_EMPTY));
+	reserveBuffer(gridParticleSSBO, particleNum * sizeof(uvec4), gridParticles.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, gridParticleSSBO);
+
+	reserveBuffer(gridOrderSSBO, particleNum * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, gridOrderSSBO);
+
+	// Reorder scratch, sized for the full capacity
+
+	reserveBuffer(particleScratchSSBO, particleNum * sizeof(Particle), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, particleScratchSSBO);
+
+	reserveBuffer(activityScratchSSBO, particleNum * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, activityScratchSSBO);
+
+	if (!stepQuery)
+		glGenQueries(1, &stepQuery);
+	if (!gridQueries[0])
+		glGenQueries(2, gridQueries);
 
 	// Bind Vertex Array Object
-	glGenVertexArrays(1, &VAO);
+	if (!VAO)
+		glGenVertexArrays(1, &VAO);
 	glBindVertexArray(VAO);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, particleSSBO);
 	glBindBuffer(GL_ARRAY_BUFFER, particleSSBO);
@@ -200,10 +407,38 @@ void ParticleManager::init(int particleGenMode)
 	uniDeltaTime = glGetUniformLocation(computeShader, "delta_time");
 	uniParticleNum = glGetUniformLocation(computeShader, "N");
 	uniPass = glGetUniformLocation(computeShader, "pass");
-	uniBoundingX = glGetUniformLocation(computeShader, "bounding_x");
-	uniBoundingZ = glGetUniformLocation(computeShader, "bounding_z");
+	uniColliderSDF = glGetUniformLocation(computeShader, "collider_sdf");
+	uniColliderMin = glGetUniformLocation(computeShader, "collider_min");
+	uniColliderMax = glGetUniformLocation(computeShader, "collider_max");
+	uniContainerMin = glGetUniformLocation(computeShader, "container_min");
+	uniContainerMax = glGetUniformLocation(computeShader, "container_max");
+	uniImplicitViscosity = glGetUniformLocation(computeShader, "implicit_viscosity");
+	uniBoundaryNum = glGetUniformLocation(computeShader, "boundary_num");
+	uniBoundaryCellMin = glGetUniformLocation(computeShader, "boundary_cell_min");
+	uniBoundaryCellDims = glGetUniformLocation(computeShader, "boundary_cell_dims");
+	uniUseActiveList = glGetUniformLocation(computeShader, "use_active_list");
+	uniGridTableSize = glGetUniformLocation(computeShader, "grid_table_size");
+	uniGridBrickCapacity = glGetUniformLocation(computeShader, "grid_brick_capacity");
+	uniGridIncremental = glGetUniformLocation(computeShader, "grid_incremental");
+	uniEmitType = glGetUniformLocation(computeShader, "emit_type");
+	uniEmitCount = glGetUniformLocation(computeShader, "emit_count");
+	uniEmitSeed = glGetUniformLocation(computeShader, "emit_seed");
+	uniEmitPosition = glGetUniformLocation(computeShader, "emit_position");
+	uniEmitDirection = glGetUniformLocation(computeShader, "emit_direction");
+	uniEmitSize = glGetUniformLocation(computeShader, "emit_size");
+	uniEmitSpeed = glGetUniformLocation(computeShader, "emit_speed");
+	uniKillPlaneNum = glGetUniformLocation(computeShader, "kill_plane_num");
+	uniKillPlanes = glGetUniformLocation(computeShader, "kill_planes");
+	uniSinkNum = glGetUniformLocation(computeShader, "sink_num");
+	uniSinkMin = glGetUniformLocation(computeShader, "sink_min");
+	uniSinkMax = glGetUniformLocation(computeShader, "sink_max");
+	uniRecordAttributes = glGetUniformLocation(computeShader, "record_attributes");
+	uniRecordStep = glGetUniformLocation(computeShader, "record_step");
 	glUseProgram(0);
 
+	// Open tank, the floor and walls replace the old box clamp
+	collider.setContainer(vec3(-boundingX, FLOOR_Y, -boundingZ), vec3(boundingX, COLLIDER_TOP_Y, boundingZ), true);
+
 	assert(glGetError() == GL_NO_ERROR);
 
 }
@@ -218,64 +453,473 @@ void ParticleManager::initDraw()
 
 	glBindVertexArray(VAO);
 	glUseProgram(shader);
-	glDrawArrays(GL_POINTS, 0, particleNum);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, countersSSBO);
+	glDrawArraysIndirect(GL_POINTS, (void*)offsetof(SimulationCounters, drawCount));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 	glBindVertexArray(0);
 }
 
 void ParticleManager::update(float deltaTime)
 {
-	if (!shader)
+	step(deltaTime);
+	initDraw();
+}
+
+void ParticleManager::step(float deltaTime)
+{
+	bindBuffers();
+	if (backend == BACKEND_CPU)
 	{
-		cout << "shader can not be empty!" << endl;
+		updateCpu(deltaTime);
+		recordFrame(recorder);
+		recordFrame(publisher);
 		return;
 	}
 
+	// Collect the timing of an earlier step without stalling
+	if (stepQueryPending)
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(stepQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(stepQuery, GL_QUERY_RESULT, &elapsed);
+			stepCost = elapsed / 1e6f;
+			stepQueryPending = false;
+		}
+	}
+	bool measure = !stepQueryPending;
+	if (measure)
+		glBeginQuery(GL_TIME_ELAPSED, stepQuery);
+
+	// Rebakes only after the obstacles changed. The walls are resampled once the container
+	// size held still, meanwhile only the container walls of pass 3 hold the fluid
+	collider.bake();
+	collider.bind(COLLIDER_TEXTURE_UNIT);
+	if (useBoundary && boundaryDirty && stepCounter >= boundarySettleStep)
+		initBoundary();
+	vec3 containerMin, containerMax;
+	collider.getContainer(containerMin, containerMax);
+
 	glBindVertexArray(VAO);
 
-	// pass 1
 	glUseProgram(computeShader);
 	glUniform1i(uniParticleNum, particleNum);
 	glUniform1f(uniDeltaTime, deltaTime);
-	glUniform1f(uniBoundingX, boundingX);
-	glUniform1f(uniBoundingZ, boundingZ);
-	int pass_loc = glGetUniformLocation(computeShader, "pass");
-	glUniform1i(pass_loc, 1);
-	glDispatchCompute(particleNum / WORK_GROUP_SIZE, 1, 1);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glUniform1i(uniImplicitViscosity, implicitViscosity);
+	glUniform1i(uniBoundaryNum, useBoundary && !boundaryDirty ? boundaryNum : 0);
+	glUniform3iv(uniBoundaryCellMin, 1, &boundaryCellMin[0]);
+	glUniform3iv(uniBoundaryCellDims, 1, &boundaryCellDims[0]);
+	glUniform1i(uniColliderSDF, COLLIDER_TEXTURE_UNIT);
+	glUniform3fv(uniColliderMin, 1, &collider.domainMin[0]);
+	glUniform3fv(uniColliderMax, 1, &collider.domainMax[0]);
+	glUniform3fv(uniContainerMin, 1, &containerMin[0]);
+	glUniform3fv(uniContainerMax, 1, &containerMax[0]);
+	glUniform1i(uniUseActiveList, false);
+	glUniform1i(uniGridTableSize, gridTableSize);
+
+	// new particles extend and removed particles shrink the live count, then dispatch
+	// and draw sizes follow it; the neighbor grid lists the survivors by cell
+	emit(deltaTime);
+	updateCounters();
+	buildGrid();
+	stepCounter++;
+
+	// sleeping particles are skipped by pass 1 to 3
+	if (useSleeping)
+		compactActive();
+
+	// pass 1: density and pressure
+	dispatchActivePass(1, GL_SHADER_STORAGE_BARRIER_BIT);
 	/*Particle* particles = (Particle*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, N, GL_MAP_READ_BIT);
 	cout << particles[0].factor.x << endl;
 	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);*/
 
+	// pass 2: acceleration and velocity
+	dispatchActivePass(2, GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+	// implicit viscosity on the velocity of pass 2, over all particles
+	if (implicitViscosity)
+		solveViscosity();
+
+	// pass 3: integration and bounding
+	dispatchActivePass(3, GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+	if (measure)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		stepQueryPending = true;
+	}
+
+	recordFrame(recorder);
+	recordFrame(publisher);
+
+	glBindVertexArray(0);
+
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void ParticleManager::bindBuffers()
+{
+	// The binding points belong to the context, another manager on it may have taken them
+	GLuint buffers[] = { particleSSBO, viscositySSBO, reductionSSBO, 0, activitySSBO, activeListSSBO, countersSSBO,
+		gridCellsSSBO, gridSSBO, particleScratchSSBO, activityScratchSSBO, gridParticleSSBO };
+	for (GLuint binding = 0; binding < sizeof(buffers) / sizeof(buffers[0]); binding++)
+		if (buffers[binding])
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffers[binding]);
+	if (ringSSBO)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, ringSSBO);
+	if (gridOrderSSBO)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, gridOrderSSBO);
+	if (useBoundary && !boundaryDirty)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, boundarySSBO);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, boundaryCellsSSBO);
+	}
+}
+
+void ParticleManager::initBoundary()
+{
+	// Sample the floor and the four walls of the container on a regular lattice
+	vector<BoundaryParticle> boundary;
+	int nx = (int)glm::round(2.f * boundingX / BOUNDARY_SPACING);
+	int ny = (int)glm::round((BOUNDARY_TOP_Y - FLOOR_Y) / BOUNDARY_SPACING);
+	int nz = (int)glm::round(2.f * boundingZ / BOUNDARY_SPACING);
+	float dx = 2.f * boundingX / nx;
+	float dz = 2.f * boundingZ / nz;
+	for (int i = 0; i <= nx; i++)
+	{
+		for (int k = 0; k <= nz; k++)
+		{
+			BoundaryParticle b;
+			b.pos = vec4(-boundingX + dx * i, FLOOR_Y, -boundingZ + dz * k, 0.f);
+			boundary.push_back(b);
+		}
+	}
+	for (int j = 1; j <= ny; j++)
+	{
+		float y = FLOOR_Y + BOUNDARY_SPACING * j;
+		for (int i = 0; i <= nx; i++)
+		{
+			BoundaryParticle b;
+			b.pos = vec4(-boundingX + dx * i, y, -boundingZ, 0.f);
+			boundary.push_back(b);
+			b.pos = vec4(-boundingX + dx * i, y, boundingZ, 0.f);
+			boundary.push_back(b);
+		}
+		for (int k = 1; k < nz; k++)
+		{
+			BoundaryParticle b;
+			b.pos = vec4(-boundingX, y, -boundingZ + dz * k, 0.f);
+			boundary.push_back(b);
+			b.pos = vec4(boundingX, y, -boundingZ + dz * k, 0.f);
+			boundary.push_back(b);
+		}
+	}
+
+	// Volume V_b = 1 / sum_k W(x_b - x_k) over the boundary samples, binned by cell of size h
+	map<ivec3, vector<int>, bool(*)(const ivec3&, const ivec3&)> cells(
+		[](const ivec3& a, const ivec3& b) { return a.x != b.x ? a.x < b.x : a.y != b.y ? a.y < b.y : a.z < b.z; });
+	for (int b = 0; b < (int)boundary.size(); b++)
+		cells[ivec3(glm::floor(vec3(boundary[b].pos) / CORE_RADIUS))].push_back(b);
+
+	float poly6 = 315.f / (64.f * glm::pi<float>() * glm::pow(CORE_RADIUS, 9.f));
+	for (int b = 0; b < (int)boundary.size(); b++)
+	{
+		vec3 pos = vec3(boundary[b].pos);
+		ivec3 cell = ivec3(glm::floor(pos / CORE_RADIUS));
+		float kernelSum = 0.f;
+		for (int x = -1; x <= 1; x++)
+		{
+			for (int y = -1; y <= 1; y++)
+			{
+				for (int z = -1; z <= 1; z++)
+				{
+					auto it = cells.find(cell + ivec3(x, y, z));
+					if (it == cells.end())
+						continue;
+					for (auto k = it->second.begin(); k != it->second.end(); ++k)
+					{
+						float r2 = glm::dot(pos - vec3(boundary[*k].pos), pos - vec3(boundary[*k].pos));
+						if (r2 < CORE_RADIUS * CORE_RADIUS)
+							kernelSum += poly6 * glm::pow(CORE_RADIUS * CORE_RADIUS - r2, 3.f);
+					}
+				}
+			}
+		}
+		boundary[b].pos.w = REST_DENSITY / kernelSum;
+	}
+
+	// Counting sort by the cells of the neighbor grid, passes 1 and 2 gather the walls through
+	// the 27 cells around a particle like the fluid. The walls span a few thousand cells at
+	// most, the table covers their bounding box densely
+	vector<GLuint> sampleCells(boundary.size());
+	ivec3 cellMax = ivec3(INT_MIN);
+	boundaryCellMin = ivec3(INT_MAX);
+	for (size_t b = 0; b < boundary.size(); b++)
+	{
+		ivec3 cell = ivec3(glm::floor(vec3(boundary[b].pos) / CORE_RADIUS));
+		boundaryCellMin = glm::min(boundaryCellMin, cell);
+		cellMax = glm::max(cellMax, cell);
+	}
+	boundaryCellDims = cellMax - boundaryCellMin + 1;
+	vector<GLuint> cellStart((size_t)boundaryCellDims.x * boundaryCellDims.y * boundaryCellDims.z + 1, 0);
+	for (size_t b = 0; b < boundary.size(); b++)
+	{
+		ivec3 local = ivec3(glm::floor(vec3(boundary[b].pos) / CORE_RADIUS)) - boundaryCellMin;
+		sampleCells[b] = (local.z * boundaryCellDims.y + local.y) * boundaryCellDims.x + local.x;
+		cellStart[sampleCells[b] + 1]++;
+	}
+	for (size_t c = 1; c < cellStart.size(); c++)
+		cellStart[c] += cellStart[c - 1];
+	vector<BoundaryParticle> sorted(boundary.size());
+	vector<GLuint> next(cellStart.begin(), cellStart.end() - 1);
+	for (size_t b = 0; b < boundary.size(); b++)
+		sorted[next[sampleCells[b]]++] = boundary[b];
+
+	boundaryNum = (int)sorted.size();
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundarySSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sorted.size() * sizeof(BoundaryParticle), sorted.data(), GL_STATIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, boundarySSBO);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundaryCellsSSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, cellStart.size() * sizeof(GLuint), cellStart.data(), GL_STATIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, boundaryCellsSSBO);
+	boundaryDirty = false;
+}
+
+void ParticleManager::setRecorder(Recorder* recorder)
+{
+	this->recorder = recorder;
+}
+
+void ParticleManager::setPublisher(Recorder* publisher)
+{
+	this->publisher = publisher;
+}
+
+void ParticleManager::recordFrame(Recorder* target)
+{
+	if (!target || !target->isRecording())
+		return;
+
+	// Earlier frames whose fence passed go to the writer, then this one is packed into a
+	// free staging buffer or dropped if all of them are still in flight
+	target->poll();
+	GLuint staging = target->acquire();
+	if (!staging)
+		return;
 
-	//pass 2
 	glUseProgram(computeShader);
 	glUniform1i(uniParticleNum, particleNum);
-	glUniform1f(uniDeltaTime, deltaTime);
-	glUniform1f(uniBoundingX, boundingX);
-	glUniform1f(uniBoundingZ, boundingZ);
-	pass_loc = glGetUniformLocation(computeShader, "pass");
-	glUniform1i(pass_loc, 2);
-	glDispatchCompute(particleNum / WORK_GROUP_SIZE, 1, 1);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
-
-	//pass 3
+	glUniform1i(uniRecordAttributes, target->getAttributes());
+	glUniform1ui(uniRecordStep, stepCounter);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, staging);
+	dispatchPass(23, (particleNum + WORK_GROUP_SIZE - 1) / WORK_GROUP_SIZE, GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+	target->submit();
+}
+
+void ParticleManager::dispatchPass(int pass, GLuint groups, GLbitfield barriers)
+{
+	glUniform1i(uniPass, pass);
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(barriers);
+}
+
+void ParticleManager::dispatchActivePass(int pass, GLbitfield barriers)
+{
+	if (!useSleeping)
+	{
+		dispatchLivePass(pass, barriers);
+		return;
+	}
+
+	glUniform1i(uniPass, pass);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, activeListSSBO);
+	glDispatchComputeIndirect(0);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+	glMemoryBarrier(barriers);
+}
+
+void ParticleManager::dispatchLivePass(int pass, GLbitfield barriers)
+{
+	glUniform1i(uniPass, pass);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, countersSSBO);
+	glDispatchComputeIndirect(0);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+	glMemoryBarrier(barriers);
+}
+
+void ParticleManager::updateCounters()
+{
+	// Derive the indirect arguments after a pass changed the live count
+	dispatchPass(13, 1, GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+void ParticleManager::emit(float deltaTime)
+{
+	for (auto it = emitters.begin(); it != emitters.end(); ++it)
+	{
+		if (!it->enabled)
+			continue;
+
+		// Whole particles this step, the fraction is kept for the next one
+		it->pending += it->rate * deltaTime;
+		// More than the capacity in one step would recycle a ring position twice
+		GLuint count = (GLuint)it->pending;
+		it->pending -= count;
+		count = glm::min(count, (GLuint)particleNum);
+		if (count == 0)
+			continue;
+
+		glUniform1i(uniEmitType, it->type);
+		glUniform1ui(uniEmitCount, count);
+		glUniform1ui(uniEmitSeed, stepCounter * 2654435761u + (GLuint)(it - emitters.begin()));
+		glUniform3fv(uniEmitPosition, 1, &it->position[0]);
+		glUniform3fv(uniEmitDirection, 1, &it->direction[0]);
+		glUniform3fv(uniEmitSize, 1, &it->size[0]);
+		glUniform1f(uniEmitSpeed, it->speed);
+		dispatchPass(14, (count + WORK_GROUP_SIZE - 1) / WORK_GROUP_SIZE, GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+}
+
+// The cell ranges are rebuilt every step. The particles themselves are reordered by cell,
+// which also compacts the removed ones away, every step or in incremental mode only once
+// removed particles or more than GPU_GRID_MOVED_FRACTION out of their cell call for it
+void ParticleManager::buildGrid()
+{
+	readGridCost();
+	bool measure = !gridQueryPending;
+	if (measure)
+		glQueryCounter(gridQueries[0], GL_TIMESTAMP);
+
+	int killPlaneNum = glm::min((int)killPlanes.size(), MAX_KILL_PLANES);
+	int sinkNum = glm::min((int)sinks.size(), MAX_SINKS);
+	vec3 sinkMin[MAX_SINKS], sinkMax[MAX_SINKS];
+	for (int k = 0; k < sinkNum; k++)
+	{
+		sinkMin[k] = sinks[k].minCorner;
+		sinkMax[k] = sinks[k].maxCorner;
+	}
+	glUniform1i(uniKillPlaneNum, killPlaneNum);
+	if (killPlaneNum)
+		glUniform4fv(uniKillPlanes, killPlaneNum, &killPlanes[0][0]);
+	glUniform1i(uniSinkNum, sinkNum);
+	if (sinkNum)
+	{
+		glUniform3fv(uniSinkMin, sinkNum, &sinkMin[0][0]);
+		glUniform3fv(uniSinkMax, sinkNum, &sinkMax[0][0]);
+	}
+
+	// Allocate the bricks of the surviving particles through the hashed table and count
+	// the particles of their cells (all on the GPU)
+	fitGridCells();
+	glUniform1ui(uniGridBrickCapacity, gridBrickCapacity);
+	glUniform1i(uniGridIncremental, incrementalGrid);
+	GLuint tableGroups = gridTableSize / WORK_GROUP_SIZE;
+	dispatchPass(18, tableGroups, GL_SHADER_STORAGE_BARRIER_BIT);
+	dispatchLivePass(19, GL_SHADER_STORAGE_BARRIER_BIT);
+	dispatchPass(20, tableGroups, GL_SHADER_STORAGE_BARRIER_BIT);
+	dispatchLivePass(21, GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// Counts to cell starts over the allocated cells only, then scatter by cell
+	GPUCount cellTotal = { gridSSBO, offsetof(GridHeader, cellTotal) };
+	primitives->scanExclusive(gridCellsSSBO, gridBrickCapacity * GRID_BRICK * GRID_BRICK * GRID_BRICK + 1, &cellTotal);
 	glUseProgram(computeShader);
-	glUniform1i(uniParticleNum, particleNum);
-	glUniform1f(uniDeltaTime, deltaTime);
-	glUniform1f(uniBoundingX, boundingX);
-	glUniform1f(uniBoundingZ, boundingZ);
-	pass_loc = glGetUniformLocation(computeShader, "pass");
-	glUniform1i(pass_loc, 3);
-	glDispatchCompute(particleNum / WORK_GROUP_SIZE, 1, 1);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
-
-	// draw the particle display shader
-	glUseProgram(shader);
-	glDrawArrays(GL_POINTS, 0, particleNum);
+	dispatchLivePass(22, GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	dispatchPass(24, (particleNum + WORK_GROUP_SIZE - 1) / WORK_GROUP_SIZE, GL_SHADER_STORAGE_BARRIER_BIT);
 
-	glBindVertexArray(0);
+	// The survivor total becomes the live count, the ring head keeps counting emissions
+	primitives->copyScanTotal(countersSSBO, offsetof(SimulationCounters, liveCount));
+	updateCounters();
+	dispatchLivePass(17, GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	if (measure)
+	{
+		glQueryCounter(gridQueries[1], GL_TIMESTAMP);
+		gridQueryPending = true;
+	}
 
-	assert(glGetError() == GL_NO_ERROR);
+	// The bricks of this step size the pool of a later one, copied aside as the next steps
+	// overwrite them
+	if (!gridFence)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, gridSSBO);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, gridReadbackBuffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GridHeader));
+		gridFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
+
+void ParticleManager::resizeGridCells(GLuint bricks)
+{
+	bricks = glm::min(glm::max(bricks, (GLuint)GRID_MIN_BRICKS), (GLuint)particleNum);
+	if (gridCellsSSBO && bricks == gridBrickCapacity)
+		return;
+	if (!gridCellsSSBO)
+		glGenBuffers(1, &gridCellsSSBO);
+	gridBrickCapacity = bricks;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gridCellsSSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, ((size_t)bricks * GRID_BRICK * GRID_BRICK * GRID_BRICK + 1) * sizeof(GLuint), NULL,
+		GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, gridCellsSSBO);
+}
+
+void ParticleManager::fitGridCells()
+{
+	if (!gridFence || glClientWaitSync(gridFence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		return;
+	glDeleteSync(gridFence);
+	gridFence = 0;
+
+	// Twice the bricks once they fill more than 3/4 of the pool, overflowed bricks shared
+	// the overflow cell meanwhile, or less than 1/4 of it
+	glBindBuffer(GL_COPY_READ_BUFFER, gridReadbackBuffer);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GridHeader), &gridHeader);
+	if (4 * gridHeader.brickCount > 3 * gridBrickCapacity || 4 * gridHeader.brickCount < gridBrickCapacity)
+		resizeGridCells(2 * gridHeader.brickCount);
+}
+
+void ParticleManager::readGridCost()
+{
+	if (!gridQueryPending)
+		return;
+	GLint available = 0;
+	glGetQueryObjectiv(gridQueries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+	GLuint64 start = 0, end = 0;
+	glGetQueryObjectui64v(gridQueries[0], GL_QUERY_RESULT, &start);
+	glGetQueryObjectui64v(gridQueries[1], GL_QUERY_RESULT, &end);
+	gridCost = (end - start) / 1e6f;
+	gridQueryPending = false;
+}
+
+void ParticleManager::compactActive()
+{
+	// Reset the awake count on the GPU, no readback involved
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, activeListSSBO);
+	glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, offsetof(ActiveListHeader, activeCount), sizeof(GLuint),
+		GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	dispatchLivePass(11, GL_SHADER_STORAGE_BARRIER_BIT);
+	dispatchPass(12, 1, GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+	glUniform1i(uniUseActiveList, true);
+}
+
+void ParticleManager::solveViscosity()
+{
+	// Matrix free conjugate gradient, the scalars never leave the GPU
+	dispatchLivePass(4, GL_SHADER_STORAGE_BARRIER_BIT);
+	dispatchPass(5, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+	for (int k = 0; k < viscosityIterations; k++)
+	{
+		dispatchLivePass(6, GL_SHADER_STORAGE_BARRIER_BIT);
+		dispatchPass(7, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+		dispatchLivePass(8, GL_SHADER_STORAGE_BARRIER_BIT);
+		dispatchPass(9, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+		dispatchLivePass(10, GL_SHADER_STORAGE_BARRIER_BIT);
+	}
 }
 
 
@@ -296,32 +940,418 @@ void ParticleManager::draw(float deltaTime, int drawType)
 
 void ParticleManager::setBounding(int axisType, float boundingVal)
 {
-	if (axisType == TYPE_X_AXIS)
+	float& bounding = axisType == TYPE_X_AXIS ? boundingX : boundingZ;
+	if ((axisType != TYPE_X_AXIS && axisType != TYPE_Z_AXIS) || bounding == boundingVal)
+		return;
+
+	// Set x or z range bounding
+	bounding = boundingVal;
+
+	// The container walls follow at once, the boundary samples once the size held still for
+	// a while. A size set before the first step is sampled right away
+	boundaryDirty = true;
+	boundarySettleStep = stepCounter > 0 ? stepCounter + BOUNDARY_SETTLE_STEPS : 0;
+	collider.setContainer(vec3(-boundingX, FLOOR_Y, -boundingZ), vec3(boundingX, COLLIDER_TOP_Y, boundingZ), true);
+}
+
+void ParticleManager::setImplicitViscosity(bool enabled, int iterations)
+{
+	this->implicitViscosity = enabled;
+	this->viscosityIterations = iterations;
+}
+
+void ParticleManager::setBoundaryParticles(bool enabled)
+{
+	this->useBoundary = enabled;
+}
+
+void ParticleManager::addEmitter(int type, vec3 position, vec3 direction, vec3 size, float speed, float rate)
+{
+	Emitter emitter;
+	emitter.type = type;
+	emitter.enabled = true;
+	emitter.position = position;
+	emitter.direction = normalize(direction);
+	emitter.size = size;
+	emitter.speed = speed;
+	emitter.rate = rate;
+	emitter.pending = 0.f;
+	emitters.push_back(emitter);
+}
+
+void ParticleManager::setBackend(int backend, int kernelLevel)
+{
+	if (backend == BACKEND_CPU)
 	{
-		// Set x range bounding
-		this->boundingX = boundingVal;
+		if (!cpuSolver)
+		{
+			cpuSolver = new CpuSolver();
+			cpuSolver->setIncrementalGrid(incrementalGrid);
+		}
+		cpuSolver->setKernelLevel(kernelLevel);
 	}
-	else if (axisType == TYPE_Z_AXIS)
+	if (backend == this->backend)
+		return;
+
+	// The live particles change hands, the GPU buffer keeps its capacity
+	if (backend == BACKEND_CPU)
 	{
-		// Set z range bounding
-		this->boundingZ = boundingVal;
+		cpuParticles.resize(getLiveCount());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, cpuParticles.size() * sizeof(Particle), cpuParticles.data());
+		cpuSolver->load(cpuParticles.data(), (int)cpuParticles.size());
 	}
-	
+	this->backend = backend;
 }
 
+void ParticleManager::setCpuScheduling(int cellsPerTask, bool pinThreads, bool symmetricPairs)
+{
+	if (!cpuSolver)
+		return;
+	cpuSolver->setBlockSize(cellsPerTask);
+	cpuSolver->setPinThreads(pinThreads);
+	cpuSolver->setSymmetric(symmetricPairs);
+}
+
+void ParticleManager::setIncrementalGrid(bool enabled)
+{
+	incrementalGrid = enabled;
+	if (cpuSolver)
+		cpuSolver->setIncrementalGrid(enabled);
+}
+
+GridStats ParticleManager::getGridStats()
+{
+	if (cpuSolver && backend == BACKEND_CPU)
+		return cpuSolver->getGridStats();
+
+	GridStats stats = GridStats();
+	stats.movedFraction = gridHeader.liveCount > 0 ? (float)gridHeader.movedCount / gridHeader.liveCount : 0.f;
+	stats.updateTime = gridCost;
+	stats.rebuilt = gridHeader.reordered != 0;
+	stats.rebuilds = (int)gridHeader.reorderTotal;
+	return stats;
+}
+
+ThreadPoolStats ParticleManager::getCpuSchedulerStats()
+{
+	if (!cpuSolver || backend != BACKEND_CPU)
+		return ThreadPoolStats();
+	return cpuSolver->getSchedulerStats();
+}
+
+void ParticleManager::updateCpu(float deltaTime)
+{
+	// Emitters, removal, sleeping, boundary particles and implicit viscosity stay GPU only
+	auto start = chrono::high_resolution_clock::now();
+	collider.bake();
+	cpuSolver->step(deltaTime, collider);
+	cpuSolver->store(cpuParticles.data());
+	chrono::duration<float, milli> elapsed = chrono::high_resolution_clock::now() - start;
+	stepCost = elapsed.count();
+	stepCounter++;
+
+	// Upload for drawing, the live count on the GPU did not change
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, cpuParticles.size() * sizeof(Particle), cpuParticles.data());
+}
+
+void ParticleManager::setSleeping(bool enabled)
+{
+	this->useSleeping = enabled;
+}
+
+float ParticleManager::getActiveFraction()
+{
+	if (!useSleeping)
+		return 1.f;
+
+	ActiveListHeader header;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, activeListSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ActiveListHeader), &header);
+	int liveCount = getLiveCount();
+	return liveCount > 0 ? (float)header.activeCount / liveCount : 0.f;
+}
+
+int ParticleManager::getBrickCount()
+{
+	if (backend == BACKEND_CPU && cpuSolver)
+		return cpuSolver->getBrickCount();
+
+	GridHeader header;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gridSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GridHeader), &header);
+	return (int)header.brickCount;
+}
+
+int ParticleManager::getLiveCount()
+{
+	SimulationCounters counters;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, countersSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(SimulationCounters), &counters);
+	return (int)counters.liveCount;
+}
+
+float ParticleManager::getStepCost()
+{
+	return stepCost;
+}
+
+void ParticleManager::getTimeStepLimits(float& viscosityLimit, float& cflLimit)
+{
+	// Read and restart the maxima gathered by pass 2 and 3 (stalls, call rarely)
+	ReductionHeader header;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, reductionSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ReductionHeader), &header);
+	GLuint zero[2] = { 0, 0 };
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, offsetof(ReductionHeader, maxViscosityRate), sizeof(zero), zero);
+
+	float viscosityRate, maxSpeed;
+	memcpy(&viscosityRate, &header.maxViscosityRate, sizeof(float));
+	memcpy(&maxSpeed, &header.maxSpeed, sizeof(float));
+
+	// Explicit Euler on the viscosity term needs dt < 1 / max_i(k * sum_j w_ij)
+	viscosityLimit = viscosityRate > 0.f ? 1.f / viscosityRate : 0.f;
+	// CFL condition with the speed of sound of p = k * (rho - rho0)
+	cflLimit = CFL_NUMBER * CORE_RADIUS / (glm::sqrt(STIFFNESS) + maxSpeed);
+}
+
+SimulationParameters ParticleManager::getParameters()
+{
+	SimulationParameters parameters;
+	parameters.mode = mode;
+	parameters.backend = backend;
+	parameters.boundingX = boundingX;
+	parameters.boundingZ = boundingZ;
+	parameters.implicitViscosity = implicitViscosity;
+	parameters.viscosityIterations = viscosityIterations;
+	parameters.useBoundary = useBoundary;
+	parameters.useSleeping = useSleeping;
+	return parameters;
+}
+
+void ParticleManager::saveCheckpoint(const string& path)
+{
+	SimulationCounters counters;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, countersSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(SimulationCounters), &counters);
+
+	Checkpoint checkpoint;
+	CheckpointHeader& header = checkpoint.header;
+	header.capacity = particleNum;
+	header.liveCount = counters.liveCount;
+	header.emitHead = counters.emitHead;
+	header.emitterCount = (uint32_t)emitters.size();
+	header.killPlaneCount = (uint32_t)killPlanes.size();
+	header.sinkCount = (uint32_t)sinks.size();
+	vector<ColliderObstacle> obstacles;
+	vector<vec3> corners;
+	collider.getObstacles(obstacles, corners);
+	header.obstacleCount = (uint32_t)obstacles.size();
+	header.cornerCount = (uint32_t)corners.size();
+	header.stepCounter = stepCounter;
+	header.parameters = getParameters();
+	checkpoint.create(path);
+
+	// Straight from the mapped GPU buffers into the mapped file, the CPU backend uploads
+	// its particles every step so the GPU copy is current on both backends
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	if (header.liveCount)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
+		void* particles = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, header.liveCount * sizeof(Particle), GL_MAP_READ_BIT);
+		if (particles)
+			memcpy((void*)checkpoint.particles(), particles, header.liveCount * sizeof(Particle));
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, activitySSBO);
+		void* sleepSteps = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, header.liveCount * sizeof(GLuint), GL_MAP_READ_BIT);
+		if (sleepSteps)
+			memcpy(checkpoint.activity(), sleepSteps, header.liveCount * sizeof(GLuint));
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		if (!particles || !sleepSteps)
+			throw runtime_error("Could not map the particle buffers for " + path + "!");
+
+		// Ring position of every live slot, the restored run recycles in the same order
+		vector<GLuint> ringSlots(particleNum);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ringSSBO);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, particleNum * sizeof(GLuint), ringSlots.data());
+		GLuint* ring = checkpoint.ring();
+		for (GLuint r = 0; r < (GLuint)particleNum; r++)
+			if (ringSlots[r] < header.liveCount)
+				ring[ringSlots[r]] = r;
+	}
+	copy(emitters.begin(), emitters.end(), checkpoint.emitters());
+	copy(killPlanes.begin(), killPlanes.end(), checkpoint.killPlanes());
+	copy(sinks.begin(), sinks.end(), checkpoint.sinks());
+	copy(obstacles.begin(), obstacles.end(), checkpoint.obstacles());
+	copy(corners.begin(), corners.end(), checkpoint.corners());
+	checkpoint.close();
+}
+
+const Particle* ParticleManager::mapParticles(GLuint& liveCount)
+{
+	SimulationCounters counters;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, countersSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(SimulationCounters), &counters);
+	liveCount = counters.liveCount;
+	if (!liveCount)
+		return NULL;
+
+	// The CPU backend uploads its particles every step, so the GPU copy is current on both
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
+	const Particle* particles = (const Particle*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, liveCount * sizeof(Particle), GL_MAP_READ_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	if (!particles)
+		throw runtime_error("Could not map the particle buffer!");
+	return particles;
+}
+
+void ParticleManager::unmapParticles()
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
+	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void ParticleManager::exportFrame(const string& path, int format)
+{
+	// The exporter reads the mapped GPU buffer a chunk at a time
+	GLuint liveCount = 0;
+	const Particle* particles = mapParticles(liveCount);
+	try {
+		exportParticles(path, format, particles, liveCount);
+	}
+	catch (...) {
+		if (particles)
+			unmapParticles();
+		throw;
+	}
+	if (particles)
+		unmapParticles();
+}
+
+void ParticleManager::restore(Checkpoint& checkpoint)
+{
+	const CheckpointHeader& header = checkpoint.header;
+	if (header.liveCount > (uint32_t)particleNum)
+		throw runtime_error("The checkpoint holds more particles than the buffer!");
+
+	// Settings first, the container follows the restored bounding
+	SimulationParameters parameters = header.parameters;
+	mode = parameters.mode;
+	boundingX = parameters.boundingX;
+	boundingZ = parameters.boundingZ;
+	implicitViscosity = parameters.implicitViscosity != 0;
+	viscosityIterations = parameters.viscosityIterations;
+	useBoundary = parameters.useBoundary != 0;
+	useSleeping = parameters.useSleeping != 0;
+	stepCounter = (GLuint)header.stepCounter;
+	emitters.assign(checkpoint.emitters(), checkpoint.emitters() + header.emitterCount);
+	killPlanes.assign(checkpoint.killPlanes(), checkpoint.killPlanes() + header.killPlaneCount);
+	sinks.assign(checkpoint.sinks(), checkpoint.sinks() + header.sinkCount);
+	collider.setObstacles(checkpoint.obstacles(), header.obstacleCount, checkpoint.corners(), header.cornerCount);
+
+	// The mapped particles go to the GPU buffer and the CPU solver as they lie in the file
+	initBuffers(checkpoint.particles(), header.liveCount, checkpoint.activity(), header.emitHead, checkpoint.ring());
+	if (parameters.backend == BACKEND_CPU)
+	{
+		cpuSolver = new CpuSolver();
+		cpuSolver->load(checkpoint.particles(), (int)header.liveCount);
+		cpuParticles.assign(checkpoint.particles(), checkpoint.particles() + header.liveCount);
+		backend = BACKEND_CPU;
+	}
+}
+
+void ParticleManager::importScene(SceneImport& scene)
+{
+	GLuint count = (GLuint)scene.count();
+	if (count > (GLuint)particleNum)
+		throw runtime_error("The scene holds more particles than the buffer!");
+
+	// The points are converted from the mapped file into the mapped GPU buffer, without a
+	// copy of the scene in between
+	initBuffers(NULL, count, NULL, count, NULL);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleSSBO);
+	Particle* particles = (Particle*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(Particle),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (!particles)
+		throw runtime_error("Could not map the particle buffer for the scene!");
+	scene.read(particles);
+	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+}
 
 void ParticleManager::cleanup()
 {
+	if (cpuSolver) { delete cpuSolver; cpuSolver = NULL; }
+	cpuParticles.clear();
+
+	// Scenes come and go on a long lived context, the buffers go with the scene
+	GLuint buffers[] = { particleSSBO, viscositySSBO, reductionSSBO, boundarySSBO, boundaryCellsSSBO, ringSSBO, activitySSBO,
+		activeListSSBO, countersSSBO, gridCellsSSBO, gridSSBO, gridParticleSSBO, gridOrderSSBO, particleScratchSSBO,
+		activityScratchSSBO };
+	glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+	if (gridReadbackBuffer) glDeleteBuffers(1, &gridReadbackBuffer);
+	if (gridFence) glDeleteSync(gridFence);
+	if (VAO) glDeleteVertexArrays(1, &VAO);
+	if (stepQuery) glDeleteQueries(1, &stepQuery);
+	if (gridQueries[0]) glDeleteQueries(2, gridQueries);
 	VAO = 0;
 	VBO = 0;
 	particleSSBO = 0;
+	viscositySSBO = 0;
+	reductionSSBO = 0;
+	boundarySSBO = 0;
+	boundaryCellsSSBO = 0;
+	ringSSBO = 0;
+	activitySSBO = 0;
+	activeListSSBO = 0;
+	countersSSBO = 0;
+	gridCellsSSBO = 0;
+	gridSSBO = 0;
+	gridParticleSSBO = 0;
+	gridTableSize = 0;
+	gridBrickCapacity = 0;
+	gridOrderSSBO = 0;
+	gridReadbackBuffer = 0;
+	gridFence = 0;
+	particleScratchSSBO = 0;
+	activityScratchSSBO = 0;
+	stepQuery = 0;
+	gridQueries[0] = gridQueries[1] = 0;
 	
 	// clean up uniform variables
 	uniDeltaTime = 0;
 	uniParticleNum = 0;
 	uniPass = 0;
-	uniBoundingZ = 0;
-	uniBoundingX = 0;
+	uniColliderSDF = 0;
+	uniColliderMin = 0;
+	uniColliderMax = 0;
+	uniContainerMin = 0;
+	uniContainerMax = 0;
+	uniImplicitViscosity = 0;
+	uniBoundaryNum = 0;
+	uniBoundaryCellMin = 0;
+	uniBoundaryCellDims = 0;
+	uniUseActiveList = 0;
+	uniGridTableSize = 0;
+	uniGridBrickCapacity = 0;
+	uniGridIncremental = 0;
+	uniEmitType = 0;
+	uniEmitCount = 0;
+	uniEmitSeed = 0;
+	uniEmitPosition = 0;
+	uniEmitDirection = 0;
+	uniEmitSize = 0;
+	uniEmitSpeed = 0;
+	uniKillPlaneNum = 0;
+	uniKillPlanes = 0;
+	uniSinkNum = 0;
+	uniSinkMin = 0;
+	uniSinkMax = 0;
+	uniRecordAttributes = 0;
+	uniRecordStep = 0;
 }
 
 ParticleManager::~ParticleManager()
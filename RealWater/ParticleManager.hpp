@@ -8,6 +8,9 @@
 #include <glm/glm.hpp>
 #include <GL/glew.h>
 #include "constants.hpp";
+#include "SDFCollider.hpp"
+#include "primitives.hpp"
+#include "ThreadPool.hpp"
 
 using namespace glm;
 using namespace std;
@@ -23,20 +26,166 @@ struct Particle
 	vec4 factor;
 };
 
+// Static wall sample, pos.w is the precomputed volume psi = rho0 * V_b (binding 3)
+struct BoundaryParticle
+{
+	vec4 pos;
+};
+
+// Indirect dispatch arguments and awake count in front of the active list (binding 5)
+struct ActiveListHeader
+{
+	GLuint groupsX;
+	GLuint groupsY;
+	GLuint groupsZ;
+	GLuint activeCount;
+};
+
+// GPU resident live particle count with its indirect dispatch and draw arguments (binding 6)
+struct SimulationCounters
+{
+	GLuint groupsX;				// DispatchIndirectCommand over the live particles
+	GLuint groupsY;
+	GLuint groupsZ;
+	GLuint liveCount;
+	GLuint drawCount;			// DrawArraysIndirectCommand
+	GLuint drawInstanceCount;
+	GLuint drawFirst;
+	GLuint drawBaseInstance;
+	GLuint emitHead;			// total emitted, the next ring position is emitHead % capacity
+	GLuint pad[3];
+};
+
+const GLuint RING_EMPTY = 0xffffffffu;	// ring position of a removed particle, GRID_EMPTY in sh_compute.glsl
+
+// Sparse block grid counters in front of the hashed brick table (binding 8)
+struct GridHeader
+{
+	GLuint brickCount;			// allocated bricks, those beyond the pool too
+	GLuint cellTotal;			// cells of the bricks in the pool, one more for the overflow cell
+	GLuint movedCount;			// particles out of the cell of the last reorder
+	GLuint reordered;			// nonzero if the step reordered the particles
+	GLuint reorderTotal;		// steps that reordered since the buffers were set up
+	GLuint liveCount;			// live count the step started with
+	GLuint pad[2];
+};
+
+// Emitter types
+const int EMITTER_NOZZLE = 0;	// disk outlet
+const int EMITTER_PLANE = 1;	// rectangle facing the flow
+const int EMITTER_VOLUME = 2;	// box
+
+// Simulation backends
+const int BACKEND_GPU = 0;		// compute shader passes
+const int BACKEND_CPU = 1;		// CpuSolver with SIMD kernels, uploads the particles every step
+
+class CpuSolver;
+struct GridStats;
+class Checkpoint;
+class Recorder;
+class SceneImport;
+
+// Settings the panel pushes every step, saved with a checkpoint
+struct SimulationParameters
+{
+	int mode;
+	int backend;
+	float boundingX;
+	float boundingZ;
+	int implicitViscosity;
+	int viscosityIterations;
+	int useBoundary;
+	int useSleeping;
+};
+
+// Particles entering the box are removed
+struct Sink
+{
+	vec3 minCorner;
+	vec3 maxCorner;
+};
+
+// Continuous inflow, spawns rate particles per second into the preallocated buffer
+struct Emitter
+{
+	int type;
+	bool enabled;
+	vec3 position;
+	vec3 direction;
+	vec3 size;			// nozzle radius in x / plane half extents in xy / volume half extents
+	float speed;
+	float rate;
+	float pending;		// fractional particles carried to the next step
+};
+
+// CG vectors of the implicit viscosity solve (binding 1)
+struct ViscositySolve
+{
+	vec4 r;
+	vec4 p;
+	vec4 ap;
+};
+
+// CG scalars and step statistics (binding 2), followed by one vec4 partial per work group
+struct ReductionHeader
+{
+	vec4 rr;
+	vec4 alpha;
+	vec4 beta;
+	GLuint maxViscosityRate;
+	GLuint maxSpeed;
+	GLuint pad[2];
+};
+
 
 class ParticleManager {
 public:
-	ParticleManager(unsigned int particleNum, int mode, GLuint shader, GLuint computeShader);
+	// Restores the checkpoint or loads the imported scene instead of generating the mode if
+	// one is given. Without a display shader (0) the scene is only stepped, never drawn
+	ParticleManager(unsigned int particleNum, int mode, GLuint shader, GLuint computeShader, GPUPrimitives* primitives,
+		Checkpoint* checkpoint = NULL, SceneImport* scene = NULL);
 	~ParticleManager();
 	void init(int mode);			// init particle buffer data
+	// Starts over as a new manager of the same capacity would, keeping its GL buffers
+	void reset(int mode, Checkpoint* checkpoint = NULL, SceneImport* scene = NULL);
 	void initDraw();				// draw the init particles
-	void update(float deltaTime);	// update the particles
+	void update(float deltaTime);	// step and draw the particles
+	void step(float deltaTime);		// solver passes only, needs no display shader
 	void draw(float deltaTime, int drawType);
 	void setBounding(int axisType, float boundingVal);
+	void setImplicitViscosity(bool enabled, int iterations);
+	void setBoundaryParticles(bool enabled);
+	void setSleeping(bool enabled);
+	void addEmitter(int type, vec3 position, vec3 direction, vec3 size, float speed, float rate);
+	void setBackend(int backend, int kernelLevel);	// kernel level of the CPU backend
+	void setCpuScheduling(int cellsPerTask, bool pinThreads, bool symmetricPairs);
+	// The CPU grid patches the slots of moved particles, the GPU grid keeps the particles in
+	// place and only reorders them once enough moved
+	void setIncrementalGrid(bool enabled);
+	ThreadPoolStats getCpuSchedulerStats();		// since the last call, empty on the GPU backend
+	GridStats getGridStats();					// last grid update, of a recent step on the GPU
+	float getActiveFraction();		// awake particles of the last step (stalls, call rarely)
+	int getLiveCount();				// live particles on the GPU (stalls, call rarely)
+	int getBrickCount();			// allocated grid bricks (stalls, call rarely)
+	float getStepCost();			// gpu time of the last measured update, cpu time on the CPU backend (ms)
+	void getTimeStepLimits(float& viscosityLimit, float& cflLimit);	// max stable dt since last call (s)
+	SimulationParameters getParameters();
+	void saveCheckpoint(const string& path);	// stalls for the GPU, throws runtime_error
+	void setRecorder(Recorder* recorder);		// records every step until NULL
+	void setPublisher(Recorder* publisher);		// publishes every step to its shared ring until NULL
+	void exportFrame(const string& path, int format);	// EXPORT_*, stalls for the GPU, throws runtime_error
+	// Live particles read only in place on the GPU buffer, NULL if there are none. Stalls for
+	// the GPU, no step until unmapParticles(). Throws runtime_error
+	const Particle* mapParticles(GLuint& liveCount);
+	void unmapParticles();
 	void cleanup();
 
-	int particleNum;	// Particle number base (use base to get particle init matirx)
+	int particleNum;	// Particle capacity, the live count is kept on the GPU
 	vector<vec3> positions;
+	SDFCollider collider;	// static geometry, the container follows setBounding
+	vector<Emitter> emitters;
+	vector<vec4> killPlanes;	// keep the side where dot(xyz, p) >= w, at most MAX_KILL_PLANES
+	vector<Sink> sinks;			// at most MAX_SINKS
 
 private:
 	int mode;
@@ -45,20 +194,110 @@ private:
 	float delta_time;
 	float boundingZ;
 	float boundingX;
+	bool implicitViscosity;
+	int viscosityIterations;
+	bool useBoundary;
+	bool boundaryDirty;
+	GLuint boundarySettleStep;	// first step the dirty walls may be resampled at
+	int boundaryNum;
+	ivec3 boundaryCellMin;		// dense cell table of the sorted wall samples
+	ivec3 boundaryCellDims;
+	bool useSleeping;
+	int backend;
+	CpuSolver* cpuSolver;
+	vector<Particle> cpuParticles;
+	GLuint stepCounter;
+	Recorder* recorder;
+	Recorder* publisher;
+	float stepCost;
+	bool stepQueryPending;
 	GLuint VAO;
 	GLuint VBO;
 	GLuint shader;
+	GPUPrimitives* primitives;	// shared scan / sort building blocks
 
 	// Uniform Location
 	GLuint uniDeltaTime;
 	GLuint uniParticleNum;
 	GLuint uniPass;
-	GLuint uniBoundingZ;
-	GLuint uniBoundingX;
+	GLuint uniColliderSDF;
+	GLuint uniColliderMin;
+	GLuint uniColliderMax;
+	GLuint uniContainerMin;
+	GLuint uniContainerMax;
+	GLuint uniImplicitViscosity;
+	GLuint uniBoundaryNum;
+	GLuint uniBoundaryCellMin;
+	GLuint uniBoundaryCellDims;
+	GLuint uniUseActiveList;
+	GLuint uniGridTableSize;
+	GLuint uniGridBrickCapacity;
+	GLuint uniGridIncremental;
+	GLuint uniEmitType;
+	GLuint uniEmitCount;
+	GLuint uniEmitSeed;
+	GLuint uniEmitPosition;
+	GLuint uniEmitDirection;
+	GLuint uniEmitSize;
+	GLuint uniEmitSpeed;
+	GLuint uniKillPlaneNum;
+	GLuint uniKillPlanes;
+	GLuint uniSinkNum;
+	GLuint uniSinkMin;
+	GLuint uniSinkMax;
+	GLuint uniRecordAttributes;
+	GLuint uniRecordStep;
 
 	//SSBO
 	GLuint computeShader;
 	GLuint particleSSBO;
+	GLuint viscositySSBO;
+	GLuint reductionSSBO;
+	GLuint boundarySSBO;
+	GLuint boundaryCellsSSBO;
+	GLuint ringSSBO;			// emitter ring, slot of every ring position
+	GLuint activitySSBO;
+	GLuint activeListSSBO;
+	GLuint countersSSBO;
+	GLuint gridCellsSSBO;
+	GLuint gridSSBO;
+	GLuint gridParticleSSBO;
+	GLuint gridTableSize;
+	GLuint gridBrickCapacity;	// bricks of gridCellsSSBO, fitted to the brickCount of earlier steps
+	GLuint gridOrderSSBO;
+	GLuint gridReadbackBuffer;	// GridHeader of a step, read once gridFence passed
+	GLsync gridFence;
+	bool incrementalGrid;
+	GridHeader gridHeader;		// last read back
+	float gridCost;				// gpu time of the grid update of a recent step (ms)
+	GLuint particleScratchSSBO;
+	GLuint activityScratchSSBO;
+
+	// Timer query
+	GLuint stepQuery;
+	GLuint gridQueries[2];		// timestamps around the grid update
+	bool gridQueryPending;
+
+	void dispatchPass(int pass, GLuint groups, GLbitfield barriers);
+	void dispatchActivePass(int pass, GLbitfield barriers);	// sized by the active list
+	void dispatchLivePass(int pass, GLbitfield barriers);	// sized by the live count
+	void updateCounters();
+	void emit(float deltaTime);
+	void buildGrid();				// bin, drop removed particles and reorder by cell once needed
+	void resizeGridCells(GLuint bricks);
+	void fitGridCells();			// brick pool to the bricks of an earlier step, never waits
+	void readGridCost();			// timing of an earlier grid update, never waits
+	void compactActive();
+	void solveViscosity();
+	// Ring positions of the live particles, NULL for the order of the slots
+	void initBuffers(const Particle* particles, GLuint liveCount, const GLuint* sleepSteps, GLuint emitHead, const GLuint* ring);
+	void bindBuffers();				// SSBO points 0 to 11 and 13 to 15 of this manager
+	void load(Checkpoint* checkpoint, SceneImport* scene);
+	void restore(Checkpoint& checkpoint);
+	void importScene(SceneImport& scene);
+	void initBoundary();			// sample the container walls, precompute volumes, sort by cell
+	void updateCpu(float deltaTime);
+	void recordFrame(Recorder* target);	// pack the live particles for a recorder, never waits
 };
 
 #endif // !_PARTICLE_MANAGER_HPP
\ No newline at end of file
@@ -17,6 +17,17 @@
 
 /* Particle */
 #include "ParticleManager.hpp";
+#include "primitives.hpp"
+#include "CpuSolver.hpp"
+#include "Checkpoint.hpp"
+#include "Importer.hpp"
+#include "Recorder.hpp"
+#include "FrameCodec.hpp"
+#include "ReplayPlayer.hpp"
+#include "Exporter.hpp"
+#include "Offscreen.hpp"
+#include "Simulation.hpp"
+#include "JobServer.hpp"
 
 using namespace std;
 using namespace glm;
@@ -26,10 +37,12 @@ using namespace glm;
 void initOpenGL();
 void initGLFW();
 void initState();
+void initSimulation(bool headless);
 void initParticle();
 
 // Callback functions
 void display();
+void renderScene();
 void idle();
 void window_size(GLFWwindow* window, int width, int height);
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -38,20 +51,40 @@ void cleanup();
 // Util functions
 void getUniformLocations();
 void configureUniforms();
+void configureColliders();
+void configureEmitters();
+void configureRemoval();
+void saveCheckpoint();
+void restoreCheckpoint();
+void importScene();
+RwSceneDesc panelSceneDesc();
+void toggleRecording();
+void togglePublishing();
+void toggleReplay();
+void exportFrame();
+int runHeadless(int argc, char** argv);
+int runServer(const string& socketPath);
+int submitRequest(int argc, char** argv);
 
 GLFWwindow* window;
 GLuint width;
 GLuint height;
+bool benchMode;     // --bench-primitives: hidden window, print the table and quit
 
 // Particle 
 ParticleManager* particleManager;
 GLuint particleShader;
-GLuint computeShader;
+SimulationContext* simulation;	// solver program and primitives of the RealWaterCore library
+Recorder* recorder;
+Recorder* publisher;    // frames to the shared memory ring of external processes
+ReplayPlayer* replay;
 static int N;
 GLuint uniModel;
 GLuint uniDeltaTime;
 static bool isStart;
 static bool isReset;
+static bool isRestore;
+static bool isImport;
 static float rotX = 0.f;
 static float rotY = 0.f;
 static float scaleRatio = 0.2f;
@@ -65,6 +98,56 @@ static int imguiParticleNum = PARTICLE_NUM_BASE * PARTICLE_NUM_BASE * PARTICLE_N
 static float imguiBoundingZ = 3.2f;
 static float imguiBoundingX = 3.2f;
 static const char* imguiShadingModeItems[] = { "Default", "Velocity Visual", "Surface Color"};
+static bool imguiImplicitViscosity = false;
+static int imguiViscosityIterations = VISCOSITY_CG_ITERATIONS;
+static float imguiStepCost = 0.f;
+static float imguiViscosityLimit = 0.f;
+static float imguiCflLimit = 0.f;
+static bool imguiBoundaryParticles = false;
+static bool imguiSleeping = false;
+static float imguiActiveFraction = 1.f;
+static int imguiBrickCount = 0;
+static bool imguiSphereObstacle = false;
+static bool imguiMeshObstacle = false;
+static char imguiMeshPath[256] = "models/obstacle.obj";
+static char imguiCheckpointPath[256] = "scene.rwc";
+static char imguiImportPath[256] = "scene.ply";
+static char imguiRecordingPath[256] = "recording.rwr";
+static char imguiPublishName[64] = "realwater";
+static RecorderStats imguiPublisherStats;
+static bool imguiRecordPosition = true;
+static bool imguiRecordVelocity = false;
+static bool imguiRecordColor = false;
+static bool imguiRecordId = false;
+static bool imguiRecordCompressed = true;
+static float imguiRecordErrorBound = CODEC_DEFAULT_ERROR_BOUND;
+static RecorderStats imguiRecorderStats;
+static char imguiReplayPath[256] = "recording.rwr";
+static int imguiReplayFrame = 0;
+static bool imguiReplayPlaying = false;
+static char imguiExportPath[256] = "frame";
+static int imguiExportFormat = EXPORT_VTK;
+static const char* imguiExportFormatItems[] = { "VTK", "PLY", "Point Cache" };
+static bool imguiExportSequence = false;
+static int imguiExportCount = 0;
+static bool imguiEmit = false;
+static int imguiEmitterType = EMITTER_NOZZLE;
+static float imguiEmitRate = EMITTER_DEFAULT_RATE;
+static float imguiEmitSpeed = 2.f;
+static const char* imguiEmitterTypeItems[] = { "Nozzle", "Plane", "Volume" };
+static bool imguiDrainSink = false;
+static bool imguiKillPlane = false;
+static float imguiKillPlaneHeight = -5.5f;
+static int imguiBackend = BACKEND_GPU;
+static int imguiCpuKernel = CPU_KERNEL_SCALAR;
+static int imguiCpuKernelMax = CPU_KERNEL_SCALAR;
+static const char* imguiCpuKernelItems[] = { "Scalar", "AVX2", "AVX-512" };
+static int imguiCellsPerTask = CPU_CELLS_PER_TASK;
+static bool imguiPinThreads = false;
+static bool imguiSymmetricPairs = false;
+static bool imguiIncrementalGrid = false;
+static ThreadPoolStats imguiSchedulerStats;
+static GridStats imguiGridStats;
 
 // Camera Ddata
 GLuint uniView;
@@ -88,11 +171,37 @@ float timer;
 
 int main(int argc, char** argv)
 {
+    // CPU kernel benchmark, no window needed
+    if (argc > 1 && string(argv[1]) == "--bench-cpu") {
+        benchmarkCpuKernels();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-codec") {
+        benchmarkFrameCodec();
+        return 0;
+    }
+    // Image sequence without a window or a display
+    if (argc > 1 && string(argv[1]) == "--headless")
+        return runHeadless(argc, argv);
+    // Job server on a warm headless context, and a client for it
+    if (argc > 1 && string(argv[1]) == "--serve")
+        return runServer(argc > 2 ? argv[2] : JOB_SERVER_SOCKET);
+    if (argc > 3 && string(argv[1]) == "--submit")
+        return submitRequest(argc, argv);
+
     try {
         initState();
+        benchMode = argc > 1 && string(argv[1]) == "--bench-primitives";
         initGLFW();
         initOpenGL();
+        initSimulation(false);
         initParticle();
+        if (benchMode) {
+            benchmarkPrimitives(*simulation->primitives);
+            cleanup();
+            glfwTerminate();
+            return 0;
+        }
     }
     catch (const exception& e) {
         // Handle any errors
@@ -114,6 +223,11 @@ int main(int argc, char** argv)
         glfwPollEvents();
     }
 
+    // Frames still in flight go to the file before the context is gone
+    if (recorder) { delete recorder; recorder = NULL; }
+    if (publisher) { delete publisher; publisher = NULL; }
+    if (replay) { delete replay; replay = NULL; }
+
     // Cleanup ImGui
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -128,16 +242,22 @@ void initState()
     width = 800;
     height = 800;
     window = NULL;
+    benchMode = false;
 
     // Particle
     N = PARTICLE_NUM_BASE;  // pow(x, 3) must be multiple of 256(group size)
     particleManager = NULL;
     particleShader = 0;
-    computeShader = 0;
+    simulation = NULL;
+    recorder = NULL;
+    publisher = NULL;
+    replay = NULL;
     uniModel = 0;
     uniDeltaTime = 0;
     isStart = false;
     isReset = true;
+    isRestore = false;
+    isImport = false;
 
     // Camera 
     uniView = 0;
@@ -153,6 +273,10 @@ void initState()
     frameCount = 0;
     timer = 0.f;
 
+    // Best SIMD kernels of this CPU for the CPU backend
+    imguiCpuKernelMax = detectCpuKernelLevel();
+    imguiCpuKernel = imguiCpuKernelMax;
+
     // Force images to load vertically flipped
     // OpenGL expects pixel data to start at the lower-left corner
     stbi_set_flip_vertically_on_load(1);
@@ -171,20 +295,23 @@ void initParticle()
     // Get all uniform locations
     getUniformLocations();
     particleShaders.clear();
-
-    // Compute shader
-    GLuint computeShader0;
-    computeShader0 = compileShader(GL_COMPUTE_SHADER, COMPUTE_SHADER);
-    computeShader = glCreateProgram();
-    glAttachShader(computeShader, computeShader0);
-    glLinkProgram(computeShader);
-    glDeleteShader(computeShader0);
     glUseProgram(0);
 
+    recorder = new Recorder();
+    publisher = new Recorder();
+    replay = new ReplayPlayer();
+
     assert(glGetError() == GL_NO_ERROR);
 
 }
 
+void initSimulation(bool headless)
+{
+    // The solver programs live in the library, the app only adds the display shader
+    simulation = new SimulationContext();
+    simulation->create(headless);
+}
+
 void initGLFW()
 {
     glfwInit();
@@ -194,6 +321,7 @@ void initGLFW()
         throw(runtime_error(err));
     }
 
+    glfwWindowHint(GLFW_VISIBLE, benchMode ? GLFW_FALSE : GLFW_TRUE);
     window = glfwCreateWindow(width, height, "Real Water", NULL, NULL);
     if (!window)
     {
@@ -286,6 +414,98 @@ void draw_gui(GLFWwindow* window)
             isReset = true;
         }
 
+        ImGui::Text("Checkpoint (particles, settings and step counter)");
+        ImGui::InputText("File", imguiCheckpointPath, IM_ARRAYSIZE(imguiCheckpointPath));
+        if (ImGui::Button("Save Checkpoint"))
+            saveCheckpoint();
+        ImGui::SameLine();
+        if (ImGui::Button("Load Checkpoint"))
+        {
+            isStart = false;
+            isRestore = true;
+        }
+
+        ImGui::Text("Import (PLY or point cache as is, OBJ filled at the particle spacing)");
+        ImGui::InputText("Scene", imguiImportPath, IM_ARRAYSIZE(imguiImportPath));
+        if (ImGui::Button("Import Scene"))
+        {
+            isStart = false;
+            isImport = true;
+        }
+
+        ImGui::Text("Recording (written in the background, see recorder stats)");
+        ImGui::InputText("Recording", imguiRecordingPath, IM_ARRAYSIZE(imguiRecordingPath));
+        ImGui::Checkbox("Position", &imguiRecordPosition);
+        ImGui::SameLine();
+        ImGui::Checkbox("Velocity", &imguiRecordVelocity);
+        ImGui::SameLine();
+        ImGui::Checkbox("Color Field", &imguiRecordColor);
+        ImGui::SameLine();
+        ImGui::Checkbox("Particle Id", &imguiRecordId);
+        ImGui::Checkbox("Compress", &imguiRecordCompressed);
+        if (imguiRecordCompressed)
+        {
+            ImGui::SameLine();
+            ImGui::InputFloat("Error Bound", &imguiRecordErrorBound, 0.f, 0.f, "%.6f");
+            // Raised to what the finest position grid holds over the box
+            imguiRecordErrorBound = glm::max(imguiRecordErrorBound, codecMaxError(particleManager->collider.domainMin,
+                particleManager->collider.domainMax, CODEC_MAX_POSITION_BITS));
+        }
+        // A failed write ends the recording, the file is left without its index
+        string recordError = recorder->getError();
+        if (!recordError.empty() && recorder->isRecording())
+            recorder->stop();
+        if (ImGui::Button(recorder->isRecording() ? "Stop Recording" : "Record"))
+            toggleRecording();
+        if (!recordError.empty())
+            ImGui::Text("%s", recordError.c_str());
+        if (recorder->isRecording())
+        {
+            imguiRecorderStats = recorder->getStats();
+            ImGui::Text("Recorder: %d frames, %d dropped, %.1f MB at %.0f MB/s", (int)imguiRecorderStats.framesWritten,
+                (int)imguiRecorderStats.framesDropped, imguiRecorderStats.bytesWritten / 1e6f, imguiRecorderStats.writeSpeed);
+            if (imguiRecordCompressed)
+                ImGui::Text("Compression: %.2fx, encoder %.0f MB/s on one core", imguiRecorderStats.ratio,
+                    imguiRecorderStats.encodeSpeed);
+        }
+
+        ImGui::Text("Shared memory ring (the attributes above, read by other processes)");
+        ImGui::InputText("Ring", imguiPublishName, IM_ARRAYSIZE(imguiPublishName));
+        if (ImGui::Button(publisher->isRecording() ? "Stop Publishing" : "Publish"))
+            togglePublishing();
+        if (publisher->isRecording())
+        {
+            imguiPublisherStats = publisher->getStats();
+            ImGui::Text("Publisher: %d frames, %d dropped, %.0f MB/s", (int)imguiPublisherStats.framesWritten,
+                (int)imguiPublisherStats.framesDropped, imguiPublisherStats.writeSpeed);
+        }
+
+        ImGui::Text("Export (position, velocity, density, pressure, normal)");
+        ImGui::InputText("Export", imguiExportPath, IM_ARRAYSIZE(imguiExportPath));
+        ImGui::Combo("Format", &imguiExportFormat, imguiExportFormatItems, IM_ARRAYSIZE(imguiExportFormatItems));
+        if (ImGui::Button("Export Frame"))
+            exportFrame();
+        ImGui::SameLine();
+        ImGui::Checkbox("Every Step", &imguiExportSequence);
+
+        ImGui::Text("Playback (draws a recording instead of simulating)");
+        ImGui::InputText("Replay", imguiReplayPath, IM_ARRAYSIZE(imguiReplayPath));
+        if (ImGui::Button(replay->isOpen() ? "Close Replay" : "Open Replay"))
+            toggleReplay();
+        if (replay->isOpen())
+        {
+            ImGui::SameLine();
+            if (ImGui::Button(imguiReplayPlaying ? "Pause Replay" : "Play Replay"))
+                imguiReplayPlaying = !imguiReplayPlaying;
+            if (ImGui::SliderInt("Frame", &imguiReplayFrame, 0, glm::max(replay->getFrameCount() - 1, 0)))
+                imguiReplayPlaying = false;
+            ImGui::Text("Showing frame %d of %d, step %u, %d particles", replay->getFrame(), replay->getFrameCount(),
+                replay->getStep(), replay->getLiveCount());
+            string error = replay->getError();
+            if (!error.empty())
+                ImGui::Text("%s", error.c_str());
+        }
+
         ImGui::Text("Particle System Model Control");
         ImGui::SliderFloat("Scale", &scaleRatio, 0.05f, 2.f);
         ImGui::SliderFloat("Rotate X", &rotX, 0.f, 180.f);
@@ -299,10 +519,34 @@ void draw_gui(GLFWwindow* window)
         ImGui::SameLine();
         ImGui::RadioButton("Sorted Plane 2", &imguiParticleGenMode, 3);
         ImGui::RadioButton("Sorted Cube Mode", &imguiParticleGenMode, 4);
+        ImGui::SameLine();
+        ImGui::RadioButton("Pour Mode", &imguiParticleGenMode, 5);
+
+        ImGui::Text("Emitter (continuous inflow up to the buffer capacity)");
+        ImGui::Checkbox("Emit", &imguiEmit);
+        ImGui::SameLine();
+        ImGui::Combo("Emitter Type", &imguiEmitterType, imguiEmitterTypeItems, IM_ARRAYSIZE(imguiEmitterTypeItems));
+        ImGui::SliderFloat("Rate (particles/s)", &imguiEmitRate, 100.f, 20000.f);
+        ImGui::SliderFloat("Speed", &imguiEmitSpeed, 0.f, 10.f);
+
+        ImGui::Text("Particle Removal (stream compaction keeps the rest contiguous)");
+        ImGui::Checkbox("Drain Sink", &imguiDrainSink);
+        ImGui::SameLine();
+        ImGui::Checkbox("Kill Plane", &imguiKillPlane);
+        ImGui::SliderFloat("Kill Plane Height", &imguiKillPlaneHeight, -6.f, 2.f);
 
         ImGui::Text("Particle Bounding Setting");
         ImGui::SliderFloat("X", &imguiBoundingX, 1.f, 7.f);
         ImGui::SliderFloat("Z", &imguiBoundingZ, 1.f, 4.f);
+        ImGui::Checkbox("Boundary Particles (wall density and pressure)", &imguiBoundaryParticles);
+
+        ImGui::Text("Static Colliders (baked into a distance field)");
+        bool collidersChanged = ImGui::Checkbox("Sphere Obstacle", &imguiSphereObstacle);
+        ImGui::SameLine();
+        collidersChanged |= ImGui::Checkbox("Mesh Obstacle", &imguiMeshObstacle);
+        ImGui::InputText("Mesh (OBJ)", imguiMeshPath, IM_ARRAYSIZE(imguiMeshPath));
+        if (collidersChanged)
+            configureColliders();
 
         ImGui::Text("Particle Shading Mode");
         ImGui::Combo("Shading Mode", &imguiShadingMode, imguiShadingModeItems, IM_ARRAYSIZE(imguiShadingModeItems));
@@ -315,6 +559,25 @@ void draw_gui(GLFWwindow* window)
         ImGui::SameLine();
         ImGui::SliderFloat("", &imguiDeltaTime, 1.f, 50.f);
 
+        ImGui::Text("Viscosity Solver (implicit for high viscosity runs)");
+        ImGui::Checkbox("Implicit Viscosity", &imguiImplicitViscosity);
+        ImGui::SliderInt("CG Iterations", &imguiViscosityIterations, 1, 50);
+
+        ImGui::Text("Skip particles at rest");
+        ImGui::Checkbox("Sleeping Particles", &imguiSleeping);
+
+        ImGui::Text("Solver Backend (CPU: density, forces and collisions only)");
+        ImGui::RadioButton("GPU", &imguiBackend, BACKEND_GPU);
+        ImGui::SameLine();
+        ImGui::RadioButton("CPU", &imguiBackend, BACKEND_CPU);
+        ImGui::SameLine();
+        ImGui::Combo("Kernels", &imguiCpuKernel, imguiCpuKernelItems, imguiCpuKernelMax + 1);
+        ImGui::SliderInt("Cells per Task", &imguiCellsPerTask, 1, 64);
+        ImGui::SameLine();
+        ImGui::Checkbox("Pin Threads", &imguiPinThreads);
+        ImGui::Checkbox("Symmetric Pairs (half shell)", &imguiSymmetricPairs);
+        ImGui::SameLine();
+        ImGui::Checkbox("Incremental Grid", &imguiIncrementalGrid);
         
     ImGui::End();
 
@@ -323,6 +586,27 @@ void draw_gui(GLFWwindow* window)
         ImGui::SameLine();
         ImGui::Text("FPS: %d", imguiFPS);
         ImGui::Text("Delta Time %.3f ms", deltaTime * 1000);
+        ImGui::Text("Step Cost (%s): %.3f ms", imguiBackend == BACKEND_CPU ? "CPU" : "GPU", imguiStepCost);
+        ImGui::Text("Active Particles: %.1f %%", imguiActiveFraction * 100);
+        ImGui::Text("Grid Bricks: %d (%d cells each)", imguiBrickCount, GRID_BRICK * GRID_BRICK * GRID_BRICK);
+        ImGui::Text("Max Stable Step: viscosity %.3f ms, CFL %.3f ms", imguiViscosityLimit * 1000, imguiCflLimit * 1000);
+        if (imguiBackend == BACKEND_CPU && imguiSchedulerStats.tasks > 0)
+        {
+            // Tasks per job and the stolen share tell whether the block size balances the load
+            ImGui::Text("CPU Tasks: %zu per step, %.1f %% stolen, deepest queue %zu",
+                imguiSchedulerStats.tasks / glm::max(imguiSchedulerStats.jobs, (size_t)1) * 3,
+                100.f * imguiSchedulerStats.steals / imguiSchedulerStats.tasks, imguiSchedulerStats.maxQueueDepth);
+            for (size_t k = 0; k < imguiSchedulerStats.workerTasks.size(); k++)
+                ImGui::Text("  Worker %zu: %.1f %% of tasks", k, 100.f * imguiSchedulerStats.workerTasks[k] / imguiSchedulerStats.tasks);
+            ImGui::Text("CPU Grid: %.2f %% moved, %.3f ms, %s, %d rebuilds", imguiGridStats.movedFraction * 100,
+                imguiGridStats.updateTime, imguiGridStats.rebuilt ? "rebuilt" : "patched", imguiGridStats.rebuilds);
+        }
+        else if (imguiBackend == BACKEND_GPU)
+        {
+            // Moved counts the particles out of the cell of the last reorder
+            ImGui::Text("GPU Grid: %.2f %% moved, %.3f ms, %s, %d reorders", imguiGridStats.movedFraction * 100,
+                imguiGridStats.updateTime, imguiGridStats.rebuilt ? "reordered" : "listed", imguiGridStats.rebuilds);
+        }
     ImGui::End();
 
     /*static bool show_demo = true;
@@ -340,14 +624,265 @@ void configureUniforms()
     glUniform1i(uniSetLight, imguiSetLight);
 }
 
+void configureColliders()
+{
+    // Obstacles below the spawn region, baked on the next update
+    particleManager->collider.clearObstacles();
+    if (imguiSphereObstacle)
+        particleManager->collider.addSphere(vec3(0.f, -4.f, 0.f), 1.f);
+    if (imguiMeshObstacle)
+    {
+        try {
+            particleManager->collider.addMesh(imguiMeshPath, vec3(0.f, -4.5f, 0.f), 1.f);
+        }
+        catch (const exception& e) {
+            cerr << e.what() << endl;
+            imguiMeshObstacle = false;
+        }
+    }
+}
+
+void configureEmitters()
+{
+    // The panel drives the first emitter, added above the tank on demand
+    if (particleManager->emitters.empty())
+    {
+        if (!imguiEmit)
+            return;
+        particleManager->addEmitter(imguiEmitterType, vec3(-1.f, 2.f, 0.f), vec3(0.3f, -1.f, 0.f), vec3(4 * RADIUS), imguiEmitSpeed, imguiEmitRate);
+    }
+
+    Emitter& emitter = particleManager->emitters[0];
+    emitter.enabled = imguiEmit;
+    emitter.type = imguiEmitterType;
+    emitter.rate = imguiEmitRate;
+    emitter.speed = imguiEmitSpeed;
+    // Plane and volume emitters cover a larger area than the nozzle outlet
+    emitter.size = imguiEmitterType == EMITTER_NOZZLE ? vec3(4 * RADIUS) : vec3(0.5f, 0.5f, 0.25f);
+}
+
+void configureRemoval()
+{
+    // A drain in the middle of the floor and a horizontal kill plane
+    particleManager->sinks.clear();
+    particleManager->killPlanes.clear();
+    if (imguiDrainSink)
+    {
+        Sink drain = { vec3(-0.5f, FLOOR_Y - 1.f, -0.5f), vec3(0.5f, FLOOR_Y + 0.1f, 0.5f) };
+        particleManager->sinks.push_back(drain);
+    }
+    if (imguiKillPlane)
+        particleManager->killPlanes.push_back(vec4(0.f, 1.f, 0.f, imguiKillPlaneHeight));
+}
+
+void saveCheckpoint()
+{
+    try {
+        particleManager->saveCheckpoint(imguiCheckpointPath);
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+    }
+}
+
+void toggleRecording()
+{
+    if (recorder->isRecording())
+    {
+        recorder->stop();
+        return;
+    }
+    int attributes = (imguiRecordPosition ? RECORD_POSITION : 0) | (imguiRecordVelocity ? RECORD_VELOCITY : 0)
+        | (imguiRecordColor ? RECORD_COLOR : 0) | (imguiRecordId ? RECORD_ID : 0);
+    if (!attributes)
+        return;
+    try {
+        recorder->start(imguiRecordingPath, particleManager->particleNum, attributes, particleManager->collider.domainMin,
+            particleManager->collider.domainMax, imguiRecordCompressed ? imguiRecordErrorBound : 0.f);
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+    }
+}
+
+void togglePublishing()
+{
+    if (publisher->isRecording())
+    {
+        publisher->stop();
+        return;
+    }
+    int attributes = (imguiRecordPosition ? RECORD_POSITION : 0) | (imguiRecordVelocity ? RECORD_VELOCITY : 0)
+        | (imguiRecordColor ? RECORD_COLOR : 0) | (imguiRecordId ? RECORD_ID : 0);
+    if (!attributes)
+        return;
+    try {
+        publisher->publish(imguiPublishName, particleManager->particleNum, attributes);
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+    }
+}
+
+void exportFrame()
+{
+    // A numbered file per step in a sequence, a single one otherwise
+    string path = imguiExportPath;
+    if (imguiExportSequence)
+    {
+        char number[16];
+        snprintf(number, sizeof(number), "_%05d", imguiExportCount++);
+        path += number;
+    }
+    path += exportExtension(imguiExportFormat);
+    try {
+        particleManager->exportFrame(path, imguiExportFormat);
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+        imguiExportSequence = false;
+    }
+}
+
+void toggleReplay()
+{
+    if (replay->isOpen())
+    {
+        replay->close();
+        return;
+    }
+    try {
+        replay->open(imguiReplayPath);
+        isStart = false;
+        imguiReplayFrame = 0;
+        imguiReplayPlaying = false;
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+    }
+}
+
+void restoreCheckpoint()
+{
+    // A manager with the capacity and the settings of the saved run
+    try {
+        RwSceneDesc desc = panelSceneDesc();
+        desc.checkpoint = imguiCheckpointPath;
+        ParticleManager* restored = simulation->createScene(desc, particleShader);
+        delete particleManager;
+        particleManager = restored;
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+        return;
+    }
+
+    // The panel pushes its settings every step, so it takes over the restored ones
+    SimulationParameters parameters = particleManager->getParameters();
+    imguiParticleGenMode = parameters.mode;
+    imguiBackend = parameters.backend;
+    imguiBoundingX = parameters.boundingX;
+    imguiBoundingZ = parameters.boundingZ;
+    imguiImplicitViscosity = parameters.implicitViscosity != 0;
+    imguiViscosityIterations = parameters.viscosityIterations;
+    imguiBoundaryParticles = parameters.useBoundary != 0;
+    imguiSleeping = parameters.useSleeping != 0;
+    imguiEmit = !particleManager->emitters.empty() && particleManager->emitters[0].enabled;
+    if (!particleManager->emitters.empty())
+    {
+        imguiEmitterType = particleManager->emitters[0].type;
+        imguiEmitRate = particleManager->emitters[0].rate;
+        imguiEmitSpeed = particleManager->emitters[0].speed;
+    }
+    imguiDrainSink = !particleManager->sinks.empty();
+    imguiKillPlane = !particleManager->killPlanes.empty();
+    if (imguiKillPlane)
+        imguiKillPlaneHeight = particleManager->killPlanes[0].w;
+
+    // The checkpoint brings its obstacles, the ticks only follow them
+    vector<ColliderObstacle> obstacles;
+    vector<vec3> corners;
+    particleManager->collider.getObstacles(obstacles, corners);
+    imguiSphereObstacle = false;
+    imguiMeshObstacle = false;
+    for (const ColliderObstacle& obstacle : obstacles)
+    {
+        imguiSphereObstacle |= obstacle.type == OBSTACLE_SPHERE;
+        imguiMeshObstacle |= obstacle.type == OBSTACLE_MESH;
+    }
+}
+
+void importScene()
+{
+    // A manager sized to the scene
+    try {
+        RwSceneDesc desc = panelSceneDesc();
+        desc.scene = imguiImportPath;
+        ParticleManager* imported = simulation->createScene(desc, particleShader);
+        delete particleManager;
+        particleManager = imported;
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+        return;
+    }
+
+    // The buffer holds just the scene, there is no room for inflow
+    imguiEmit = false;
+    configureColliders();
+}
+
+RwSceneDesc panelSceneDesc()
+{
+    RwSceneDesc desc;
+    rwDefaultSceneDesc(&desc);
+    desc.mode = imguiParticleGenMode;
+    desc.backend = imguiBackend;
+    desc.boundingX = imguiBoundingX;
+    desc.boundingZ = imguiBoundingZ;
+    desc.implicitViscosity = imguiImplicitViscosity;
+    desc.viscosityIterations = imguiViscosityIterations;
+    desc.useBoundary = imguiBoundaryParticles;
+    desc.useSleeping = imguiSleeping;
+    return desc;
+}
+
 void display()
 {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    renderScene();
+
+    // Draw ImGui
+    draw_gui(window);
+
+    glfwSwapBuffers(window);
+}
+
+void renderScene()
+{
     // Render Particles
+    // A new manager may have another capacity than the staging buffers
+    if ((isReset || isRestore || isImport) && recorder->isRecording())
+        recorder->stop();
+    if ((isReset || isRestore || isImport) && publisher->isRecording())
+        publisher->stop();
     if (isReset) {
-        particleManager = new ParticleManager(N*N*N, imguiParticleGenMode, particleShader, computeShader);
+        // Pour mode starts empty, the library gives it room for the inflow
+        ParticleManager* generated = simulation->createScene(panelSceneDesc(), particleShader);
+        delete particleManager;
+        particleManager = generated;
+        imguiEmit = imguiParticleGenMode == 5;
+        configureColliders();
         isReset = false;
     }
+    if (isRestore) {
+        restoreCheckpoint();
+        isRestore = false;
+    }
+    if (isImport) {
+        importScene();
+        isImport = false;
+    }
 
     glUseProgram(particleShader);
 
@@ -375,11 +910,31 @@ void display()
     // Configure other uniform attributes
     configureUniforms();
     
-    if (isStart == true)
+    if (replay->isOpen())
+    {
+        // No compute passes, the decode thread catches up with the latest frame asked for
+        if (imguiReplayPlaying && replay->getFrameCount() > 0)
+            imguiReplayFrame = (imguiReplayFrame + 1) % replay->getFrameCount();
+        replay->seek(imguiReplayFrame);
+        replay->draw();
+    }
+    else if (isStart == true)
     {
         particleManager->setBounding(TYPE_X_AXIS, imguiBoundingX);
         particleManager->setBounding(TYPE_Z_AXIS, imguiBoundingZ);
+        particleManager->setImplicitViscosity(imguiImplicitViscosity, imguiViscosityIterations);
+        particleManager->setBoundaryParticles(imguiBoundaryParticles);
+        particleManager->setSleeping(imguiSleeping);
+        particleManager->setBackend(imguiBackend, imguiCpuKernel);
+        particleManager->setCpuScheduling(imguiCellsPerTask, imguiPinThreads, imguiSymmetricPairs);
+        particleManager->setIncrementalGrid(imguiIncrementalGrid);
+        particleManager->setRecorder(recorder->isRecording() ? recorder : NULL);
+        particleManager->setPublisher(publisher->isRecording() ? publisher : NULL);
+        configureEmitters();
+        configureRemoval();
         particleManager->draw(timeStep, UPDATE_DRAW_TYPE);
+        if (imguiExportSequence)
+            exportFrame();
     }
     else
     {
@@ -387,11 +942,114 @@ void display()
     }
 
     glUseProgram(0);
+}
 
-    // Draw ImGui
-    draw_gui(window);
+int runHeadless(int argc, char** argv)
+{
+    // --headless [--frames n] [--output prefix] [--format png|raw] [--size WxH] [--mode m] [--dt s] [--scene file]
+    int frames = 240;
+    string output = "frame";
+    int format = OFFSCREEN_PNG;
+    int frameWidth = 1280, frameHeight = 720;
+    int mode = imguiParticleGenMode;
+    float dt = 1.f / 60.f;
+    string scene;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        string option = argv[i], value = argv[i + 1];
+        if (option == "--frames")
+            frames = atoi(value.c_str());
+        else if (option == "--output")
+            output = value;
+        else if (option == "--format")
+            format = value == "raw" ? OFFSCREEN_RAW : OFFSCREEN_PNG;
+        else if (option == "--size")
+            sscanf(value.c_str(), "%dx%d", &frameWidth, &frameHeight);
+        else if (option == "--mode")
+            mode = atoi(value.c_str());
+        else if (option == "--dt")
+            dt = (float)atof(value.c_str());
+        else if (option == "--scene")
+            scene = value;
+        else
+            cerr << "Unknown option " << option << endl;
+    }
 
-    glfwSwapBuffers(window);
+    OffscreenRenderer renderer;
+    try {
+        initState();
+        width = frameWidth;
+        height = frameHeight;
+        initSimulation(true);
+        initOpenGL();
+        initParticle();
+        cout << "Headless: " << simulation->describe() << endl;
+
+        // The first frame builds the scene like a reset of the panel, or imports it
+        imguiParticleGenMode = mode;
+        if (!scene.empty())
+        {
+            snprintf(imguiImportPath, sizeof(imguiImportPath), "%s", scene.c_str());
+            isImport = true;
+        }
+        isStart = true;
+        timeStep = dt;
+        renderer.create(frameWidth, frameHeight, output, format);
+        for (int f = 0; f < frames; f++)
+        {
+            renderer.begin();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            renderScene();
+            renderer.end();
+            if ((f + 1) % 30 == 0 || f + 1 == frames)
+                cout << "Frame " << f + 1 << " / " << frames << endl;
+            if (!renderer.getError().empty())
+                throw runtime_error(renderer.getError());
+        }
+        renderer.finish();
+        if (!renderer.getError().empty())
+            throw runtime_error(renderer.getError());
+        cout << renderer.getFramesWritten() << " frames written" << endl;
+    }
+    catch (const exception& e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        renderer.destroy();
+        cleanup();
+        return -1;
+    }
+
+    renderer.destroy();
+    cleanup();
+    return 0;
+}
+
+int runServer(const string& socketPath)
+{
+    // --serve [socket], jobs run until a client sends shutdown
+    try {
+        JobServer server;
+        server.run(socketPath);
+    }
+    catch (const exception& e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
+
+int submitRequest(int argc, char** argv)
+{
+    // --submit socket key=value ..., or status / shutdown; prints the replies
+    string request;
+    for (int i = 3; i < argc; i++)
+        request += (i > 3 ? " " : "") + string(argv[i]);
+    try {
+        return submitJob(argv[2], request, cout) ? 0 : 1;
+    }
+    catch (const exception& e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
 }
 
 void idle()
@@ -408,6 +1066,18 @@ void idle()
         imguiFPS = frameCount;
         timer = 0.f;
         frameCount = 0;
+
+        // Step statistics, the explicit viscosity limit is what the implicit solve removes
+        if (particleManager && isStart)
+        {
+            imguiStepCost = particleManager->getStepCost();
+            particleManager->getTimeStepLimits(imguiViscosityLimit, imguiCflLimit);
+            imguiActiveFraction = particleManager->getActiveFraction();
+            imguiParticleNum = particleManager->getLiveCount();
+            imguiBrickCount = particleManager->getBrickCount();
+            imguiSchedulerStats = particleManager->getCpuSchedulerStats();
+            imguiGridStats = particleManager->getGridStats();
+        }
     }
 
     // Set calculate time type
@@ -440,8 +1110,13 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 void cleanup()
 {
     if (window) window = NULL;
-    if (computeShader) { glDeleteProgram(computeShader); computeShader = 0; }
+    if (recorder) { delete recorder; recorder = NULL; }
+    if (publisher) { delete publisher; publisher = NULL; }
+    if (replay) { delete replay; replay = NULL; }
     if (particleShader) { glDeleteProgram(particleShader); particleShader = 0; }
+    // The scene before its context, a headless context goes with it
+    if (particleManager) { delete particleManager; particleManager = NULL; }
+    if (simulation) { delete simulation; simulation = NULL; }
     
     // clear uniform location
     uniModel = 0;
@@ -0,0 +1,177 @@
+#include "RealWaterCore.h"
+#include "Simulation.hpp"
+#include <string>
+#include <cstddef>
+#include <stdexcept>
+
+static_assert(sizeof(Particle) == RW_ATTRIBUTE_STRIDE * sizeof(float), "RW_ATTRIBUTE_STRIDE must match Particle");
+
+struct RwContext
+{
+	SimulationContext simulation;
+	string description;
+};
+
+struct RwScene
+{
+	RwContext* context;
+	ParticleManager* manager;
+	const Particle* mapped;		// live particles while the attributes are mapped
+	GLuint mappedCount;
+};
+
+// Exceptions end at the interface, the message stays for rwGetError
+static thread_local string lastError;
+
+static void fail(const exception& e)
+{
+	lastError = e.what();
+}
+
+const char* rwGetError(void)
+{
+	return lastError.c_str();
+}
+
+RwContext* rwCreateContext(int flags)
+{
+	RwContext* context = new RwContext();
+	try {
+		context->simulation.create(flags == RW_CONTEXT_HEADLESS);
+		context->description = context->simulation.describe();
+	}
+	catch (const exception& e) {
+		fail(e);
+		delete context;
+		return NULL;
+	}
+	return context;
+}
+
+void rwDestroyContext(RwContext* context)
+{
+	delete context;
+}
+
+const char* rwDescribeContext(RwContext* context)
+{
+	return context ? context->description.c_str() : "";
+}
+
+void rwDefaultSceneDesc(RwSceneDesc* desc)
+{
+	desc->mode = 4;
+	desc->capacity = 0;
+	desc->checkpoint = NULL;
+	desc->scene = NULL;
+	desc->backend = RW_BACKEND_GPU;
+	desc->boundingX = BOUNDING_DEFAULT;
+	desc->boundingZ = BOUNDING_DEFAULT;
+	desc->implicitViscosity = 0;
+	desc->viscosityIterations = VISCOSITY_CG_ITERATIONS;
+	desc->useBoundary = 0;
+	desc->useSleeping = 0;
+}
+
+RwScene* rwCreateScene(RwContext* context, const RwSceneDesc* desc)
+{
+	if (!context || !desc)
+		return NULL;
+	RwScene* scene = new RwScene();
+	scene->context = context;
+	scene->mapped = NULL;
+	scene->mappedCount = 0;
+	try {
+		scene->manager = context->simulation.createScene(*desc);
+	}
+	catch (const exception& e) {
+		fail(e);
+		delete scene;
+		return NULL;
+	}
+	return scene;
+}
+
+void rwDestroyScene(RwScene* scene)
+{
+	if (!scene)
+		return;
+	rwUnmapAttributes(scene);
+	scene->context->simulation.releaseScene(scene->manager);
+	delete scene;
+}
+
+int rwStep(RwScene* scene, int steps, float deltaTime)
+{
+	if (!scene)
+		return -1;
+	rwUnmapAttributes(scene);
+	try {
+		for (int i = 0; i < steps; i++)
+			scene->manager->step(deltaTime);
+	}
+	catch (const exception& e) {
+		fail(e);
+		return -1;
+	}
+	return 0;
+}
+
+int rwGetLiveCount(RwScene* scene)
+{
+	if (!scene)
+		return -1;
+	return scene->mapped ? (int)scene->mappedCount : scene->manager->getLiveCount();
+}
+
+const float* rwMapAttribute(RwScene* scene, int attribute, int* count)
+{
+	static const size_t offsets[] = { offsetof(Particle, currPos), offsetof(Particle, vel),
+		offsetof(Particle, surfaceNorm), offsetof(Particle, factor) };
+	if (count)
+		*count = 0;
+	if (!scene || attribute < RW_ATTRIBUTE_POSITION || attribute > RW_ATTRIBUTE_FACTOR)
+		return NULL;
+
+	// One mapping of the particle buffer serves every attribute
+	if (!scene->mapped)
+	{
+		try {
+			scene->mapped = scene->manager->mapParticles(scene->mappedCount);
+		}
+		catch (const exception& e) {
+			fail(e);
+			return NULL;
+		}
+	}
+	if (!scene->mapped)
+		return NULL;
+	if (count)
+		*count = (int)scene->mappedCount;
+	return (const float*)((const char*)scene->mapped + offsets[attribute]);
+}
+
+void rwUnmapAttributes(RwScene* scene)
+{
+	if (!scene || !scene->mapped)
+		return;
+	scene->manager->unmapParticles();
+	scene->mapped = NULL;
+	scene->mappedCount = 0;
+}
+
+int rwSaveCheckpoint(RwScene* scene, const char* path)
+{
+	if (!scene || !path)
+		return -1;
+	// The checkpoint maps the particle buffer itself
+	rwUnmapAttributes(scene);
+	try {
+		scene->manager->saveCheckpoint(path);
+	}
+	catch (const exception& e) {
+		fail(e);
+		return -1;
+	}
+	return 0;
+}
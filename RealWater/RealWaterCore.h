@@ -0,0 +1,76 @@
+#ifndef _REALWATER_CORE_H
+#define _REALWATER_CORE_H
+
+// C interface of the simulation core (RealWaterCore library), for programs that step scenes
+// without a window or a UI. A context holds the compiled programs, scenes are created on it
+// and share them. Every call of a context and its scenes stays on the thread that created
+// the context, the GL context is current there. Shaders load from shaders/ relative to the
+// working directory.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// rwCreateContext
+#define RW_CONTEXT_CURRENT 0		// run on the GL context current on the calling thread
+#define RW_CONTEXT_HEADLESS 1		// bring up a context without a window (EGL, no display needed)
+
+// rwMapAttribute, vec4 per particle with stride RW_ATTRIBUTE_STRIDE
+#define RW_ATTRIBUTE_POSITION 0
+#define RW_ATTRIBUTE_VELOCITY 1
+#define RW_ATTRIBUTE_NORMAL 2		// surface normal
+#define RW_ATTRIBUTE_FACTOR 3		// density, pressure, color field
+#define RW_ATTRIBUTE_STRIDE 24		// floats from one particle to the next
+
+// RwSceneDesc backend
+#define RW_BACKEND_GPU 0
+#define RW_BACKEND_CPU 1
+
+typedef struct RwContext RwContext;
+typedef struct RwScene RwScene;
+
+// A new scene, rwDefaultSceneDesc fills in the settings of the interactive app
+typedef struct RwSceneDesc
+{
+	int mode;					// generated scene 0 to 5 of the app, 5 pours from a nozzle
+	int capacity;				// particles, 0 for the size of the mode
+	const char* checkpoint;		// restore this checkpoint instead, its settings win, NULL for none
+	const char* scene;			// import this PLY, point cache or OBJ instead, NULL for none
+	int backend;				// RW_BACKEND_*
+	float boundingX;			// half extents of the container
+	float boundingZ;
+	int implicitViscosity;
+	int viscosityIterations;
+	int useBoundary;			// boundary particles on the container walls
+	int useSleeping;			// skip particles at rest
+} RwSceneDesc;
+
+// Message of the last failed call on this thread, empty if none
+const char* rwGetError(void);
+
+// NULL on failure
+RwContext* rwCreateContext(int flags);
+void rwDestroyContext(RwContext* context);		// destroy its scenes first
+const char* rwDescribeContext(RwContext* context);	// GL version and renderer
+
+void rwDefaultSceneDesc(RwSceneDesc* desc);
+RwScene* rwCreateScene(RwContext* context, const RwSceneDesc* desc);	// NULL on failure
+void rwDestroyScene(RwScene* scene);
+
+// Advances the scene, returns 0 or -1. Ends a mapping of the attributes
+int rwStep(RwScene* scene, int steps, float deltaTime);
+int rwGetLiveCount(RwScene* scene);				// stalls for the GPU, -1 on failure
+
+// The attribute of the first live particle, read in place on the GPU buffer until
+// rwUnmapAttributes or the next step. Stalls for the GPU, NULL on failure or if no particle
+// is alive. count receives the live particles
+const float* rwMapAttribute(RwScene* scene, int attribute, int* count);
+void rwUnmapAttributes(RwScene* scene);
+
+int rwSaveCheckpoint(RwScene* scene, const char* path);	// 0 or -1
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !_REALWATER_CORE_H
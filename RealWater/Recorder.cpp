@@ -0,0 +1,387 @@
+#include "Recorder.hpp"
+#include "FrameCodec.hpp"
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+static_assert(RECORD_POSITION == SHARED_RING_POSITION && RECORD_VELOCITY == SHARED_RING_VELOCITY && RECORD_COLOR == SHARED_RING_COLOR
+	&& RECORD_ID == SHARED_RING_ID,
+	"shared ring frames are packed frames");
+
+Recorder::Recorder() :
+	next(0),
+	acquired(-1),
+	recording(false),
+	attributes(0),
+	capacity(0),
+	file(NULL),
+	encoder(NULL),
+	fileOffset(0),
+	stopping(false),
+	framesWritten(0),
+	framesDropped(0),
+	bytesWritten(0),
+	bytesPacked(0),
+	writeMicroseconds(0),
+	encodeMicroseconds(0),
+	failed(false)
+{
+	for (int i = 0; i < RECORD_RING; i++)
+	{
+		slots[i].buffer = 0;
+		slots[i].mapped = NULL;
+		slots[i].fence = 0;
+		slots[i].state = SLOT_FREE;
+	}
+}
+
+Recorder::~Recorder()
+{
+	stop();
+}
+
+size_t Recorder::frameBytes(GLuint liveCount, int attributes)
+{
+	size_t floats = 0;
+	if (attributes & RECORD_POSITION) floats += 3;
+	if (attributes & RECORD_VELOCITY) floats += 3;
+	if (attributes & RECORD_COLOR) floats += 1;
+	if (attributes & RECORD_ID) floats += 1;
+	return floats * liveCount * sizeof(float);
+}
+
+void Recorder::start(const string& path, GLuint capacity, int attributes, vec3 boundsMin, vec3 boundsMax, float errorBound)
+{
+	stop();
+	int positionBits = errorBound > 0.f ? codecPositionBits(boundsMin, boundsMax, errorBound) : 0;
+	if (errorBound > 0.f && !positionBits)
+	{
+		stringstream ss;
+		ss << "Error bound " << errorBound << " is below the " << codecMaxError(boundsMin, boundsMax, CODEC_MAX_POSITION_BITS)
+			<< " of the finest position grid over the box!";
+		throw runtime_error(ss.str());
+	}
+	file = fopen(path.c_str(), "wb");
+	if (!file)
+		throw runtime_error("Could not open " + path + "!");
+	// Large sequential writes, the stream buffer only has to hold the headers
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+	RecordingHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+	header.version = RECORDING_VERSION;
+	header.attributes = attributes;
+	header.capacity = capacity;
+	for (int c = 0; c < 3; c++)
+	{
+		header.boundsMin[c] = boundsMin[c];
+		header.boundsMax[c] = boundsMax[c];
+	}
+	if (errorBound > 0.f)
+	{
+		header.positionBits = positionBits;
+		header.errorBound = errorBound;
+		header.keyframeInterval = CODEC_KEYFRAME_INTERVAL;
+		encoder = new FrameEncoder();
+		encoder->reset(header);
+	}
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		fclose(file);
+		file = NULL;
+		if (encoder) { delete encoder; encoder = NULL; }
+		throw runtime_error("Could not write " + path + "!");
+	}
+	this->path = path;
+	fileOffset = sizeof(header);
+	allocate(capacity, attributes);
+}
+
+void Recorder::publish(const string& name, GLuint capacity, int attributes, int slotCount)
+{
+	stop();
+	ring.create(name, slotCount, attributes, capacity);
+	allocate(capacity, attributes);
+}
+
+void Recorder::allocate(GLuint capacity, int attributes)
+{
+	this->capacity = capacity;
+	this->attributes = attributes;
+	frameOffsets.clear();
+	framesWritten = 0;
+	framesDropped = 0;
+	bytesWritten = 0;
+	bytesPacked = 0;
+	writeMicroseconds = 0;
+	encodeMicroseconds = 0;
+	failed = false;
+	{
+		lock_guard<mutex> lock(queueLock);
+		error.clear();
+	}
+
+	// Persistent and coherent, the writer reads what the pack pass wrote without mapping
+	// again once the fence has passed
+	GLsizeiptr size = sizeof(RecordFrameHeader) + frameBytes(capacity, attributes);
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	for (int i = 0; i < RECORD_RING; i++)
+	{
+		glGenBuffers(1, &slots[i].buffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, slots[i].buffer);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, size, NULL, flags);
+		slots[i].mapped = (char*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, flags);
+		slots[i].fence = 0;
+		slots[i].state = SLOT_FREE;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	next = 0;
+	acquired = -1;
+
+	stopping = false;
+	recording = true;
+	writer = thread(&Recorder::writerLoop, this);
+}
+
+void Recorder::stop()
+{
+	if (!recording)
+		return;
+
+	// An acquired buffer was never packed, the rest still goes to the file
+	if (acquired >= 0)
+	{
+		slots[acquired].state = SLOT_FREE;
+		acquired = -1;
+	}
+	for (int n = 0; n < RECORD_RING; n++)
+	{
+		Slot& slot = slots[(next + n) % RECORD_RING];
+		if (slot.state != SLOT_FENCED)
+			continue;
+		while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		slot.state = SLOT_WRITING;
+		lock_guard<mutex> lock(queueLock);
+		queue.push_back((int)(&slot - slots));
+	}
+	{
+		lock_guard<mutex> lock(queueLock);
+		stopping = true;
+	}
+	queueReady.notify_one();
+	writer.join();
+
+	if (ring.isOpen())
+	{
+		ring.close();
+		releaseStaging();
+		return;
+	}
+
+	// The index lets a reader seek to any frame. Behind a failed write the frames are not all
+	// in the file, without an index readers take it for unfinished
+	if (!failed)
+	{
+		RecordingFooter footer;
+		memset(&footer, 0, sizeof(footer));
+		footer.indexOffset = fileOffset;
+		footer.frameCount = frameOffsets.size();
+		memcpy(footer.magic, RECORDING_INDEX_MAGIC, sizeof(footer.magic));
+		if ((!frameOffsets.empty() && fwrite(frameOffsets.data(), sizeof(uint64_t), frameOffsets.size(), file) != frameOffsets.size())
+			|| fwrite(&footer, sizeof(footer), 1, file) != 1)
+			fail();
+	}
+	if (fclose(file) != 0 && !failed)
+		fail();
+	file = NULL;
+	if (encoder) { delete encoder; encoder = NULL; }
+	releaseStaging();
+}
+
+void Recorder::releaseStaging()
+{
+	for (int i = 0; i < RECORD_RING; i++)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, slots[i].buffer);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		glDeleteBuffers(1, &slots[i].buffer);
+		slots[i].buffer = 0;
+		slots[i].mapped = NULL;
+		slots[i].state = SLOT_FREE;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	recording = false;
+}
+
+bool Recorder::isRecording()
+{
+	return recording;
+}
+
+GLuint Recorder::acquire()
+{
+	if (!recording)
+		return 0;
+	if (failed)
+		return 0;
+	Slot& slot = slots[next];
+	if (slot.state != SLOT_FREE)
+	{
+		framesDropped++;
+		return 0;
+	}
+	slot.state = SLOT_ACQUIRED;
+	acquired = next;
+	next = (next + 1) % RECORD_RING;
+	return slot.buffer;
+}
+
+void Recorder::submit()
+{
+	if (acquired < 0)
+		return;
+	Slot& slot = slots[acquired];
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.state = SLOT_FENCED;
+	acquired = -1;
+}
+
+void Recorder::poll()
+{
+	if (!recording)
+		return;
+
+	// Oldest first, a frame waits behind the one before it so the file stays in order
+	for (int n = 0; n < RECORD_RING; n++)
+	{
+		Slot& slot = slots[(next + n) % RECORD_RING];
+		if (slot.state == SLOT_FREE || slot.state == SLOT_WRITING)
+			continue;
+		if (slot.state != SLOT_FENCED)
+			break;
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		slot.state = SLOT_WRITING;
+		{
+			lock_guard<mutex> lock(queueLock);
+			queue.push_back((int)(&slot - slots));
+		}
+		queueReady.notify_one();
+	}
+}
+
+int Recorder::getAttributes()
+{
+	return attributes;
+}
+
+RecorderStats Recorder::getStats()
+{
+	RecorderStats stats;
+	stats.framesWritten = framesWritten;
+	stats.framesDropped = framesDropped;
+	stats.bytesWritten = bytesWritten;
+	uint64_t micro = writeMicroseconds;
+	stats.writeSpeed = micro > 0 ? (float)((double)stats.bytesWritten / micro) : 0.0f;
+	size_t packed = bytesPacked;
+	stats.ratio = stats.bytesWritten > 0 ? (float)((double)packed / stats.bytesWritten) : 1.f;
+	micro = encodeMicroseconds;
+	stats.encodeSpeed = micro > 0 ? (float)((double)packed / micro) : 0.0f;
+	return stats;
+}
+
+string Recorder::getError()
+{
+	lock_guard<mutex> lock(queueLock);
+	return error;
+}
+
+void Recorder::fail()
+{
+	failed = true;
+	lock_guard<mutex> lock(queueLock);
+	if (error.empty())
+		error = "Could not write " + path + "!";
+}
+
+void Recorder::writerLoop()
+{
+	while (true)
+	{
+		int index;
+		{
+			unique_lock<mutex> lock(queueLock);
+			queueReady.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			index = queue.front();
+			queue.pop_front();
+		}
+		writeFrame(slots[index]);
+	}
+}
+
+void Recorder::writeFrame(Slot& slot)
+{
+	auto begin = chrono::steady_clock::now();
+
+	// The pack pass wrote the live count of its frame, only that much goes out
+	RecordFrameHeader header;
+	memcpy(&header, slot.mapped, sizeof(header));
+	if (header.liveCount > capacity)
+		header.liveCount = capacity;
+	size_t bytes = frameBytes(header.liveCount, attributes);
+	size_t packed = sizeof(header) + bytes;
+	if (ring.isOpen())
+	{
+		// Readers map the ring, there is nothing else to write
+		ring.publish(header.step, header.liveCount, slot.mapped + sizeof(header), bytes);
+		slot.state = SLOT_FREE;
+		framesWritten++;
+		bytesWritten += packed;
+		bytesPacked += packed;
+		writeMicroseconds += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+		return;
+	}
+	if (failed)
+	{
+		slot.state = SLOT_FREE;
+		framesDropped++;
+		return;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (encoder)
+	{
+		// The staging buffer is free again as soon as its frame is encoded
+		encoder->encode(header, (const float*)(slot.mapped + sizeof(header)), encoded);
+		slot.state = SLOT_FREE;
+		encodeMicroseconds += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+		written = written && fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+		bytes = encoded.size();
+	}
+	else
+	{
+		written = written && fwrite(slot.mapped + sizeof(header), 1, bytes, file) == bytes;
+		slot.state = SLOT_FREE;
+	}
+	if (!written)
+	{
+		fail();
+		framesDropped++;
+		return;
+	}
+	frameOffsets.push_back(fileOffset);
+	fileOffset += sizeof(header) + bytes;
+
+	framesWritten++;
+	bytesWritten += sizeof(header) + bytes;
+	bytesPacked += packed;
+	writeMicroseconds += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+}
@@ -0,0 +1,151 @@
+#ifndef _RECORDER_HPP
+#define _RECORDER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "SharedRing.hpp"
+
+using namespace glm;
+using namespace std;
+
+// Attributes of a recorded frame, one array each in this order, which pass 23 of sh_compute.glsl follows
+const int RECORD_POSITION = 1;		// vec3
+const int RECORD_VELOCITY = 2;		// vec3
+const int RECORD_COLOR = 4;			// color field, float
+const int RECORD_ID = 8;			// uint32 in the bits of a float, emission number of the particle
+const int RECORD_RING = 3;			// staging buffers in flight
+const uint32_t RECORDING_VERSION = 3;
+const char RECORDING_MAGIC[8] = "RWREC";
+const char RECORDING_INDEX_MAGIC[8] = "RWINDEX";
+
+// Front of a staging buffer, written by the pack pass, and of every frame in the file
+struct RecordFrameHeader
+{
+	GLuint step;
+	GLuint liveCount;
+	GLuint attributes;
+	GLuint pad;
+};
+
+// Front of a recording, the frames follow back to back
+struct RecordingHeader
+{
+	char magic[8];			// "RWREC"
+	uint32_t version;
+	uint32_t attributes;
+	uint32_t capacity;
+	uint32_t positionBits;	// quantized frames of FrameCodec.hpp, 0 if the frames hold floats
+	float errorBound;
+	uint32_t keyframeInterval;
+	float boundsMin[3];		// box the positions are quantized in
+	float boundsMax[3];
+};
+
+// Back of a finished recording, behind frameCount file offsets of the frames
+struct RecordingFooter
+{
+	uint64_t indexOffset;
+	uint64_t frameCount;
+	char magic[8];			// "RWINDEX"
+};
+
+struct RecorderStats
+{
+	size_t framesWritten;
+	size_t framesDropped;	// every staging buffer was still in flight
+	size_t bytesWritten;
+	float writeSpeed;		// MB/s of the writer thread while busy
+	float ratio;			// packed bytes per written byte
+	float encodeSpeed;		// MB/s of packed frames through the encoder, one core
+};
+
+class FrameEncoder;
+
+// Records frames without stalling the simulation. A compute pass packs the selected
+// attributes of the live particles into one of RECORD_RING persistently mapped staging
+// buffers and a fence follows it. Polled a frame or two later, a passed fence hands the
+// buffer to the writer thread, which streams it to the file and gives it back. With every
+// buffer in flight the frame is dropped instead of waited for. With an error bound the
+// writer compresses the frames on its way (FrameCodec.hpp). Published instead of recorded,
+// the writer copies the frames into a shared memory ring (SharedRing.hpp). A failed write,
+// a full disk, ends the recording: later frames are dropped and stop() leaves the file
+// without its index, getError() tells why.
+class Recorder {
+public:
+	Recorder();
+	~Recorder();
+	// Frames are compressed if errorBound > 0, positions inside the box to within the bound and
+	// those outside it at full precision. Throws runtime_error if the bound is finer than the
+	void start(const string& path, GLuint capacity, int attributes, vec3 boundsMin = vec3(0.f), vec3 boundsMax = vec3(0.f),
+		float errorBound = 0.f);	// finest grid holds over the box, or the file does not open
+	// Frames into the named shared memory ring instead of a file, throws runtime_error
+	void publish(const string& name, GLuint capacity, int attributes, int slotCount = SHARED_RING_DEFAULT_SLOTS);
+	void stop();					// waits for the frames in flight, then writes the index or closes the ring
+	bool isRecording();
+	GLuint acquire();				// staging buffer for the next frame, 0 to drop it
+	void submit();					// fence behind the pack pass into the acquired buffer
+	void poll();					// frames whose fence passed go to the writer, never blocks
+	int getAttributes();
+	RecorderStats getStats();
+	string getError();				// first write error of the last recording, empty if none
+
+	// Bytes of a frame behind its header
+	static size_t frameBytes(GLuint liveCount, int attributes);
+
+private:
+	// Free, acquired for packing, fenced on the GPU, with the writer
+	enum { SLOT_FREE, SLOT_ACQUIRED, SLOT_FENCED, SLOT_WRITING };
+
+	struct Slot
+	{
+		GLuint buffer;
+		char* mapped;
+		GLsync fence;
+		atomic<int> state;
+	};
+
+	Slot slots[RECORD_RING];
+	int next;						// slot of the next acquire, frames stay in order
+	int acquired;
+	bool recording;
+	int attributes;
+	GLuint capacity;
+	FILE* file;
+	string path;
+	SharedRingWriter ring;			// open while publishing
+	FrameEncoder* encoder;			// NULL if the frames are written as packed
+	vector<char> encoded;
+	vector<uint64_t> frameOffsets;	// writer thread only
+	uint64_t fileOffset;
+
+	thread writer;
+	mutex queueLock;
+	condition_variable queueReady;
+	deque<int> queue;				// fenced slots in frame order
+	bool stopping;
+	atomic<size_t> framesWritten;
+	atomic<size_t> framesDropped;
+	atomic<size_t> bytesWritten;
+	atomic<size_t> bytesPacked;
+	atomic<uint64_t> writeMicroseconds;
+	atomic<uint64_t> encodeMicroseconds;
+	atomic<bool> failed;			// a write went wrong, the file is of no use
+	string error;					// under queueLock
+
+	void allocate(GLuint capacity, int attributes);	// staging buffers and writer thread
+	void releaseStaging();
+	void writerLoop();
+	void writeFrame(Slot& slot);
+	void fail();					// writer thread, after a short write or close
+};
+
+#endif // !_RECORDER_HPP
@@ -0,0 +1,257 @@
+#include "ReplayPlayer.hpp"
+#include <cstddef>
+#include <stdexcept>
+
+ReplayPlayer::ReplayPlayer() :
+	front(-1),
+	opened(false),
+	requested(-1),
+	decoded(-1),
+	stopping(false)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		buffers[i].vbo = 0;
+		buffers[i].vao = 0;
+		buffers[i].mapped = NULL;
+		buffers[i].fence = 0;
+		buffers[i].state = BUFFER_FREE;
+		buffers[i].frame = -1;
+		buffers[i].step = 0;
+		buffers[i].liveCount = 0;
+	}
+}
+
+ReplayPlayer::~ReplayPlayer()
+{
+	close();
+}
+
+void ReplayPlayer::open(const string& path)
+{
+	close();
+	reader.open(path);
+
+	// Written by the decode thread through the mapping, read by the vertex shader
+	GLsizeiptr size = glm::max<GLuint>(reader.header.capacity, 1) * sizeof(ReplayVertex);
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	for (int i = 0; i < 2; i++)
+	{
+		Buffer& buffer = buffers[i];
+		glGenVertexArrays(1, &buffer.vao);
+		glBindVertexArray(buffer.vao);
+		glGenBuffers(1, &buffer.vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer.vbo);
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		buffer.mapped = (ReplayVertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+		// Position, velocity and factor, the surface normal is a constant attribute
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(ReplayVertex), (void*)offsetof(ReplayVertex, pos));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(ReplayVertex), (void*)offsetof(ReplayVertex, vel));
+		glDisableVertexAttribArray(2);
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(ReplayVertex), (void*)offsetof(ReplayVertex, factor));
+		buffer.fence = 0;
+		buffer.state = BUFFER_FREE;
+		buffer.frame = -1;
+		buffer.liveCount = 0;
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	front = -1;
+	decoded = -1;
+	error.clear();
+	stopping = false;
+	opened = true;
+	requested = reader.frameCount() > 0 ? 0 : -1;
+	decoder = thread(&ReplayPlayer::decodeLoop, this);
+}
+
+void ReplayPlayer::close()
+{
+	if (!opened)
+		return;
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_one();
+	decoder.join();
+
+	for (int i = 0; i < 2; i++)
+	{
+		Buffer& buffer = buffers[i];
+		if (buffer.fence)
+			glDeleteSync(buffer.fence);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer.vbo);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glDeleteBuffers(1, &buffer.vbo);
+		glDeleteVertexArrays(1, &buffer.vao);
+		buffer.vbo = 0;
+		buffer.vao = 0;
+		buffer.mapped = NULL;
+		buffer.fence = 0;
+		buffer.state = BUFFER_FREE;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	reader.close();
+	front = -1;
+	opened = false;
+}
+
+bool ReplayPlayer::isOpen()
+{
+	return opened;
+}
+
+void ReplayPlayer::seek(int frame)
+{
+	if (!opened || reader.frameCount() == 0)
+		return;
+	{
+		lock_guard<mutex> guard(lock);
+		requested = glm::clamp(frame, 0, (int)reader.frameCount() - 1);
+	}
+	wake.notify_one();
+}
+
+void ReplayPlayer::draw()
+{
+	if (!opened)
+		return;
+
+	// A complete frame replaces the one on screen, which is free again once the GPU is
+	// past its last draw
+	for (int i = 0; i < 2; i++)
+	{
+		if (buffers[i].state != BUFFER_READY)
+			continue;
+		if (front >= 0)
+			buffers[front].state = BUFFER_FENCED;
+		front = i;
+		buffers[i].state = BUFFER_FRONT;
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		Buffer& buffer = buffers[i];
+		if (buffer.state != BUFFER_FENCED)
+			continue;
+		if (buffer.fence)
+		{
+			GLenum status = glClientWaitSync(buffer.fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				continue;
+			glDeleteSync(buffer.fence);
+			buffer.fence = 0;
+		}
+		{
+			lock_guard<mutex> guard(lock);
+			buffer.state = BUFFER_FREE;
+		}
+		wake.notify_one();
+	}
+
+	if (front < 0)
+		return;
+	Buffer& buffer = buffers[front];
+	glBindVertexArray(buffer.vao);
+	glVertexAttrib4f(2, -1.f, 0.f, 0.f, 0.f);
+	glDrawArrays(GL_POINTS, 0, buffer.liveCount);
+	glBindVertexArray(0);
+	if (buffer.fence)
+		glDeleteSync(buffer.fence);
+	buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+int ReplayPlayer::getFrameCount()
+{
+	return opened ? (int)reader.frameCount() : 0;
+}
+
+int ReplayPlayer::getFrame()
+{
+	return front >= 0 ? buffers[front].frame : -1;
+}
+
+GLuint ReplayPlayer::getStep()
+{
+	return front >= 0 ? buffers[front].step : 0;
+}
+
+int ReplayPlayer::getLiveCount()
+{
+	return front >= 0 ? (int)buffers[front].liveCount : 0;
+}
+
+string ReplayPlayer::getError()
+{
+	lock_guard<mutex> guard(lock);
+	return error;
+}
+
+void ReplayPlayer::decodeLoop()
+{
+	RecordFrameHeader header;
+	vector<float> data;
+	while (true)
+	{
+		int frame;
+		Buffer* target = NULL;
+		{
+			unique_lock<mutex> guard(lock);
+			wake.wait(guard, [&]
+			{
+				if (stopping)
+					return true;
+				if (requested < 0 || requested == decoded)
+					return false;
+				for (int i = 0; i < 2; i++)
+					if (buffers[i].state == BUFFER_FREE)
+						target = &buffers[i];
+				return target != NULL;
+			});
+			if (stopping)
+				return;
+			frame = requested;
+			target->state = BUFFER_DECODING;
+		}
+
+		try {
+			reader.read(frame, header, data);
+			fill(*target, frame, header, data);
+			lock_guard<mutex> guard(lock);
+			decoded = frame;
+			target->state = BUFFER_READY;
+		}
+		catch (const exception& e) {
+			lock_guard<mutex> guard(lock);
+			error = e.what();
+			decoded = frame;
+			target->state = BUFFER_FREE;
+		}
+	}
+}
+
+void ReplayPlayer::fill(Buffer& buffer, int frame, const RecordFrameHeader& header, const vector<float>& data)
+{
+	// SoA arrays of the recording to the interleaved vertices, missing attributes are zero
+	GLuint n = glm::min(header.liveCount, reader.header.capacity);
+	int attributes = reader.header.attributes;
+	const float* positions = attributes & RECORD_POSITION ? data.data() : NULL;
+	const float* velocities = attributes & RECORD_VELOCITY ? data.data() + (positions ? 3 * header.liveCount : 0) : NULL;
+	const float* colors = attributes & RECORD_COLOR
+		? data.data() + (positions ? 3 * header.liveCount : 0) + (velocities ? 3 * header.liveCount : 0) : NULL;
+	for (GLuint i = 0; i < n; i++)
+	{
+		ReplayVertex vertex;
+		vertex.pos = positions ? vec4(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2], 1.f) : vec4(0.f, 0.f, 0.f, 1.f);
+		vertex.vel = velocities ? vec4(velocities[3 * i], velocities[3 * i + 1], velocities[3 * i + 2], 0.f) : vec4(0.f);
+		vertex.factor = vec4(0.f, 0.f, colors ? colors[i] : 0.f, 0.f);
+		buffer.mapped[i] = vertex;
+	}
+	buffer.frame = frame;
+	buffer.step = header.step;
+	buffer.liveCount = n;
+}
@@ -0,0 +1,79 @@
+#ifndef _REPLAY_PLAYER_HPP
+#define _REPLAY_PLAYER_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <glm/glm.hpp>
+#include <GL/glew.h>
+#include "FrameCodec.hpp"
+
+using namespace glm;
+using namespace std;
+
+// Vertex of a replayed particle, laid out for the attributes of sh_v_particle
+struct ReplayVertex
+{
+	vec4 pos;
+	vec4 vel;
+	vec4 factor;	// color field in z
+};
+
+// Plays a finished recording back without the simulation. The recording is mapped and its
+// frames are found through the index at its end, so seeking costs one lookup (and the
+// decode from the keyframe before for compressed frames). A decode thread writes the
+// requested frame into the back one of two persistently mapped vertex buffers while the
+// front one is drawn; the buffers swap once the frame is complete and the GPU is done
+// with the old front.
+class ReplayPlayer {
+public:
+	ReplayPlayer();
+	~ReplayPlayer();
+	void open(const string& path);		// throws runtime_error
+	void close();
+	bool isOpen();
+	void seek(int frame);				// latest request wins, frames in between are skipped
+	void draw();						// with the particle shader in use, never waits
+	int getFrameCount();
+	int getFrame();						// frame on screen, -1 before the first one arrived
+	GLuint getStep();					// simulation step of the frame on screen
+	int getLiveCount();
+	string getError();					// last decode error, empty if none
+
+private:
+	// Free for the decoder, decoding, complete, on screen, off screen until its fence passes
+	enum { BUFFER_FREE, BUFFER_DECODING, BUFFER_READY, BUFFER_FRONT, BUFFER_FENCED };
+
+	struct Buffer
+	{
+		GLuint vbo;
+		GLuint vao;
+		ReplayVertex* mapped;
+		GLsync fence;				// behind the last draw of the buffer
+		atomic<int> state;
+		int frame;
+		GLuint step;
+		GLuint liveCount;
+	};
+
+	RecordingReader reader;			// decode thread only once it runs
+	Buffer buffers[2];
+	int front;
+	bool opened;
+	atomic<int> requested;
+	int decoded;					// last frame the decode thread finished
+
+	thread decoder;
+	mutex lock;
+	condition_variable wake;
+	bool stopping;
+	string error;
+
+	void decodeLoop();
+	void fill(Buffer& buffer, int frame, const RecordFrameHeader& header, const vector<float>& data);
+};
+
+#endif // !_REPLAY_PLAYER_HPP
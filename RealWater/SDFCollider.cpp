@@ -0,0 +1,352 @@
+#include "SDFCollider.hpp"
+#include "utils.hpp"
+#include "ThreadPool.hpp"
+#include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <cfloat>
+#include <stdexcept>
+
+static const float PI_F = 3.1415926535f;
+static const int BAKE_ROWS_PER_TASK = 16;	// x rows of the field per task, a few hundred samples
+
+// Bakes run on one pool for the process, created by the first. Scenes on other threads
+// take turns, a pool runs one job at a time
+static ThreadPool& bakePool(unique_lock<mutex>& turn)
+{
+	static mutex lock;
+	static ThreadPool pool;
+	turn = unique_lock<mutex>(lock);
+	return pool;
+}
+
+// Closest point on triangle abc to p (Ericson, Real-Time Collision Detection 5.1.5)
+static vec3 closestPointOnTriangle(vec3 p, vec3 a, vec3 b, vec3 c)
+{
+	vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0.f && d2 <= 0.f) return a;
+
+	vec3 bp = p - b;
+	float d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0.f && d4 <= d3) return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) return a + ab * (d1 / (d1 - d3));
+
+	vec3 cp = p - c;
+	float d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0.f && d5 <= d6) return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) return a + ac * (d2 / (d2 - d6));
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	float denom = 1.f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Signed solid angle of triangle abc seen from p (Van Oosterom and Strackee)
+static float solidAngle(vec3 p, vec3 a, vec3 b, vec3 c)
+{
+	a -= p; b -= p; c -= p;
+	float la = length(a), lb = length(b), lc = length(c);
+	float numerator = dot(a, cross(b, c));
+	float denominator = la * lb * lc + dot(a, b) * lc + dot(a, c) * lb + dot(b, c) * la;
+	return 2.f * atan2(numerator, denominator);
+}
+
+// Signed distance to an axis aligned box (negative inside)
+static float boxDistance(vec3 p, vec3 center, vec3 halfExtent)
+{
+	vec3 q = abs(p - center) - halfExtent;
+	return length(max(q, vec3(0.f))) + glm::min(glm::max(q.x, glm::max(q.y, q.z)), 0.f);
+}
+
+SDFCollider::SDFCollider(vec3 domainMin, vec3 domainMax, float cellSize) :
+	domainMin(domainMin),
+	cellSize(cellSize),
+	dirty(true),
+	texture(0)
+{
+	// Samples sit on texel centers, the domain is rounded up to whole cells
+	resolution = ivec3(ceil((domainMax - domainMin) / cellSize));
+	this->domainMax = domainMin + vec3(resolution) * cellSize;
+}
+
+void SDFCollider::setContainer(vec3 minCorner, vec3 maxCorner, bool openTop)
+{
+	Shape container;
+	container.type = SHAPE_CONTAINER;
+	container.a = minCorner;
+	container.b = maxCorner;
+	container.openTop = openTop;
+	container.firstTriangle = 0;
+	container.triangleCount = 0;
+
+	// Keep a single container, always in front. It is not baked, the field stays as it is
+	if (!shapes.empty() && shapes[0].type == SHAPE_CONTAINER)
+		shapes[0] = container;
+	else
+		shapes.insert(shapes.begin(), container);
+}
+
+void SDFCollider::getContainer(vec3& minCorner, vec3& maxCorner)
+{
+	minCorner = vec3(-FLT_MAX);
+	maxCorner = vec3(FLT_MAX);
+	if (shapes.empty() || shapes[0].type != SHAPE_CONTAINER)
+		return;
+	minCorner = shapes[0].a;
+	maxCorner = vec3(shapes[0].b.x, shapes[0].openTop ? FLT_MAX : shapes[0].b.y, shapes[0].b.z);
+}
+
+void SDFCollider::addBox(vec3 center, vec3 halfExtent)
+{
+	Shape box = { SHAPE_BOX, center, halfExtent, false, 0, 0 };
+	shapes.push_back(box);
+	dirty = true;
+}
+
+void SDFCollider::addSphere(vec3 center, float radius)
+{
+	Shape sphere = { SHAPE_SPHERE, center, vec3(radius, 0.f, 0.f), false, 0, 0 };
+	shapes.push_back(sphere);
+	dirty = true;
+}
+
+void SDFCollider::addMesh(string filename, vec3 center, float scale)
+{
+	vector<vec3> vertices;
+	vector<uvec3> triangles;
+	loadOBJ(filename, vertices, triangles);
+	if (triangles.empty())
+		return;
+
+	// Center the mesh on its bounding box, then scale and move it
+	vec3 lo = vertices[0], hi = vertices[0];
+	for (auto it = vertices.begin(); it != vertices.end(); ++it)
+	{
+		lo = glm::min(lo, *it);
+		hi = glm::max(hi, *it);
+	}
+	vec3 meshCenter = 0.5f * (lo + hi);
+
+	Shape mesh;
+	mesh.type = SHAPE_MESH;
+	mesh.openTop = false;
+	mesh.firstTriangle = meshVertices.size() / 3;
+	mesh.triangleCount = triangles.size();
+	mesh.a = vec3(FLT_MAX);
+	mesh.b = vec3(-FLT_MAX);
+	for (auto it = triangles.begin(); it != triangles.end(); ++it)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			vec3 v = center + (vertices[(*it)[k]] - meshCenter) * scale;
+			meshVertices.push_back(v);
+			mesh.a = glm::min(mesh.a, v);
+			mesh.b = glm::max(mesh.b, v);
+		}
+	}
+	shapes.push_back(mesh);
+	dirty = true;
+}
+
+void SDFCollider::clearObstacles()
+{
+	bool hasContainer = !shapes.empty() && shapes[0].type == SHAPE_CONTAINER;
+	shapes.resize(hasContainer ? 1 : 0);
+	meshVertices.clear();
+	dirty = true;
+}
+
+void SDFCollider::getObstacles(vector<ColliderObstacle>& obstacles, vector<vec3>& corners)
+{
+	obstacles.clear();
+	for (auto it = shapes.begin(); it != shapes.end(); ++it)
+	{
+		if (it->type == SHAPE_CONTAINER)
+			continue;
+		ColliderObstacle obstacle = { (int32_t)it->type, it->a, it->b, (uint32_t)it->firstTriangle, (uint32_t)it->triangleCount };
+		obstacles.push_back(obstacle);
+	}
+	corners = meshVertices;
+}
+
+void SDFCollider::setObstacles(const ColliderObstacle* obstacles, size_t count, const vec3* corners, size_t cornerCount)
+{
+	for (size_t i = 0; i < count; i++)
+		if ((obstacles[i].type != OBSTACLE_BOX && obstacles[i].type != OBSTACLE_SPHERE && obstacles[i].type != OBSTACLE_MESH)
+			|| (obstacles[i].type == OBSTACLE_MESH
+				&& 3 * ((uint64_t)obstacles[i].firstTriangle + obstacles[i].triangleCount) > cornerCount))
+			throw runtime_error("Collider obstacle out of range!");
+
+	clearObstacles();
+	meshVertices.assign(corners, corners + cornerCount);
+	for (size_t i = 0; i < count; i++)
+	{
+		const ColliderObstacle& obstacle = obstacles[i];
+		Shape shape = { (ShapeType)obstacle.type, obstacle.a, obstacle.b, false, obstacle.firstTriangle, obstacle.triangleCount };
+		shapes.push_back(shape);
+	}
+}
+
+float SDFCollider::meshDistance(const Shape& shape, vec3 p)
+{
+	// Far from the mesh the distance to its bounds is a safe lower bound
+	float band = 4.f * cellSize;
+	vec3 halfExtent = 0.5f * (shape.b - shape.a);
+	float boundsDistance = boxDistance(p, shape.a + halfExtent, halfExtent);
+	if (boundsDistance > band)
+		return boundsDistance;
+
+	float minDistance = FLT_MAX;
+	float winding = 0.f;
+	for (size_t t = shape.firstTriangle; t < shape.firstTriangle + shape.triangleCount; t++)
+	{
+		vec3 a = meshVertices[3 * t], b = meshVertices[3 * t + 1], c = meshVertices[3 * t + 2];
+		minDistance = glm::min(minDistance, length(p - closestPointOnTriangle(p, a, b, c)));
+		winding += solidAngle(p, a, b, c);
+	}
+
+	// Generalized winding number, robust to small cracks in the mesh
+	bool inside = glm::abs(winding) > 2.f * PI_F;
+	return inside ? -minDistance : minDistance;
+}
+
+float SDFCollider::shapeDistance(const Shape& shape, vec3 p)
+{
+	switch (shape.type)
+	{
+	case SHAPE_CONTAINER:
+	{
+		// Fluid is inside, distance to the nearest wall
+		vec3 toMin = p - shape.a;
+		vec3 toMax = shape.b - p;
+		float d = glm::min(glm::min(toMin.x, toMax.x), glm::min(toMin.z, toMax.z));
+		d = glm::min(d, toMin.y);
+		if (!shape.openTop)
+			d = glm::min(d, toMax.y);
+		return d;
+	}
+	case SHAPE_BOX:
+		return boxDistance(p, shape.a, shape.b);
+	case SHAPE_SPHERE:
+		return length(p - shape.a) - shape.b.x;
+	case SHAPE_MESH:
+		return meshDistance(shape, p);
+	default:
+		return FLT_MAX;
+	}
+}
+
+float SDFCollider::distance(vec3 p)
+{
+	float d = FLT_MAX;
+	for (auto it = shapes.begin(); it != shapes.end(); ++it)
+		d = glm::min(d, shapeDistance(*it, p));
+	return d;
+}
+
+float SDFCollider::obstacleDistance(vec3 p)
+{
+	float d = FLT_MAX;
+	for (auto it = shapes.begin(); it != shapes.end(); ++it)
+		if (it->type != SHAPE_CONTAINER)
+			d = glm::min(d, shapeDistance(*it, p));
+	return d;
+}
+
+void SDFCollider::bake()
+{
+	if (!dirty)
+		return;
+
+	// Every sample is independent, the rows are split over the cores. Without obstacles the
+	// field is far everywhere, kept finite for the trilinear weights and the gradient
+	float farDistance = length(domainMax - domainMin);
+	field.assign((size_t)resolution.x * resolution.y * resolution.z, 0.f);
+	unique_lock<mutex> turn;
+	bakePool(turn).parallelFor(resolution.y * resolution.z, BAKE_ROWS_PER_TASK, [&](int begin, int end, int) {
+		for (int row = begin; row < end; row++)
+		{
+			int j = row % resolution.y, k = row / resolution.y;
+			size_t index = (size_t)row * resolution.x;
+			for (int i = 0; i < resolution.x; i++)
+			{
+				vec3 p = domainMin + (vec3(i, j, k) + 0.5f) * cellSize;
+				field[index + i] = glm::min(obstacleDistance(p), farDistance);
+			}
+		}
+	});
+	turn.unlock();
+
+	if (!texture)
+	{
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_3D, texture);
+		glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32F, resolution.x, resolution.y, resolution.z);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_3D, texture);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, resolution.x, resolution.y, resolution.z, GL_RED, GL_FLOAT, field.data());
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	dirty = false;
+}
+
+float SDFCollider::sample(vec3 p)
+{
+	// Texel centered with clamp to edge, like GL_LINEAR on the texture
+	vec3 u = (p - domainMin) / cellSize - 0.5f;
+	ivec3 i0 = ivec3(floor(u));
+	vec3 f = u - vec3(i0);
+	float value = 0.f;
+	for (int c = 0; c < 8; c++)
+	{
+		ivec3 offset = ivec3(c & 1, (c >> 1) & 1, (c >> 2) & 1);
+		ivec3 i = clamp(i0 + offset, ivec3(0), resolution - 1);
+		vec3 w = mix(1.f - f, f, vec3(offset));
+		value += w.x * w.y * w.z * field[((size_t)i.z * resolution.y + i.y) * resolution.x + i.x];
+	}
+	return value;
+}
+
+vec3 SDFCollider::sampleNormal(vec3 p)
+{
+	vec3 grad = vec3(
+		sample(p + vec3(cellSize, 0.f, 0.f)) - sample(p - vec3(cellSize, 0.f, 0.f)),
+		sample(p + vec3(0.f, cellSize, 0.f)) - sample(p - vec3(0.f, cellSize, 0.f)),
+		sample(p + vec3(0.f, 0.f, cellSize)) - sample(p - vec3(0.f, 0.f, cellSize)));
+	float len = length(grad);
+	return len > 0.f ? grad / len : vec3(0.f, 1.f, 0.f);
+}
+
+void SDFCollider::bind(GLuint unit)
+{
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_3D, texture);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void SDFCollider::cleanup()
+{
+	if (texture) { glDeleteTextures(1, &texture); texture = 0; }
+	shapes.clear();
+	meshVertices.clear();
+	field.clear();
+	dirty = true;
+}
+
+SDFCollider::~SDFCollider()
+{
+	cleanup();
+}
@@ -0,0 +1,85 @@
+#ifndef _SDF_COLLIDER_HPP
+#define _SDF_COLLIDER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <GL/glew.h>
+
+using namespace glm;
+using namespace std;
+
+// Obstacle types of a ColliderObstacle
+const int32_t OBSTACLE_BOX = 1;
+const int32_t OBSTACLE_SPHERE = 2;
+const int32_t OBSTACLE_MESH = 3;
+
+// Obstacle as a checkpoint keeps it, a mesh as its range of transformed triangle corners
+struct ColliderObstacle
+{
+	int32_t type;				// OBSTACLE_*
+	vec3 a;						// center / mesh bounds min
+	vec3 b;						// half extent / (radius, 0, 0) / mesh bounds max
+	uint32_t firstTriangle;
+	uint32_t triangleCount;
+};
+
+// Static obstacles baked into a 3D signed distance texture.
+// The distance is positive where fluid may be and negative inside solids,
+// so the integration pass needs one trilinear lookup however many shapes exist.
+// The container stays out of the texture, its walls are tested directly, so that
+// resizing it never rebakes the field.
+class SDFCollider {
+public:
+	SDFCollider(vec3 domainMin, vec3 domainMax, float cellSize);
+	~SDFCollider();
+	void setContainer(vec3 minCorner, vec3 maxCorner, bool openTop);	// tank holding the fluid
+	// Container bounds, FLT_MAX above an open top and unbounded without a container
+	void getContainer(vec3& minCorner, vec3& maxCorner);
+	void addBox(vec3 center, vec3 halfExtent);							// solid box obstacle
+	void addSphere(vec3 center, float radius);							// solid sphere obstacle
+	void addMesh(string filename, vec3 center, float scale);			// closed triangle mesh obstacle (OBJ)
+	void clearObstacles();
+	// Obstacles behind the container and the 3 corners of every mesh triangle
+	void getObstacles(vector<ColliderObstacle>& obstacles, vector<vec3>& corners);
+	// Replaces the obstacles, the container stays. Throws runtime_error on a triangle range
+	// outside the corners
+	void setObstacles(const ColliderObstacle* obstacles, size_t count, const vec3* corners, size_t cornerCount);
+	void bake();					// evaluate the obstacles and upload the texture (only if changed)
+	void bind(GLuint unit);
+	float distance(vec3 p);			// signed distance of all shapes at p, the container too (cpu, exact)
+	float sample(vec3 p);			// trilinear lookup of the baked field, as the texture does
+	vec3 sampleNormal(vec3 p);		// outward normal from the baked field, as the shader does
+	void cleanup();
+
+	vec3 domainMin;
+	vec3 domainMax;
+	ivec3 resolution;
+
+private:
+	enum ShapeType { SHAPE_CONTAINER, SHAPE_BOX = OBSTACLE_BOX, SHAPE_SPHERE = OBSTACLE_SPHERE, SHAPE_MESH = OBSTACLE_MESH };
+
+	struct Shape
+	{
+		ShapeType type;
+		vec3 a;					// container min corner / center
+		vec3 b;					// container max corner / half extent / (radius, 0, 0)
+		bool openTop;
+		size_t firstTriangle;	// mesh triangle range
+		size_t triangleCount;
+	};
+
+	float shapeDistance(const Shape& shape, vec3 p);
+	float meshDistance(const Shape& shape, vec3 p);
+	float obstacleDistance(vec3 p);	// every shape but the container
+
+	float cellSize;
+	bool dirty;
+	vector<Shape> shapes;
+	vector<vec3> meshVertices;		// transformed triangle corners, 3 per triangle
+	vector<float> field;			// baked samples, x fastest
+	GLuint texture;
+};
+
+#endif // !_SDF_COLLIDER_HPP
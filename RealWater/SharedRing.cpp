@@ -0,0 +1,204 @@
+#include "SharedRing.hpp"
+#include <new>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+static size_t alignRing(size_t bytes)
+{
+	return (bytes + SHARED_RING_ALIGN - 1) / SHARED_RING_ALIGN * SHARED_RING_ALIGN;
+}
+
+// Slot f % slotCount behind the header
+static char* slotAddress(char* base, const SharedRingHeader* header, uint64_t f)
+{
+	return base + alignRing(sizeof(SharedRingHeader)) + (size_t)(f % header->slotCount) * header->slotBytes;
+}
+
+SharedRingWriter::SharedRingWriter() :
+	header(NULL),
+	frame(0)
+{
+}
+
+SharedRingWriter::~SharedRingWriter()
+{
+	close();
+}
+
+size_t SharedRingWriter::frameBytes(uint32_t liveCount, uint32_t attributes)
+{
+	size_t floats = 0;
+	if (attributes & SHARED_RING_POSITION) floats += 3;
+	if (attributes & SHARED_RING_VELOCITY) floats += 3;
+	if (attributes & SHARED_RING_COLOR) floats += 1;
+	if (attributes & SHARED_RING_ID) floats += 1;
+	return floats * liveCount * sizeof(float);
+}
+
+void SharedRingWriter::create(const string& name, int slotCount, uint32_t attributes, uint32_t capacity)
+{
+	close();
+	slotCount = std::max(slotCount, 2);
+	size_t slotBytes = alignRing(sizeof(SharedRingSlot) + frameBytes(capacity, attributes));
+	memory.createShared(name, alignRing(sizeof(SharedRingHeader)) + slotCount * slotBytes);
+
+	// New shared memory is zero, the atomics are constructed in place. The magic goes in
+	// last, a reader opening the ring before that refuses it.
+	header = new (memory.data()) SharedRingHeader;
+	header->version = SHARED_RING_VERSION;
+	header->slotCount = (uint32_t)slotCount;
+	header->slotBytes = slotBytes;
+	header->attributes = attributes;
+	header->capacity = capacity;
+	header->published.store(0);
+	header->closed.store(0);
+	for (int i = 0; i < slotCount; i++)
+		new (slotAddress(memory.data(), header, i)) SharedRingSlot;
+	atomic_thread_fence(memory_order_release);
+	memcpy(header->magic, SHARED_RING_MAGIC, sizeof(header->magic));
+	frame = 0;
+}
+
+void SharedRingWriter::close()
+{
+	if (!header)
+		return;
+	header->closed.store(1, memory_order_release);
+	header = NULL;
+	memory.close();
+}
+
+bool SharedRingWriter::isOpen()
+{
+	return header != NULL;
+}
+
+void SharedRingWriter::publish(uint32_t step, uint32_t liveCount, const void* data, size_t bytes)
+{
+	if (!header)
+		return;
+	SharedRingSlot* slot = (SharedRingSlot*)slotAddress(memory.data(), header, frame);
+	liveCount = std::min(liveCount, header->capacity);
+	bytes = std::min(bytes, (size_t)header->slotBytes - sizeof(SharedRingSlot));
+
+	// Odd while the slot is rewritten, the fence keeps the data behind that
+	slot->sequence.store(2 * frame + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->step = step;
+	slot->liveCount = liveCount;
+	slot->attributes = header->attributes;
+	memcpy((char*)slot + sizeof(SharedRingSlot), data, bytes);
+	slot->sequence.store(2 * frame + 2, memory_order_release);
+	header->published.store(frame + 1, memory_order_release);
+	frame++;
+}
+
+SharedRingReader::SharedRingReader() :
+	header(NULL)
+{
+}
+
+void SharedRingReader::open(const string& name)
+{
+	close();
+	memory.openShared(name);
+	const SharedRingHeader* mapped = (const SharedRingHeader*)memory.data();
+	bool valid = memory.size() >= alignRing(sizeof(SharedRingHeader))
+		&& memcmp(mapped->magic, SHARED_RING_MAGIC, sizeof(mapped->magic)) == 0;
+	if (valid)
+	{
+		atomic_thread_fence(memory_order_acquire);
+		valid = mapped->version == SHARED_RING_VERSION && mapped->slotCount > 0
+			&& mapped->slotBytes >= sizeof(SharedRingSlot) + SharedRingWriter::frameBytes(mapped->capacity, mapped->attributes)
+			&& alignRing(sizeof(SharedRingHeader)) + (uint64_t)mapped->slotCount * mapped->slotBytes <= memory.size();
+	}
+	if (!valid)
+	{
+		memory.close();
+		throw runtime_error(name + " is not a shared ring of version " + to_string(SHARED_RING_VERSION) + "!");
+	}
+	header = mapped;
+}
+
+void SharedRingReader::close()
+{
+	header = NULL;
+	memory.close();
+}
+
+bool SharedRingReader::isOpen()
+{
+	return header != NULL;
+}
+
+bool SharedRingReader::isClosed()
+{
+	return header && header->closed.load(memory_order_acquire) != 0;
+}
+
+uint32_t SharedRingReader::getAttributes()
+{
+	return header ? header->attributes : 0;
+}
+
+uint64_t SharedRingReader::getPublished()
+{
+	return header ? header->published.load(memory_order_acquire) : 0;
+}
+
+const SharedRingSlot* SharedRingReader::slot(uint64_t f)
+{
+	return (const SharedRingSlot*)slotAddress(memory.data(), header, f);
+}
+
+bool SharedRingReader::latest(SharedRingFrame& frame)
+{
+	uint64_t published = getPublished();
+	return published > 0 && get(published - 1, frame);
+}
+
+bool SharedRingReader::get(uint64_t f, SharedRingFrame& frame)
+{
+	if (!header || f >= getPublished())
+		return false;
+	const SharedRingSlot* s = slot(f);
+	uint64_t sequence = s->sequence.load(memory_order_acquire);
+	if (sequence != 2 * f + 2)
+		return false;
+
+	// The pointers are laid out from the live count, which is only trusted once the
+	// sequence is unchanged behind it
+	frame.frame = f;
+	frame.sequence = sequence;
+	frame.step = s->step;
+	frame.liveCount = std::min(s->liveCount, header->capacity);
+	frame.attributes = header->attributes;
+	frame.slot = s;
+	if (!valid(frame))
+		return false;
+	const float* data = (const float*)((const char*)s + sizeof(SharedRingSlot));
+	frame.positions = frame.attributes & SHARED_RING_POSITION ? data : NULL;
+	data += frame.positions ? 3 * frame.liveCount : 0;
+	frame.velocities = frame.attributes & SHARED_RING_VELOCITY ? data : NULL;
+	data += frame.velocities ? 3 * frame.liveCount : 0;
+	frame.colors = frame.attributes & SHARED_RING_COLOR ? data : NULL;
+	data += frame.colors ? frame.liveCount : 0;
+	frame.ids = frame.attributes & SHARED_RING_ID ? (const uint32_t*)data : NULL;
+	return true;
+}
+
+bool SharedRingReader::valid(const SharedRingFrame& frame)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return frame.slot->sequence.load(memory_order_relaxed) == frame.sequence;
+}
+
+bool SharedRingReader::copy(const SharedRingFrame& frame, vector<float>& data)
+{
+	size_t bytes = SharedRingWriter::frameBytes(frame.liveCount, frame.attributes);
+	data.resize(bytes / sizeof(float));
+	if (bytes)
+		memcpy(data.data(), (const char*)frame.slot + sizeof(SharedRingSlot), bytes);
+	return valid(frame);
+}
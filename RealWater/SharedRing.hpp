@@ -0,0 +1,116 @@
+#ifndef _SHARED_RING_HPP
+#define _SHARED_RING_HPP
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "MappedFile.hpp"
+
+using namespace std;
+
+// Frames of the simulation in named shared memory for processes on the same host. Nothing
+// here needs GL, a consumer builds SharedRing.cpp and MappedFile.cpp into its own program.
+const uint32_t SHARED_RING_VERSION = 1;
+const char SHARED_RING_MAGIC[8] = "RWRING";
+const int SHARED_RING_DEFAULT_SLOTS = 4;	// frames a reader can fall behind before losing them
+const size_t SHARED_RING_ALIGN = 64;		// slots start on cache lines
+
+// Attributes of a frame, same bits and order as RECORD_* of Recorder.hpp
+const uint32_t SHARED_RING_POSITION = 1;	// vec3
+const uint32_t SHARED_RING_VELOCITY = 2;	// vec3
+const uint32_t SHARED_RING_COLOR = 4;		// color field, float
+const uint32_t SHARED_RING_ID = 8;			// uint32, emission number of the particle
+
+// Front of the shared memory, slotCount slots of slotBytes follow from SHARED_RING_ALIGN on.
+// The atomics are lock free, so they work between processes mapping the same pages.
+struct SharedRingHeader
+{
+	char magic[8];				// "RWRING"
+	uint32_t version;
+	uint32_t slotCount;
+	uint64_t slotBytes;			// SharedRingSlot and the largest frame, a multiple of SHARED_RING_ALIGN
+	uint32_t attributes;
+	uint32_t capacity;			// particles of the largest frame
+	atomic<uint64_t> published;	// frames complete so far, frame f lies in slot f % slotCount
+	atomic<uint32_t> closed;	// the writer went away, a new ring may come up under the name
+	uint32_t pad;
+};
+
+// Front of a slot, the arrays of the selected attributes follow in the order of their bits.
+// The sequence is a seqlock: odd while the writer fills the slot, 2 * frame + 2 once the
+// frame is complete. A reader that sees the same even sequence before and after reading
+// the slot has read a whole frame.
+struct SharedRingSlot
+{
+	atomic<uint64_t> sequence;
+	uint32_t step;
+	uint32_t liveCount;
+	uint32_t attributes;
+	uint32_t pad[3];
+};
+
+// A frame as it lies in the ring, read in place. The writer may reuse the slot at any time,
+// so whatever was read through the pointers counts only if valid() still holds afterwards.
+struct SharedRingFrame
+{
+	uint64_t frame;
+	uint64_t sequence;
+	uint32_t step;
+	uint32_t liveCount;
+	uint32_t attributes;
+	const float* positions;		// 3 * liveCount, NULL if not published
+	const float* velocities;	// 3 * liveCount, NULL if not published
+	const float* colors;		// liveCount, NULL if not published
+	const uint32_t* ids;		// liveCount, NULL if not published
+	const SharedRingSlot* slot;
+};
+
+// Publishing side, owned by the simulator. Frames go to the oldest slot without looking
+// at the readers, so a slow reader loses frames instead of holding up the writer.
+class SharedRingWriter {
+public:
+	SharedRingWriter();
+	~SharedRingWriter();
+	// Room for frames of up to capacity particles with the attributes, throws runtime_error
+	void create(const string& name, int slotCount, uint32_t attributes, uint32_t capacity);
+	void close();				// marks the ring closed and removes the name
+	bool isOpen();
+	// Copies the arrays of a frame (at most capacity particles) into the next slot
+	void publish(uint32_t step, uint32_t liveCount, const void* data, size_t bytes);
+
+	static size_t frameBytes(uint32_t liveCount, uint32_t attributes);
+
+private:
+	MappedFile memory;
+	SharedRingHeader* header;
+	uint64_t frame;
+};
+
+// Reading side, for the consumers. Never writes to the shared memory and never waits.
+class SharedRingReader {
+public:
+	SharedRingReader();
+	void open(const string& name);	// map and validate, throws runtime_error
+	void close();
+	bool isOpen();
+	bool isClosed();				// the writer went away, open again for a new ring
+	uint32_t getAttributes();
+	uint64_t getPublished();		// frames published so far
+	// Newest complete frame, false if there is none yet or the writer is in its slot
+	bool latest(SharedRingFrame& frame);
+	// Frame f if it is still in the ring, false if it is not published yet or overwritten
+	bool get(uint64_t f, SharedRingFrame& frame);
+	bool valid(const SharedRingFrame& frame);	// slot still holds the frame
+	// Copies the arrays of the frame out, false if it was overwritten meanwhile
+	bool copy(const SharedRingFrame& frame, vector<float>& data);
+
+private:
+	MappedFile memory;
+	const SharedRingHeader* header;
+
+	const SharedRingSlot* slot(uint64_t f);
+};
+
+#endif // !_SHARED_RING_HPP
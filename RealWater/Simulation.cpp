@@ -0,0 +1,179 @@
+#include "Simulation.hpp"
+#include "Checkpoint.hpp"
+#include "Importer.hpp"
+#include "CpuKernels.hpp"
+#include "Recorder.hpp"
+#include "utils.hpp"
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+
+int sceneCapacity(int mode, int capacity)
+{
+	int cube = PARTICLE_NUM_BASE * PARTICLE_NUM_BASE * PARTICLE_NUM_BASE;
+	if (mode == 5)
+		return capacity > 0 ? capacity : POUR_PARTICLE_CAPACITY;
+	if (mode == 1 || mode == 4)
+		return std::max(capacity, cube);
+	return capacity > 0 ? capacity : cube;
+}
+
+// GLSL declarations of the constants sh_compute.glsl shares with the host code
+static string computeShaderConstants()
+{
+	stringstream ss;
+	ss << setprecision(9) << showpoint;
+	ss << "const float RADIUS = " << RADIUS << ";\n";
+	ss << "const float CORE_RADIUS = " << CORE_RADIUS << ";\n";
+	ss << "const float MASS = " << MASS << ";\n";
+	ss << "const float REST_DENSITY = " << REST_DENSITY << ";\n";
+	ss << "const float STIFFNESS = " << STIFFNESS << ";\n";
+	ss << "const float VISCOSITY = " << VISCOSITY << ";\n";
+	ss << "const vec3 GRAVITY = vec3(0.0, " << GRAVITY_Y << ", 0.0);\n";
+	ss << "const float PI = " << SPH_PI << ";\n";
+	ss << "const float SPEED_DECAY = " << SPEED_DECAY << ";\n";
+	ss << "const int GRID_BRICK = " << GRID_BRICK << ";\n";
+	ss << "const int GRID_BRICK_SHIFT = " << GRID_BRICK_SHIFT << ";\n";
+	ss << "const ivec3 GRID_BRICK_BIAS = ivec3(" << GRID_BRICK_BIAS_XZ << ", " << GRID_BRICK_BIAS_Y << ", " << GRID_BRICK_BIAS_XZ << ");\n";
+	ss << "const ivec3 GRID_BRICK_MAX = ivec3(" << GRID_BRICK_MAX_XZ << ", " << GRID_BRICK_MAX_Y << ", " << GRID_BRICK_MAX_XZ << ");\n";
+	ss << "const float GRID_MOVED_FRACTION = " << GPU_GRID_MOVED_FRACTION << ";\n";
+	ss << "const int MAX_KILL_PLANES = " << MAX_KILL_PLANES << ";\n";
+	ss << "const int MAX_SINKS = " << MAX_SINKS << ";\n";
+	ss << "const int RECORD_POSITION = " << RECORD_POSITION << ";\n";
+	ss << "const int RECORD_VELOCITY = " << RECORD_VELOCITY << ";\n";
+	ss << "const int RECORD_COLOR = " << RECORD_COLOR << ";\n";
+	ss << "const int RECORD_ID = " << RECORD_ID << ";\n";
+	return ss.str();
+}
+
+SimulationContext::SimulationContext() :
+	computeShader(0),
+	primitives(NULL),
+	headless(false)
+{
+}
+
+SimulationContext::~SimulationContext()
+{
+	destroy();
+}
+
+void SimulationContext::create(bool headless)
+{
+	destroy();
+	this->headless = headless;
+	if (headless)
+		offscreen.create();
+	glewInit();
+
+	try {
+		vector<GLuint> shaders;
+		shaders.push_back(compileShader(GL_COMPUTE_SHADER, COMPUTE_SHADER, computeShaderConstants()));
+		computeShader = linkProgram(shaders);
+		glDeleteShader(shaders[0]);
+		glUseProgram(0);
+
+		// Scan, reduce, sort and compact shared by the simulation passes
+		primitives = new GPUPrimitives();
+	}
+	catch (...) {
+		destroy();
+		throw;
+	}
+}
+
+void SimulationContext::releaseScene(ParticleManager* scene)
+{
+	if (!scene)
+		return;
+	pool.push_front(scene);
+	if (pool.size() > SCENE_POOL_SIZE)
+	{
+		delete pool.back();
+		pool.pop_back();
+	}
+}
+
+void SimulationContext::destroy()
+{
+	for (auto it = pool.begin(); it != pool.end(); ++it)
+		delete *it;
+	pool.clear();
+	if (primitives) { delete primitives; primitives = NULL; }
+	if (computeShader) { glDeleteProgram(computeShader); computeShader = 0; }
+	if (headless)
+		offscreen.destroy();
+	headless = false;
+}
+
+string SimulationContext::describe()
+{
+	return offscreen.describe();
+}
+
+ParticleManager* SimulationContext::createScene(const RwSceneDesc& description, GLuint displayShader)
+{
+	if (!computeShader)
+		throw runtime_error("The simulation context is not created!");
+
+	// The mapped checkpoint or scene file stays open until the particles are on the GPU. A
+	// checkpoint brings its own settings
+	Checkpoint checkpoint;
+	SceneImport scene;
+	int mode = description.mode;
+	int capacity;
+	bool restore = description.checkpoint && *description.checkpoint;
+	bool import = !restore && description.scene && *description.scene;
+	if (restore)
+	{
+		checkpoint.open(description.checkpoint);
+		mode = checkpoint.header.parameters.mode;
+		capacity = (int)checkpoint.header.capacity;
+	}
+	else if (import)
+	{
+		scene.open(description.scene);
+		capacity = (int)scene.count();
+	}
+	else
+		capacity = sceneCapacity(mode, description.capacity);
+
+	// A released scene of the capacity starts over in its buffers
+	ParticleManager* manager = NULL;
+	if (!displayShader)
+	{
+		for (auto it = pool.begin(); it != pool.end(); ++it)
+		{
+			if ((*it)->particleNum != capacity)
+				continue;
+			manager = *it;
+			pool.erase(it);
+			break;
+		}
+	}
+	if (manager)
+	{
+		try {
+			manager->reset(mode, restore ? &checkpoint : NULL, import ? &scene : NULL);
+		}
+		catch (...) {
+			delete manager;
+			throw;
+		}
+	}
+	else
+		manager = new ParticleManager(capacity, mode, displayShader, computeShader, primitives,
+			restore ? &checkpoint : NULL, import ? &scene : NULL);
+	if (restore)
+		return manager;
+
+	manager->setBounding(TYPE_X_AXIS, description.boundingX);
+	manager->setBounding(TYPE_Z_AXIS, description.boundingZ);
+	manager->setImplicitViscosity(description.implicitViscosity != 0, description.viscosityIterations);
+	manager->setBoundaryParticles(description.useBoundary != 0);
+	manager->setSleeping(description.useSleeping != 0);
+	manager->setBackend(description.backend, detectCpuKernelLevel());
+	return manager;
+}
@@ -0,0 +1,45 @@
+#ifndef _SIMULATION_HPP
+#define _SIMULATION_HPP
+
+#include <string>
+#include <deque>
+#include <GL/glew.h>
+#include "ParticleManager.hpp"
+#include "Offscreen.hpp"
+#include "RealWaterCore.h"
+
+using namespace std;
+
+const size_t SCENE_POOL_SIZE = 2;	// released scenes kept with their buffers for the next ones
+
+// Particles of a generated scene: the cubes have a fixed count, pour needs room for the
+// inflow, capacity 0 takes the size of the mode
+int sceneCapacity(int mode, int capacity);
+
+// The compiled solver program and the scan / sort building blocks, shared by every scene
+// created on the context. Headless it brings up a GL context of its own, otherwise it runs
+// on the one current on the calling thread.
+class SimulationContext {
+public:
+	SimulationContext();
+	~SimulationContext();
+	void create(bool headless);		// throws runtime_error
+	void destroy();					// the released scenes go with it, delete the others first
+	string describe();
+	// Generated, restored or imported as the description says, with its settings. Scenes
+	// without a display shader (0) are only stepped, they reuse the buffers of a released
+	// scene of the same capacity. Throws runtime_error
+	ParticleManager* createScene(const RwSceneDesc& description, GLuint displayShader = 0);
+	// Instead of deleting a scene without a display shader, the context keeps it for reuse
+	void releaseScene(ParticleManager* scene);
+
+	GLuint computeShader;
+	GPUPrimitives* primitives;
+
+private:
+	OffscreenContext offscreen;
+	bool headless;
+	deque<ParticleManager*> pool;	// released scenes, most recent first
+};
+
+#endif // !_SIMULATION_HPP
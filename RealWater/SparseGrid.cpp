@@ -0,0 +1,152 @@
+#include "SparseGrid.hpp"
+#include "constants.hpp"
+#include <algorithm>
+
+static const uint32_t EMPTY_KEY = 0xffffffffu;
+static const ivec3 BRICK_BIAS = ivec3(GRID_BRICK_BIAS_XZ, GRID_BRICK_BIAS_Y, GRID_BRICK_BIAS_XZ);
+static const ivec3 BRICK_MAX = ivec3(GRID_BRICK_MAX_XZ, GRID_BRICK_MAX_Y, GRID_BRICK_MAX_XZ);
+
+static inline uint32_t brickKey(ivec3 cell)
+{
+	// Arithmetic shift and mask are floor division and modulo for the negative cells too
+	uvec3 brick = uvec3((cell >> GRID_BRICK_SHIFT) + BRICK_BIAS);
+	return brick.x | brick.y << 10 | brick.z << 22;
+}
+
+static inline int brickCell(ivec3 cell)
+{
+	ivec3 local = cell & (GRID_BRICK - 1);
+	return (local.z * GRID_BRICK + local.y) * GRID_BRICK + local.x;
+}
+
+static inline uint32_t gridHash(uint32_t key)
+{
+	key ^= key >> 16;
+	key *= 0x7feb352du;
+	key ^= key >> 15;
+	key *= 0x846ca68bu;
+	key ^= key >> 16;
+	return key;
+}
+
+// 12 bits of v to every third bit, the brick coordinates in z-order
+static inline uint64_t spreadBrickBits(uint64_t v)
+{
+	v &= 0xfff;
+	v = (v | v << 16) & 0xf0000ffULL;
+	v = (v | v << 8) & 0xf00f00fULL;
+	v = (v | v << 4) & 0xc30c30c3ULL;
+	v = (v | v << 2) & 0x249249249ULL;
+	return v;
+}
+
+SparseBlockGrid::SparseBlockGrid() :
+	tableSize(0),
+	claimed(0),
+	bricks(0)
+{
+}
+
+ivec3 SparseBlockGrid::clampCell(ivec3 cell)
+{
+	return clamp(cell, -BRICK_BIAS * GRID_BRICK, (BRICK_MAX - BRICK_BIAS) * GRID_BRICK + GRID_BRICK - 1);
+}
+
+void SparseBlockGrid::reset(int maxBricks)
+{
+	// At most half full, like the GPU table
+	size_t size = 16;
+	while (size < 2 * (size_t)maxBricks)
+		size *= 2;
+	if (size != tableSize)
+	{
+		keys.reset(new atomic<uint32_t>[size]);
+		tableSize = size;
+	}
+	for (size_t h = 0; h < tableSize; h++)
+		keys[h].store(EMPTY_KEY, memory_order_relaxed);
+	claimed.store(0, memory_order_relaxed);
+	slotBrick.assign(tableSize, -1);
+	cells.clear();
+	bricks = 0;
+}
+
+size_t SparseBlockGrid::findSlot(uint32_t key)
+{
+	size_t mask = tableSize - 1;
+	size_t h = gridHash(key) & mask;
+	for (uint32_t k = keys[h].load(memory_order_relaxed); k != key && k != EMPTY_KEY; k = keys[h].load(memory_order_relaxed))
+		h = (h + 1) & mask;
+	return h;
+}
+
+bool SparseBlockGrid::insert(ivec3 cell)
+{
+	// Past half full the probes get long, a few threads may each add one more key
+	uint32_t key = brickKey(clampCell(cell));
+	size_t mask = tableSize - 1;
+	for (size_t h = gridHash(key) & mask; ; h = (h + 1) & mask)
+	{
+		uint32_t expected = keys[h].load(memory_order_relaxed);
+		if (expected == key)
+			return true;
+		if (expected != EMPTY_KEY)
+			continue;
+		if ((size_t)claimed.load(memory_order_relaxed) >= tableSize / 2)
+			return false;
+		if (keys[h].compare_exchange_strong(expected, key, memory_order_relaxed))
+		{
+			claimed.fetch_add(1, memory_order_relaxed);
+			return true;
+		}
+		if (expected == key)
+			return true;
+	}
+}
+
+void SparseBlockGrid::allocate()
+{
+	// Z-order of the brick coordinates, the GPU numbers its bricks in whatever order the
+	// atomics come
+	order.clear();
+	for (size_t h = 0; h < tableSize; h++)
+	{
+		uint32_t key = keys[h].load(memory_order_relaxed);
+		slotBrick[h] = -1;
+		if (key != EMPTY_KEY)
+			order.push_back(make_pair(spreadBrickBits(key & 0x3ff) | spreadBrickBits(key >> 10) << 1 | spreadBrickBits(key >> 22) << 2, h));
+	}
+	std::sort(order.begin(), order.end());
+	bricks = (int)order.size();
+	for (int brick = 0; brick < bricks; brick++)
+		slotBrick[order[brick].second] = brick;
+	cells.assign((size_t)bricks * GRID_BRICK * GRID_BRICK * GRID_BRICK, -1);
+}
+
+int* SparseBlockGrid::find(ivec3 cell)
+{
+	if (cell != clampCell(cell))
+		return NULL;
+	size_t h = findSlot(brickKey(cell));
+	if (slotBrick[h] < 0)
+		return NULL;
+	return &cells[(size_t)slotBrick[h] * GRID_BRICK * GRID_BRICK * GRID_BRICK + brickCell(cell)];
+}
+
+int SparseBlockGrid::brickOf(ivec3 cell)
+{
+	if (cell != clampCell(cell))
+		return -1;
+	return slotBrick[findSlot(brickKey(cell))];
+}
+
+int SparseBlockGrid::brickCount()
+{
+	return bricks;
+}
+
+size_t SparseBlockGrid::bytes()
+{
+	return tableSize * (sizeof(uint32_t) + sizeof(int)) + cells.capacity() * sizeof(int)
+		+ order.capacity() * sizeof(pair<uint64_t, size_t>);
+}
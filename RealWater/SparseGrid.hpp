@@ -0,0 +1,43 @@
+#ifndef _SPARSE_GRID_HPP
+#define _SPARSE_GRID_HPP
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+using namespace glm;
+using namespace std;
+
+// Sparse block grid on the CPU, the same bricks, keys and hash as the grid passes of
+// sh_compute.glsl. Bricks of GRID_BRICK^3 cells are claimed in a hashed table by
+// compare and swap, so insert() can run on many threads at once, and numbered in z-order
+// by allocate() once all keys are in. Memory follows the occupied bricks, not the domain.
+class SparseBlockGrid {
+public:
+	SparseBlockGrid();
+	void reset(int maxBricks);			// empty table for at least maxBricks bricks
+	bool insert(ivec3 cell);			// claim the brick of a cell, thread safe, false once the table is full
+	void allocate();					// number the claimed bricks, every cell entry -1
+	int* find(ivec3 cell);				// entry of a cell, NULL in unallocated bricks or out of keys
+	int brickOf(ivec3 cell);			// number of the cell's brick, -1 if unallocated
+	int brickCount();
+	size_t bytes();
+
+	// Cells of the support radius the keys can hold, the rest share the border bricks
+	static ivec3 clampCell(ivec3 cell);
+
+private:
+	size_t tableSize;
+	unique_ptr<atomic<uint32_t>[]> keys;	// brick key, 0xffffffff if free
+	atomic<int> claimed;				// keys inserted since the reset
+	vector<int> slotBrick;				// brick of every claimed slot
+	vector<pair<uint64_t, size_t>> order;	// z-order key and slot of the claimed bricks
+	vector<int> cells;					// GRID_BRICK^3 entries per brick
+	int bricks;
+
+	size_t findSlot(uint32_t key);		// slot of the key or the free slot ending its probe
+};
+
+#endif // !_SPARSE_GRID_HPP
@@ -0,0 +1,196 @@
+#include "ThreadPool.hpp"
+#include <algorithm>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+ThreadPool::ThreadPool(int threadCount) :
+	body(NULL),
+	remaining(0),
+	jobGeneration(0),
+	stopping(false),
+	pinned(false),
+	jobs(0),
+	maxQueueDepth(0)
+{
+	if (threadCount <= 0)
+		threadCount = max(1, (int)thread::hardware_concurrency());
+	for (int k = 0; k < threadCount; k++)
+	{
+		workers.push_back(unique_ptr<Worker>(new Worker()));
+		workers[k]->tasksRun = 0;
+		workers[k]->steals = 0;
+		workers[k]->failedSteals = 0;
+	}
+	// Worker 0 is whoever calls parallelFor
+	for (int k = 1; k < threadCount; k++)
+		workers[k]->handle = thread(&ThreadPool::workerLoop, this, k);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lk(jobLock);
+		stopping = true;
+	}
+	jobStart.notify_all();
+	for (size_t k = 1; k < workers.size(); k++)
+		workers[k]->handle.join();
+}
+
+void ThreadPool::parallelFor(int count, int blockSize, const function<void(int, int, int)>& body)
+{
+	if (count <= 0)
+		return;
+	blockSize = max(blockSize, 1);
+	int blocks = (count + blockSize - 1) / blockSize;
+	int workerCount = (int)workers.size();
+
+	// Contiguous runs of blocks per worker keep neighboring cells on one core until stolen
+	this->body = &body;
+	remaining = blocks;
+	for (int k = 0; k < workerCount; k++)
+	{
+		int first = (int)((long long)blocks * k / workerCount);
+		int last = (int)((long long)blocks * (k + 1) / workerCount);
+		lock_guard<mutex> lk(workers[k]->lock);
+		for (int b = first; b < last; b++)
+		{
+			Task task = { b * blockSize, min((b + 1) * blockSize, count) };
+			workers[k]->tasks.push_back(task);
+		}
+		maxQueueDepth = max(maxQueueDepth, workers[k]->tasks.size());
+	}
+	jobs++;
+
+	{
+		lock_guard<mutex> lk(jobLock);
+		jobGeneration++;
+	}
+	jobStart.notify_all();
+
+	// Help until the queues are drained, then wait for the tasks still running
+	runTasks(0);
+	while (remaining.load(memory_order_acquire) > 0)
+		this_thread::yield();
+	this->body = NULL;
+}
+
+void ThreadPool::workerLoop(int worker)
+{
+	unsigned int seen = 0;
+	while (true)
+	{
+		{
+			unique_lock<mutex> lk(jobLock);
+			jobStart.wait(lk, [&]() { return stopping || jobGeneration != seen; });
+			if (stopping)
+				return;
+			seen = jobGeneration;
+		}
+		runTasks(worker);
+	}
+}
+
+void ThreadPool::runTasks(int worker)
+{
+	// Jobs do not spawn tasks, so once every deque is empty this worker is done
+	Task task;
+	while (popLocal(worker, task) || steal(worker, task))
+	{
+		(*body)(task.begin, task.end, worker);
+		workers[worker]->tasksRun.fetch_add(1, memory_order_relaxed);
+		remaining.fetch_sub(1, memory_order_release);
+	}
+}
+
+bool ThreadPool::popLocal(int worker, Task& task)
+{
+	Worker& w = *workers[worker];
+	lock_guard<mutex> lk(w.lock);
+	if (w.tasks.empty())
+		return false;
+	task = w.tasks.back();
+	w.tasks.pop_back();
+	return true;
+}
+
+bool ThreadPool::steal(int worker, Task& task)
+{
+	// Victims in ring order from the next worker, the oldest (front) task is taken
+	int workerCount = (int)workers.size();
+	for (int k = 1; k < workerCount; k++)
+	{
+		Worker& victim = *workers[(worker + k) % workerCount];
+		lock_guard<mutex> lk(victim.lock);
+		if (victim.tasks.empty())
+			continue;
+		task = victim.tasks.front();
+		victim.tasks.pop_front();
+		workers[worker]->steals.fetch_add(1, memory_order_relaxed);
+		return true;
+	}
+	workers[worker]->failedSteals.fetch_add(1, memory_order_relaxed);
+	return false;
+}
+
+void ThreadPool::setAffinity(bool pinned)
+{
+	if (pinned == this->pinned)
+		return;
+	this->pinned = pinned;
+	for (int k = 1; k < (int)workers.size(); k++)
+		pin(k, pinned);
+}
+
+void ThreadPool::pin(int worker, bool enabled)
+{
+	unsigned int cores = max(1u, thread::hardware_concurrency());
+#ifdef _WIN32
+	DWORD_PTR mask = enabled ? (DWORD_PTR)1 << (worker % cores) : ~(DWORD_PTR)0;
+	SetThreadAffinityMask(workers[worker]->handle.native_handle(), mask);
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned int c = 0; c < cores; c++)
+		if (!enabled || c == worker % cores)
+			CPU_SET(c, &set);
+	pthread_setaffinity_np(workers[worker]->handle.native_handle(), sizeof(set), &set);
+#endif
+}
+
+int ThreadPool::size()
+{
+	return (int)workers.size();
+}
+
+ThreadPoolStats ThreadPool::getStats()
+{
+	// Read between jobs, the counters are only written while one runs
+	ThreadPoolStats stats = {};
+	stats.jobs = jobs;
+	stats.maxQueueDepth = maxQueueDepth;
+	for (auto& w : workers)
+	{
+		stats.tasks += w->tasksRun;
+		stats.steals += w->steals;
+		stats.failedSteals += w->failedSteals;
+		stats.workerTasks.push_back(w->tasksRun);
+	}
+	return stats;
+}
+
+void ThreadPool::resetStats()
+{
+	jobs = 0;
+	maxQueueDepth = 0;
+	for (auto& w : workers)
+	{
+		w->tasksRun = 0;
+		w->steals = 0;
+		w->failedSteals = 0;
+	}
+}
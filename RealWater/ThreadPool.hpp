@@ -0,0 +1,77 @@
+#ifndef _THREAD_POOL_HPP
+#define _THREAD_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+using namespace std;
+
+// Scheduling counters since the last resetStats()
+struct ThreadPoolStats
+{
+	size_t jobs;
+	size_t tasks;
+	size_t steals;				// tasks taken from another worker's deque
+	size_t failedSteals;		// steal rounds that found every deque empty
+	size_t maxQueueDepth;		// deepest deque at the start of a job
+	vector<size_t> workerTasks;	// tasks run by each worker, the calling thread is worker 0
+};
+
+// Work stealing pool for fork-join loops. A job is split into blocks that are dealt out in
+// contiguous runs to per-worker deques; owners pop from the back, idle workers steal from
+// the front of a victim, so dense regions of the loop spread over the idle cores.
+class ThreadPool {
+public:
+	ThreadPool(int threadCount = 0);		// 0 = one worker per hardware thread
+	~ThreadPool();
+
+	// body(begin, end, worker) over [0, count) in blocks of blockSize, returns when all ran.
+	// The calling thread works as worker 0, worker ids index per-worker scratch.
+	void parallelFor(int count, int blockSize, const function<void(int, int, int)>& body);
+	void setAffinity(bool pinned);			// pin worker k to hardware thread k
+	int size();
+	ThreadPoolStats getStats();
+	void resetStats();
+
+private:
+	struct Task
+	{
+		int begin;
+		int end;
+	};
+
+	struct Worker
+	{
+		mutex lock;
+		deque<Task> tasks;
+		thread handle;
+		atomic<size_t> tasksRun;		// relaxed, a worker may still be leaving the last job
+		atomic<size_t> steals;
+		atomic<size_t> failedSteals;
+	};
+
+	vector<unique_ptr<Worker>> workers;
+	const function<void(int, int, int)>* body;
+	atomic<int> remaining;		// tasks of the current job not finished yet
+	mutex jobLock;
+	condition_variable jobStart;
+	unsigned int jobGeneration;
+	bool stopping;
+	bool pinned;
+	size_t jobs;
+	size_t maxQueueDepth;
+
+	void workerLoop(int worker);
+	void runTasks(int worker);
+	bool popLocal(int worker, Task& task);
+	bool steal(int worker, Task& task);
+	void pin(int worker, bool enabled);
+};
+
+#endif // !_THREAD_POOL_HPP
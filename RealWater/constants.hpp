@@ -10,7 +10,49 @@ const int INIT_DRAW_TYPE = 1;
 const int UPDATE_DRAW_TYPE = 2;
 const float RADIUS = 0.04f;
 const int PARTICLE_NUM_BASE = 16; //24 16 8
+const float CORE_RADIUS = RADIUS * 10;
+const float STIFFNESS = 10.f;
+const float REST_DENSITY = 100.f;
+const float MASS = 80.f;
+const float VISCOSITY = 200.f;
+const float GRAVITY_Y = -10.f;
+const float SPEED_DECAY = 0.8f;
+const float SPH_PI = 3.1415926535f;
+const int CPU_CELLS_PER_TASK = 8;		// occupied cells per scheduler task of the CPU solver
+const int CPU_PARTICLES_PER_TASK = 4096;	// particles per task of the CPU grid build
+const float CPU_GRID_SLACK = 0.125f;			// free slots per cell of the incremental CPU grid
+const float CPU_GRID_MOVED_FRACTION = 0.05f;	// more moved particles and the grid is rebuilt
+const float CPU_GRID_TOMBSTONE_FRACTION = 0.1f;
+const float GPU_GRID_MOVED_FRACTION = 0.1f;	// particles out of their cell before the GPU grid reorders again
+const int GRID_BRICK = 4;				// cells per brick edge of the sparse grid
+const int GRID_BRICK_SHIFT = 2;			// log2(GRID_BRICK)
+// Brick keys hold 10 / 12 / 10 bits around these biases, cells beyond share the border bricks
+const int GRID_BRICK_BIAS_XZ = 512;
+const int GRID_BRICK_BIAS_Y = 2048;
+const int GRID_BRICK_MAX_XZ = 1022;
+const int GRID_BRICK_MAX_Y = 4094;
+const int GRID_MIN_BRICKS = 64;			// smallest brick pool of the GPU grid
+const float CFL_NUMBER = 0.4f;
+const int VISCOSITY_CG_ITERATIONS = 10;
+const int POUR_PARTICLE_CAPACITY = 4 * PARTICLE_NUM_BASE * PARTICLE_NUM_BASE * PARTICLE_NUM_BASE;
+const float EMITTER_DEFAULT_RATE = 2000.f;	// particles per second
+const int MAX_KILL_PLANES = 4;
+const int MAX_SINKS = 4;
 // Boudning type
 const int TYPE_X_AXIS = 0;
 const int TYPE_Z_AXIS = 1;
+// Bounding (container) range
+const float BOUNDING_DEFAULT = 3.2f;
+const float BOUNDING_MAX_X = 7.f;
+const float BOUNDING_MAX_Z = 4.f;
+const float FLOOR_Y = -6.f;
+// Signed distance colliders
+const float COLLIDER_TOP_Y = 10.f;		// top of the baked region, the container is open above
+const float COLLIDER_MARGIN = 0.5f;
+const float COLLIDER_CELL_SIZE = 0.1f;
+const int COLLIDER_TEXTURE_UNIT = 1;
+// Boundary particles on the container walls
+const float BOUNDARY_SPACING = CORE_RADIUS * 0.5f;
+const float BOUNDARY_TOP_Y = 2.f;		// walls are sampled from the floor up to here
+const int BOUNDARY_SETTLE_STEPS = 15;	// steps the container size holds still before the walls are resampled
 
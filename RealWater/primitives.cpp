@@ -0,0 +1,482 @@
+#include "primitives.hpp"
+#include "utils.hpp"
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <glm/glm.hpp>
+
+#define PRIMITIVE_GROUP_SIZE 256
+
+static GLuint groupsFor(GLuint n)
+{
+	return (n + PRIMITIVE_GROUP_SIZE - 1) / PRIMITIVE_GROUP_SIZE;
+}
+
+static GLuint compileProgram(const char* filename)
+{
+	vector<GLuint> shaders;
+	shaders.push_back(compileShader(GL_COMPUTE_SHADER, filename));
+	GLuint program = linkProgram(shaders);
+	glDeleteShader(shaders[0]);
+	return program;
+}
+
+// Every pass reads what the previous one wrote, copies may read the results too
+static void dispatchGroups(GLuint groups)
+{
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+GPUPrimitives::GPUPrimitives() :
+	scanTotal(0),
+	sortKeys(0),
+	sortValues(0),
+	sortHistogram(0),
+	compactPositions(0)
+{
+	scanProgram = compileProgram(SCAN_SHADER);
+	reduceProgram = compileProgram(REDUCE_SHADER);
+	radixSortProgram = compileProgram(RADIX_SORT_SHADER);
+	compactProgram = compileProgram(COMPACT_SHADER);
+	reduceBuffers[0] = reduceBuffers[1] = 0;
+
+	uniScanPass = glGetUniformLocation(scanProgram, "pass");
+	uniScanN = glGetUniformLocation(scanProgram, "n");
+	uniScanUseCount = glGetUniformLocation(scanProgram, "use_count_buffer");
+	uniScanCountIndex = glGetUniformLocation(scanProgram, "count_index");
+	uniScanLevel = glGetUniformLocation(scanProgram, "level");
+	uniReduceN = glGetUniformLocation(reduceProgram, "n");
+	uniReduceOp = glGetUniformLocation(reduceProgram, "op");
+	uniSortPass = glGetUniformLocation(radixSortProgram, "pass");
+	uniSortN = glGetUniformLocation(radixSortProgram, "n");
+	uniSortUseCount = glGetUniformLocation(radixSortProgram, "use_count_buffer");
+	uniSortCountIndex = glGetUniformLocation(radixSortProgram, "count_index");
+	uniSortShift = glGetUniformLocation(radixSortProgram, "shift");
+	uniSortNumGroups = glGetUniformLocation(radixSortProgram, "num_groups");
+	uniCompactPass = glGetUniformLocation(compactProgram, "pass");
+	uniCompactN = glGetUniformLocation(compactProgram, "n");
+}
+
+GPUPrimitives::~GPUPrimitives()
+{
+	cleanup();
+}
+
+void GPUPrimitives::reserve(GLuint& buffer, GLsizeiptr bytes)
+{
+	GLint size = 0;
+	if (buffer)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+		glGetBufferParameteriv(GL_SHADER_STORAGE_BUFFER, GL_BUFFER_SIZE, &size);
+		if (size >= bytes)
+			return;
+	}
+	else
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, glm::max(bytes, (GLsizeiptr)sizeof(GLuint)), NULL, GL_DYNAMIC_COPY);
+}
+
+void GPUPrimitives::bindCount(const GPUCount* count, GLuint uniUseCount, GLuint uniCountIndex)
+{
+	glUniform1i(uniUseCount, count != NULL);
+	if (count)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, count->buffer);
+		glUniform1ui(uniCountIndex, count->offset / sizeof(GLuint));
+	}
+}
+
+void GPUPrimitives::scanExclusive(GLuint data, GLuint maxN, const GPUCount* count)
+{
+	glUseProgram(scanProgram);
+	glUniform1ui(uniScanN, maxN);
+	bindCount(count, uniScanUseCount, uniScanCountIndex);
+
+	// Up sweep: scan each level inside its groups, the group totals form the next level
+	vector<GLuint> levelGroups;
+	GLuint levelData = data;
+	GLuint n = maxN;
+	for (int level = 0;; level++)
+	{
+		GLuint groups = glm::max(groupsFor(n), 1u);
+		if ((int)scanLevels.size() <= level)
+			scanLevels.push_back(0);
+		reserve(scanLevels[level], groups * sizeof(GLuint));
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, levelData);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, scanLevels[level]);
+		glUniform1i(uniScanPass, 1);
+		glUniform1i(uniScanLevel, level);
+		dispatchGroups(groups);
+		levelGroups.push_back(groups);
+
+		if (groups == 1)
+			break;
+		levelData = scanLevels[level];
+		n = groups;
+	}
+	int top = (int)levelGroups.size() - 1;
+	scanTotal = scanLevels[top];
+
+	// Down sweep: add the scanned totals of each level to the level below
+	for (int level = top - 1; level >= 0; level--)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, level == 0 ? data : scanLevels[level - 1]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, scanLevels[level]);
+		glUniform1i(uniScanPass, 2);
+		glUniform1i(uniScanLevel, level);
+		dispatchGroups(levelGroups[level]);
+	}
+	glUseProgram(0);
+}
+
+void GPUPrimitives::copyScanTotal(GLuint dst, GLuint dstOffset)
+{
+	glBindBuffer(GL_COPY_READ_BUFFER, scanTotal);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, dst);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, dstOffset, sizeof(GLuint));
+}
+
+void GPUPrimitives::reduce(GLuint data, GLuint n, int op, GLuint result, GLuint resultOffset)
+{
+	glUseProgram(reduceProgram);
+	glUniform1i(uniReduceOp, op);
+
+	// One partial per group, ping-pong until a single value is left
+	GLuint src = data;
+	GLuint count = n;
+	int k = 0;
+	do
+	{
+		GLuint groups = glm::max(groupsFor(count), 1u);
+		reserve(reduceBuffers[k], groups * sizeof(float));
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, src);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, reduceBuffers[k]);
+		glUniform1ui(uniReduceN, count);
+		dispatchGroups(groups);
+		src = reduceBuffers[k];
+		count = groups;
+		k ^= 1;
+	} while (count > 1);
+	glUseProgram(0);
+
+	glBindBuffer(GL_COPY_READ_BUFFER, src);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, result);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, resultOffset, sizeof(float));
+}
+
+void GPUPrimitives::radixSort(GLuint keys, GLuint values, GLuint maxN, const GPUCount* count)
+{
+	GLuint groups = groupsFor(maxN);
+	if (groups == 0)
+		return;
+	reserve(sortKeys, maxN * sizeof(GLuint));
+	reserve(sortValues, maxN * sizeof(GLuint));
+	reserve(sortHistogram, 16 * groups * sizeof(GLuint));
+
+	// 8 passes ping-pong between the inputs and the scratch, the result ends in the inputs
+	GLuint inKeys = keys, inValues = values;
+	GLuint outKeys = sortKeys, outValues = sortValues;
+	for (GLuint shift = 0; shift < 32; shift += 4)
+	{
+		for (int pass = 1; pass <= 2; pass++)
+		{
+			glUseProgram(radixSortProgram);
+			glUniform1i(uniSortPass, pass);
+			glUniform1ui(uniSortN, maxN);
+			glUniform1ui(uniSortShift, shift);
+			glUniform1ui(uniSortNumGroups, groups);
+			bindCount(count, uniSortUseCount, uniSortCountIndex);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, inKeys);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, inValues);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, outKeys);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, outValues);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 21, sortHistogram);
+			dispatchGroups(groups);
+
+			// Digit-major histograms scan into the global offset of each group and digit
+			if (pass == 1)
+				scanExclusive(sortHistogram, 16 * groups);
+		}
+		swap(inKeys, outKeys);
+		swap(inValues, outValues);
+	}
+	glUseProgram(0);
+}
+
+void GPUPrimitives::compact(GLuint input, GLuint flags, GLuint output, GLuint n, GLuint countBuffer, GLuint countOffset)
+{
+	reserve(compactPositions, n * sizeof(GLuint));
+	GLuint groups = groupsFor(n);
+
+	for (int pass = 1; pass <= 2; pass++)
+	{
+		glUseProgram(compactProgram);
+		glUniform1i(uniCompactPass, pass);
+		glUniform1ui(uniCompactN, n);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, input);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, flags);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, compactPositions);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, output);
+		if (groups)
+			dispatchGroups(groups);
+
+		if (pass == 1)
+			scanExclusive(compactPositions, n);
+	}
+	glUseProgram(0);
+	copyScanTotal(countBuffer, countOffset);
+}
+
+void GPUPrimitives::cleanup()
+{
+	if (scanProgram) { glDeleteProgram(scanProgram); scanProgram = 0; }
+	if (reduceProgram) { glDeleteProgram(reduceProgram); reduceProgram = 0; }
+	if (radixSortProgram) { glDeleteProgram(radixSortProgram); radixSortProgram = 0; }
+	if (compactProgram) { glDeleteProgram(compactProgram); compactProgram = 0; }
+	if (!scanLevels.empty())
+		glDeleteBuffers((GLsizei)scanLevels.size(), scanLevels.data());
+	scanLevels.clear();
+	scanTotal = 0;
+	glDeleteBuffers(2, reduceBuffers);
+	reduceBuffers[0] = reduceBuffers[1] = 0;
+	glDeleteBuffers(1, &sortKeys);
+	glDeleteBuffers(1, &sortValues);
+	glDeleteBuffers(1, &sortHistogram);
+	glDeleteBuffers(1, &compactPositions);
+	sortKeys = 0;
+	sortValues = 0;
+	sortHistogram = 0;
+	compactPositions = 0;
+}
+
+
+void cpuScanExclusive(const vector<GLuint>& input, vector<GLuint>& output)
+{
+	output.resize(input.size());
+	GLuint sum = 0;
+	for (size_t i = 0; i < input.size(); i++)
+	{
+		output[i] = sum;
+		sum += input[i];
+	}
+}
+
+float cpuReduce(const vector<float>& data, int op)
+{
+	float identity = 0.f;
+	if (op == REDUCE_MIN)
+		identity = numeric_limits<float>::infinity();
+	else if (op == REDUCE_MAX)
+		identity = -numeric_limits<float>::infinity();
+
+	// Same block size and halving tree as sh_reduce.glsl, level by level
+	vector<float> level = data;
+	do
+	{
+		GLuint groups = glm::max(groupsFor((GLuint)level.size()), 1u);
+		vector<float> next(groups);
+		for (GLuint g = 0; g < groups; g++)
+		{
+			float block[PRIMITIVE_GROUP_SIZE];
+			for (GLuint k = 0; k < PRIMITIVE_GROUP_SIZE; k++)
+			{
+				size_t i = (size_t)g * PRIMITIVE_GROUP_SIZE + k;
+				block[k] = i < level.size() ? level[i] : identity;
+			}
+			for (GLuint s = PRIMITIVE_GROUP_SIZE / 2; s > 0; s >>= 1)
+			{
+				for (GLuint k = 0; k < s; k++)
+				{
+					if (op == REDUCE_MIN)
+						block[k] = glm::min(block[k], block[k + s]);
+					else if (op == REDUCE_MAX)
+						block[k] = glm::max(block[k], block[k + s]);
+					else
+						block[k] = block[k] + block[k + s];
+				}
+			}
+			next[g] = block[0];
+		}
+		level.swap(next);
+	} while (level.size() > 1);
+	return level[0];
+}
+
+void cpuRadixSort(vector<GLuint>& keys, vector<GLuint>& values)
+{
+	// Stable counting sort per 4 bit digit, as on the GPU
+	vector<GLuint> tmpKeys(keys.size()), tmpValues(values.size());
+	for (GLuint shift = 0; shift < 32; shift += 4)
+	{
+		GLuint offsets[16] = { 0 };
+		for (size_t i = 0; i < keys.size(); i++)
+			offsets[(keys[i] >> shift) & 15]++;
+		GLuint start = 0;
+		for (int d = 0; d < 16; d++)
+		{
+			GLuint c = offsets[d];
+			offsets[d] = start;
+			start += c;
+		}
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			GLuint dst = offsets[(keys[i] >> shift) & 15]++;
+			tmpKeys[dst] = keys[i];
+			tmpValues[dst] = values[i];
+		}
+		keys.swap(tmpKeys);
+		values.swap(tmpValues);
+	}
+}
+
+GLuint cpuCompact(const vector<GLuint>& input, const vector<GLuint>& flags, vector<GLuint>& output)
+{
+	output.clear();
+	for (size_t i = 0; i < input.size(); i++)
+		if (flags[i] != 0)
+			output.push_back(input[i]);
+	return (GLuint)output.size();
+}
+
+
+// Average GPU time of op in ms, setup runs outside the timer before every repetition
+static float timeGPU(int repeats, function<void()> setup, function<void()> op)
+{
+	GLuint query;
+	glGenQueries(1, &query);
+	GLuint64 total = 0;
+	for (int r = 0; r < repeats; r++)
+	{
+		setup();
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		op();
+		glEndQuery(GL_TIME_ELAPSED);
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+		total += elapsed;
+	}
+	glDeleteQueries(1, &query);
+	return total / (repeats * 1e6f);
+}
+
+static float timeCPU(int repeats, function<void()> op)
+{
+	auto start = chrono::high_resolution_clock::now();
+	for (int r = 0; r < repeats; r++)
+		op();
+	chrono::duration<float, milli> elapsed = chrono::high_resolution_clock::now() - start;
+	return elapsed.count() / repeats;
+}
+
+static GLuint createBuffer(const void* data, GLsizeiptr bytes)
+{
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, data, GL_DYNAMIC_COPY);
+	return buffer;
+}
+
+static void upload(GLuint buffer, const void* data, GLsizeiptr bytes)
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, data);
+}
+
+static void download(GLuint buffer, void* data, GLsizeiptr bytes)
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, data);
+}
+
+static void report(const char* name, GLuint n, float gpuMs, float cpuMs, bool exact)
+{
+	cout << left << setw(12) << name << right << setw(10) << n
+		<< fixed << setprecision(3)
+		<< setw(11) << gpuMs << " ms" << setw(10) << n / (gpuMs * 1e3f) << " Melem/s"
+		<< setw(11) << cpuMs << " ms" << setw(10) << n / (cpuMs * 1e3f) << " Melem/s"
+		<< "  " << (exact ? "exact" : "MISMATCH") << endl;
+}
+
+void benchmarkPrimitives(GPUPrimitives& primitives)
+{
+	const GLuint sizes[] = { 1u << 10, 1u << 14, 1u << 18, 1u << 22 };
+	const int repeats = 10;
+	mt19937 gen(12345);
+
+	cout << left << setw(12) << "primitive" << right << setw(10) << "n"
+		<< setw(25) << "gpu" << setw(25) << "cpu reference" << endl;
+
+	for (GLuint n : sizes)
+	{
+		vector<GLuint> keys(n), values(n), flags(n), small(n);
+		vector<float> floats(n);
+		uniform_real_distribution<float> unit(0.f, 1.f);
+		for (GLuint i = 0; i < n; i++)
+		{
+			keys[i] = gen();
+			values[i] = i;
+			flags[i] = gen() & 1;
+			small[i] = gen() & 15;
+			floats[i] = unit(gen);
+		}
+		GLsizeiptr bytes = n * sizeof(GLuint);
+		GLuint keyBuffer = createBuffer(keys.data(), bytes);
+		GLuint valueBuffer = createBuffer(values.data(), bytes);
+		GLuint flagBuffer = createBuffer(flags.data(), bytes);
+		GLuint outputBuffer = createBuffer(NULL, bytes);
+		GLuint resultBuffer = createBuffer(NULL, 4 * sizeof(GLuint));
+
+		// Exclusive scan
+		vector<GLuint> expected, got(n);
+		float gpuMs = timeGPU(repeats, [&]() { upload(keyBuffer, small.data(), bytes); },
+			[&]() { primitives.scanExclusive(keyBuffer, n); });
+		float cpuMs = timeCPU(repeats, [&]() { cpuScanExclusive(small, expected); });
+		download(keyBuffer, got.data(), bytes);
+		report("scan", n, gpuMs, cpuMs, got == expected);
+
+		// Reductions
+		upload(valueBuffer, floats.data(), n * sizeof(float));
+		const char* reduceNames[] = { "reduce sum", "reduce min", "reduce max" };
+		for (int op = REDUCE_SUM; op <= REDUCE_MAX; op++)
+		{
+			float expectedValue = 0.f, value = 0.f;
+			gpuMs = timeGPU(repeats, []() {}, [&]() { primitives.reduce(valueBuffer, n, op, resultBuffer, 0); });
+			cpuMs = timeCPU(repeats, [&]() { expectedValue = cpuReduce(floats, op); });
+			download(resultBuffer, &value, sizeof(float));
+			report(reduceNames[op], n, gpuMs, cpuMs, memcmp(&value, &expectedValue, sizeof(float)) == 0);
+		}
+
+		// Key-value radix sort
+		vector<GLuint> sortedKeys, sortedValues, gotValues(n);
+		gpuMs = timeGPU(repeats,
+			[&]() { upload(keyBuffer, keys.data(), bytes); upload(valueBuffer, values.data(), bytes); },
+			[&]() { primitives.radixSort(keyBuffer, valueBuffer, n); });
+		cpuMs = timeCPU(repeats, [&]() { sortedKeys = keys; sortedValues = values; cpuRadixSort(sortedKeys, sortedValues); });
+		download(keyBuffer, got.data(), bytes);
+		download(valueBuffer, gotValues.data(), bytes);
+		report("radix sort", n, gpuMs, cpuMs, got == sortedKeys && gotValues == sortedValues);
+
+		// Stream compaction
+		GLuint expectedCount = 0, count = 0;
+		upload(keyBuffer, keys.data(), bytes);
+		gpuMs = timeGPU(repeats, []() {},
+			[&]() { primitives.compact(keyBuffer, flagBuffer, outputBuffer, n, resultBuffer, 0); });
+		cpuMs = timeCPU(repeats, [&]() { expectedCount = cpuCompact(keys, flags, expected); });
+		download(resultBuffer, &count, sizeof(GLuint));
+		got.resize(count);
+		download(outputBuffer, got.data(), count * sizeof(GLuint));
+		report("compact", n, gpuMs, cpuMs, count == expectedCount && got == expected);
+
+		GLuint buffers[] = { keyBuffer, valueBuffer, flagBuffer, outputBuffer, resultBuffer };
+		glDeleteBuffers(5, buffers);
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef _PRIMITIVES_HPP
+#define _PRIMITIVES_HPP
+
+#include <vector>
+#include <GL/glew.h>
+
+using namespace std;
+
+static const char* SCAN_SHADER = "shaders/sh_scan.glsl";
+static const char* REDUCE_SHADER = "shaders/sh_reduce.glsl";
+static const char* RADIX_SORT_SHADER = "shaders/sh_radix_sort.glsl";
+static const char* COMPACT_SHADER = "shaders/sh_compact.glsl";
+
+// Reduction operators
+const int REDUCE_SUM = 0;
+const int REDUCE_MIN = 1;
+const int REDUCE_MAX = 2;
+
+// Element count that stays on the GPU, a uint at a byte offset of a buffer
+struct GPUCount
+{
+	GLuint buffer;
+	GLuint offset;
+};
+
+// Building blocks on uint / float SSBOs, 256 elements per work group. The wrappers bind
+// their buffers to SSBO points 16 to 21 and leave the current program unbound, callers
+// rebind their own program afterwards. Results stay on the GPU.
+class GPUPrimitives {
+public:
+	GPUPrimitives();
+	~GPUPrimitives();
+
+	// In place exclusive scan of maxN uints, or of the first *count of them
+	void scanExclusive(GLuint data, GLuint maxN, const GPUCount* count = NULL);
+	// Copy the total of the last scan (one uint) into a buffer
+	void copyScanTotal(GLuint dst, GLuint dstOffset);
+	// Reduce n floats into the float at resultOffset (bytes) of result
+	void reduce(GLuint data, GLuint n, int op, GLuint result, GLuint resultOffset);
+	// Stable key-value sort of maxN uint pairs (or the first *count), 4 bit digits
+	void radixSort(GLuint keys, GLuint values, GLuint maxN, const GPUCount* count = NULL);
+	// output = input[i] where flags[i] != 0 in order, the kept count goes to countBuffer
+	void compact(GLuint input, GLuint flags, GLuint output, GLuint n, GLuint countBuffer, GLuint countOffset);
+	void cleanup();
+
+private:
+	GLuint scanProgram;
+	GLuint reduceProgram;
+	GLuint radixSortProgram;
+	GLuint compactProgram;
+
+	// Uniform Location
+	GLuint uniScanPass;
+	GLuint uniScanN;
+	GLuint uniScanUseCount;
+	GLuint uniScanCountIndex;
+	GLuint uniScanLevel;
+	GLuint uniReduceN;
+	GLuint uniReduceOp;
+	GLuint uniSortPass;
+	GLuint uniSortN;
+	GLuint uniSortUseCount;
+	GLuint uniSortCountIndex;
+	GLuint uniSortShift;
+	GLuint uniSortNumGroups;
+	GLuint uniCompactPass;
+	GLuint uniCompactN;
+
+	// Scratch, grown on demand
+	vector<GLuint> scanLevels;		// group totals of each scan level, the top one is the total
+	GLuint scanTotal;
+	GLuint reduceBuffers[2];
+	GLuint sortKeys;
+	GLuint sortValues;
+	GLuint sortHistogram;
+	GLuint compactPositions;
+
+	void bindCount(const GPUCount* count, GLuint uniUseCount, GLuint uniCountIndex);
+	void reserve(GLuint& buffer, GLsizeiptr bytes);
+};
+
+// CPU references, bit exact with the GPU versions
+void cpuScanExclusive(const vector<GLuint>& input, vector<GLuint>& output);
+float cpuReduce(const vector<float>& data, int op);		// same tree order as the GPU
+void cpuRadixSort(vector<GLuint>& keys, vector<GLuint>& values);
+GLuint cpuCompact(const vector<GLuint>& input, const vector<GLuint>& flags, vector<GLuint>& output);
+
+// Time each primitive at several sizes against its CPU reference and print the table
+void benchmarkPrimitives(GPUPrimitives& primitives);
+
+#endif // !_PRIMITIVES_HPP
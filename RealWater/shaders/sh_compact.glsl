@@ -0,0 +1,48 @@
+#version 460 compatibility
+#extension GL_ARB_compute_shader: enable
+#extension GL_ARB_shader_storage_buffer_object: enable
+
+// Stream compaction of uints, keeps input[i] where flags[i] != 0 in order.
+// Pass 1 writes the keep flags, the host scans them, pass 2 scatters.
+
+layout(std430, binding = 16) buffer CompactInput
+{
+	uint input_data[];
+};
+
+layout(std430, binding = 17) buffer CompactFlags
+{
+	uint flags[];
+};
+
+layout(std430, binding = 18) buffer CompactScan
+{
+	uint positions[];
+};
+
+layout(std430, binding = 19) buffer CompactOutput
+{
+	uint output_data[];
+};
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;  // group size
+
+uniform int pass;
+uniform uint n;
+
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= n)
+		return;
+
+	if (pass == 1)
+		positions[i] = flags[i] != 0 ? 1 : 0;
+
+	else if (pass == 2)
+	{
+		if (flags[i] != 0)
+			output_data[positions[i]] = input_data[i];
+	}
+}
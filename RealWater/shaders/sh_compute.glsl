@@ -17,45 +17,485 @@ layout(std430, binding = 0) buffer Particle
 	particle particles[];
 };
 
-const float RADIUS = 0.04f;
-const float CORE_RAIDUS = RADIUS * 10;
-const float MASS = 80.0f;
-const float REST_DENSITY = 100.f;
-const float STIFFNESS = 10.f;
-const float VISCOSITY = 200.f;
-const vec3 GRAVITY = vec3(0.f, -10.f, 0.f);
-const float PI = 3.1415926535f;
-const float SPEED_DECAY = 0.8;
+// Static wall samples (Akinci et al. 2012), w holds the precomputed volume psi = rho0 * V_b
+struct boundary_particle
+{
+	vec4 pos;
+};
+
+layout(std430, binding = 3) buffer Boundary
+{
+	boundary_particle boundary[];
+};
+
+// The samples are sorted by cell when the walls are resampled. Start of every cell of a dense
+// table over the cells of the walls, one more entry ends the last cell
+layout(std430, binding = 13) buffer BoundaryCells
+{
+	uint boundary_cell_start[];
+};
+
+// Steps each particle has been at rest, asleep from SLEEP_STEPS on
+layout(std430, binding = 4) buffer Activity
+{
+	uint sleep_steps[];
+};
+
+// Indirect dispatch arguments followed by the compacted list of awake particles
+layout(std430, binding = 5) buffer ActiveList
+{
+	uint groups_x;
+	uint groups_y;
+	uint groups_z;
+	uint active_count;
+	uint active_ids[];
+};
+
+// GPU resident particle count and the indirect arguments derived from it,
+// passes that add or remove particles keep it up to date without any readback
+layout(std430, binding = 6) buffer Counters
+{
+	uint live_groups_x;				// glDispatchComputeIndirect over the live particles
+	uint live_groups_y;
+	uint live_groups_z;
+	uint live_count;
+	uint draw_count;				// glDrawArraysIndirect of the live particles
+	uint draw_instance_count;
+	uint draw_first;
+	uint draw_base_instance;
+	uint emit_head;					// total emitted, never reset by the reorder (ring buffer)
+	uint counters_pad0;
+	uint counters_pad1;
+	uint counters_pad2;
+};
+
+// Sparse block grid: bricks of GRID_BRICK^3 cells are allocated on demand through a
+// hashed table of brick keys, so memory follows the occupied space and not the domain.
+// Per cell particle counts, scanned in place by the primitives library into the start of
+// every cell in GridOrder. The cells hold grid_brick_capacity bricks, sized
+// from an earlier step. Bricks beyond share one overflow cell behind them for the step, a
+// cell whose particles every neighbor search of those bricks goes through.
+layout(std430, binding = 7) buffer GridCells
+{
+	uint cell_start[];
+};
+
+layout(std430, binding = 8) buffer Grid
+{
+	uint brick_count;
+	uint cell_total;				// cells of the allocated bricks and the overflow cell, count of the scan
+	uint moved_count;				// particles out of the cell they were last reordered into
+	uint grid_reorder;				// nonzero if this step reorders the particles by cell
+	uint reorder_total;				// steps that reordered, never reset by pass 18
+	uint grid_live;					// live count the step started with
+	uint grid_pad0;
+	uint grid_pad1;
+	uint grid_table[];				// pairs of brick key (GRID_EMPTY if free) and brick
+};
+
+// Cell of each particle and its rank in the cell (x, y), the position in GridOrder is
+// start + rank. The brick key and brick cell (z, w) the slot held at the last reorder
+layout(std430, binding = 11) buffer GridParticle
+{
+	uvec4 grid_particle[];
+};
+
+// Slot of the particle at every position of the cell ranges. The particles are reordered by
+// cell only once enough of them left the cell of the last reorder, or to drop removed ones,
+// until then they keep their slots and only this list is rebuilt. The identity after a reorder
+layout(std430, binding = 15) buffer GridOrder
+{
+	uint grid_order[];
+};
+
+// Scratch copies the reordered survivors are packed into
+
+layout(std430, binding = 9) buffer ParticleScratch
+{
+	particle scratch[];
+};
+
+layout(std430, binding = 10) buffer ActivityScratch
+{
+	uint sleep_steps_scratch[];
+};
+
+// Emitter ring: slot of the particle at every ring position, GRID_EMPTY if it was removed.
+// The particle emitted as number s sits at position s % N, the reorder by cell moves the
+// particles and pass 24 follows them, so that emission recycles the oldest by age
+layout(std430, binding = 14) buffer RingSlots
+{
+	uint ring_slot[];
+};
+
+// Staging buffer of the recorder, a frame header and the selected attributes as arrays.
+// Floats go in by their bits, so that the ids beside them stay exact
+layout(std430, binding = 12) buffer Record
+{
+	uint record_header[4];			// step, live count, attributes, pad
+	uint record_data[];
+};
+
+// Conjugate gradient vectors of the implicit viscosity solve
+struct viscosity_solve
+{
+	vec4 r;		// residual
+	vec4 p;		// search direction
+	vec4 ap;	// A * p
+};
+
+layout(std430, binding = 1) buffer ViscositySolve
+{
+	viscosity_solve solve[];
+};
+
+// CG scalars (one per velocity component) and step statistics
+layout(std430, binding = 2) buffer Reduction
+{
+	vec4 rr;						// r . r of the current iteration
+	vec4 alpha;						// step length
+	vec4 beta;						// direction update factor
+	uint max_viscosity_rate;		// float bits, max_i of k * sum_j w_ij (explicit stability)
+	uint max_speed;					// float bits, max particle speed
+	uint pad0;
+	uint pad1;
+	vec4 partials[];				// one partial dot product per work group
+};
+
+// RADIUS, CORE_RADIUS, MASS, REST_DENSITY, STIFFNESS, VISCOSITY, GRAVITY, PI, SPEED_DECAY,
+// GRID_BRICK, GRID_BRICK_SHIFT, GRID_BRICK_BIAS, GRID_BRICK_MAX, MAX_KILL_PLANES, MAX_SINKS
+// and RECORD_* are prepended from constants.hpp and Recorder.hpp by SimulationContext
 const float SURFACE_TENSION = 10.f;
+const float VISCOSITY_TOLERANCE = 1e-10f;
+const uint SLEEP_STEPS = 30;
+const float SLEEP_VELOCITY = 0.02f;
+const float SLEEP_ACCELERATION = 1.f;
+const uint GRID_EMPTY = 0xffffffffu;
+const ivec3 GRID_CELL_MIN = -GRID_BRICK_BIAS * GRID_BRICK;
+const ivec3 GRID_CELL_MAX = (GRID_BRICK_MAX - GRID_BRICK_BIAS) * GRID_BRICK + GRID_BRICK - 1;
 
 layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;  // group size
 
-uniform int N;					// number of particls
+uniform int N;					// capacity of the particle buffer
 uniform float delta_time;		// delta time each frame
 uniform int pass;
-uniform float bounding_z;		// set the bounding range for z
-uniform float bounding_x;		// set the bounding range for x
+uniform sampler3D collider_sdf;	// signed distance to static colliders, negative inside
+uniform vec3 collider_min;		// world space bounds of collider_sdf
+uniform vec3 collider_max;
+uniform vec3 container_min;		// walls of the container, tested directly and never baked
+uniform vec3 container_max;		// FLT_MAX above the open top
+uniform bool implicit_viscosity;	// solve viscosity implicitly after pass 2
+uniform int boundary_num;		// number of boundary particles, 0 disables wall handling
+uniform ivec3 boundary_cell_min;	// first cell of the boundary cell table
+uniform ivec3 boundary_cell_dims;	// cells of the table along each axis
+uniform bool use_active_list;	// pass 1 to 3 run on the awake particles only
+uniform int grid_table_size;	// power of two, at least twice the particle capacity
+uniform uint grid_brick_capacity;	// bricks of GridCells, those allocated beyond overflow
+uniform bool grid_incremental;	// reorder past GRID_MOVED_FRACTION moved particles, else every step
+uniform int record_attributes;	// RECORD_* mask of pass 23
+uniform uint record_step;
+
+// Emitter of pass 14
+uniform int emit_type;			// 0 = nozzle, 1 = plane, 2 = volume
+uniform uint emit_count;		// particles to spawn this step
+uniform uint emit_seed;			// changes every step
+uniform vec3 emit_position;
+uniform vec3 emit_direction;	// normalized flow direction
+uniform vec3 emit_size;			// nozzle radius / plane half extents / volume half extents
+uniform float emit_speed;
+
+// Removal, particles behind a kill plane or inside a sink are dropped by pass 15 to 17
+uniform int kill_plane_num;
+uniform vec4 kill_planes[MAX_KILL_PLANES];	// keep the side where dot(xyz, p) >= w
+uniform int sink_num;
+uniform vec3 sink_min[MAX_SINKS];
+uniform vec3 sink_max[MAX_SINKS];
+
+shared vec4 partial_sums[256];
+
+
+// Viscosity coefficient k of acc_viscosity_i = k * sum_j (v_j - v_i) / (rho_i * rho_j) * (h - r)
+float viscosityCoefficient()
+{
+	return MASS * VISCOSITY * 45.f / (PI * pow(CORE_RADIUS, 6));
+}
+
+// Cell of the support radius holding a position
+ivec3 gridCell(vec3 pos)
+{
+	return clamp(ivec3(floor(pos / CORE_RADIUS)), GRID_CELL_MIN, GRID_CELL_MAX);
+}
+
+uint brickKey(ivec3 cell)
+{
+	uvec3 brick = uvec3((cell >> GRID_BRICK_SHIFT) + GRID_BRICK_BIAS);
+	return brick.x | brick.y << 10 | brick.z << 22;
+}
+
+// Index of the cell in the bricks
+uint brickCell(ivec3 cell)
+{
+	ivec3 local = cell & (GRID_BRICK - 1);
+	return uint((local.z * GRID_BRICK + local.y) * GRID_BRICK + local.x);
+}
+
+uint gridHash(uint key)
+{
+	key ^= key >> 16;
+	key *= 0x7feb352du;
+	key ^= key >> 15;
+	key *= 0x846ca68bu;
+	key ^= key >> 16;
+	return key & uint(grid_table_size - 1);
+}
+
+// Brick of a key, -1 if no particle allocated it
+int findBrick(uint key)
+{
+	for (uint h = gridHash(key); ; h = (h + 1) & uint(grid_table_size - 1))
+	{
+		uint k = grid_table[2 * h];
+		if (k == key)
+			return int(grid_table[2 * h + 1]);
+		if (k == GRID_EMPTY)
+			return -1;
+	}
+}
+
+// Index of a cell of an allocated brick in GridCells, the overflow cell for bricks beyond
+// the capacity
+uint gridCellIndex(int brick, ivec3 cell)
+{
+	const uint cells = GRID_BRICK * GRID_BRICK * GRID_BRICK;
+	return uint(brick) < grid_brick_capacity ? uint(brick) * cells + brickCell(cell) : grid_brick_capacity * cells;
+}
+
+// Positions [start, end) of a cell in GridOrder, false for cells in unallocated bricks. The
+// overflow cell is handed out once per search, later cells of overflowed bricks are false
+bool cellRange(ivec3 cell, inout bool overflowSeen, out uint start, out uint end)
+{
+	if (any(lessThan(cell, GRID_CELL_MIN)) || any(greaterThan(cell, GRID_CELL_MAX)))
+		return false;
+	int brick = findBrick(brickKey(cell));
+	if (brick < 0)
+		return false;
+	if (uint(brick) >= grid_brick_capacity)
+	{
+		if (overflowSeen)
+			return false;
+		overflowSeen = true;
+	}
+	uint c = gridCellIndex(brick, cell);
+	start = cell_start[c];
+	end = c + 1 < cell_total ? cell_start[c + 1] : live_count;
+	return start < end;
+}
+
+// Boundary samples [start, end) of a cell, false for cells without walls
+bool boundaryRange(ivec3 cell, out uint start, out uint end)
+{
+	ivec3 local = cell - boundary_cell_min;
+	if (any(lessThan(local, ivec3(0))) || any(greaterThanEqual(local, boundary_cell_dims)))
+		return false;
+	uint c = uint((local.z * boundary_cell_dims.y + local.y) * boundary_cell_dims.x + local.x);
+	start = boundary_cell_start[c];
+	end = boundary_cell_start[c + 1];
+	return start < end;
+}
+
+// Neighbor cell n of 27 around a cell
+ivec3 neighborCell(ivec3 cell, int n)
+{
+	return cell + ivec3(n % 3, n / 3 % 3, n / 9) - 1;
+}
+
+// Matrix free product of the backward Euler viscosity matrix A = I - dt * L
+// with the velocity (operand 0) or the CG search direction (operand 1)
+vec3 applyViscosityMatrix(uint i, int operand)
+{
+	vec3 x_i = operand == 0 ? particles[i].vel.xyz : solve[i].p.xyz;
+	vec3 lx = vec3(0.f);
+	ivec3 cell_i = gridCell(particles[i].currPos.xyz);
+	bool overflowSeen = false;
+	for (int n = 0; n < 27; n++)
+	{
+		uint start, end;
+		if (!cellRange(neighborCell(cell_i, n), overflowSeen, start, end))
+			continue;
+		for (uint k = start; k < end; k++)
+		{
+			uint j = grid_order[k];
+			float dist = distance(particles[i].currPos, particles[j].currPos);
+			if (dist < CORE_RADIUS && i != j)
+			{
+				vec3 x_j = operand == 0 ? particles[j].vel.xyz : solve[j].p.xyz;
+				float density_ij = particles[i].factor.x * particles[j].factor.x;
+				lx += (x_j - x_i) / density_ij * (CORE_RADIUS - dist);
+			}
+		}
+	}
+	return x_i - delta_time * viscosityCoefficient() * lx;
+}
+
+// Outward normal of the colliders from the gradient of the distance field
+vec3 colliderNormal(vec3 uvw)
+{
+	vec3 h = 1.f / vec3(textureSize(collider_sdf, 0));
+	vec3 grad = vec3(
+		textureLod(collider_sdf, uvw + vec3(h.x, 0.f, 0.f), 0.f).r - textureLod(collider_sdf, uvw - vec3(h.x, 0.f, 0.f), 0.f).r,
+		textureLod(collider_sdf, uvw + vec3(0.f, h.y, 0.f), 0.f).r - textureLod(collider_sdf, uvw - vec3(0.f, h.y, 0.f), 0.f).r,
+		textureLod(collider_sdf, uvw + vec3(0.f, 0.f, h.z), 0.f).r - textureLod(collider_sdf, uvw - vec3(0.f, 0.f, h.z), 0.f).r);
+	float len = length(grad);
+	return len > 0.f ? grad / len : vec3(0.f, 1.f, 0.f);
+}
+
+// Distance to the nearest container wall, negative outside, and the inward normal of that
+// wall. The same field the container had when it was baked, without the texture
+float containerDistance(vec3 pos, out vec3 n)
+{
+	vec3 toMin = pos - container_min;
+	vec3 toMax = container_max - pos;
+	float phi = toMin.y;
+	n = vec3(0.f, 1.f, 0.f);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (toMin[axis] < phi)
+		{
+			phi = toMin[axis];
+			n = vec3(0.f);
+			n[axis] = 1.f;
+		}
+		if (toMax[axis] < phi)
+		{
+			phi = toMax[axis];
+			n = vec3(0.f);
+			n[axis] = -1.f;
+		}
+	}
+	return phi;
+}
+
+// PCG hash, uniform float in [0, 1)
+float random01(inout uint state)
+{
+	state = state * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	word = (word >> 22u) ^ word;
+	return float(word >> 8) / 16777216.f;
+}
+
+// Particle removed by a kill plane or a sink
+bool isRemoved(vec3 pos)
+{
+	for (int k = 0; k < kill_plane_num; k++)
+	{
+		if (dot(kill_planes[k].xyz, pos) < kill_planes[k].w)
+			return true;
+	}
+	for (int k = 0; k < sink_num; k++)
+	{
+		if (all(greaterThanEqual(pos, sink_min[k])) && all(lessThanEqual(pos, sink_max[k])))
+			return true;
+	}
+	return false;
+}
+
+// Sum a value over the work group and store it as this group's partial
+void reducePartial(vec4 value)
+{
+	uint lid = gl_LocalInvocationID.x;
+	partial_sums[lid] = value;
+	barrier();
+	for (uint s = gl_WorkGroupSize.x / 2; s > 0; s >>= 1)
+	{
+		if (lid < s)
+			partial_sums[lid] += partial_sums[lid + s];
+		barrier();
+	}
+	if (lid == 0)
+		partials[gl_WorkGroupID.x] = partial_sums[0];
+}
+
+// Sum all partials with a single work group, the result is valid in partial_sums[0]
+void reduceAll()
+{
+	uint lid = gl_LocalInvocationID.x;
+	uint groups = (live_count + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+	vec4 sum = vec4(0.f);
+	for (uint g = lid; g < groups; g += gl_WorkGroupSize.x)
+		sum += partials[g];
+	partial_sums[lid] = sum;
+	barrier();
+	for (uint s = gl_WorkGroupSize.x / 2; s > 0; s >>= 1)
+	{
+		if (lid < s)
+			partial_sums[lid] += partial_sums[lid + s];
+		barrier();
+	}
+}
 
 
 void main()
 {
 	uint i = gl_GlobalInvocationID.x;  // 1D, so the .y and .z is both 1
 
+	// Indirect dispatch over the compacted awake particles or all live ones
+	if (use_active_list && pass <= 3)
+	{
+		if (i >= active_count)
+			return;
+		i = active_ids[i];
+	}
+	else if (pass <= 3 && i >= live_count)
+	{
+		return;
+	}
+
 	if (pass == 1)
 	{
 		// Density and Pressure
 		float nb_sum = 0.f;
-		for (int j = 0; j < N; j++)
+		bool moving = sleep_steps[i] == 0;
+		ivec3 cell_i = gridCell(particles[i].currPos.xyz);
+		bool overflowSeen = false;
+		for (int n = 0; n < 27; n++)
 		{
-			float dist = distance(particles[i].currPos, particles[j].currPos);
-			if (dist < CORE_RAIDUS)
+			uint start, end;
+			if (!cellRange(neighborCell(cell_i, n), overflowSeen, start, end))
+				continue;
+			for (uint k = start; k < end; k++)
 			{
-				nb_sum += pow(pow(CORE_RAIDUS, 2) - pow(dist, 2), 3);
+				uint j = grid_order[k];
+				float dist = distance(particles[i].currPos, particles[j].currPos);
+				if (dist < CORE_RADIUS)
+				{
+					nb_sum += pow(pow(CORE_RADIUS, 2) - pow(dist, 2), 3);
+					// a moving particle wakes the sleeping ones it approaches
+					if (moving && sleep_steps[j] >= SLEEP_STEPS)
+						sleep_steps[j] = 0;
+				}
 			}
 		}
 		
+		// Boundary contribution, psi replaces the fluid mass
+		float nb_boundary_sum = 0.f;
+		for (int n = 0; n < 27 && boundary_num > 0; n++)
+		{
+			uint start, end;
+			if (!boundaryRange(neighborCell(cell_i, n), start, end))
+				continue;
+			for (uint b = start; b < end; b++)
+			{
+				float dist = distance(particles[i].currPos.xyz, boundary[b].pos.xyz);
+				if (dist < CORE_RADIUS)
+				{
+					nb_boundary_sum += boundary[b].pos.w * pow(pow(CORE_RADIUS, 2) - pow(dist, 2), 3);
+				}
+			}
+		}
+
 		// Density
-		float density_i = MASS * 315 / (64 * PI * pow(CORE_RAIDUS, 9)) * nb_sum;
+		float density_i = 315 / (64 * PI * pow(CORE_RADIUS, 9)) * (MASS * nb_sum + nb_boundary_sum);
 		// Pressure
 		float pressure_i = max(STIFFNESS * (density_i - REST_DENSITY), 0.f);
 
@@ -73,37 +513,67 @@ void main()
 		vec3 nb_sacc_sum = vec3(0.f);			// surface tension sum
 		float nb_color_surface_sum = 0.f;		// color field sum
 		vec3 nb_surface_normal_sum = vec3(0.f); // surface nromal sum
+		float nb_viscosity_weight_sum = 0.f;	// sum of viscosity weights (stability)
 
-		for (int j = 0; j < N; j++)
+		ivec3 cell_i = gridCell(particles[i].currPos.xyz);
+		bool overflowSeen = false;
+		for (int n = 0; n < 27; n++)
 		{
-			float dist = distance(particles[i].currPos, particles[j].currPos);
-			if (dist < CORE_RAIDUS && i != j)
+			uint start, end;
+			if (!cellRange(neighborCell(cell_i, n), overflowSeen, start, end))
+				continue;
+			for (uint k = start; k < end; k++)
 			{
-				// sum up quantity in pressure direction related to neighbour
-				float pressure_ij = particles[i].factor.y + particles[j].factor.y;
-				float density_ij = particles[i].factor.x * particles[j].factor.x;
-				float r_diff_pow_2 = pow(CORE_RAIDUS - dist, 2); 
-				vec3 dir_ij = particles[i].currPos.xyz - particles[j].currPos.xyz;	
-				nb_pacc_sum += normalize(dir_ij) * (pressure_ij / (2.f * density_ij)) * r_diff_pow_2;
+				uint j = grid_order[k];
+				float dist = distance(particles[i].currPos, particles[j].currPos);
+				if (dist < CORE_RADIUS && i != j)
+				{
+					// sum up quantity in pressure direction related to neighbour
+					float pressure_ij = particles[i].factor.y + particles[j].factor.y;
+					float density_ij = particles[i].factor.x * particles[j].factor.x;
+					float r_diff_pow_2 = pow(CORE_RADIUS - dist, 2); 
+					vec3 dir_ij = particles[i].currPos.xyz - particles[j].currPos.xyz;	
+					nb_pacc_sum += normalize(dir_ij) * (pressure_ij / (2.f * density_ij)) * r_diff_pow_2;
 			
-				// sum up quantity in viscosity direction related to neighbour
-				vec3 velocity_ji = particles[j].vel.xyz - particles[i].vel.xyz;
-				nb_vacc_sum += velocity_ji / density_ij * (CORE_RAIDUS - dist);
+					// sum up quantity in viscosity direction related to neighbour
+					vec3 velocity_ji = particles[j].vel.xyz - particles[i].vel.xyz;
+					nb_vacc_sum += velocity_ji / density_ij * (CORE_RADIUS - dist);
+					nb_viscosity_weight_sum += (CORE_RADIUS - dist) / density_ij;
 
-				// sum up quantity in color field
-				nb_color_surface_sum += (1.f / particles[j].factor.x) * pow(pow(CORE_RAIDUS, 2) - pow(dist, 2), 3);
+					// sum up quantity in color field
+					nb_color_surface_sum += (1.f / particles[j].factor.x) * pow(pow(CORE_RADIUS, 2) - pow(dist, 2), 3);
 
-				// sum up surface normal 
-				nb_surface_normal_sum += (1.f / particles[j].factor.x) * pow(pow(CORE_RAIDUS, 2) - pow(dist, 2), 2) * dir_ij;
+					// sum up surface normal 
+					nb_surface_normal_sum += (1.f / particles[j].factor.x) * pow(pow(CORE_RADIUS, 2) - pow(dist, 2), 2) * dir_ij;
 
-				// sum up surface tension
-				nb_sacc_sum += (1.f / density_ij) * (pow(CORE_RAIDUS, 2) - pow(dist, 2)) * (pow(dist, 2) - 3.f/4.f * (pow(CORE_RAIDUS,2) - pow(dist,2)));
+					// sum up surface tension
+					nb_sacc_sum += (1.f / density_ij) * (pow(CORE_RADIUS, 2) - pow(dist, 2)) * (pow(dist, 2) - 3.f/4.f * (pow(CORE_RADIUS,2) - pow(dist,2)));
+				}
+			}
+		}
+
+		// pressure from the walls, mirrored pressure of particle i weighted by psi
+		vec3 nb_boundary_pacc_sum = vec3(0.f);
+		float pressure_i = particles[i].factor.y;
+		float density_i = particles[i].factor.x;
+		for (int n = 0; n < 27 && boundary_num > 0; n++)
+		{
+			uint start, end;
+			if (!boundaryRange(neighborCell(cell_i, n), start, end))
+				continue;
+			for (uint b = start; b < end; b++)
+			{
+				vec3 dir_ib = particles[i].currPos.xyz - boundary[b].pos.xyz;
+				float dist = length(dir_ib);
+				if (dist < CORE_RADIUS && dist > 0.f)
+				{
+					nb_boundary_pacc_sum += boundary[b].pos.w * (dir_ib / dist) * (pressure_i / (density_i * density_i)) * pow(CORE_RADIUS - dist, 2);
+				}
 			}
-			
 		}
 
 		// write color field to buffer
-		float color_field = MASS * 315.f / (64.f * PI * pow(CORE_RAIDUS, 9)) * nb_color_surface_sum;
+		float color_field = MASS * 315.f / (64.f * PI * pow(CORE_RADIUS, 9)) * nb_color_surface_sum;
 		particles[i].factor.z = color_field;
 //		if (abs(color_field - 0.f) < 0.01f )
 //			particles[i].factor.z = 0;
@@ -111,17 +581,20 @@ void main()
 //			particles[i].factor.z = 1;
 
 		// write surface normal to buffer (should normalize)
-		vec3 surface_normal = -MASS * 945.f / (32.f * PI * pow(CORE_RAIDUS, 9)) * nb_surface_normal_sum;
+		vec3 surface_normal = -MASS * 945.f / (32.f * PI * pow(CORE_RADIUS, 9)) * nb_surface_normal_sum;
 		particles[i].surfaceNorm = vec4(normalize(surface_normal), 0.f);
 
 		// acc in pressure
-		vec3 acc_pressure_i = MASS * 45.f / (PI * pow(CORE_RAIDUS, 6)) * nb_pacc_sum;
+		vec3 acc_pressure_i = 45.f / (PI * pow(CORE_RADIUS, 6)) * (MASS * nb_pacc_sum + nb_boundary_pacc_sum);
 		// acc in viscosity
-		vec3 acc_viscosity_i =  MASS * VISCOSITY * 45.f / (PI * pow(CORE_RAIDUS, 6)) * nb_vacc_sum;
+		vec3 acc_viscosity_i = implicit_viscosity ? vec3(0.f) : viscosityCoefficient() * nb_vacc_sum;
+		// explicit viscosity is stable while delta_time < 1 / rate
+		float viscosity_rate = viscosityCoefficient() * nb_viscosity_weight_sum;
+		atomicMax(max_viscosity_rate, floatBitsToUint(viscosity_rate));
 		// acc in gravity
 		vec3 acc_gravity_i = GRAVITY;
 		// acc in surface tension
-		vec3 acc_surface_tension = -MASS * SURFACE_TENSION * 945.f / (8.f * PI * pow(CORE_RAIDUS, 9)) *
+		vec3 acc_surface_tension = -MASS * SURFACE_TENSION * 945.f / (8.f * PI * pow(CORE_RADIUS, 9)) *
 			(nb_sacc_sum * particles[i].surfaceNorm.xyz);
 
 		// write acc to the buffer
@@ -138,41 +611,379 @@ void main()
 		vec4 prevPos = particles[i].currPos;
 		vec4 vel = particles[i].vel;
 
-		// detect bouding to correct the position
-		if (currPos.x < -bounding_x)
+		// collide with the container walls, then with the baked obstacles, one trilinear
+		// lookup for any shape
+		vec3 n;
+		float phi = containerDistance(currPos.xyz, n);
+		if (phi < 0.f)
 		{
-			currPos.x = -bounding_x;
-			vel.x = -vel.x * SPEED_DECAY;
+			currPos.xyz -= phi * n;
+			float vel_n = dot(vel.xyz, n);
+			if (vel_n < 0.f)
+				vel.xyz -= (1.f + SPEED_DECAY) * vel_n * n;
 		}
-		else if (currPos.x > bounding_x)
+		vec3 uvw = (currPos.xyz - collider_min) / (collider_max - collider_min);
+		phi = textureLod(collider_sdf, uvw, 0.f).r;
+		if (phi < 0.f)
 		{
-			currPos.x = bounding_x;
-			vel.x = -vel.x * SPEED_DECAY;
+			n = colliderNormal(uvw);
+			currPos.xyz -= phi * n;
+			// reflect the normal velocity with decay, keep the tangential part
+			float vel_n = dot(vel.xyz, n);
+			if (vel_n < 0.f)
+				vel.xyz -= (1.f + SPEED_DECAY) * vel_n * n;
 		}
-		if (currPos.y < -6.f)
+
+		particles[i].currPos = currPos;
+		particles[i].prevPos = prevPos;
+		particles[i].vel = vel;
+		atomicMax(max_speed, floatBitsToUint(length(vel.xyz)));
+
+		// activity tracking, at rest for SLEEP_STEPS steps puts the particle asleep
+		if (length(vel.xyz) < SLEEP_VELOCITY && length(particles[i].acc.xyz) < SLEEP_ACCELERATION)
+			sleep_steps[i] = min(sleep_steps[i] + 1, SLEEP_STEPS);
+		else
+			sleep_steps[i] = 0;
+	}
+
+	// Implicit viscosity: conjugate gradient on (I - dt * L) v = v*, one solve per component,
+	// where v* is the velocity written by pass 2 without the viscosity acceleration
+	else if (pass == 4)
+	{
+		// r = v* - A * v*, p = r
+		vec3 r = vec3(0.f);
+		if (i < live_count)
 		{
-			currPos.y = -6.f;
-			vel.y = -vel.y * SPEED_DECAY;
+			r = particles[i].vel.xyz - applyViscosityMatrix(i, 0);
+			solve[i].r = vec4(r, 0.f);
+			solve[i].p = vec4(r, 0.f);
 		}
-//		else if (currPos.y > 4.f)
-//		{
-//			currPos.y = 4.f;
-//			vel.y = -vel.y * SPEED_DECAY;
-//		}
-		if (currPos.z < -bounding_z)
+		reducePartial(vec4(r * r, 0.f));
+	}
+
+	else if (pass == 5)
+	{
+		// rr = r . r
+		reduceAll();
+		if (gl_LocalInvocationID.x == 0)
+			rr = partial_sums[0];
+	}
+
+	else if (pass == 6)
+	{
+		// ap = A * p
+		vec3 p = vec3(0.f);
+		vec3 ap = vec3(0.f);
+		if (i < live_count)
 		{
-			currPos.z = -bounding_z;
-			vel.z = -vel.z * SPEED_DECAY;
+			p = solve[i].p.xyz;
+			ap = applyViscosityMatrix(i, 1);
+			solve[i].ap = vec4(ap, 0.f);
 		}
-		else if (currPos.z > bounding_z)
+		reducePartial(vec4(p * ap, 0.f));
+	}
+
+	else if (pass == 7)
+	{
+		// alpha = rr / (p . ap), frozen once a component converged
+		reduceAll();
+		if (gl_LocalInvocationID.x == 0)
 		{
-			currPos.z = bounding_z;
-			vel.z = -vel.z * SPEED_DECAY;
+			vec4 p_ap = partial_sums[0];
+			for (int c = 0; c < 3; c++)
+				alpha[c] = (rr[c] > VISCOSITY_TOLERANCE && p_ap[c] > 0.f) ? rr[c] / p_ap[c] : 0.f;
 		}
+	}
 
-		particles[i].currPos = currPos;
-		particles[i].prevPos = prevPos;
-		particles[i].vel = vel;
+	else if (pass == 8)
+	{
+		// v += alpha * p, r -= alpha * ap
+		vec3 r = vec3(0.f);
+		if (i < live_count)
+		{
+			particles[i].vel.xyz += alpha.xyz * solve[i].p.xyz;
+			r = solve[i].r.xyz - alpha.xyz * solve[i].ap.xyz;
+			solve[i].r = vec4(r, 0.f);
+		}
+		reducePartial(vec4(r * r, 0.f));
+	}
+
+	else if (pass == 9)
+	{
+		// beta = rr_new / rr
+		reduceAll();
+		if (gl_LocalInvocationID.x == 0)
+		{
+			vec4 rr_new = partial_sums[0];
+			for (int c = 0; c < 3; c++)
+				beta[c] = rr[c] > VISCOSITY_TOLERANCE ? rr_new[c] / rr[c] : 0.f;
+			rr = rr_new;
+		}
+	}
+
+	else if (pass == 10)
+	{
+		// p = r + beta * p
+		if (i < live_count)
+			solve[i].p.xyz = solve[i].r.xyz + beta.xyz * solve[i].p.xyz;
+	}
+
+	// Sleeping particles: compact the awake ones into the active list
+	else if (pass == 11)
+	{
+		if (i < live_count && sleep_steps[i] < SLEEP_STEPS)
+			active_ids[atomicAdd(active_count, 1)] = i;
+	}
+
+	else if (pass == 12)
+	{
+		// indirect dispatch size of pass 1 to 3
+		if (i == 0)
+		{
+			groups_x = (active_count + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+			groups_y = 1;
+			groups_z = 1;
+		}
+	}
+
+	// Emission: spawn emit_count particles into the ring buffer slots
+	else if (pass == 14)
+	{
+		if (i >= emit_count)
+			return;
+
+		uint state = emit_seed ^ (i * 2654435761u);
+		vec3 tangent = normalize(cross(emit_direction, abs(emit_direction.y) < 0.99f ? vec3(0.f, 1.f, 0.f) : vec3(1.f, 0.f, 0.f)));
+		vec3 bitangent = cross(emit_direction, tangent);
+		vec3 pos = emit_position;
+		if (emit_type == 0)
+		{
+			// nozzle: uniform point on the outlet disk
+			float r = emit_size.x * sqrt(random01(state));
+			float theta = 2.f * PI * random01(state);
+			pos += r * (cos(theta) * tangent + sin(theta) * bitangent);
+		}
+		else if (emit_type == 1)
+		{
+			// plane: point on the rectangle facing the flow direction
+			pos += (2.f * random01(state) - 1.f) * emit_size.x * tangent + (2.f * random01(state) - 1.f) * emit_size.y * bitangent;
+		}
+		else
+		{
+			// volume: point in the box
+			pos += (2.f * vec3(random01(state), random01(state), random01(state)) - 1.f) * emit_size;
+		}
+
+		// The particle emitted N before takes the slot of the oldest, if it was removed since
+		// there is room behind the live particles
+		uint ring = atomicAdd(emit_head, 1) % uint(N);
+		uint slot = ring_slot[ring];
+		if (slot == GRID_EMPTY)
+		{
+			slot = atomicAdd(live_count, 1);
+			ring_slot[ring] = slot;
+		}
+		particles[slot].prevPos = vec4(pos, 1.f);
+		particles[slot].currPos = vec4(pos, 1.f);
+		particles[slot].vel = vec4(emit_direction * emit_speed, 1.f);
+		particles[slot].acc = vec4(0.f);
+		particles[slot].surfaceNorm = vec4(0.f);
+		particles[slot].factor = vec4(vec3(0.f), 1.f);
+		sleep_steps[slot] = 0;
+	}
+
+	// Grid 1: free every table slot, dispatched over the table
+	else if (pass == 18)
+	{
+		if (i < uint(grid_table_size))
+		{
+			grid_table[2 * i] = GRID_EMPTY;
+			grid_table[2 * i + 1] = 0;
+		}
+		if (i == 0)
+		{
+			brick_count = 0;
+			cell_total = 0;
+			moved_count = 0;
+			grid_reorder = grid_incremental ? 0 : 1;
+			grid_live = live_count;
+		}
+	}
+
+	// Grid 2: claim a table slot for the brick of every surviving particle
+	else if (pass == 19)
+	{
+		if (i < live_count && !isRemoved(particles[i].currPos.xyz))
+		{
+			uint key = brickKey(gridCell(particles[i].currPos.xyz));
+			for (uint h = gridHash(key); ; h = (h + 1) & uint(grid_table_size - 1))
+			{
+				uint prev = atomicCompSwap(grid_table[2 * h], GRID_EMPTY, key);
+				if (prev == GRID_EMPTY || prev == key)
+					break;
+			}
+		}
+	}
+
+	// Grid 3: allocate the claimed bricks with empty cells, dispatched over the table. The
+	// first brick beyond the capacity opens the overflow cell, brick_count counts them all
+	else if (pass == 20)
+	{
+		if (i < uint(grid_table_size) && grid_table[2 * i] != GRID_EMPTY)
+		{
+			const uint cells = GRID_BRICK * GRID_BRICK * GRID_BRICK;
+			uint brick = atomicAdd(brick_count, 1);
+			grid_table[2 * i + 1] = brick;
+			if (brick < grid_brick_capacity)
+			{
+				for (uint c = 0; c < cells; c++)
+					cell_start[brick * cells + c] = 0;
+				atomicAdd(cell_total, cells);
+			}
+			else if (brick == grid_brick_capacity)
+			{
+				cell_start[brick * cells] = 0;
+				atomicAdd(cell_total, 1);
+			}
+		}
+	}
+
+	// Grid 4: count the particles of every cell and those that left the cell of the last
+	// reorder. Removed particles get no cell and have to be compacted away by a reorder
+	else if (pass == 21)
+	{
+		if (i < live_count)
+		{
+			uvec2 cell_rank = uvec2(GRID_EMPTY, 0);
+			if (!isRemoved(particles[i].currPos.xyz))
+			{
+				ivec3 cell = gridCell(particles[i].currPos.xyz);
+				uint key = brickKey(cell);
+				uint c = gridCellIndex(findBrick(key), cell);
+				cell_rank = uvec2(c, atomicAdd(cell_start[c], 1));
+				if (grid_particle[i].zw != uvec2(key, brickCell(cell)))
+					atomicAdd(moved_count, 1);
+			}
+			else
+			{
+				grid_reorder = 1;
+			}
+			grid_particle[i].xy = cell_rank;
+		}
+	}
+
+	// Grid 5: once the host scanned the counts into starts, list the particles by cell, or
+	// scatter the survivors by cell into the scratch buffers if this step reorders. The
+	// reorder is also the stream compaction of removed particles.
+	else if (pass == 22)
+	{
+		bool reorder = grid_reorder != 0 || float(moved_count) > GRID_MOVED_FRACTION * float(live_count);
+		if (i == 0)
+		{
+			grid_reorder = reorder ? 1 : 0;
+			reorder_total += reorder ? 1 : 0;
+		}
+		if (i < live_count && grid_particle[i].x != GRID_EMPTY)
+		{
+			uint dst = cell_start[grid_particle[i].x] + grid_particle[i].y;
+			if (reorder)
+			{
+				ivec3 cell = gridCell(particles[i].currPos.xyz);
+				scratch[dst] = particles[i];
+				sleep_steps_scratch[dst] = sleep_steps[i];
+				grid_particle[dst].zw = uvec2(brickKey(cell), brickCell(cell));
+				grid_order[dst] = dst;
+			}
+			else
+			{
+				grid_order[dst] = i;
+			}
+		}
+	}
+
+	// Grid 6: the emitter ring follows the reorder, dispatched over the capacity. Positions
+	// of removed particles are freed
+	else if (pass == 24)
+	{
+		if (grid_reorder != 0 && i < uint(N) && ring_slot[i] != GRID_EMPTY)
+		{
+			uvec2 cell_rank = grid_particle[ring_slot[i]].xy;
+			ring_slot[i] = cell_rank.x == GRID_EMPTY ? GRID_EMPTY : cell_start[cell_rank.x] + cell_rank.y;
+		}
+	}
+
+	// Grid 7: copy the reordered survivors back, dispatched over the new live count
+	else if (pass == 17)
+	{
+		if (grid_reorder != 0 && i < live_count)
+		{
+			particles[i] = scratch[i];
+			sleep_steps[i] = sleep_steps_scratch[i];
+		}
+	}
+
+	// Pack the recorded attributes of the live particles, arrays in mask order, dispatched
+	// over the capacity. The id of a particle is its emission number: the particle emitted as
+	// number s sits at ring position s % N, which pass 24 keeps through every reorder, so it
+	// is the last number up to emit_head - 1 that falls on the position
+	else if (pass == 23)
+	{
+		uint live = min(live_count, uint(N));
+		if (i == 0)
+		{
+			record_header[0] = record_step;
+			record_header[1] = live;
+			record_header[2] = uint(record_attributes);
+			record_header[3] = 0;
+		}
+		uint base = 0;
+		if ((record_attributes & RECORD_POSITION) != 0)
+		{
+			if (i < live)
+			{
+				record_data[base + 3 * i] = floatBitsToUint(particles[i].currPos.x);
+				record_data[base + 3 * i + 1] = floatBitsToUint(particles[i].currPos.y);
+				record_data[base + 3 * i + 2] = floatBitsToUint(particles[i].currPos.z);
+			}
+			base += 3 * live;
+		}
+		if ((record_attributes & RECORD_VELOCITY) != 0)
+		{
+			if (i < live)
+			{
+				record_data[base + 3 * i] = floatBitsToUint(particles[i].vel.x);
+				record_data[base + 3 * i + 1] = floatBitsToUint(particles[i].vel.y);
+				record_data[base + 3 * i + 2] = floatBitsToUint(particles[i].vel.z);
+			}
+			base += 3 * live;
+		}
+		if ((record_attributes & RECORD_COLOR) != 0)
+		{
+			if (i < live)
+				record_data[base + i] = floatBitsToUint(particles[i].factor.z);
+			base += live;
+		}
+		if ((record_attributes & RECORD_ID) != 0 && i < uint(N) && ring_slot[i] < live)
+		{
+			uint last = emit_head - 1;
+			record_data[base + ring_slot[i]] = last - (last % uint(N) + uint(N) - i) % uint(N);
+		}
+	}
+
+	// Indirect dispatch and draw arguments from the live count
+	else if (pass == 13)
+	{
+		if (i == 0)
+		{
+			live_count = min(live_count, uint(N));
+			live_groups_x = (live_count + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+			live_groups_y = 1;
+			live_groups_z = 1;
+			draw_count = live_count;
+			draw_instance_count = 1;
+			draw_first = 0;
+			draw_base_instance = 0;
+		}
 	}
 	
 }
\ No newline at end of file
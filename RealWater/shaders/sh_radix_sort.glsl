@@ -0,0 +1,137 @@
+#version 460 compatibility
+#extension GL_ARB_compute_shader: enable
+#extension GL_ARB_shader_storage_buffer_object: enable
+
+// Stable least significant digit radix sort of uint keys with uint values, 4 bits per
+// pass. Pass 1 builds digit-major group histograms, which the host scans device wide,
+// pass 2 sorts each group locally by the digit and scatters it to the global offsets.
+
+layout(std430, binding = 16) buffer KeysIn
+{
+	uint keys_in[];
+};
+
+layout(std430, binding = 17) buffer ValuesIn
+{
+	uint values_in[];
+};
+
+layout(std430, binding = 18) buffer KeysOut
+{
+	uint keys_out[];
+};
+
+layout(std430, binding = 19) buffer ValuesOut
+{
+	uint values_out[];
+};
+
+layout(std430, binding = 20) buffer SortCount
+{
+	uint count_data[];
+};
+
+layout(std430, binding = 21) buffer BlockHistogram
+{
+	uint block_hist[];		// [digit * num_groups + group]
+};
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;  // group size
+
+uniform int pass;
+uniform uint n;
+uniform bool use_count_buffer;
+uniform uint count_index;
+uniform uint shift;			// bit offset of the digit
+uniform uint num_groups;	// groups dispatched for the capacity
+
+shared uint hist[16];
+shared uint digit_start[16];
+shared uint scan_sums[256];
+shared uint local_keys[256];
+shared uint local_values[256];
+
+
+uint scanInclusive(uint value)
+{
+	uint lid = gl_LocalInvocationID.x;
+	scan_sums[lid] = value;
+	barrier();
+	for (uint offset = 1; offset < gl_WorkGroupSize.x; offset <<= 1)
+	{
+		uint add = lid >= offset ? scan_sums[lid - offset] : 0;
+		barrier();
+		scan_sums[lid] += add;
+		barrier();
+	}
+	return scan_sums[lid];
+}
+
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	uint lid = gl_LocalInvocationID.x;
+	uint group = gl_WorkGroupID.x;
+	uint count = use_count_buffer ? count_data[count_index] : n;
+	bool valid = i < count;
+
+	if (lid < 16)
+		hist[lid] = 0;
+	barrier();
+
+	if (pass == 1)
+	{
+		// Digit histogram of the group
+		if (valid)
+			atomicAdd(hist[(keys_in[i] >> shift) & 15], 1);
+		barrier();
+		if (lid < 16)
+			block_hist[lid * num_groups + group] = hist[lid];
+	}
+
+	else if (pass == 2)
+	{
+		// Elements past the count take the largest digit and stay behind the valid ones
+		uint key = valid ? keys_in[i] : 0xffffffffu;
+		uint value = valid ? values_in[i] : 0;
+		if (valid)
+			atomicAdd(hist[(key >> shift) & 15], 1);
+
+		// Stable local sort by the digit, one bit split at a time
+		for (uint b = 0; b < 4; b++)
+		{
+			uint bit = (key >> (shift + b)) & 1;
+			uint zeros = scanInclusive(1 - bit);
+			uint total_zeros = scan_sums[gl_WorkGroupSize.x - 1];
+			uint pos = bit == 0 ? zeros - 1 : total_zeros + lid - zeros;
+			barrier();
+			local_keys[pos] = key;
+			local_values[pos] = value;
+			barrier();
+			key = local_keys[lid];
+			value = local_values[lid];
+			barrier();
+		}
+
+		if (lid == 0)
+		{
+			uint start = 0;
+			for (uint d = 0; d < 16; d++)
+			{
+				digit_start[d] = start;
+				start += hist[d];
+			}
+		}
+		barrier();
+
+		uint digit = (key >> shift) & 15;
+		uint rank = lid - digit_start[digit];
+		if (rank < hist[digit])
+		{
+			uint dst = block_hist[digit * num_groups + group] + rank;
+			keys_out[dst] = key;
+			values_out[dst] = value;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#version 460 compatibility
+#extension GL_ARB_compute_shader: enable
+#extension GL_ARB_shader_storage_buffer_object: enable
+
+// Min, max or sum of floats, each work group reduces 256 elements with a fixed
+// tree order so that the CPU reference can reproduce the result bit for bit
+
+layout(std430, binding = 16) buffer ReduceInput
+{
+	float data[];
+};
+
+layout(std430, binding = 17) buffer ReduceOutput
+{
+	float result[];		// one per work group
+};
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;  // group size
+
+uniform uint n;
+uniform int op;			// 0 = sum, 1 = min, 2 = max
+
+shared float reduce_sums[256];
+
+
+float identity()
+{
+	if (op == 1)
+		return uintBitsToFloat(0x7f800000u);	// +inf
+	if (op == 2)
+		return uintBitsToFloat(0xff800000u);	// -inf
+	return 0.f;
+}
+
+float combine(float a, float b)
+{
+	precise float r;
+	if (op == 1)
+		r = min(a, b);
+	else if (op == 2)
+		r = max(a, b);
+	else
+		r = a + b;
+	return r;
+}
+
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	uint lid = gl_LocalInvocationID.x;
+
+	reduce_sums[lid] = i < n ? data[i] : identity();
+	barrier();
+	for (uint s = gl_WorkGroupSize.x / 2; s > 0; s >>= 1)
+	{
+		if (lid < s)
+			reduce_sums[lid] = combine(reduce_sums[lid], reduce_sums[lid + s]);
+		barrier();
+	}
+	if (lid == 0)
+		result[gl_WorkGroupID.x] = reduce_sums[0];
+}
@@ -0,0 +1,82 @@
+#version 460 compatibility
+#extension GL_ARB_compute_shader: enable
+#extension GL_ARB_shader_storage_buffer_object: enable
+
+// Device wide exclusive scan of uints, one level of the block hierarchy per dispatch.
+// Level k holds one element per work group of level k - 1.
+
+layout(std430, binding = 16) buffer ScanData
+{
+	uint data[];
+};
+
+layout(std430, binding = 17) buffer ScanSums
+{
+	uint sums[];		// inclusive total of each work group
+};
+
+layout(std430, binding = 20) buffer ScanCount
+{
+	uint count_data[];
+};
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;  // group size
+
+uniform int pass;
+uniform uint n;					// level 0 element count without a count buffer
+uniform bool use_count_buffer;	// read the level 0 count from count_data[count_index] instead
+uniform uint count_index;
+uniform int level;
+
+shared uint scan_sums[256];
+
+
+// Element count of this level, derived from the level 0 count on the GPU
+uint levelCount()
+{
+	uint count = use_count_buffer ? count_data[count_index] : n;
+	for (int l = 0; l < level; l++)
+		count = (count + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+	return count;
+}
+
+// Inclusive Hillis-Steele scan over the work group
+uint scanInclusive(uint value)
+{
+	uint lid = gl_LocalInvocationID.x;
+	scan_sums[lid] = value;
+	barrier();
+	for (uint offset = 1; offset < gl_WorkGroupSize.x; offset <<= 1)
+	{
+		uint add = lid >= offset ? scan_sums[lid - offset] : 0;
+		barrier();
+		scan_sums[lid] += add;
+		barrier();
+	}
+	return scan_sums[lid];
+}
+
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	uint count = levelCount();
+
+	if (pass == 1)
+	{
+		// Work group scan, exclusive in place plus the group total
+		uint value = i < count ? data[i] : 0;
+		uint inclusive = scanInclusive(value);
+		if (i < count)
+			data[i] = inclusive - value;
+		if (gl_LocalInvocationID.x == gl_WorkGroupSize.x - 1)
+			sums[gl_WorkGroupID.x] = inclusive;
+	}
+
+	else if (pass == 2)
+	{
+		// Add the scanned totals of the level above
+		if (i < count)
+			data[i] += sums[gl_WorkGroupID.x];
+	}
+}
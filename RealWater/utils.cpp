@@ -1,7 +1,10 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <cstring>
+#include <cstdlib>
 #include "utils.hpp"
+#include "MappedFile.hpp"
 
 // import stb_image
 #define STB_IMAGE_IMPLEMENTATION
@@ -18,9 +21,27 @@ GLuint compileShader(GLenum type, string filename, string prepend) {
 		throw runtime_error(ss.str());
 	}
 	stringstream buffer;
-	buffer << prepend << endl;
 	buffer << file.rdbuf();
 	string bufStr = buffer.str();
+
+	// The prepended lines go after the #version and #extension lines, which have to come first
+	if (!prepend.empty()) {
+		size_t pos = 0;
+		while (bufStr.compare(pos, 8, "#version") == 0 || bufStr.compare(pos, 10, "#extension") == 0) {
+			size_t end = bufStr.find('\n', pos);
+			pos = end == string::npos ? bufStr.length() : end + 1;
+		}
+		bufStr.insert(pos, prepend + "\n");
+	}
+
+	// The shaders ask for 4.6 but use nothing past 4.5, which is as far as some drivers
+	// (Mesa llvmpipe of the headless mode among them) go
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	size_t version = bufStr.find("#version 460");
+	if (version != string::npos && major * 10 + minor < 46)
+		bufStr.replace(version, 12, "#version 450");
 	const char* bufCStr = bufStr.c_str();
 	GLint length = bufStr.length();
 
@@ -47,6 +68,8 @@ GLuint compileShader(GLenum type, string filename, string prepend) {
 			typeStr = "vertex"; break;
 		case GL_FRAGMENT_SHADER:
 			typeStr = "fragment"; break;
+		case GL_COMPUTE_SHADER:
+			typeStr = "compute"; break;
 		}
 		ss << "Error compliing " + typeStr + " Shader!" << endl << endl << logText.data() << endl;
 
@@ -91,4 +114,59 @@ GLuint linkProgram(vector<GLuint> shaders) {
 
 	return program;
 
-}
\ No newline at end of file
+}
+
+void loadOBJ(string filename, vector<glm::vec3>& vertices, vector<glm::uvec3>& triangles) {
+	// The file is mapped and parsed a line at a time without streams, meshes of millions of
+	// triangles load in about a second
+	MappedFile file;
+	file.open(filename);
+	const char* data = file.data();
+	const char* end = data + file.size();
+
+	// Only positions and faces are needed, polygons are split into a triangle fan
+	string line;
+	vector<unsigned int> face;
+	while (data < end) {
+		const char* next = (const char*)memchr(data, '\n', end - data);
+		next = next ? next + 1 : end;
+		line.assign(data, next);
+		data = next;
+
+		const char* p = line.c_str();
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			char* q = (char*)p + 1;
+			glm::vec3 v;
+			v.x = strtof(q, &q);
+			v.y = strtof(q, &q);
+			v.z = strtof(q, &q);
+			vertices.push_back(v);
+		}
+		else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			face.clear();
+			char* q = (char*)p + 1;
+			while (true) {
+				// "v", "v/vt", "v//vn" or "v/vt/vn", negative indices count from the end
+				char* start = q;
+				long index = strtol(q, &q, 10);
+				if (q == start)
+					break;
+				face.push_back(index < 0 ? (unsigned int)(vertices.size() + index) : (unsigned int)(index - 1));
+				while (*q && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n')
+					q++;
+			}
+			for (size_t k = 2; k < face.size(); k++)
+				triangles.push_back(glm::uvec3(face[0], face[k - 1], face[k]));
+		}
+	}
+
+	for (auto it = triangles.begin(); it != triangles.end(); ++it) {
+		if ((*it).x >= vertices.size() || (*it).y >= vertices.size() || (*it).z >= vertices.size()) {
+			stringstream ss;
+			ss << "Invalid face index in " << filename << "!" << endl;
+			throw runtime_error(ss.str());
+		}
+	}
+}
@@ -4,11 +4,13 @@
 #include <string>
 #include <vector>
 #include <GL/glew.h>
+#include <glm/glm.hpp>
 
 using namespace std;
 
 GLuint compileShader(GLenum type, string filename, string prepend = "");
 GLuint linkProgram(vector<GLuint> shaders);
+void loadOBJ(string filename, vector<glm::vec3>& vertices, vector<glm::uvec3>& triangles);
 
 #endif // !_UTILS_HPP
 